@@ -88,6 +88,11 @@ static inline int pte_write(pte_t pte)
 	return pte_flags(pte) & _PAGE_RW;
 }
 
+static inline int pmd_write(pmd_t pmd)
+{
+	return pmd_flags(pmd) & _PAGE_RW;
+}
+
 static inline int pte_huge(pte_t pte)
 {
 	return pte_flags(pte) & _PAGE_PSE;
@@ -382,9 +387,14 @@ static inline int pmd_none(pmd_t pmd)
 	return (val & ~_PAGE_KNL_ERRATUM_MASK) == 0;
 }
 
+/*
+ * A pte table may be write-protected at pmd level,
+ * see processor pcache lazy fork.
+ */
 static inline int pmd_bad(pmd_t pmd)
 {
-	return (pmd_flags(pmd) & ~_PAGE_USER) != _KERNPG_TABLE;
+	return (pmd_flags(pmd) & ~(_PAGE_USER | _PAGE_RW)) !=
+	       (_KERNPG_TABLE & ~_PAGE_RW);
 }
 
 /*
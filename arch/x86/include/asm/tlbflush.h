@@ -65,12 +65,35 @@ static inline void invpcid_flush_all_nonglobals(void)
 	__invpcid(0, 0, INVPCID_TYPE_ALL_NON_GLOBAL);
 }
 
+#ifdef CONFIG_X86_PCID
+/*
+ * Number of mm each cpu keeps TLB entries for.
+ * Slot @asid is loaded with PCID (@asid + 1).
+ */
+#define TLB_NR_DYN_ASIDS	6
+
+/*
+ * @ctx_id: mm_struct->ctx_id of the mm cached in this slot
+ * @tlb_gen: mm_struct->tlb_gen this slot is up to date with
+ */
+struct tlb_context {
+	u64 ctx_id;
+	u64 tlb_gen;
+};
+#endif
+
 struct tlb_state {
 #ifdef CONFIG_SMP
 	struct mm_struct *active_mm;
 	int state;
 #endif
 
+#ifdef CONFIG_X86_PCID
+	u16 loaded_asid;
+	u16 next_asid;
+	struct tlb_context ctxs[TLB_NR_DYN_ASIDS];
+#endif
+
 	/*
 	 * Access to this CR4 shadow and to H/W CR4 is protected by
 	 * disabling interrupts when modifying either one.
@@ -155,6 +178,20 @@ static inline void __flush_tlb_global_irq_disabled(void)
 
 #define TLB_FLUSH_ALL	-1UL
 
+static inline bool tlb_pcid_enabled(void)
+{
+	return IS_ENABLED(CONFIG_X86_PCID) &&
+	       (this_cpu_read(cpu_tlbstate.cr4) & X86_CR4_PCIDE);
+}
+
+#ifdef CONFIG_X86_PCID
+void setup_pcid(void);
+void init_tlb_context(struct mm_struct *mm);
+#else
+static inline void setup_pcid(void) { }
+static inline void init_tlb_context(struct mm_struct *mm) { }
+#endif
+
 static inline void __flush_tlb_single(unsigned long addr)
 {
 	asm volatile("invlpg (%0)" ::"r" (addr) : "memory");
@@ -297,4 +334,54 @@ static inline void flush_tlb_kernel_range(unsigned long start,
 
 #endif
 
+/*
+ * TLB gather:
+ *
+ * Collect pages of one mm whose PTEs were changed, and shoot them down
+ * with one flush_tlb_mm_range() at the end, i.e. one IPI per batch
+ * instead of one per page. Pages are merged into a single range, which
+ * flush_tlb_mm_range() turns into a full flush if it is too large.
+ * Gathering a page of another mm flushes what was gathered so far.
+ *
+ * Until tlb_gather_flush() returns, other cpus may still use stale
+ * entries. Callers must not reuse the old frames before that.
+ */
+struct tlb_gather {
+	struct mm_struct	*mm;
+	unsigned long		start;
+	unsigned long		end;
+	unsigned long		nr_pages;
+};
+
+static inline void tlb_gather_init(struct tlb_gather *tlb)
+{
+	tlb->mm = NULL;
+	tlb->start = TLB_FLUSH_ALL;
+	tlb->end = 0;
+	tlb->nr_pages = 0;
+}
+
+static inline void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	if (tlb->nr_pages)
+		flush_tlb_mm_range(tlb->mm, tlb->start, tlb->end);
+	tlb_gather_init(tlb);
+}
+
+static inline void tlb_gather_page(struct tlb_gather *tlb,
+				   struct mm_struct *mm, unsigned long address)
+{
+	if (unlikely(tlb->mm != mm)) {
+		tlb_gather_flush(tlb);
+		tlb->mm = mm;
+	}
+
+	address &= PAGE_MASK;
+	if (address < tlb->start)
+		tlb->start = address;
+	if (address + PAGE_SIZE > tlb->end)
+		tlb->end = address + PAGE_SIZE;
+	tlb->nr_pages++;
+}
+
 #endif /* _ASM_X86_TLBFLUSH_H_ */
@@ -658,6 +658,7 @@ void cpu_init(void)
 	cr4_init_shadow();
 
 	cr4_clear_bits(X86_CR4_VME|X86_CR4_PVI|X86_CR4_TSD|X86_CR4_DE);
+	setup_pcid();
 
 	/* Initialize the per-CPU GDT table */
 	switch_to_new_gdt(cpu);
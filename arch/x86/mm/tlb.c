@@ -9,9 +9,11 @@
 
 #include <lego/mm.h>
 #include <lego/smp.h>
+#include <lego/slab.h>
 #include <lego/sched.h>
 #include <lego/cpumask.h>
 #include <lego/profile.h>
+#include <asm/pgalloc.h>
 #include <asm/tlbflush.h>
 
 DEFINE_PER_CPU_SHARED_ALIGNED(struct tlb_state, cpu_tlbstate) = {
@@ -22,15 +24,153 @@ DEFINE_PER_CPU_SHARED_ALIGNED(struct tlb_state, cpu_tlbstate) = {
 	.cr4 = ~0UL,	/* fail hard if we screw up cr4 shadow initialization */
 };
 
+/*
+ * @new_tlb_gen: the mm->tlb_gen this flush brings cpus up to,
+ *               0 if the flush is not tracked.
+ */
 struct flush_tlb_info {
 	struct mm_struct *flush_mm;
 	unsigned long flush_start;
 	unsigned long flush_end;
+	u64 new_tlb_gen;
 };
 
+#ifdef CONFIG_X86_PCID
+/*
+ * PCID
+ *
+ * Each cpu caches TLB_NR_DYN_ASIDS mm, identified by mm->ctx_id, and
+ * loads them with their own PCID. Switching to a cached mm does not
+ * flush the TLB.
+ *
+ * A cpu only gets flush IPIs for the mm it is running, thus the entries
+ * of a cached but not running mm go stale once that mm is flushed. Each
+ * flush bumps mm->tlb_gen, and each cached slot remembers the tlb_gen
+ * it is up to date with. The PCID is flushed when the mm is switched in
+ * and its tlb_gen moved on.
+ */
+static atomic64_t last_mm_ctx_id = ATOMIC64_INIT(1);
+
+/* Set by profile_switch_mm() to measure the cost without PCID */
+static bool tlb_pcid_force_flush;
+
+/* init_mm has ctx_id 0 */
+void init_tlb_context(struct mm_struct *mm)
+{
+	mm->ctx_id = atomic64_inc_return(&last_mm_ctx_id);
+	atomic64_set(&mm->tlb_gen, 0);
+}
+
+/* Called by each cpu, while it is still running with PCID 0 */
+void setup_pcid(void)
+{
+	if (!cpu_has(X86_FEATURE_PCID))
+		return;
+
+	/* Kernel entries must be shared by all PCIDs */
+	if (!cpu_has(X86_FEATURE_PGE))
+		return;
+
+	cr4_set_bits(X86_CR4_PCIDE);
+}
+
+static inline unsigned long build_cr3(struct mm_struct *mm, u16 asid)
+{
+	return __pa(mm->pgd) | (asid + 1);
+}
+
+static inline unsigned long build_cr3_noflush(struct mm_struct *mm, u16 asid)
+{
+	return build_cr3(mm, asid) | X86_CR3_PCID_NOFLUSH;
+}
+
+static void choose_new_asid(struct mm_struct *next, u64 next_tlb_gen,
+			    u16 *new_asid, bool *need_flush)
+{
+	u16 asid;
+
+	for (asid = 0; asid < TLB_NR_DYN_ASIDS; asid++) {
+		if (this_cpu_read(cpu_tlbstate.ctxs[asid].ctx_id) != next->ctx_id)
+			continue;
+
+		*new_asid = asid;
+		*need_flush = this_cpu_read(cpu_tlbstate.ctxs[asid].tlb_gen) < next_tlb_gen ||
+			      unlikely(tlb_pcid_force_flush);
+		return;
+	}
+
+	/* Not cached, recycle the slots round-robin */
+	asid = this_cpu_read(cpu_tlbstate.next_asid);
+	if (asid >= TLB_NR_DYN_ASIDS)
+		asid = 0;
+	this_cpu_write(cpu_tlbstate.next_asid, asid + 1);
+
+	*new_asid = asid;
+	*need_flush = true;
+}
+
 /*
- * If CR4.PCIDE=0 (lego's case), the load_cr3 invalidates all TLB entries
+ * The loaded mm has been flushed up to @new_tlb_gen on this cpu.
+ * A partial flush only counts if we were up to date right before it,
+ * flushes of one mm can reach us out of order.
+ */
+static void update_loaded_tlb_gen(u64 new_tlb_gen, bool full)
+{
+	u16 asid = this_cpu_read(cpu_tlbstate.loaded_asid);
+	u64 tlb_gen = this_cpu_read(cpu_tlbstate.ctxs[asid].tlb_gen);
+
+	if (!new_tlb_gen || new_tlb_gen <= tlb_gen)
+		return;
+
+	if (full || tlb_gen == new_tlb_gen - 1)
+		this_cpu_write(cpu_tlbstate.ctxs[asid].tlb_gen, new_tlb_gen);
+}
+
+static void load_mm_cr3(struct mm_struct *next)
+{
+	u64 next_tlb_gen;
+	bool need_flush;
+	u16 new_asid;
+
+	if (!tlb_pcid_enabled()) {
+		load_cr3(next->pgd);
+		return;
+	}
+
+	/* Pairs with atomic64_inc_return() in flush_tlb_mm_range() */
+	smp_mb();
+	next_tlb_gen = atomic64_read(&next->tlb_gen);
+
+	choose_new_asid(next, next_tlb_gen, &new_asid, &need_flush);
+	if (need_flush) {
+		this_cpu_write(cpu_tlbstate.ctxs[new_asid].ctx_id, next->ctx_id);
+		this_cpu_write(cpu_tlbstate.ctxs[new_asid].tlb_gen, next_tlb_gen);
+		write_cr3(build_cr3(next, new_asid));
+	} else {
+		write_cr3(build_cr3_noflush(next, new_asid));
+	}
+	this_cpu_write(cpu_tlbstate.loaded_asid, new_asid);
+}
+
+static inline u64 inc_mm_tlb_gen(struct mm_struct *mm)
+{
+	/* Full barrier, orders PTE updates before cpumask reads */
+	return atomic64_inc_return(&mm->tlb_gen);
+}
+#else
+static inline void load_mm_cr3(struct mm_struct *next)
+{
+	load_cr3(next->pgd);
+}
+
+static inline void update_loaded_tlb_gen(u64 new_tlb_gen, bool full) { }
+static inline u64 inc_mm_tlb_gen(struct mm_struct *mm) { return 0; }
+#endif /* CONFIG_X86_PCID */
+
+/*
+ * If CR4.PCIDE=0, the load_cr3 invalidates all TLB entries
  * associated with PCID 0000H except those for global pages.
+ * With PCID enabled, see load_mm_cr3() above.
  *
  * All kernel direct mapped pages are global pages. This at least ensures
  * kernel mapping entries won't go back and forth with respect to TLB.
@@ -72,7 +212,7 @@ void switch_mm_irqs_off(struct mm_struct *prev, struct mm_struct *next,
 		 *
 		 * And this is why we re-load cr3 after setting mm_cpumask.
 		 */
-		load_cr3(next->pgd);
+		load_mm_cr3(next);
 
 		/*
 		 * Stop flush IPIs for the previous mm
@@ -83,7 +223,7 @@ void switch_mm_irqs_off(struct mm_struct *prev, struct mm_struct *next,
 	} else {
 		if (unlikely(!cpumask_test_cpu(cpu, mm_cpumask(next)))) {
 			cpumask_set_cpu(cpu, mm_cpumask(next));
-			load_cr3(next->pgd);
+			load_mm_cr3(next);
 		}
 	}
 }
@@ -119,12 +259,13 @@ static void flush_tlb_func(void *info)
 			addr += PAGE_SIZE;
 		}
 	}
+	update_loaded_tlb_gen(f->new_tlb_gen, f->flush_end == TLB_FLUSH_ALL);
 }
 
 DEFINE_PROFILE_POINT(flush_tlb_others)
 
-void flush_tlb_others(const struct cpumask *cpumask, struct mm_struct *mm,
-		      unsigned long start, unsigned long end)
+static void __flush_tlb_others(const struct cpumask *cpumask, struct mm_struct *mm,
+			       unsigned long start, unsigned long end, u64 new_tlb_gen)
 {
 	struct flush_tlb_info info;
 	PROFILE_POINT_TIME(flush_tlb_others)
@@ -134,23 +275,33 @@ void flush_tlb_others(const struct cpumask *cpumask, struct mm_struct *mm,
 	info.flush_mm = mm;
 	info.flush_start = start;
 	info.flush_end = end;
+	info.new_tlb_gen = new_tlb_gen;
 
 	profile_point_start(flush_tlb_others);
 	smp_call_function_many(cpumask, flush_tlb_func, &info, 1);
 	profile_point_leave(flush_tlb_others);
 }
 
+void flush_tlb_others(const struct cpumask *cpumask, struct mm_struct *mm,
+		      unsigned long start, unsigned long end)
+{
+	__flush_tlb_others(cpumask, mm, start, end, 0);
+}
+
 void flush_tlb_current_task(void)
 {
 	struct mm_struct *mm = current->mm;
+	u64 new_tlb_gen;
 
 	preempt_disable();
+	new_tlb_gen = inc_mm_tlb_gen(mm);
 
 	/* This is an implicit full barrier that synchronizes with switch_mm. */
 	local_flush_tlb();
+	update_loaded_tlb_gen(new_tlb_gen, true);
 
 	if (cpumask_any_but(mm_cpumask(mm), smp_processor_id()) < nr_cpu_ids)
-		flush_tlb_others(mm_cpumask(mm), mm, 0UL, TLB_FLUSH_ALL);
+		__flush_tlb_others(mm_cpumask(mm), mm, 0UL, TLB_FLUSH_ALL, new_tlb_gen);
 
 	preempt_enable();
 }
@@ -173,15 +324,25 @@ void flush_tlb_mm_range(struct mm_struct *mm,
 	unsigned long addr;
 	/* do a global flush by default */
 	unsigned long base_pages_to_flush = TLB_FLUSH_ALL;
+	u64 new_tlb_gen;
 
 	if (end != TLB_FLUSH_ALL)
 		base_pages_to_flush = (end - start) >> PAGE_SHIFT;
 
 	preempt_disable();
 
+	/*
+	 * Cpus that cached @mm but are not running it
+	 * will flush it when they switch back.
+	 */
+	new_tlb_gen = inc_mm_tlb_gen(mm);
+
 	/*
 	 * Both branches below are implicit full barriers (MOV to CR or
 	 * INVLPG) that synchronize with switch_mm.
+	 *
+	 * Only the loaded PCID is affected. If @mm is not running here,
+	 * this is wasted but harmless.
 	 */
 	if (base_pages_to_flush > tlb_single_page_flush_ceiling) {
 		base_pages_to_flush = TLB_FLUSH_ALL;
@@ -197,12 +358,72 @@ void flush_tlb_mm_range(struct mm_struct *mm,
 		end = TLB_FLUSH_ALL;
 	}
 
+	if (mm == current->mm)
+		update_loaded_tlb_gen(new_tlb_gen, end == TLB_FLUSH_ALL);
+
 	if (cpumask_any_but(mm_cpumask(mm), smp_processor_id()) < nr_cpu_ids)
-		flush_tlb_others(mm_cpumask(mm), mm, start, end);
+		__flush_tlb_others(mm_cpumask(mm), mm, start, end, new_tlb_gen);
 
 	preempt_enable();
 }
 
+#define NR_PROFILE_SWITCH_MM	(1000)
+
+/*
+ * Average latency of one switch_mm_irqs_off() between the
+ * running mm and @scratch, in both directions.
+ */
+static u64 profile_switch_mm(struct mm_struct *scratch)
+{
+	struct mm_struct *mm = current->mm ? : &init_mm;
+	unsigned long flags;
+	u64 start, end;
+	int i;
+
+	local_irq_save(flags);
+	start = sched_clock();
+	for (i = 0; i < NR_PROFILE_SWITCH_MM; i++) {
+		switch_mm_irqs_off(mm, scratch, current);
+		switch_mm_irqs_off(scratch, mm, current);
+	}
+	end = sched_clock();
+	local_irq_restore(flags);
+
+	return (end - start) / (2 * NR_PROFILE_SWITCH_MM);
+}
+
+static void profile_switch_mm_cost(void)
+{
+	struct mm_struct *scratch;
+
+	scratch = kzalloc(sizeof(*scratch), GFP_KERNEL);
+	if (!scratch)
+		return;
+
+	scratch->pgd = pgd_alloc(scratch);
+	if (!scratch->pgd) {
+		kfree(scratch);
+		return;
+	}
+	mm_init_cpumask(scratch);
+	init_tlb_context(scratch);
+
+	pr_info(" switch_mm #pcid=%d\n", tlb_pcid_enabled());
+	pr_info(" ... latency: %9llu ns\n", profile_switch_mm(scratch));
+
+#ifdef CONFIG_X86_PCID
+	if (tlb_pcid_enabled()) {
+		WRITE_ONCE(tlb_pcid_force_flush, true);
+		pr_info(" ... latency: %9llu ns (flush on each switch)\n",
+			profile_switch_mm(scratch));
+		WRITE_ONCE(tlb_pcid_force_flush, false);
+	}
+#endif
+
+	pgd_free(scratch, scratch->pgd);
+	kfree(scratch);
+}
+
 void profile_tlb_shootdown(void)
 {
 	static int nr_profile_tlb_shootdown = 0;
@@ -242,5 +463,7 @@ void profile_tlb_shootdown(void)
 			i, end - start);
 	}
 
+	profile_switch_mm_cost();
+
 	pr_info("Profile TLB Shootdown at CPU%d ... done\n", smp_processor_id());
 }
@@ -82,6 +82,9 @@ struct fit_sglist {
 	int len;
 };
 
+/* Max number of buffers ibapi_send_reply_sge_timeout() can gather */
+#define FIT_MAX_SGE	8
+
 void ibapi_free_recv_buf(void *input_buf);
 
 /* IMM related */
@@ -106,6 +109,9 @@ extern unsigned long sysctl_send_reply_max_timeout_sec;
 int ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr,
 			     int max_ret_size, int if_use_ret_phys_addr,
 			     unsigned long timeout_sec);
+int ibapi_send_reply_sge_timeout(int target_node, struct fit_sglist *sglist,
+				 int nr_sge, void *ret_addr, int max_ret_size,
+				 int if_use_ret_phys_addr, unsigned long timeout_sec);
 int ibapi_send_reply_timeout_w_private_bits(int target_node, void *addr, int size, void *ret_addr,
 			     int max_ret_size, int *private_bits, int if_use_ret_phys_addr,
 			     unsigned long timeout_sec);
@@ -152,6 +158,11 @@ static inline int ibapi_send_reply_timeout(int target_node, void *addr, int size
 				       unsigned long timeout_sec)
 { return -EIO; }
 
+static inline int ibapi_send_reply_sge_timeout(int target_node, struct fit_sglist *sglist,
+				 int nr_sge, void *ret_addr, int max_ret_size,
+				 int if_use_ret_phys_addr, unsigned long timeout_sec)
+{ return -EIO; }
+
 int ibapi_send_reply_timeout_w_private_bits(int target_node, void *addr, int size, void *ret_addr,
 			     int max_ret_size, int *private_bits, int if_use_ret_phys_addr,
 			     unsigned long timeout_sec);
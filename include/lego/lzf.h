@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_LZF_H_
+#define _LEGO_LZF_H_
+
+#include <lego/types.h>
+
+/*
+ * Byte oriented LZ77 in the LZF stream format. No entropy coding,
+ * which keeps both directions at memcpy-like speed for page sized data.
+ *
+ * The hash table is provided by caller, it does not need to be cleared
+ * between calls. Offsets are stored in 16 bits, thus @in_len of one
+ * compression must not exceed LZF_MAX_IN_LEN.
+ */
+#define LZF_HTAB_BITS		12
+#define LZF_HTAB_SIZE		(1 << LZF_HTAB_BITS)
+#define LZF_MAX_IN_LEN		65536
+
+unsigned int lzf_compress(const void *in, unsigned int in_len,
+			  void *out, unsigned int out_len, u16 *htab);
+unsigned int lzf_decompress(const void *in, unsigned int in_len,
+			    void *out, unsigned int out_len);
+
+#endif /* _LEGO_LZF_H_ */
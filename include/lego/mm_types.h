@@ -13,6 +13,7 @@
 #include <asm/pgtable.h>
 
 #include <lego/rwsem.h>
+#include <lego/wait.h>
 #include <lego/types.h>
 #include <lego/rbtree.h>
 #include <lego/cpumask.h>
@@ -82,6 +83,93 @@ enum {
 	NR_MM_COUNTERS
 };
 
+#ifdef CONFIG_PCACHE_PREFETCH
+#define NR_PCACHE_PREFETCH_STREAMS	4
+
+/*
+ * One detected access stream within an address space.
+ * @last_miss: the latest miss that belongs to this stream
+ * @last_addr: the furthest line this stream has covered,
+ *             either by a real miss or by issued prefetch
+ * @stride: distance between two consecutive misses, 0 if not trained
+ */
+struct pcache_prefetch_stream {
+	unsigned long		last_miss;
+	unsigned long		last_addr;
+	long			stride;
+	int			confidence;
+};
+
+/*
+ * A range advised by madvise(MADV_SEQUENTIAL or MADV_RANDOM).
+ * @behavior is 0 (MADV_NORMAL) if this slot is free.
+ */
+#define NR_PCACHE_PREFETCH_ADVICE	4
+
+struct pcache_prefetch_advice {
+	unsigned long		start;
+	unsigned long		end;
+	int			behavior;
+};
+
+/*
+ * Per-mm processor pcache prefetch state.
+ * Streams and advices are protected by @lock. @nr_inflight counts queued
+ * and running prefetch works, process exit waits for it to drop to 0.
+ */
+struct pcache_prefetch_info {
+	spinlock_t			lock;
+	int				next_replace;
+	struct pcache_prefetch_stream	streams[NR_PCACHE_PREFETCH_STREAMS];
+
+	int				next_advice;
+	struct pcache_prefetch_advice	advice[NR_PCACHE_PREFETCH_ADVICE];
+
+	atomic_t			nr_inflight;
+	bool				exiting;
+};
+#endif
+
+#ifdef CONFIG_PCACHE_LAZY_FORK
+struct pcache_lazy_fork;
+
+/*
+ * Per-mm processor lazy fork state.
+ * @lock protects the lazy forks of our children on @children, and their
+ * child's @lf. Copies in flight are waited for on @wait.
+ * Our own @lf, if any, is protected by the lock of @parent. We hold
+ * a mm_count of @parent until we are freed.
+ */
+struct pcache_lazy_fork_info {
+	spinlock_t			lock;
+	wait_queue_head_t		wait;
+	struct list_head		children;
+
+	struct mm_struct		*parent;
+	struct pcache_lazy_fork		*lf;
+};
+#endif
+
+#ifdef CONFIG_PCACHE_FAULT_AROUND
+#define NR_PCACHE_FAULT_AROUND_REFUSED	4
+
+/*
+ * Per-mm record of vmas that refused fault-around, as told by memory.
+ * Read misses within them skip fault-around. This is only a hint,
+ * memory makes the final decision on every request.
+ */
+struct pcache_fault_around_range {
+	unsigned long		start;
+	unsigned long		end;
+};
+
+struct pcache_fault_around_info {
+	spinlock_t				lock;
+	int					next_replace;
+	struct pcache_fault_around_range	refused[NR_PCACHE_FAULT_AROUND_REFUSED];
+};
+#endif
+
 struct mm_struct {
 	unsigned long task_size;		/* size of task vm space */
 	unsigned long highest_vm_end;		/* highest vma end address */
@@ -125,7 +213,32 @@ struct mm_struct {
 	int gpid;
 	struct list_head list;
 
+#ifdef CONFIG_PCACHE_PREFETCH
+	struct pcache_prefetch_info pcache_prefetch;
+#endif
+
+#ifdef CONFIG_COMP_PROCESSOR
+	unsigned long *pcache_resident_sets;	/* pcache sets this mm has mapped lines in */
+#endif
+
+#ifdef CONFIG_PCACHE_LAZY_FORK
+	struct pcache_lazy_fork_info pcache_lazy_fork;
+#endif
+
+#ifdef CONFIG_PCACHE_FAULT_AROUND
+	struct pcache_fault_around_info pcache_fault_around;
+#endif
+
+#ifdef CONFIG_PCACHE_PARTITION
+	int pcache_partid;			/* pcache way partition group */
+#endif
+
 	cpumask_var_t cpu_vm_mask_var;		/* CPUs this VM has run on */
+
+#ifdef CONFIG_X86_PCID
+	u64 ctx_id;				/* unique id, never reused */
+	atomic64_t tlb_gen;			/* bumped by each TLB flush */
+#endif
 };
 
 static inline void mm_init_cpumask(struct mm_struct *mm)
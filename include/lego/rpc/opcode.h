@@ -30,9 +30,13 @@
 
 #define P2M_HEARTBEAT		((__u32)0x10000000)
 #define P2M_PCACHE_MISS		((__u32)0x20000000)
+#define P2M_PCACHE_MISS_BATCH	((__u32)0x20000001)
+#define P2M_PCACHE_MISS_EXTENT	((__u32)0x20000002)
+#define P2M_PCACHE_MISS_AROUND	((__u32)0x20000003)
 #define P2M_PCACHE_FLUSH	((__u32)0x30000000)
 #define P2M_PCACHE_REPLICA	((__u32)0x30000001)
 #define P2M_PCACHE_ZEROFILL	((__u32)0x30000002)
+#define P2M_PCACHE_FLUSH_BATCH	((__u32)0x30000003)
 
 #define P2M_READ		((__u32)__NR_read)
 #define P2M_WRITE		((__u32)__NR_write)
@@ -43,6 +47,7 @@
 #define P2M_MREMAP		((__u32)__NR_mremap)
 #define P2M_BRK			((__u32)__NR_brk)
 #define P2M_MSYNC		((__u32)__NR_msync)
+#define P2M_MADVISE		((__u32)__NR_madvise)
 #define P2M_FORK		((__u32)__NR_fork)
 #define P2M_EXECVE		((__u32)__NR_execve)
 #define P2M_CHECKPOINT		((__u32)__NR_checkpoint_process)
@@ -38,6 +38,13 @@ struct p2m_zerofill_msg {
 void handle_p2m_zerofill(struct p2m_zerofill_msg *msg,
 			 struct thpool_buffer *tb);
 
+/*
+ * Batched pcache replies carry @credits, the number of request slots
+ * free at the memory node when the reply was built. Senders should
+ * hold back speculative requests while it is below P2M_CREDITS_LOW.
+ */
+#define P2M_CREDITS_LOW		(32)
+
 /* P2M_PCACHE_FLUSH */
 struct p2m_flush_msg {
 	struct common_header	header;
@@ -48,6 +55,35 @@ struct p2m_flush_msg {
 
 void handle_p2m_flush_one(struct p2m_flush_msg *msg, struct thpool_buffer *tb);
 
+/*
+ * P2M_PCACHE_FLUSH_BATCH
+ *
+ * Flush up to PCACHE_FLUSH_BATCH_MAX lines with one round-trip.
+ * Lines may belong to different processes, but all of them must belong
+ * to the same memory node. @nr_lines lines follow @pcacheline in the
+ * order of @lines.
+ *
+ * The reply has one status per line. If the whole request can not
+ * be handled, an int error code is replied, same as P2M_PCACHE_FLUSH.
+ */
+struct p2m_flush_batch_msg {
+	struct common_header	header;
+	__u32			nr_lines;
+	struct {
+		__u32		pid;
+		__u64		user_va;
+	} lines[PCACHE_FLUSH_BATCH_MAX];
+	char			pcacheline[0];
+};
+
+struct p2m_flush_batch_reply {
+	__s32			retval[PCACHE_FLUSH_BATCH_MAX];
+	__u32			credits;
+};
+
+void handle_p2m_flush_batch(struct p2m_flush_batch_msg *msg,
+			    struct thpool_buffer *tb);
+
 /*
  * P2M_MISS
  */
@@ -79,6 +115,96 @@ struct p2m_pcache_miss_reply_struct {
 void handle_p2m_pcache_miss(struct p2m_pcache_miss_msg *msg,
 			    struct thpool_buffer *b);
 
+/*
+ * P2M_PCACHE_MISS_BATCH
+ *
+ * Fetch up to PCACHE_MISS_BATCH_MAX lines of the same process
+ * with one round-trip. All lines must belong to the same memory node.
+ *
+ * The reply has a fixed header with one status per requested line,
+ * followed by @nr_lines lines, in the order of @missing_vaddr.
+ * Data of failed lines is undefined. If the whole request can not
+ * be handled, an int error code is replied, same as P2M_PCACHE_MISS.
+ */
+struct p2m_pcache_miss_batch_msg {
+	struct common_header	header;
+	__u32			pid;
+	__u32			tgid;
+	__u32			flags;
+	__u32			nr_lines;
+	__u64			missing_vaddr[PCACHE_MISS_BATCH_MAX];
+};
+
+struct p2m_pcache_miss_batch_reply {
+	__s32			retval[PCACHE_MISS_BATCH_MAX];
+	__u32			credits;
+	char			data[0];
+};
+
+#define P2M_PCACHE_MISS_BATCH_REPLY_SIZE(nr)				\
+	(sizeof(struct p2m_pcache_miss_batch_reply) + (nr) * PCACHE_LINE_SIZE)
+
+void handle_p2m_pcache_miss_batch(struct p2m_pcache_miss_batch_msg *msg,
+				  struct thpool_buffer *tb);
+
+/*
+ * P2M_PCACHE_MISS_EXTENT
+ *
+ * Fetch one PCACHE_EXTENT_SIZE aligned extent with one round-trip.
+ * The extent must lie within one private anonymous vma, otherwise an
+ * int error code is replied and the sender falls back to P2M_PCACHE_MISS.
+ * On success the reply is exactly PCACHE_EXTENT_SIZE bytes of data.
+ */
+#define PCACHE_EXTENT_SIZE	PMD_SIZE
+#define PCACHE_EXTENT_MASK	PMD_MASK
+#define PCACHE_EXTENT_NR_LINES	(PCACHE_EXTENT_SIZE / PCACHE_LINE_SIZE)
+
+struct p2m_pcache_miss_extent_msg {
+	struct common_header	header;
+	__u32			pid;
+	__u32			tgid;
+	__u32			flags;
+	__u64			start;
+};
+
+void handle_p2m_pcache_miss_extent(struct p2m_pcache_miss_extent_msg *msg,
+				   struct thpool_buffer *tb);
+
+/*
+ * P2M_PCACHE_MISS_AROUND
+ *
+ * Fetch the line of @missing_vaddr. If its vma is read-only or executable,
+ * also fetch the lines around it within the @nr_lines aligned window,
+ * without going beyond the vma. The reply has a fixed header followed by
+ * @nr_lines contiguous lines starting from @start. [@vm_start, @vm_end)
+ * is the vma, so processor can remember the ones that refuse fault-around.
+ * If the missing line itself can not be handled, an int error code is
+ * replied, same as P2M_PCACHE_MISS.
+ */
+struct p2m_pcache_miss_around_msg {
+	struct common_header	header;
+	__u32			pid;
+	__u32			tgid;
+	__u32			flags;
+	__u32			nr_lines;
+	__u64			missing_vaddr;
+};
+
+struct p2m_pcache_miss_around_reply {
+	__u64			start;
+	__u64			vm_start;
+	__u64			vm_end;
+	__u32			nr_lines;
+	__u32			around;		/* 0 if the vma refuses fault-around */
+	char			data[0];
+};
+
+#define P2M_PCACHE_MISS_AROUND_REPLY_SIZE(nr)				\
+	(sizeof(struct p2m_pcache_miss_around_reply) + (nr) * PCACHE_LINE_SIZE)
+
+void handle_p2m_pcache_miss_around(struct p2m_pcache_miss_around_msg *msg,
+				   struct thpool_buffer *tb);
+
 struct p2m_replica_msg {
 	struct common_header	header;
 	struct replica_log	log;
@@ -298,6 +424,46 @@ struct p2m_msync_struct {
 };
 int handle_p2m_msync(struct p2m_msync_struct *, u64, struct common_header *, void *);
 
+/*
+ * P2M_MADVISE
+ *
+ * Only behaviors that need memory to act are sent, currently
+ * MADV_DONTNEED and MADV_FREE. They take two rounds, so that dirty
+ * lines of file-backed and shared mappings are never thrown away:
+ *
+ *  1) With @query set, memory replies the pieces of [start, start+len)
+ *     that are private anonymous, the only ones it will discard. If
+ *     they do not fit in @ranges, @next tells where to query again.
+ *  2) Processor drops its cached lines of those pieces, then sends
+ *     [start, next) again without @query, memory frees the pages.
+ *
+ * The range never crosses memory nodes.
+ */
+#define P2M_MADVISE_NR_RANGES	16
+
+struct p2m_madvise_struct {
+	__u32	pid;
+	__u32	query;
+	__u64	start;
+	__u64	len;
+	__s32	behavior;
+};
+
+struct p2m_madvise_range {
+	__u64	start;
+	__u64	end;
+};
+
+struct p2m_madvise_reply_struct {
+	__s32	ret;
+	__u32	nr_ranges;
+	__u64	next;
+	struct p2m_madvise_range ranges[P2M_MADVISE_NR_RANGES];
+};
+
+void handle_p2m_madvise(struct p2m_madvise_struct *payload,
+			struct common_header *hdr, struct thpool_buffer *tb);
+
 /*
  * P2M_CHECKPOINT
  */
@@ -13,6 +13,7 @@
 #include <lego/kernel.h>
 #include <lego/rbtree.h>
 #include <lego/rwsem.h>
+#include <lego/seqlock.h>
 #include <lego/auxvec.h>
 #include <lego/spinlock.h>
 #include <lego/hashtable.h>
@@ -139,6 +140,22 @@ struct lego_mm_struct {
 	struct rw_semaphore mmap_sem;
 	struct lego_task_struct *task;
 
+	/*
+	 * Bumped around every mmap_sem write section, validates the
+	 * per-worker vma cache used by speculative pcache misses.
+	 * @vma_cache_id is unique across mm lifetimes, so a cache
+	 * entry can not match a new mm allocated at the same address.
+	 */
+	seqcount_t vma_seq;
+	unsigned long vma_cache_id;
+
+#ifdef CONFIG_MEM_ANON_PREFETCH
+	/* Sequential anonymous miss detection, updated without lock */
+	unsigned long anon_prefetch_last;
+	unsigned long anon_prefetch_end;
+	unsigned int anon_prefetch_streak;
+#endif
+
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
 	/*
 	 * distributed vma range limit management array. Unlike processor side, size of 
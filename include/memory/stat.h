@@ -15,7 +15,12 @@
 enum memory_manager_stat_item {
 	/* Handler */
 	HANDLE_PCACHE_MISS,
+	HANDLE_PCACHE_MISS_BATCH,
+	HANDLE_PCACHE_MISS_EXTENT,
+	HANDLE_PCACHE_MISS_AROUND,
+	HANDLE_PCACHE_MISS_SPECULATIVE,
 	HANDLE_PCACHE_FLUSH,
+	HANDLE_PCACHE_FLUSH_BATCH,
 	HANDLE_PCACHE_REPLICA,
 	HANDLE_P2M_MMAP,
 	HANDLE_P2M_MUNMAP,
@@ -28,6 +33,9 @@ enum memory_manager_stat_item {
 
 	NR_BATCHED_LOG_FLUSH,
 
+	NR_ANON_PREFETCH_PAGES,
+	NR_ANON_PREFETCH_DROPPED,
+
 	NR_MEMORY_MANAGER_STAT_ITEMS,
 };
 
@@ -23,6 +23,12 @@
 
 #define NR_THPOOL_BUFFER	(256)
 
+/*
+ * Requests that arrive while all buffers are in use are parked here,
+ * and picked up by workers as they free buffers.
+ */
+#define NR_THPOOL_BACKLOG	(NR_THPOOL_BUFFER * 4)
+
 #define NR_THPOOL_WORKERS	CONFIG_THPOOL_NR_WORKERS
 
 struct thpool_buffer;
@@ -32,6 +38,19 @@ struct tw_padding {
 } ____cacheline_aligned;
 #define TW_PADDING(name)	struct tw_padding name
 
+/*
+ * Each worker has one queue per lane, and always serves the FAST lane first.
+ * FAST is for pcache misses and flushes, which are small and latency
+ * critical. Everything else, such as fork, execve and mmap, goes to SLOW.
+ */
+enum thpool_lane {
+	THPOOL_LANE_FAST,
+	THPOOL_LANE_SLOW,
+
+	NR_THPOOL_LANES,
+	THPOOL_LANE_NONE = NR_THPOOL_LANES,
+};
+
 #define QUEUING_STAT_STRIDE_US	(5)
 #define QUEUING_STAT_STRIDE_NS	(QUEUING_STAT_STRIDE_US*1000)
 #define QUEUING_STAT_ENTRIES	(40)
@@ -39,8 +58,8 @@ struct tw_padding {
 /* This structure describes a worker thread */
 struct thpool_worker {
 	/*
-	 * This counter is updated while the list
-	 * is updated. And they are updated under @lock.
+	 * This counter is updated while the lists
+	 * are updated. And they are updated under @lock.
 	 * Thus a simple int will do.
 	 *
 	 * Besides, the top three fields will always be
@@ -50,12 +69,18 @@ struct thpool_worker {
 	int			cpu;
 	int			nr_queued;
 	spinlock_t		lock;
-	struct list_head	work_head;
+	struct list_head	work_head[NR_THPOOL_LANES];
 	struct task_struct	*task;
+
+	/* Lane of the request being handled, read by dispatcher and thieves */
+	enum thpool_lane	running;
 	TW_PADDING(_pad1);
 
 	/* for debug usage */
 	unsigned long		nr_handled;
+	unsigned long		nr_handled_fast;
+	unsigned long		nr_stolen;
+	unsigned long		max_fast_queuing_delay_ns;
 	unsigned long		total_queuing_delay_ns;
 	unsigned long		max_queuing_delay_ns;
 	unsigned long		min_queuing_delay_ns;
@@ -77,9 +102,10 @@ static inline int cpu_thpool_worker(struct thpool_worker *tw)
 	return tw->cpu;
 }
 
+/* Also read without @lock, by idle workers and the dispatcher */
 static inline int nr_queued_thpool_worker(struct thpool_worker *tw)
 {
-	return tw->nr_queued;
+	return READ_ONCE(tw->nr_queued);
 }
 
 static inline void inc_queued_thpool_worker(struct thpool_worker *tw)
@@ -92,6 +118,17 @@ static inline void dec_queued_thpool_worker(struct thpool_worker *tw)
 	tw->nr_queued--;
 }
 
+static inline enum thpool_lane running_thpool_worker(struct thpool_worker *tw)
+{
+	return READ_ONCE(tw->running);
+}
+
+static inline void
+set_running_thpool_worker(struct thpool_worker *tw, enum thpool_lane lane)
+{
+	WRITE_ONCE(tw->running, lane);
+}
+
 struct tb_padding {
 	char x[0];
 } __aligned(PAGE_SIZE);
@@ -102,6 +139,7 @@ struct thpool_buffer {
 	unsigned long		time_enqueue_ns;
 	unsigned long		time_dequeue_ns;
 	struct list_head	next;
+	enum thpool_lane	lane;
 
 	void			*fit_rx;
 	void			*fit_ctx;
@@ -209,6 +247,9 @@ static inline void *thpool_buffer_tx(struct thpool_buffer *tb)
 
 void handle_bad_request(struct common_header *hdr, u64 desc);
 
+/* Free request slots, advertised to requesters in some replies */
+int thpool_credits(void);
+
 #ifdef CONFIG_COUNTER_THPOOL
 #define THPOOL_WORKER_INHANDLER		0x1UL
 static inline int thpool_worker_in_handler(struct thpool_worker *tw)
@@ -270,12 +311,20 @@ static inline unsigned long thpool_buffer_queuing_delay(struct thpool_buffer *tb
 	return tb->time_dequeue_ns - tb->time_enqueue_ns;
 }
 
-static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw, unsigned long diff_ns)
+static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw,
+						   struct thpool_buffer *tb,
+						   unsigned long diff_ns)
 {
 	int i;
 
 	tw->total_queuing_delay_ns += diff_ns;
 
+	if (tb->lane == THPOOL_LANE_FAST) {
+		tw->nr_handled_fast++;
+		if (diff_ns > tw->max_fast_queuing_delay_ns)
+			tw->max_fast_queuing_delay_ns = diff_ns;
+	}
+
 	if (diff_ns > tw->max_queuing_delay_ns)
 		tw->max_queuing_delay_ns = diff_ns;
 	if (diff_ns < tw->min_queuing_delay_ns)
@@ -291,6 +340,11 @@ static inline void inc_thpool_worker_nr_handled(struct thpool_worker *tw)
 	tw->nr_handled++;
 }
 
+static inline void inc_thpool_worker_nr_stolen(struct thpool_worker *tw)
+{
+	tw->nr_stolen++;
+}
+
 #else
 static inline int thpool_worker_in_handler(struct thpool_worker *tw) { return 0; }
 static inline void set_in_handler_thpool_worker(struct thpool_worker *tw) { }
@@ -307,9 +361,11 @@ wip_buffer_thpool_worker(struct thpool_worker *tw) { return NULL; }
 static inline unsigned long thpool_buffer_queuing_delay(struct thpool_buffer *tb) { return 0; }
 static inline void thpool_buffer_dequeue_time(struct thpool_buffer *tb) { }
 static inline void thpool_buffer_enqueue_time(struct thpool_buffer *tb) { }
-static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw, unsigned long diff_ns) { }
+static inline void add_thpool_worker_total_queuing(struct thpool_worker *tw,
+		struct thpool_buffer *tb, unsigned long diff_ns) { }
 
 static inline void inc_thpool_worker_nr_handled(struct thpool_worker *tw) { }
+static inline void inc_thpool_worker_nr_stolen(struct thpool_worker *tw) { }
 #endif /* CONFIG_COUNTER_THPOOL */
 
 void fit_ack_reply_callback(struct thpool_buffer *b);
@@ -12,6 +12,8 @@
 
 #include <lego/bug.h>
 #include <lego/mmap.h>
+#include <lego/rwsem.h>
+#include <lego/percpu.h>
 #include <lego/pgfault.h>
 
 #include <memory/task.h>
@@ -246,6 +248,72 @@ int mprotect_fixup(struct lego_task_struct *tsk, struct vm_area_struct *vma,
 
 void exit_lego_mmap(struct lego_mm_struct *mm);
 
+/*
+ * Last anonymous vma a worker faulted on. Only touched by its own CPU,
+ * except @active_mm, which is set while a speculative miss runs on the
+ * vma without mmap_sem, and is polled by writers of that mm.
+ * Workers are pinned, so this is per-worker.
+ */
+struct vma_miss_cache {
+	struct lego_mm_struct	*active_mm;
+	unsigned long		mm_id;
+	unsigned int		seq;
+	unsigned long		start;
+	unsigned long		end;
+	struct vm_area_struct	*vma;
+} ____cacheline_aligned;
+
+DECLARE_PER_CPU(struct vma_miss_cache, vma_miss_cache);
+
+void lego_mm_vma_write_begin(struct lego_mm_struct *mm);
+
+static inline void lego_mm_vma_write_end(struct lego_mm_struct *mm)
+{
+	write_seqcount_end(&mm->vma_seq);
+}
+
+/*
+ * All writers of mmap_sem must use these, so that speculative
+ * misses see the vma tree change.
+ */
+static inline void lego_mmap_write_lock(struct lego_mm_struct *mm)
+{
+	down_write(&mm->mmap_sem);
+	lego_mm_vma_write_begin(mm);
+}
+
+static inline int __must_check
+lego_mmap_write_lock_killable(struct lego_mm_struct *mm)
+{
+	if (down_write_killable(&mm->mmap_sem))
+		return -EINTR;
+	lego_mm_vma_write_begin(mm);
+	return 0;
+}
+
+static inline void lego_mmap_write_unlock(struct lego_mm_struct *mm)
+{
+	lego_mm_vma_write_end(mm);
+	up_write(&mm->mmap_sem);
+}
+
+/* handle_pcache/prefetch.c */
+struct thpool_worker;
+
+#ifdef CONFIG_MEM_ANON_PREFETCH
+void anon_prefetch_note_miss(struct lego_task_struct *p, unsigned long address,
+			     unsigned long vm_end);
+bool anon_prefetch_run(struct thpool_worker *w);
+#else
+static inline void anon_prefetch_note_miss(struct lego_task_struct *p,
+					   unsigned long address,
+					   unsigned long vm_end) { }
+static inline bool anon_prefetch_run(struct thpool_worker *w)
+{
+	return false;
+}
+#endif
+
 
 /* fault.c */
 /*
@@ -13,6 +13,8 @@
 #include <lego/list.h>
 #include <lego/const.h>
 #include <lego/bitops.h>
+#include <lego/bitmap.h>
+#include <lego/hash.h>
 #include <lego/jiffies.h>
 #include <lego/spinlock.h>
 
@@ -330,6 +332,18 @@ pcache_set_to_first_pcache_meta(struct pcache_set *pset)
 	return pcache_meta_map + offset;
 }
 
+static inline struct pcache_meta *
+pcache_set_way_to_pcache_meta(struct pcache_set *pset, unsigned long way)
+{
+	return pcache_set_to_first_pcache_meta(pset) + way * nr_cachesets;
+}
+
+/* Number of free lines within @pset, may be stale once returned */
+static inline int pset_nr_free(struct pcache_set *pset)
+{
+	return bitmap_weight(pset->free_map, PCACHE_ASSOCIATIVITY);
+}
+
 /**
  * pcache_meta_to_pa
  * @pcm: pcache meta in question
@@ -548,20 +562,44 @@ enum piggyback_options {
 };
 
 /* Allocate one pcache line from the pset @address maps to */
-struct pcache_meta *pcache_alloc(unsigned long address,
+struct pcache_meta *pcache_alloc(struct mm_struct *mm, unsigned long address,
 				 enum piggyback_options piggyback);
+struct pcache_meta *pcache_alloc_ptl(struct mm_struct *mm, unsigned long address);
+struct pcache_meta *pcache_alloc_noevict(struct mm_struct *mm,
+					 unsigned long address);
 
 int pcache_flush_one(struct pcache_meta *pcm);
 void clflush_one(struct task_struct *tsk, unsigned long user_va, void *cache_addr);
 void __clflush_one(pid_t tgid, unsigned long user_va,
 		   unsigned int m_nid, unsigned int rep_nid, void *cache_addr);
 
+/* One line to flush by __clflush_batch() */
+struct clflush_batch_entry {
+	pid_t		tgid;
+	unsigned int	m_nid;
+	unsigned int	rep_nid;
+	unsigned long	user_va;
+	void		*cache_addr;
+};
+
+void __clflush_batch(unsigned int m_nid, struct clflush_batch_entry *entries,
+		     int nr_entries);
+
 /* eviction */
-int pcache_evict_line(struct pcache_set *pset, unsigned long address,
-		      enum piggyback_options piggyback);
+int pcache_evict_line(struct mm_struct *mm, struct pcache_set *pset,
+		      unsigned long address, enum piggyback_options piggyback);
+int pcache_evict_lines(struct pcache_set *pset, int nr_to_evict);
 
 #ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
 bool __pset_find_eviction(struct pcache_set *, unsigned long, struct task_struct *);
+void __pset_wait_eviction(struct pcache_set *, unsigned long, struct task_struct *);
+
+static inline atomic_t *
+pset_eviction_filter(struct pcache_set *pset, unsigned long uvaddr)
+{
+	return &pset->eviction_filter[hash_long(uvaddr >> PCACHE_LINE_SIZE_SHIFT,
+						PSET_EVICTION_FILTER_SHIFT)];
+}
 
 static inline bool
 pset_find_eviction(unsigned long uvaddr, struct task_struct *p)
@@ -571,23 +609,34 @@ pset_find_eviction(unsigned long uvaddr, struct task_struct *p)
 	/*
 	 * HACK!!!
 	 *
-	 * We are safe to JUST check counter here. The reason is simple:
-	 * we first do insert and update counter, then we do unmap.
+	 * We are safe to JUST check the filter here. The reason is simple:
+	 * we first do insert and update filter, then we do unmap.
 	 *
 	 * This code path happen at pgfault time. It basically means
 	 * either 1) the page has never been established, 2) the page
 	 * has just been evicted. According to above, we are safe
 	 * at both cases.
 	 */
-	if (likely(atomic_read(&pset->nr_eviction_entries) == 0))
+	if (likely(atomic_read(pset_eviction_filter(pset, uvaddr)) == 0))
 		return false;
 
 	/*
-	 * We may have some false-positive here due to set-associated pcache.
-	 * Should be fine...
+	 * We may have some false-positive here due to set-associated pcache
+	 * and hash collisions. The list walk gives the exact answer.
 	 */
 	return __pset_find_eviction(pset, uvaddr, p);
 }
+
+/*
+ * Called by pgfault before going to remote memory.
+ * Sleep until the pending eviction of @uvaddr, if any, is flushed back.
+ */
+static inline void
+pset_wait_eviction(unsigned long uvaddr, struct task_struct *p)
+{
+	if (unlikely(pset_find_eviction(uvaddr, p)))
+		__pset_wait_eviction(user_vaddr_to_pcache_set(uvaddr), uvaddr, p);
+}
 #endif
 
 /*
@@ -609,10 +658,23 @@ enum pcache_rmap_status {
 	PCACHE_RMAP_FAILED,
 };
 
+/*
+ * Return any one rmap of a mapped @pcm.
+ * @pcm must be locked on entry.
+ */
+static inline struct pcache_rmap *pcache_first_rmap(struct pcache_meta *pcm)
+{
+	if (likely(RmapUsed(&pcm->rmap_inline)))
+		return &pcm->rmap_inline;
+	return list_first_entry(&pcm->rmap, struct pcache_rmap, next);
+}
+
 int pcache_zap_pte(struct mm_struct *mm, unsigned long address,
 		   pte_t ptent, pte_t *pte, spinlock_t *ptl);
 int pcache_move_pte(struct mm_struct *mm, pte_t *old_pte, pte_t *new_pte,
 		    unsigned long old_addr, unsigned long new_addr, spinlock_t *old_ptl);
+int pcache_zap_mm_pset(struct pcache_set *pset, struct mm_struct *mm,
+		       int *nr_dirty);
 
 int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
 		    unsigned long address, struct mm_struct *owner_mm,
@@ -638,10 +700,16 @@ static inline int fork_dup_pcache(struct task_struct *t,
 static inline void pcache_print_info(void) { }
 #endif
 
+struct tlb_gather;
+
 int rmap_walk(struct pcache_meta *pcm, struct rmap_walk_control *rwc);
 int pcache_try_to_unmap(struct pcache_meta *pcm);
 bool pcache_try_to_unmap_check_dirty(struct pcache_meta *pcm);
 bool pcache_try_to_unmap_reserve_check_dirty(struct pcache_meta *pcm);
+bool pcache_try_to_unmap_check_dirty_tlb(struct pcache_meta *pcm,
+					 struct tlb_gather *tlb);
+bool pcache_try_to_unmap_reserve_check_dirty_tlb(struct pcache_meta *pcm,
+						 struct tlb_gather *tlb);
 int pcache_wrprotect(struct pcache_meta *pcm);
 int pcache_referenced(struct pcache_meta *pcm);
 void pcache_referenced_trylock(struct pcache_meta *pcm,
@@ -657,7 +725,35 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 			unsigned long flags, fill_func_t fill_func, void *arg,
 			enum rmap_caller caller, enum piggyback_options piggyback);
 
+/*
+ * Describe a P2M_PCACHE_MISS_BATCH request.
+ * All lines belong to the same process and the same memory node.
+ * @dst[i] is the kernel va of the pcache line that @address[i] goes to.
+ */
+struct pcache_miss_batch {
+	unsigned int		memory_nid;
+	unsigned int		pid;
+	unsigned int		tgid;
+	unsigned int		flags;
+	int			nr;
+	unsigned long		address[PCACHE_MISS_BATCH_MAX];
+	void			*dst[PCACHE_MISS_BATCH_MAX];
+	int			retval[PCACHE_MISS_BATCH_MAX];
+};
+
+int pcache_fill_remote_batch(struct pcache_miss_batch *b, void *reply_buf);
+
+/* Request slots advertised by memory nodes, see P2M_CREDITS_LOW */
+void pcache_update_memory_credits(unsigned int nid, unsigned int credits);
+bool pcache_memory_node_congested(unsigned int nid);
+
 #include <processor/pcache_victim.h>
 #include <processor/pcache_evict.h>
+#include <processor/pcache_prefetch.h>
+#include <processor/pcache_lazy_fork.h>
+#include <processor/pcache_extent_fill.h>
+#include <processor/pcache_fault_around.h>
+#include <processor/pcache_ctier.h>
+#include <processor/pcache_partition.h>
 
 #endif /* _LEGO_PROCESSOR_PCACHE_H_ */
@@ -34,4 +34,19 @@
 
 #define PCACHE_LINE_NR_PAGES		(PCACHE_LINE_SIZE / PAGE_SIZE)
 
+/* Max number of lines carried by one P2M_PCACHE_MISS_BATCH */
+#define PCACHE_MISS_BATCH_MAX		(16)
+
+/* Max number of lines carried by one P2M_PCACHE_MISS_AROUND */
+#define PCACHE_FAULT_AROUND_MAX		(16)
+
+/*
+ * Max number of lines carried by one P2M_PCACHE_FLUSH_BATCH
+ * Lines are sent in place, one sg entry each, plus one for the header.
+ */
+#define PCACHE_FLUSH_BATCH_MAX		(7)
+
+/* Max number of lines evicted together by pcache_evict_lines() */
+#define PCACHE_EVICT_BATCH_MAX		(8)
+
 #endif /* _LEGO_PROCESSOR_PCACHE_CONFIG_H_ */
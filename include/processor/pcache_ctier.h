@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_CTIER_H_
+#define _LEGO_PROCESSOR_PCACHE_CTIER_H_
+
+#include <lego/mm.h>
+#include <lego/atomic.h>
+#include <processor/pcache_types.h>
+
+/*
+ * Who an evicted line belongs to. Captured before the line is unmapped,
+ * tgid 0 means the line is not going to be stored.
+ */
+struct pcache_ctier_key {
+	pid_t			tgid;
+	unsigned long		address;
+	unsigned long		seq;
+};
+
+#ifdef CONFIG_PCACHE_CTIER
+extern atomic_t ctier_nr_entries;
+
+void __init pcache_ctier_early_init(void);
+void __init pcache_ctier_post_init(void);
+void pcache_ctier_evict_prepare(struct pcache_meta *pcm,
+				struct pcache_ctier_key *key);
+void pcache_ctier_store(struct pcache_meta *pcm, struct pcache_ctier_key *key);
+int pcache_ctier_try_fill(struct mm_struct *mm, unsigned long address,
+			  pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
+			  unsigned long flags);
+void pcache_ctier_invalidate_range(pid_t tgid, unsigned long start,
+				   unsigned long end);
+void pcache_ctier_invalidate_tgid(pid_t tgid);
+
+/*
+ * Called by pgfault before going to remote memory.
+ * Coarse but cheap, the real lookup takes the tier lock.
+ */
+static inline bool pcache_ctier_may_hit(void)
+{
+	return atomic_read(&ctier_nr_entries) > 0;
+}
+#else
+static inline void pcache_ctier_early_init(void) { }
+static inline void pcache_ctier_post_init(void) { }
+static inline void pcache_ctier_evict_prepare(struct pcache_meta *pcm,
+					      struct pcache_ctier_key *key) { }
+static inline void pcache_ctier_store(struct pcache_meta *pcm,
+				      struct pcache_ctier_key *key) { }
+static inline int pcache_ctier_try_fill(struct mm_struct *mm, unsigned long address,
+					pte_t *page_table, pte_t orig_pte,
+					pmd_t *pmd, unsigned long flags)
+{
+	return 1;
+}
+static inline void pcache_ctier_invalidate_range(pid_t tgid, unsigned long start,
+						 unsigned long end) { }
+static inline void pcache_ctier_invalidate_tgid(pid_t tgid) { }
+static inline bool pcache_ctier_may_hit(void)
+{
+	return false;
+}
+#endif /* CONFIG_PCACHE_CTIER */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_CTIER_H_ */
@@ -30,6 +30,33 @@ int __init evict_sweep_init(void);
 static inline int evict_sweep_init(void) { return 0; }
 #endif
 
+/*
+ * Background reclaim
+ *
+ * kpcache_reclaimd keeps the number of free lines of each set at or above
+ * a low watermark. Allocations that bring a set below the low watermark
+ * queue it to reclaimd, which evicts lines until the high watermark is met.
+ */
+#ifdef CONFIG_PCACHE_RECLAIMD
+#define PCACHE_RECLAIM_WMARK_HIGH					\
+	min_t(int, CONFIG_PCACHE_RECLAIMD_WMARK_HIGH, PCACHE_ASSOCIATIVITY - 1)
+#define PCACHE_RECLAIM_WMARK_LOW					\
+	min_t(int, CONFIG_PCACHE_RECLAIMD_WMARK_LOW, PCACHE_RECLAIM_WMARK_HIGH)
+
+int __init pcache_reclaimd_init(void);
+void __pcache_reclaim_wakeup(struct pcache_set *pset);
+
+/* Called after each allocation from @pset */
+static inline void pcache_reclaim_check(struct pcache_set *pset)
+{
+	if (unlikely(pset_nr_free(pset) < PCACHE_RECLAIM_WMARK_LOW))
+		__pcache_reclaim_wakeup(pset);
+}
+#else
+static inline int pcache_reclaimd_init(void) { return 0; }
+static inline void pcache_reclaim_check(struct pcache_set *pset) { }
+#endif
+
 /*
  * Eviction Algorithm
  * 	Least Recently Used
@@ -96,17 +123,35 @@ static inline void detach_from_lru(struct pcache_meta *pcm)
 	del_from_lru_list(pcm, pset);
 }
 
+/*
+ * Move @pcm to the tail of LRU list, where eviction starts scanning.
+ * Caller must hold a ref, and @pcm must either be not Valid yet or be
+ * locked, so that eviction and sweep will not unlink it in the middle.
+ */
+static inline void move_to_lru_tail(struct pcache_meta *pcm)
+{
+	struct pcache_set *pset;
+
+	pset = pcache_meta_to_pcache_set(pcm);
+	spin_lock(&pset->lru_lock);
+	list_move_tail(&pcm->lru, &pset->lru_list);
+	spin_unlock(&pset->lru_lock);
+}
+
 static inline void init_pcache_lru(struct pcache_meta *pcm)
 {
 	INIT_LIST_HEAD(&pcm->lru);
 }
 
 /* Callback: find a pcache line to evict */
-struct pcache_meta *evict_find_line_lru(struct pcache_set *pset);
+struct pcache_meta *evict_find_line_lru(struct pcache_set *pset,
+					unsigned long way_mask);
 
 void kevict_sweepd_lru(void);
 
 #else
+static inline int pset_nr_lru(struct pcache_set *pset) { return 0; }
+
 static inline void
 add_to_lru_list(struct pcache_meta *pcm, struct pcache_set *pset) { }
 static inline void
@@ -114,11 +159,12 @@ del_from_lru_list(struct pcache_meta *pcm, struct pcache_set *pset) { }
 
 static inline void attach_to_lru(struct pcache_meta *pcm) { }
 static inline void detach_from_lru(struct pcache_meta *pcm) { }
+static inline void move_to_lru_tail(struct pcache_meta *pcm) { }
 
 static inline void init_pcache_lru(struct pcache_meta *pcm) { }
 
 static inline struct pcache_meta *
-evict_find_line_lru(struct pcache_set *pset)
+evict_find_line_lru(struct pcache_set *pset, unsigned long way_mask)
 {
 	BUG();
 }
@@ -135,10 +181,11 @@ static inline void kevict_sweepd_lru(void)
  * 	First-In-First-Out (FIFO)
  */
 #ifdef CONFIG_PCACHE_EVICT_FIFO
-struct pcache_meta *evict_find_line_fifo(struct pcache_set *pset);
+struct pcache_meta *evict_find_line_fifo(struct pcache_set *pset,
+					unsigned long way_mask);
 #else
 static inline struct pcache_meta *
-evict_find_line_fifo(struct pcache_set *pset) { BUG(); }
+evict_find_line_fifo(struct pcache_set *pset, unsigned long way_mask) { BUG(); }
 #endif /* EVICT_FIFO */
 
 /*
@@ -146,23 +193,89 @@ evict_find_line_fifo(struct pcache_set *pset) { BUG(); }
  * 	Random
  */
 #ifdef CONFIG_PCACHE_EVICT_RANDOM
-struct pcache_meta *evict_find_line_random(struct pcache_set *pset);
+struct pcache_meta *evict_find_line_random(struct pcache_set *pset,
+					unsigned long way_mask);
 #else
 static inline struct pcache_meta *
-evict_find_line_random(struct pcache_set *pset) { BUG(); }
+evict_find_line_random(struct pcache_set *pset, unsigned long way_mask) { BUG(); }
 #endif /* EVICT_RANDOM */
 
+/*
+ * Eviction Algorithm
+ * 	CLOCK (second-chance)
+ */
+#ifdef CONFIG_PCACHE_EVICT_CLOCK
+struct pcache_meta *evict_find_line_clock(struct pcache_set *pset,
+					unsigned long way_mask);
+#else
+static inline struct pcache_meta *
+evict_find_line_clock(struct pcache_set *pset, unsigned long way_mask) { BUG(); }
+#endif /* EVICT_CLOCK */
+
+/*
+ * Eviction Algorithm
+ * 	Adaptive Replacement (ARC)
+ */
+#ifdef CONFIG_PCACHE_EVICT_ARC
+struct pcache_meta *evict_find_line_arc(struct pcache_set *pset,
+					unsigned long way_mask);
+void arc_admit_pcache(struct pcache_meta *pcm, struct pcache_set *pset,
+		      unsigned long address);
+
+/* Called when @pcm is freed */
+static inline void arc_free_pcache(struct pcache_meta *pcm,
+				   struct pcache_set *pset)
+{
+	if (TestClearPcacheFrequent(pcm))
+		atomic_dec(&pset->arc_nr_frequent);
+}
+#else
+static inline struct pcache_meta *
+evict_find_line_arc(struct pcache_set *pset, unsigned long way_mask) { BUG(); }
+static inline void arc_admit_pcache(struct pcache_meta *pcm,
+		struct pcache_set *pset, unsigned long address) { }
+static inline void arc_free_pcache(struct pcache_meta *pcm,
+				   struct pcache_set *pset) { }
+#endif /* EVICT_ARC */
+
 #ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
 void pset_remove_eviction(struct pcache_set *pset,
 			  struct pcache_meta *pcm, int nr_added);
 int evict_line_perset_list(struct pcache_set *pset, struct pcache_meta *pcm,
 			   enum piggyback_options piggyback);
+int evict_line_perset_list_unmap(struct pcache_set *pset, struct pcache_meta *pcm,
+				 struct tlb_gather *tlb, bool *dirty);
+void evict_line_perset_list_finish(struct pcache_set *pset, struct pcache_meta *pcm,
+				   int nr_added, bool dirty,
+				   enum piggyback_options piggyback);
 void __init alloc_pcache_perset_map(void);
+
+/*
+ * Piggyback info is only touched by perset eviction and the refill
+ * of the same line. It lives in its own array, indexed the same way
+ * as pcache_meta_map, to keep pcm itself small.
+ */
+extern struct piggyback_info *piggyback_info_map;
+
+static inline struct piggyback_info *
+pcache_meta_to_piggyback(struct pcache_meta *pcm)
+{
+	return &piggyback_info_map[__pcache_meta_index(pcm)];
+}
 #else
 static inline int
 evict_line_perset_list(struct pcache_set *pset, struct pcache_meta *pcm,
 			enum piggyback_options piggyback) { BUG(); }
+static inline int
+evict_line_perset_list_unmap(struct pcache_set *pset, struct pcache_meta *pcm,
+			     struct tlb_gather *tlb, bool *dirty) { BUG(); }
+static inline void
+evict_line_perset_list_finish(struct pcache_set *pset, struct pcache_meta *pcm,
+			      int nr_added, bool dirty,
+			      enum piggyback_options piggyback) { BUG(); }
 static inline void __init alloc_pcache_perset_map(void) { }
+static inline struct piggyback_info *
+pcache_meta_to_piggyback(struct pcache_meta *pcm) { BUG(); }
 
 static inline void pset_remove_eviction(struct pcache_set *pset,
 			  struct pcache_meta *pcm, int nr_added)
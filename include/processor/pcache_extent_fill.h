@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_EXTENT_FILL_H_
+#define _LEGO_PROCESSOR_PCACHE_EXTENT_FILL_H_
+
+#include <lego/mm.h>
+#include <processor/pcache_types.h>
+
+#ifdef CONFIG_PCACHE_EXTENT_FILL
+void __init pcache_extent_fill_post_init(void);
+int pcache_extent_fill(struct mm_struct *mm, unsigned long address,
+		       pmd_t *pmd, unsigned long flags);
+
+/*
+ * Called by pgfault before the pte table of @address is allocated.
+ * A pmd that has never been populated means nothing within this
+ * extent is cached, which is worth one try to fetch it all.
+ */
+static inline bool pcache_extent_fill_candidate(pmd_t *pmd, unsigned long flags)
+{
+	return pmd_none(*pmd) && !(flags & FAULT_FLAG_INSTRUCTION);
+}
+#else
+static inline void pcache_extent_fill_post_init(void) { }
+static inline int pcache_extent_fill(struct mm_struct *mm, unsigned long address,
+				     pmd_t *pmd, unsigned long flags)
+{
+	return -ENOSYS;
+}
+static inline bool pcache_extent_fill_candidate(pmd_t *pmd, unsigned long flags)
+{
+	return false;
+}
+#endif /* CONFIG_PCACHE_EXTENT_FILL */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_EXTENT_FILL_H_ */
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_FAULT_AROUND_H_
+#define _LEGO_PROCESSOR_PCACHE_FAULT_AROUND_H_
+
+#include <lego/mm.h>
+#include <processor/pcache_types.h>
+
+#ifdef CONFIG_PCACHE_FAULT_AROUND
+void pcache_fault_around_mm_init(struct mm_struct *mm);
+void __init pcache_fault_around_post_init(void);
+bool pcache_fault_around_refused(struct mm_struct *mm, unsigned long address);
+int pcache_fault_around(struct mm_struct *mm, unsigned long address,
+			pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
+			unsigned long flags);
+
+/*
+ * Called by pgfault for a miss that goes to remote memory.
+ * Writes are never worth it. Instruction fetches always try,
+ * plain reads try unless memory has refused this vma before.
+ */
+static inline bool pcache_fault_around_candidate(struct mm_struct *mm,
+						 unsigned long address,
+						 unsigned long flags)
+{
+	if (flags & FAULT_FLAG_WRITE)
+		return false;
+	if (flags & FAULT_FLAG_INSTRUCTION)
+		return true;
+	return !pcache_fault_around_refused(mm, address);
+}
+#else
+static inline void pcache_fault_around_mm_init(struct mm_struct *mm) { }
+static inline void pcache_fault_around_post_init(void) { }
+static inline int pcache_fault_around(struct mm_struct *mm, unsigned long address,
+				      pte_t *page_table, pte_t orig_pte,
+				      pmd_t *pmd, unsigned long flags)
+{
+	return -EBUSY;
+}
+static inline bool pcache_fault_around_candidate(struct mm_struct *mm,
+						 unsigned long address,
+						 unsigned long flags)
+{
+	return false;
+}
+#endif /* CONFIG_PCACHE_FAULT_AROUND */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_FAULT_AROUND_H_ */
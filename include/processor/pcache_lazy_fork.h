@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_LAZY_FORK_H_
+#define _LEGO_PROCESSOR_PCACHE_LAZY_FORK_H_
+
+#include <lego/mm.h>
+#include <lego/list.h>
+#include <processor/pcache_types.h>
+
+struct fork_vmainfo;
+
+#ifdef CONFIG_PCACHE_LAZY_FORK
+/*
+ * Part of one VMA within one pmd, whose PTEs are not copied to the child yet.
+ * Parent's pmd covering it is write-protected until the copy is done.
+ */
+enum lazy_fork_range_state {
+	LAZY_FORK_PENDING,
+	LAZY_FORK_COPYING,
+	LAZY_FORK_DONE,
+};
+
+struct lazy_fork_range {
+	unsigned long		start;
+	unsigned long		end;
+	unsigned long		vm_flags;
+	enum lazy_fork_range_state state;
+};
+
+/*
+ * One fork() whose pgtable copy is deferred, protected by the parent's lock.
+ * Linked to parent's pcache_lazy_fork.children, pointed by child's
+ * pcache_lazy_fork.lf. Sorted @ranges, @nr_pending of them are not DONE yet,
+ * and all the ones before @first_pending are DONE.
+ */
+struct pcache_lazy_fork {
+	struct mm_struct	*parent_mm;
+	struct mm_struct	*child_mm;
+	struct task_struct	*child_task;
+	struct list_head	next;
+
+	int			nr_pending;
+	int			first_pending;
+	int			nr_ranges;
+	struct lazy_fork_range	ranges[0];
+};
+
+void lazy_fork_mm_init(struct mm_struct *mm);
+void lazy_fork_mm_exit(struct mm_struct *mm);
+void lazy_fork_mm_free(struct mm_struct *mm);
+int lazy_fork_dup_pcache(struct task_struct *dst_task, struct mm_struct *dst_mm,
+			 struct mm_struct *src_mm, struct fork_vmainfo *vmas,
+			 int nr_vmas);
+void __lazy_fork_resolve_range(struct mm_struct *mm, unsigned long start,
+			       unsigned long end, bool drop);
+void __lazy_fork_handle_fault(struct mm_struct *mm, pmd_t *pmd,
+			      unsigned long address);
+void lazy_fork_note_pinned(struct mm_struct *mm, unsigned long address);
+void lazy_fork_resolve_pinned(void);
+
+static inline bool lazy_fork_active(struct mm_struct *mm)
+{
+	return READ_ONCE(mm->pcache_lazy_fork.lf) != NULL ||
+	       !list_empty(&mm->pcache_lazy_fork.children);
+}
+
+/*
+ * Called before [@start, @end) of @mm is zapped or moved.
+ * Pending copies to children, or from our parent, are done first.
+ * If @drop is set, our own pending ranges fully inside are dropped.
+ */
+static inline void lazy_fork_resolve_range(struct mm_struct *mm,
+					   unsigned long start, unsigned long end,
+					   bool drop)
+{
+	if (unlikely(lazy_fork_active(mm)))
+		__lazy_fork_resolve_range(mm, start, end, drop);
+}
+
+/*
+ * Called by pgfault with @pmd of @address populated.
+ * A write-protected pmd or a pending copy needs to be resolved first.
+ */
+static inline void lazy_fork_handle_fault(struct mm_struct *mm, pmd_t *pmd,
+					  unsigned long address)
+{
+	if (unlikely(lazy_fork_active(mm) ||
+		     (!pmd_none(*pmd) && !pmd_write(*pmd))))
+		__lazy_fork_handle_fault(mm, pmd, address);
+}
+
+/* Child's pgtable is incomplete, nothing should fill it behind our back */
+static inline bool lazy_fork_child_pending(struct mm_struct *mm)
+{
+	return READ_ONCE(mm->pcache_lazy_fork.lf) != NULL;
+}
+#else
+static inline void lazy_fork_mm_init(struct mm_struct *mm) { }
+static inline void lazy_fork_mm_exit(struct mm_struct *mm) { }
+static inline void lazy_fork_mm_free(struct mm_struct *mm) { }
+static inline int lazy_fork_dup_pcache(struct task_struct *dst_task,
+				       struct mm_struct *dst_mm,
+				       struct mm_struct *src_mm,
+				       struct fork_vmainfo *vmas, int nr_vmas)
+{
+	BUG();
+	return 0;
+}
+static inline void lazy_fork_resolve_range(struct mm_struct *mm,
+					   unsigned long start, unsigned long end,
+					   bool drop) { }
+static inline void lazy_fork_handle_fault(struct mm_struct *mm, pmd_t *pmd,
+					  unsigned long address) { }
+static inline bool lazy_fork_child_pending(struct mm_struct *mm) { return false; }
+static inline void lazy_fork_note_pinned(struct mm_struct *mm,
+					 unsigned long address) { }
+static inline void lazy_fork_resolve_pinned(void) { }
+#endif /* CONFIG_PCACHE_LAZY_FORK */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_LAZY_FORK_H_ */
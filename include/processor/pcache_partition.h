@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_PARTITION_H_
+#define _LEGO_PROCESSOR_PCACHE_PARTITION_H_
+
+#include <lego/mm.h>
+#include <lego/atomic.h>
+#include <processor/pcache_types.h>
+
+/* A way mask that does not restrict anything */
+#define PCACHE_WAYS_ALL		(~0UL)
+
+#ifdef CONFIG_PCACHE_PARTITION
+#define PCACHE_NR_PARTITIONS	((int)CONFIG_PCACHE_PARTITION_NR_GROUPS)
+
+/*
+ * One group of processes. Lines are allocated and evicted only within
+ * @way_mask of the group the faulting process belongs to. Masks of
+ * different groups may overlap. Counters are charged to the group
+ * that allocated the line.
+ */
+struct pcache_partition {
+	unsigned long		way_mask;
+	atomic_long_t		nr_lines;
+	atomic_long_t		nr_fill;
+	atomic_long_t		nr_evicted;
+	atomic_long_t		nr_evicted_by_others;
+} ____cacheline_aligned;
+
+extern struct pcache_partition pcache_partitions[PCACHE_NR_PARTITIONS];
+
+void pcache_partition_mm_init(struct mm_struct *mm);
+void __init pcache_partition_init(void);
+long pcache_partition_ctl(int op, int group, unsigned long arg);
+
+/* @mm is NULL for callers that do not act on behalf of a process */
+static inline unsigned long pcache_mm_way_mask(struct mm_struct *mm)
+{
+	if (!mm)
+		return PCACHE_WAYS_ALL;
+	return READ_ONCE(pcache_partitions[mm->pcache_partid].way_mask);
+}
+
+static inline bool pcache_way_allowed(unsigned long way_mask, unsigned int way)
+{
+	return way_mask & (1UL << way);
+}
+
+static inline bool pcache_way_mask_partial(unsigned long way_mask)
+{
+	return way_mask != PCACHE_WAYS_ALL;
+}
+
+/* Called when @pcm is allocated for @mm */
+static inline void pcache_partition_charge(struct pcache_meta *pcm,
+					   struct mm_struct *mm)
+{
+	struct pcache_partition *p;
+
+	pcm->partid = mm ? mm->pcache_partid : 0;
+	p = pcache_partitions + pcm->partid;
+	atomic_long_inc(&p->nr_lines);
+	atomic_long_inc(&p->nr_fill);
+}
+
+/* Called when @pcm is freed */
+static inline void pcache_partition_uncharge(struct pcache_meta *pcm)
+{
+	atomic_long_dec(&pcache_partitions[pcm->partid].nr_lines);
+}
+
+/* Called when @pcm is evicted to make room for @mm */
+static inline void pcache_partition_evicted(struct pcache_meta *pcm,
+					    struct mm_struct *mm)
+{
+	struct pcache_partition *p = pcache_partitions + pcm->partid;
+
+	atomic_long_inc(&p->nr_evicted);
+	if (mm && mm->pcache_partid != pcm->partid)
+		atomic_long_inc(&p->nr_evicted_by_others);
+}
+#else
+static inline void pcache_partition_mm_init(struct mm_struct *mm) { }
+static inline void pcache_partition_init(void) { }
+static inline long pcache_partition_ctl(int op, int group, unsigned long arg)
+{
+	return -ENOSYS;
+}
+static inline unsigned long pcache_mm_way_mask(struct mm_struct *mm)
+{
+	return PCACHE_WAYS_ALL;
+}
+static inline bool pcache_way_allowed(unsigned long way_mask, unsigned int way)
+{
+	return true;
+}
+static inline bool pcache_way_mask_partial(unsigned long way_mask)
+{
+	return false;
+}
+static inline void pcache_partition_charge(struct pcache_meta *pcm,
+					   struct mm_struct *mm) { }
+static inline void pcache_partition_uncharge(struct pcache_meta *pcm) { }
+static inline void pcache_partition_evicted(struct pcache_meta *pcm,
+					    struct mm_struct *mm) { }
+#endif /* CONFIG_PCACHE_PARTITION */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_PARTITION_H_ */
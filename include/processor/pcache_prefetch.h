@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _LEGO_PROCESSOR_PCACHE_PREFETCH_H_
+#define _LEGO_PROCESSOR_PCACHE_PREFETCH_H_
+
+#include <lego/mm.h>
+#include <processor/pcache_types.h>
+#include <processor/pcache_stat.h>
+
+#ifdef CONFIG_PCACHE_PREFETCH
+void pcache_prefetch_mm_init(struct mm_struct *mm);
+void pcache_prefetch_mm_exit(struct mm_struct *mm);
+void pcache_prefetch_miss(struct mm_struct *mm, unsigned long address);
+void pcache_prefetch_range(struct mm_struct *mm, unsigned long start,
+			   unsigned long end);
+void pcache_prefetch_advise(struct mm_struct *mm, unsigned long start,
+			    unsigned long end, int behavior);
+void __init pcache_prefetch_post_init(void);
+
+/* Speculative fill helpers, also used by extent fill and fault-around */
+bool pcache_fill_pending_eviction(unsigned long address, struct task_struct *owner);
+void pcache_fill_snapshot(unsigned long start, int nr, int *evict_seq,
+			  unsigned long *skip);
+int pcache_fill_install(struct mm_struct *mm, pmd_t *pmd, unsigned long address,
+			struct pcache_meta *pcm, struct task_struct *owner,
+			enum rmap_caller caller, int evict_seq, bool young);
+int pcache_fill_install_copy(struct mm_struct *mm, pmd_t *pmd,
+			     unsigned long address, void *src,
+			     enum rmap_caller caller, int evict_seq, bool young);
+
+/*
+ * Called when an eviction starts within @pset.
+ * Any prefetch that went to network before this is considered stale.
+ */
+static inline void pcache_prefetch_evict_start(struct pcache_set *pset)
+{
+	atomic_inc(&pset->evict_seq);
+}
+
+/*
+ * Called when we find a PTE mapped to @pcm was referenced.
+ * The first reference to a prefetched line counts as a prefetch hit.
+ */
+static inline void pcache_prefetch_referenced(struct pcache_meta *pcm)
+{
+	if (unlikely(PcachePrefetched(pcm)) && TestClearPcachePrefetched(pcm))
+		inc_pcache_event(PCACHE_PREFETCH_HIT);
+}
+
+/*
+ * Called when @pcm is freed.
+ * A prefetched line that was never referenced was wasted.
+ */
+static inline void pcache_prefetch_free(struct pcache_meta *pcm)
+{
+	if (unlikely(PcachePrefetched(pcm)) && TestClearPcachePrefetched(pcm))
+		inc_pcache_event(PCACHE_PREFETCH_UNUSED);
+}
+#else
+static inline void pcache_prefetch_mm_init(struct mm_struct *mm) { }
+static inline void pcache_prefetch_mm_exit(struct mm_struct *mm) { }
+static inline void pcache_prefetch_miss(struct mm_struct *mm, unsigned long address) { }
+static inline void pcache_prefetch_range(struct mm_struct *mm, unsigned long start,
+					 unsigned long end) { }
+static inline void pcache_prefetch_advise(struct mm_struct *mm, unsigned long start,
+					  unsigned long end, int behavior) { }
+static inline void pcache_prefetch_post_init(void) { }
+static inline void pcache_prefetch_evict_start(struct pcache_set *pset) { }
+static inline void pcache_prefetch_referenced(struct pcache_meta *pcm) { }
+static inline void pcache_prefetch_free(struct pcache_meta *pcm) { }
+#endif /* CONFIG_PCACHE_PREFETCH */
+
+#endif /* _LEGO_PROCESSOR_PCACHE_PREFETCH_H_ */
@@ -32,6 +32,7 @@ enum pcache_event_item {
 	PCACHE_CLFLUSH_CLEAN_SKIPPED,
 	PCACHE_CLFLUSH_FAIL,
 	PCACHE_CLFLUSH_PIGGYBACK_FB,
+	PCACHE_CLFLUSH_BATCH,		/* nr of batched flush requests */
 
 	/*
 	 * Write-protection fault
@@ -46,6 +47,8 @@ enum pcache_event_item {
 	PCACHE_FAULT_FILL_FROM_MEMORY,	/* nr of pcache fill from remote memory */
 	PCACHE_FAULT_FILL_FROM_MEMORY_PIGGYBACK,
 	PCACHE_FAULT_FILL_FROM_MEMORY_PIGGYBACK_FB,
+	PCACHE_FILL_BATCH,		/* nr of batched fill requests */
+	PCACHE_FILL_BATCH_LINES,	/* nr of lines fetched by batched fill */
 	PCACHE_FAULT_FILL_FROM_VICTIM,	/* nr of pcache fill from victim cache */
 
 	/*
@@ -56,6 +59,7 @@ enum pcache_event_item {
 	 * failure_find: algorithm part failed to find a candidate
 	 * failure_evict: mechanism part failed to evict the candidate
 	 * succeed: evicted a line
+	 * batch: multi-line evictions sharing one TLB shootdown
 	 */
 	PCACHE_EVICTION_TRIGGERED,
 	PCACHE_EVICTION_EAGAIN_FREEABLE,
@@ -63,9 +67,11 @@ enum pcache_event_item {
 	PCACHE_EVICTION_FAILURE_FIND,
 	PCACHE_EVICTION_FAILURE_EVICT,
 	PCACHE_EVICTION_SUCCEED,
+	PCACHE_EVICTION_BATCH,
 
 	PCACHE_PSET_LIST_LOOKUP,
 	PCACHE_PSET_LIST_HIT,
+	PCACHE_PSET_LIST_WAIT,
 
         PCACHE_VICTIM_LOOKUP,
         PCACHE_VICTIM_HIT,
@@ -97,6 +103,22 @@ enum pcache_event_item {
 	PCACHE_SWEEP_NR_PSET,		/* nr of pset that have been sweeped */
 	PCACHE_SWEEP_NR_MOVED_PCM,	/* nr of moved pcache lines */
 
+	PCACHE_CLOCK_SCANNED,		/* nr of ways passed by clock hand */
+	PCACHE_CLOCK_SECOND_CHANCE,	/* nr of referenced lines skipped by clock */
+
+	/*
+	 * Adaptive replacement counters
+	 * Misses are PCACHE_FAULT_FILL_*, same as other algorithms.
+	 * Lines found referenced by eviction scans are hits:
+	 * scan hit rate: (promote + frequent_hit) / (that + evict_*)
+	 */
+	PCACHE_ARC_PROMOTE,		/* nr of recent lines promoted to frequent */
+	PCACHE_ARC_FREQUENT_HIT,	/* nr of referenced frequent lines kept */
+	PCACHE_ARC_EVICT_RECENT,	/* nr of lines evicted from recent */
+	PCACHE_ARC_EVICT_FREQUENT,	/* nr of lines evicted from frequent */
+	PCACHE_ARC_GHOST_HIT_RECENT,	/* nr of refetches of recent evictions */
+	PCACHE_ARC_GHOST_HIT_FREQUENT,	/* nr of refetches of frequent evictions */
+
 	PCACHE_MREMAP_PSET_SAME,
 	PCACHE_MREMAP_PSET_DIFF,
 
@@ -110,6 +132,73 @@ enum pcache_event_item {
 	PCACHE_PEE_FREE,
 	PCACHE_PEE_FREE_KMALLOC,
 
+	/*
+	 * Prefetch counters
+	 * accuracy: hit / filled
+	 * coverage: hit / (hit + PCACHE_FAULT_FILL_FROM_MEMORY)
+	 */
+	PCACHE_PREFETCH_TRIGGERED,	/* nr of misses that triggered prefetch */
+	PCACHE_PREFETCH_ISSUED,		/* nr of lines queued for prefetch */
+	PCACHE_PREFETCH_QUEUE_FULL,	/* nr of lines dropped due to full queue */
+	PCACHE_PREFETCH_SKIPPED,	/* nr of lines already present or being evicted */
+	PCACHE_PREFETCH_FILLED,		/* nr of lines filled and mapped by prefetch */
+	PCACHE_PREFETCH_RACE,		/* nr of filled lines dropped due to races */
+	PCACHE_PREFETCH_FAIL,		/* nr of lines failed to alloc or fetch */
+	PCACHE_PREFETCH_HIT,		/* nr of prefetched lines got referenced */
+	PCACHE_PREFETCH_UNUSED,		/* nr of prefetched lines freed unreferenced */
+	PCACHE_PREFETCH_THROTTLED,	/* nr of lines dropped due to busy memory */
+
+	/*
+	 * Background reclaim counters
+	 * direct eviction: PCACHE_EVICTION_TRIGGERED - PCACHE_RECLAIM_EVICTED
+	 */
+	PCACHE_RECLAIM_QUEUED,		/* nr of sets queued to reclaimd */
+	PCACHE_RECLAIM_QUEUE_FULL,	/* nr of sets dropped due to full queue */
+	PCACHE_RECLAIM_EVICTED,		/* nr of lines evicted by reclaimd */
+	PCACHE_RECLAIM_FAIL,		/* nr of sets reclaimd gave up */
+
+	/* Process exit counters */
+	PCACHE_EXIT_PSET_SCANNED,	/* nr of sets scanned at exit */
+	PCACHE_EXIT_ZAPPED,		/* nr of lines zapped at exit */
+	PCACHE_EXIT_DIRTY_DROPPED,	/* nr of dirty lines dropped unflushed */
+	PCACHE_EXIT_FULL_WALK,		/* nr of exits that walked the pgtable */
+
+	/* Lazy fork counters */
+	PCACHE_LAZY_FORK_DEFERRED,	/* nr of ranges not copied at fork */
+	PCACHE_LAZY_FORK_COPIED,	/* nr of ranges copied afterwards */
+	PCACHE_LAZY_FORK_DROPPED,	/* nr of ranges never copied */
+	PCACHE_LAZY_FORK_EAGER,		/* nr of forks that fell back to copy */
+	PCACHE_LAZY_FORK_PINNED,	/* nr of dirty lines not evicted */
+	PCACHE_LAZY_FORK_UNPINNED,	/* nr of pmds resolved by eviction */
+
+	/* Extent fill counters */
+	PCACHE_EXTENT_FILL,		/* nr of extents fetched in one request */
+	PCACHE_EXTENT_FILL_LINES,	/* nr of lines mapped by extent fill */
+	PCACHE_EXTENT_FILL_SKIPPED,	/* nr of lines not mapped by extent fill */
+	PCACHE_EXTENT_FILL_REJECTED,	/* nr of extents rejected by memory */
+	PCACHE_EXTENT_FILL_BUSY,	/* nr of extents without free buffer */
+
+	/* madvise counters */
+	PCACHE_MADVISE_WILLNEED,	/* nr of lines queued by MADV_WILLNEED */
+	PCACHE_MADVISE_DONTNEED,	/* nr of ranges dropped by MADV_DONTNEED/FREE */
+	PCACHE_MADVISE_COLD,		/* nr of lines demoted by MADV_COLD */
+
+	/* Fault-around counters */
+	PCACHE_FAULT_AROUND,		/* nr of misses that fetched extra lines */
+	PCACHE_FAULT_AROUND_LINES,	/* nr of extra lines mapped by fault-around */
+	PCACHE_FAULT_AROUND_SKIPPED,	/* nr of extra lines fetched but not mapped */
+	PCACHE_FAULT_AROUND_REFUSED,	/* nr of misses whose vma refused fault-around */
+	PCACHE_FAULT_AROUND_BUSY,	/* nr of misses without free buffer */
+
+	/* Compressed tier counters */
+	PCACHE_CTIER_STORE,		/* nr of evicted lines stored compressed */
+	PCACHE_CTIER_STORE_BYTES,	/* nr of bytes they compressed to */
+	PCACHE_CTIER_STORE_FAIL,	/* nr of evicted lines not stored */
+	PCACHE_CTIER_HIT,		/* nr of misses filled from compressed tier */
+	PCACHE_CTIER_MISS,		/* nr of lookups that went to memory */
+	PCACHE_CTIER_DROP,		/* nr of entries dropped to make room */
+	PCACHE_CTIER_INVALIDATE,	/* nr of entries dropped by unmap or exit */
+
 	NR_PCACHE_EVENT_ITEMS,
 };
 
@@ -132,6 +221,11 @@ static inline void inc_pcache_event_cond(enum pcache_event_item item, bool doit)
 		inc_pcache_event(item);
 }
 
+static inline void mod_pcache_event(enum pcache_event_item item, long nr)
+{
+	atomic_long_add(nr, &pcache_event_stats.event[item]);
+}
+
 static inline unsigned long pcache_event(enum pcache_event_item item)
 {
 	return atomic_long_read(&pcache_event_stats.event[item]);
@@ -179,6 +273,7 @@ static inline long pcache_used(void)
 #else
 static inline void inc_pcache_event(enum pcache_event_item i) { }
 static inline void inc_pcache_event_cond(enum pcache_event_item item, bool doit) { }
+static inline void mod_pcache_event(enum pcache_event_item item, long nr) { }
 static inline unsigned long pcache_event(enum pcache_event_item i) { return 0; }
 static inline void mod_pset_event(int i, struct pcache_set *pset,
 				  enum pcache_set_stat_item item) { }
@@ -14,6 +14,7 @@
 #include <lego/const.h>
 #include <lego/bitops.h>
 #include <lego/spinlock.h>
+#include <lego/wait.h>
 
 #include <processor/pcache_config.h>
 
@@ -89,6 +90,10 @@ PEE_FLAGS(Used, used)
 
 #endif /* CONFIG_PCACHE_EVICTION_PERSET_LIST */
 
+/* One cacheline of atomic_t */
+#define PSET_EVICTION_FILTER_SHIFT	(4)
+#define PSET_EVICTION_FILTER_SIZE	(1 << PSET_EVICTION_FILTER_SHIFT)
+
 struct pset_padding {
 	char x[0];
 } ____cacheline_aligned_in_smp;
@@ -106,9 +111,12 @@ struct pset_padding {
 struct pcache_set {
 	unsigned long		flags;
 
-	/* This links all FREE pcache lines within pset */
-	struct list_head	free_head;
-	spinlock_t		free_lock;
+	/*
+	 * One bit per way, set if that line is FREE.
+	 * Lines are allocated and freed with atomic bitops, without lock.
+	 * It shares the cacheline with LRU fields, which allocation touches anyway.
+	 */
+	DECLARE_BITMAP(free_map, PCACHE_ASSOCIATIVITY);
 
 	/*
 	 * Eviction Algorithms Specific
@@ -122,6 +130,27 @@ struct pcache_set {
 	spinlock_t		lru_lock;
 #endif
 
+#ifdef CONFIG_PCACHE_EVICT_CLOCK
+	/* Next way to inspect, updated racily by evictions */
+	unsigned int		clock_hand;
+#endif
+
+#ifdef CONFIG_PCACHE_EVICT_ARC
+	/*
+	 * @arc_hand: next way to inspect
+	 * @arc_target: target number of lines in the recent segment
+	 * @arc_nr_frequent: number of lines in the frequent segment
+	 * @arc_ghost: line aligned addresses evicted recently, see evict_arc.c
+	 */
+	unsigned int		arc_hand;
+	int			arc_target;
+	atomic_t		arc_nr_frequent;
+
+	PSET_PADDING(_pad_arc_ghost)
+	atomic_t		arc_ghost_head;
+	unsigned long		arc_ghost[PCACHE_ASSOCIATIVITY];
+#endif
+
 	/*
 	 * Eviction Mechanism Specific
 	 */
@@ -136,10 +165,40 @@ struct pcache_set {
 	atomic_t		nr_victims;
 
 #elif defined (CONFIG_PCACHE_EVICTION_PERSET_LIST)
+	/*
+	 * Counting filter of line addresses on @eviction_list, indexed by
+	 * pset_eviction_filter(). Updated under @eviction_list_lock, read
+	 * locklessly by pgfault. A zero slot means no eviction of that
+	 * address is pending, others need a list walk to tell.
+	 *
+	 * Faults that do find a pending eviction sleep on @eviction_wait.
+	 */
 	PSET_PADDING(_pad2_)
+	atomic_t		eviction_filter[PSET_EVICTION_FILTER_SIZE];
+
+	PSET_PADDING(_pad3_)
 	spinlock_t		eviction_list_lock;
 	struct list_head	eviction_list;
-	atomic_t		nr_eviction_entries;
+	wait_queue_head_t	eviction_wait;
+#endif
+
+#ifdef CONFIG_PCACHE_PREFETCH
+	/*
+	 * Bumped each time an eviction starts within this set.
+	 * Prefetch snapshots it before going to network, and drops
+	 * the filled line if it changed in the middle.
+	 */
+	atomic_t		evict_seq;
+#endif
+
+#ifdef CONFIG_PCACHE_RECLAIMD
+	/*
+	 * @reclaim_pressure: allocations that found this set below its
+	 *                    low watermark since reclaimd served it last time
+	 * @reclaim_queued: set is in the reclaimd queue
+	 */
+	atomic_t		reclaim_pressure;
+	atomic_t		reclaim_queued;
 #endif
 
 	atomic_t		stat[NR_PSET_STAT_ITEMS];
@@ -184,10 +243,40 @@ struct pcm_pad {
 } ____cacheline_aligned_in_smp;
 #define PCM_PADDING(name)	struct pcm_pad name;
 
+enum rmap_caller {
+	RMAP_FILL_PAGE_REMOTE,
+	RMAP_ZEROFILL,
+	RMAP_VICTIM_FILL,
+	RMAP_COW,
+	RMAP_FORK,
+	RMAP_MREMAP_SLOWPATH,
+	RMAP_PREFETCH,
+	RMAP_EXTENT_FILL,
+	RMAP_FAULT_AROUND,
+	RMAP_CTIER_FILL,
+
+	NR_RMAP_CALLER,
+};
+
+struct pcache_rmap {
+	unsigned long		flags;
+	pte_t			*page_table;
+	struct mm_struct	*owner_mm;
+	struct task_struct	*owner_process;
+	enum rmap_caller	caller;
+
+	/* page aligned user virtual address */
+	unsigned long		address;
+
+	/* linked rmaps, belong to the same pcm */
+	struct list_head	next;
+};
+
 /**
  * struct pcache_meta	- Metadata about one pcache line
  * @bits: various state bits (see below)
- * @rmap: reverse mapping info
+ * @rmap: reverse mapping info, the 2nd and later ones
+ * @rmap_inline: reverse mapping info, the first one
  * @mapcount: count of ptes mapped to this pcm
  *
  * You can think this structure as the traditional metadata
@@ -208,11 +297,18 @@ struct pcache_meta {
 	atomic_t		mapcount;
 	atomic_t		_refcount;
 
-	/* This is linked to pset free_head */
-	struct list_head	free_list;
-
 	struct list_head	rmap;
-	struct piggyback_info	pb;
+
+	/*
+	 * Most lines are mapped by one single process,
+	 * they never touch the @rmap list. Only fork/COW
+	 * sharing needs kmalloc'ed rmaps linked there.
+	 *
+	 * pcache_rmap is not cacheline aligned on its own,
+	 * or this would push pcm past 128 bytes. The meta
+	 * size must divide PAGE_SIZE by a power of 2.
+	 */
+	struct pcache_rmap	rmap_inline;
 
 #ifdef CONFIG_DEBUG_PCACHE
 	struct task_struct	*locker;
@@ -221,31 +317,10 @@ struct pcache_meta {
 #ifdef CONFIG_PCACHE_EVICT_LRU
 	struct list_head	lru;
 #endif
-} ____cacheline_aligned;
 
-enum rmap_caller {
-	RMAP_FILL_PAGE_REMOTE,
-	RMAP_ZEROFILL,
-	RMAP_VICTIM_FILL,
-	RMAP_COW,
-	RMAP_FORK,
-	RMAP_MREMAP_SLOWPATH,
-
-	NR_RMAP_CALLER,
-};
-
-struct pcache_rmap {
-	unsigned long		flags;
-	pte_t			*page_table;
-	struct mm_struct	*owner_mm;
-	struct task_struct	*owner_process;
-	enum rmap_caller	caller;
-
-	/* page aligned user virtual address */
-	unsigned long		address;
-
-	/* linked rmaps, belong to the same pcm */
-	struct list_head	next;
+#ifdef CONFIG_PCACHE_PARTITION
+	unsigned int		partid;		/* group that allocated us */
+#endif
 } ____cacheline_aligned;
 
 /*
@@ -380,6 +455,13 @@ PSET_FLAGS(Sweeping, sweeping)
  * 			A following pcache_alloc from the same CPU, with
  * 			ENABLE_PIGGYBACK will get it. Check piggyback.h
  *
+ * PC_prefetched:	This pcm was filled by prefetch and has not been
+ * 			referenced yet. Cleared once a referenced PTE is seen.
+ * 			Used for prefetch accuracy accounting only.
+ *
+ * PC_frequent:		This pcm is in the frequent segment of adaptive
+ * 			replacement. Set under pcache lock, cleared at free.
+ *
  * Hack: remember to update the pcacheflag_names array in debug file.
  *
  * 1) PC_valid is more like the traditional cache valid bit. It is set when
@@ -393,6 +475,8 @@ enum pcache_meta_bits {
 	PC_writeback,
 	PC_piggyback,
 	PC_piggyback_cached,
+	PC_prefetched,
+	PC_frequent,
 
 	__NR_PCLBITS,
 };
@@ -469,6 +553,8 @@ PCACHE_META_BITS(Reclaim, reclaim)
 PCACHE_META_BITS(Writeback, writeback)
 PCACHE_META_BITS(Piggyback, piggyback)
 PCACHE_META_BITS(PiggybackCached, piggyback_cached)
+PCACHE_META_BITS(Prefetched, prefetched)
+PCACHE_META_BITS(Frequent, frequent)
 
 /*
  * Flags checked when a pcache is freed.
@@ -69,9 +69,33 @@ struct victim_flush_job {
 	struct pcache_victim_meta *victim;
 	struct completion done;
 	bool wait;
+	unsigned int nid;		/* index of the queue it is on */
 	struct list_head next;
 };
 
+/*
+ * One flush queue per memory node
+ *
+ * @nr_jobs: current queue depth
+ * @max_nr_jobs: max queue depth seen so far
+ * @nr_stolen: jobs flushed by a worker this queue is not homed on
+ * @nr_requests/@nr_lines: flush requests sent to this node, and lines in them
+ * @flush_ns: total time spent in those requests
+ */
+struct victim_flush_queue {
+	spinlock_t		lock;
+	struct list_head	head;
+	atomic_t		nr_jobs;
+	atomic_t		max_nr_jobs;
+	atomic_long_t		nr_stolen;
+	atomic_long_t		nr_requests;
+	atomic_long_t		nr_lines;
+	atomic_long_t		flush_ns;
+} ____cacheline_aligned;
+
+#define VICTIM_NR_FLUSH_QUEUES	CONFIG_FIT_NR_NODES
+#define VICTIM_NR_FLUSHD	CONFIG_PCACHE_EVICTION_VICTIM_NR_FLUSHD
+
 #ifdef CONFIG_PCACHE_EVICTION_VICTIM
 
 static inline int victim_ref_count(struct pcache_victim_meta *v)
@@ -404,8 +428,7 @@ void __init victim_cache_early_init(void);
 void __init victim_cache_post_init(void);
 
 extern atomic_t nr_flush_jobs;
-extern spinlock_t victim_flush_lock;
-extern struct list_head victim_flush_queue;
+extern struct victim_flush_queue victim_flush_queues[VICTIM_NR_FLUSH_QUEUES];
 
 static inline int nr_flush_queue_jobs(void)
 {
@@ -413,6 +436,7 @@ static inline int nr_flush_queue_jobs(void)
 }
 
 void dump_victim_flush_queue(void);
+void print_victim_flush_stats(void);
 void dump_all_victim(void);
 void dump_victim_lines_and_queue(void);
 
@@ -432,6 +456,7 @@ static __always_inline struct victim_flush_job *steal_victim_flush_job(void)
 #else
 static inline void victim_cache_early_init(void) { }
 static inline void victim_cache_post_init(void) { }
+static inline void print_victim_flush_stats(void) { }
 #endif /* CONFIG_PCACHE_EVICTION_VICTIM */
 
 #endif /* _LEGO_PROCESSOR_PCACHE_VICTIM_H_ */
@@ -18,6 +18,7 @@
 
 #include <lego/mm.h>
 #include <lego/comp_common.h>
+#include <asm/tlbflush.h>
 
 void dump_page_tables(struct task_struct *tsk,
 		      unsigned long __user start, unsigned long __user end);
@@ -26,7 +27,8 @@ void free_pgd_range(struct mm_struct *mm,
 		    unsigned long __user addr, unsigned long __user end);
 
 void unmap_page_range(struct mm_struct *mm,
-		      unsigned long addr, unsigned long end);
+		      unsigned long addr, unsigned long end,
+		      struct tlb_gather *tlb);
 
 /* Callback for fork() */
 int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
@@ -33,6 +33,9 @@ int pcache_handle_fault(struct mm_struct *mm,
 
 void pcache_process_exit(struct task_struct *tsk);
 void pcache_thread_exit(struct task_struct *tsk);
+void pcache_mm_init(struct mm_struct *mm);
+void pcache_mm_free(struct mm_struct *mm);
+long pcache_madvise(unsigned long start, unsigned long end, int behavior);
 
 #ifdef CONFIG_CHECKPOINT
 int checkpoint_thread(struct task_struct *);
@@ -54,6 +57,14 @@ void open_stdio_files(void);
 
 static inline void pcache_process_exit(struct task_struct *tsk) { }
 static inline void pcache_thread_exit(struct task_struct *tsk) { }
+static inline void pcache_mm_init(struct mm_struct *mm) { }
+static inline void pcache_mm_free(struct mm_struct *mm) { }
+
+static inline long pcache_madvise(unsigned long start, unsigned long end,
+				  int behavior)
+{
+	return 0;
+}
 
 static inline void kick_off_user(void) { }
 static inline void processor_manager_init(void) { }
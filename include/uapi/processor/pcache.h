@@ -30,4 +30,26 @@ struct pcache_stat {
 	unsigned long	nr_eviction;
 };
 
+/*
+ * pcache_partition(op, group, arg)
+ *
+ * SET_WAYS:	lines of @group may only use the ways set in @arg
+ * ATTACH:	process @arg (0 for caller) and its future children join @group
+ * STAT:	copy struct pcache_partition_stat of @group to @arg
+ *
+ * SET_WAYS needs root. Without root, ATTACH only works on the caller's
+ * own process, and only to a group whose ways are a subset of its own.
+ */
+#define PCACHE_PARTITION_SET_WAYS	0
+#define PCACHE_PARTITION_ATTACH		1
+#define PCACHE_PARTITION_STAT		2
+
+struct pcache_partition_stat {
+	unsigned long	way_mask;
+	unsigned long	nr_lines;		/* lines currently owned */
+	unsigned long	nr_fill;		/* lines allocated */
+	unsigned long	nr_evicted;		/* owned lines evicted */
+	unsigned long	nr_evicted_by_others;	/* ... to make room for other groups */
+};
+
 #endif /* _LEGO_UAPI_PROCESSOR_PCACHE_H_ */
@@ -25,6 +25,7 @@
 #include <processor/distvm.h>
 
 #include <asm/pgalloc.h>
+#include <asm/tlbflush.h>
 #include <asm/fpu/internal.h>
 
 /* Initialized by the architecture: */
@@ -186,6 +187,7 @@ void __mmdrop(struct mm_struct *mm)
 
 	/* Processor: Free distributed VMA resource */
 	processor_distvm_exit(mm);
+	pcache_mm_free(mm);
 
 	mm_free_pgd(mm);
 	check_mm(mm);
@@ -338,6 +340,7 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p)
 	mm->map_count = 0;
 	mm->pinned_vm = 0;
 	mm_init_cpumask(mm);
+	init_tlb_context(mm);
 	spin_lock_init(&mm->page_table_lock);
 	init_rwsem(&mm->mmap_sem);
 
@@ -358,6 +361,12 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p)
 		return NULL;
 	}
 
+	/* Processor: init pcache prefetch streams */
+	pcache_prefetch_mm_init(mm);
+
+	/* Processor: init pcache resident set tracking */
+	pcache_mm_init(mm);
+
 	return mm;
 }
 
@@ -7,7 +7,35 @@
  * (at your option) any later version.
  */
 
+#include <lego/mm.h>
 #include <lego/syscalls.h>
+#include <processor/processor.h>
+
+static int madvise_behavior_valid(int behavior)
+{
+	switch (behavior) {
+	case MADV_NORMAL:
+	case MADV_RANDOM:
+	case MADV_SEQUENTIAL:
+	case MADV_WILLNEED:
+	case MADV_DONTNEED:
+	case MADV_FREE:
+	case MADV_REMOVE:
+	case MADV_DONTFORK:
+	case MADV_DOFORK:
+	case MADV_MERGEABLE:
+	case MADV_UNMERGEABLE:
+	case MADV_HUGEPAGE:
+	case MADV_NOHUGEPAGE:
+	case MADV_DONTDUMP:
+	case MADV_DODUMP:
+	case MADV_COLD:
+	case MADV_PAGEOUT:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
 /*
  * The madvise(2) system call.
@@ -53,6 +81,14 @@
  *  MADV_DONTDUMP - the application wants to prevent pages in the given range
  *		from being included in its core dump.
  *  MADV_DODUMP - cancel MADV_DONTDUMP: no longer exclude from core dump.
+ *  MADV_COLD - the application is not expected to use this memory soon,
+ *		deactivate pages in this range so that they can be reclaimed
+ *		easily if memory pressure happens.
+ *  MADV_PAGEOUT - the application is not expected to use this memory soon,
+ *		page out the pages in this range immediately.
+ *
+ * Processor manager translates behaviors into pcache actions,
+ * see pcache_madvise(). The rest are accepted and ignored.
  *
  * return values:
  *  zero    - success
@@ -67,7 +103,31 @@
  */
 SYSCALL_DEFINE3(madvise, unsigned long, start, size_t, len_in, int, behavior)
 {
+	unsigned long end;
+	size_t len;
+	long ret;
+
 	syscall_enter("start: %#lx, len_in: %#lx, behavior: %d\n",
 		start, len_in, behavior);
-	return 0;
+
+	if (!madvise_behavior_valid(behavior))
+		return -EINVAL;
+
+	if (offset_in_page(start))
+		return -EINVAL;
+	len = PAGE_ALIGN(len_in);
+
+	/* Check to see whether len was rounded up from small -ve to zero */
+	if (len_in && !len)
+		return -EINVAL;
+
+	end = start + len;
+	if (end < start)
+		return -EINVAL;
+	if (end == start)
+		return 0;
+
+	ret = pcache_madvise(start, end, behavior);
+	syscall_exit(ret);
+	return ret;
 }
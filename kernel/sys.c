@@ -581,6 +581,11 @@ SYSCALL_DEFINE1(pcache_stat, struct pcache_stat __user *, statbuf)
 	BUG();
 }
 
+SYSCALL_DEFINE3(pcache_partition, int, op, int, group, unsigned long, arg)
+{
+	BUG();
+}
+
 SYSCALL_DEFINE2(access, const char __user *, filename, int, mode)
 {
 	BUG();
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * LZF stream format, one control byte followed by its payload:
+ *
+ *   000lllll			literal run, (lllll + 1) bytes follow
+ *   LLLooooo oooooooo		back reference, length (LLL + 2),
+ *				offset (ooooo << 8 | oooooooo) + 1
+ *   111ooooo LLLLLLLL oooooooo	back reference, length (LLLLLLLL + 9)
+ */
+
+#include <lego/lzf.h>
+#include <lego/bug.h>
+#include <lego/string.h>
+#include <lego/kernel.h>
+
+#define LZF_MAX_LIT		(1 << 5)
+#define LZF_MAX_OFF		(1 << 13)
+#define LZF_MAX_REF		((1 << 8) + (1 << 3))
+
+static inline unsigned int lzf_hash(const u8 *p)
+{
+	u32 v = (p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (v * 2654435761U) >> (32 - LZF_HTAB_BITS);
+}
+
+/**
+ * lzf_compress
+ * @in: data to compress
+ * @in_len: length of @in, at most LZF_MAX_IN_LEN
+ * @out: where compressed data goes
+ * @out_len: size of @out
+ * @htab: LZF_HTAB_SIZE entries of scratch space
+ *
+ * Return the compressed length, or 0 if it does not fit into @out_len.
+ * Callers usually pass an @out_len smaller than @in_len, so that data
+ * which does not compress well is given up early.
+ */
+unsigned int lzf_compress(const void *in, unsigned int in_len,
+			  void *out, unsigned int out_len, u16 *htab)
+{
+	const u8 *in_start = in, *ip = in, *in_end = ip + in_len;
+	u8 *op = out, *out_end = op + out_len;
+	u8 *lit_ctrl;
+	unsigned int lit = 0;
+
+	if (WARN_ON_ONCE(in_len > LZF_MAX_IN_LEN))
+		return 0;
+	if (!in_len || out_len < 2)
+		return 0;
+
+	/* Control byte of the first literal run */
+	lit_ctrl = op++;
+
+	while (ip < in_end) {
+		if (likely(ip + 2 < in_end)) {
+			unsigned int h = lzf_hash(ip);
+			unsigned int pos = ip - in_start;
+			unsigned int cand = htab[h];
+
+			htab[h] = pos;
+
+			/* Stale entries point anywhere, check before use */
+			if (cand < pos && pos - cand - 1 < LZF_MAX_OFF &&
+			    !memcmp(in_start + cand, ip, 3)) {
+				const u8 *ref = in_start + cand;
+				unsigned int off = pos - cand - 1;
+				unsigned int len = 3;
+				unsigned int maxlen = min_t(unsigned int,
+							    in_end - ip, LZF_MAX_REF);
+
+				while (len < maxlen && ref[len] == ip[len])
+					len++;
+
+				/* Close the current run, or reuse its control byte */
+				if (lit)
+					*lit_ctrl = lit - 1;
+				else
+					op--;
+
+				if (op + 3 > out_end)
+					return 0;
+
+				ip += len;
+				len -= 2;
+				if (len < 7) {
+					*op++ = (off >> 8) + (len << 5);
+				} else {
+					*op++ = (off >> 8) + (7 << 5);
+					*op++ = len - 7;
+				}
+				*op++ = off;
+
+				lit = 0;
+				lit_ctrl = op++;
+				continue;
+			}
+		}
+
+		if (op >= out_end)
+			return 0;
+		*op++ = *ip++;
+
+		if (++lit == LZF_MAX_LIT) {
+			*lit_ctrl = lit - 1;
+			lit = 0;
+			lit_ctrl = op++;
+		}
+	}
+
+	if (lit)
+		*lit_ctrl = lit - 1;
+	else
+		op--;
+
+	return op - (u8 *)out;
+}
+
+/**
+ * lzf_decompress
+ * @in: data produced by lzf_compress()
+ * @in_len: length of @in
+ * @out: where decompressed data goes
+ * @out_len: size of @out
+ *
+ * Return the decompressed length, or 0 if @in is corrupted or
+ * does not fit into @out_len.
+ */
+unsigned int lzf_decompress(const void *in, unsigned int in_len,
+			    void *out, unsigned int out_len)
+{
+	const u8 *ip = in, *in_end = ip + in_len;
+	u8 *op = out, *out_end = op + out_len;
+
+	while (ip < in_end) {
+		unsigned int ctrl = *ip++;
+
+		if (ctrl < LZF_MAX_LIT) {
+			ctrl++;
+			if (op + ctrl > out_end || ip + ctrl > in_end)
+				return 0;
+			memcpy(op, ip, ctrl);
+			op += ctrl;
+			ip += ctrl;
+		} else {
+			unsigned int len = ctrl >> 5;
+			unsigned int off = (ctrl & 0x1f) << 8;
+			const u8 *ref;
+
+			if (len == 7) {
+				if (ip >= in_end)
+					return 0;
+				len += *ip++;
+			}
+			if (ip >= in_end)
+				return 0;
+			off += *ip++;
+			len += 2;
+
+			if (op + len > out_end || off >= op - (u8 *)out)
+				return 0;
+
+			/* Byte by byte, the reference may overlap with us */
+			ref = op - off - 1;
+			do {
+				*op++ = *ref++;
+			} while (--len);
+		}
+	}
+
+	return op - (u8 *)out;
+}
@@ -50,10 +50,33 @@ static DEFINE_COMPLETION(thpool_init_completion);
 
 /*
  * Pre-allocated thpool buffer
- * TB_HEAD points the current available buffer
+ * Free ones are linked by their @next
  */
-static int TB_HEAD __cacheline_aligned;
 static struct thpool_buffer *thpool_buffer_map __read_mostly;
+static LIST_HEAD(thpool_buffer_free_list);
+static int nr_free_thpool_buffer;
+
+/* A request received while no buffer is free */
+struct thpool_backlog_entry {
+	void	*fit_ctx;
+	void	*fit_imm;
+	void	*fit_rx;
+	int	fit_node_id;
+	int	fit_offset;
+};
+
+static struct thpool_backlog_entry thpool_backlog[NR_THPOOL_BACKLOG];
+static unsigned int thpool_backlog_head, thpool_backlog_tail;
+
+/*
+ * Protects free list and backlog. A buffer is only put back
+ * to the free list if the backlog is empty, thus requests
+ * are always served in arrival order.
+ */
+static DEFINE_SPINLOCK(thpool_buffer_lock);
+
+unsigned long nr_thpool_reqs;
+unsigned long nr_thpool_backlogged;
 
 static inline int thpool_worker_id(struct thpool_worker *worker)
 {
@@ -69,7 +92,7 @@ static inline void
 enqueue_tail_thpool_worker(struct thpool_worker *worker, struct thpool_buffer *buffer)
 {
 	spin_lock(&worker->lock);
-	list_add_tail(&buffer->next, &worker->work_head);
+	list_add_tail(&buffer->next, &worker->work_head[buffer->lane]);
 	/*
 	 * This is not necessary but will do no harm.
 	 * Since we are running on x86 TSO.
@@ -85,56 +108,210 @@ enqueue_tail_thpool_worker(struct thpool_worker *worker, struct thpool_buffer *b
 	spin_unlock(&worker->lock);
 }
 
+/* FAST lane first. Return NULL if both lanes are empty. */
 static inline struct thpool_buffer *
 __dequeue_head_thpool_worker(struct thpool_worker *worker)
+{
+	struct thpool_buffer *buffer;
+	int lane;
+
+	for (lane = 0; lane < NR_THPOOL_LANES; lane++) {
+		if (list_empty(&worker->work_head[lane]))
+			continue;
+
+		buffer = list_entry(worker->work_head[lane].next,
+				    struct thpool_buffer, next);
+		list_del(&buffer->next);
+		dec_queued_thpool_worker(worker);
+		return buffer;
+	}
+	return NULL;
+}
+
+static inline struct thpool_buffer *
+dequeue_head_thpool_worker(struct thpool_worker *worker)
 {
 	struct thpool_buffer *buffer;
 
-	buffer = list_entry(worker->work_head.next, struct thpool_buffer, next);
-	list_del(&buffer->next);
-	dec_queued_thpool_worker(worker);
+	/* Check comments on enqueue */
+	if (!nr_queued_thpool_worker(worker))
+		return NULL;
 
+	spin_lock(&worker->lock);
+	buffer = __dequeue_head_thpool_worker(worker);
+	spin_unlock(&worker->lock);
 	return buffer;
 }
 
+/*
+ * Called by an idle @thief. Take a request from a worker that is busy
+ * handling another one, or that has more than one queued. Never spin on
+ * a contended lock, the owner or the dispatcher is in there.
+ */
+static struct thpool_buffer *steal_thpool_buffer(struct thpool_worker *thief)
+{
+	struct thpool_worker *victim;
+	struct thpool_buffer *buffer;
+	int i, idx;
+
+	idx = thpool_worker_id(thief);
+	for (i = 1; i < NR_THPOOL_WORKERS; i++) {
+		victim = thpool_worker_map + (idx + i) % NR_THPOOL_WORKERS;
+
+		if (!nr_queued_thpool_worker(victim))
+			continue;
+		if (running_thpool_worker(victim) == THPOOL_LANE_NONE &&
+		    nr_queued_thpool_worker(victim) < 2)
+			continue;
+		if (!spin_trylock(&victim->lock))
+			continue;
+
+		buffer = __dequeue_head_thpool_worker(victim);
+		spin_unlock(&victim->lock);
+		if (buffer) {
+			inc_thpool_worker_nr_stolen(thief);
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static inline int nr_thpool_backlog(void)
+{
+	return READ_ONCE(thpool_backlog_head) - READ_ONCE(thpool_backlog_tail);
+}
+
+int thpool_credits(void)
+{
+	return max(READ_ONCE(nr_free_thpool_buffer) - nr_thpool_backlog(), 0);
+}
+
 static inline struct thpool_buffer *
-alloc_thpool_buffer(void)
+__alloc_thpool_buffer(void)
 {
 	struct thpool_buffer *tb;
-	int idx;
 
-	idx = TB_HEAD % NR_THPOOL_BUFFER;
-	tb = thpool_buffer_map + idx;
-	TB_HEAD++;
+	if (list_empty(&thpool_buffer_free_list))
+		return NULL;
 
-	/*
-	 * Buffer allocation is a simple ring.
-	 * If the warning is triggered, it basically means:
-	 * - buffer is not big enough
-	 * - handler are too slow
-	 */
-	while (ThpoolBufferUsed(tb)) {
-		WARN_ON_ONCE(1);
-		cpu_relax();
-	}
+	tb = list_first_entry(&thpool_buffer_free_list, struct thpool_buffer, next);
+	list_del_init(&tb->next);
+	nr_free_thpool_buffer--;
 
 	__SetThpoolBufferUsed(tb);
 	return tb;
 }
 
+static inline void
+fill_thpool_buffer(struct thpool_buffer *b, void *fit_ctx, void *fit_imm,
+		   void *rx, int node_id, int fit_offset)
+{
+	b->fit_rx = rx;
+	b->fit_ctx = fit_ctx;
+	b->fit_imm = fit_imm;
+	b->fit_offset = fit_offset;
+	b->fit_node_id = node_id;
+}
+
+static inline enum thpool_lane thpool_buffer_lane(struct thpool_buffer *r)
+{
+	struct common_header *hdr = to_common_header(thpool_buffer_rx(r));
+
+	switch (hdr->opcode) {
+	case P2M_PCACHE_MISS:
+	case P2M_PCACHE_MISS_BATCH:
+	case P2M_PCACHE_MISS_EXTENT:
+	case P2M_PCACHE_MISS_AROUND:
+	case P2M_PCACHE_FLUSH:
+	case P2M_PCACHE_FLUSH_BATCH:
+	case P2M_PCACHE_ZEROFILL:
+		return THPOOL_LANE_FAST;
+	default:
+		return THPOOL_LANE_SLOW;
+	}
+}
+
 /*
- * Choose a worker based on request types
+ * A worker inside a SLOW handler may not come back for milliseconds.
+ * Count it as this many queued requests when placing a FAST one.
+ */
+#define THPOOL_SLOW_RUNNING_LOAD	(8)
+
+/*
+ * Choose the least loaded worker, starting from a rotating position
+ * so that ties are spread. Idle workers steal whatever we get wrong.
  */
 static inline struct thpool_worker *
 select_thpool_worker(struct thpool_buffer *r)
 {
-	struct thpool_worker *tw;
-	int idx;
+	struct thpool_worker *tw, *best = NULL;
+	int i, idx, load, best_load = INT_MAX;
+	enum thpool_lane running;
 
 	idx = TW_HEAD % NR_THPOOL_WORKERS;
-	tw = thpool_worker_map + idx;
 	TW_HEAD++;
-	return tw;
+
+	for (i = 0; i < NR_THPOOL_WORKERS; i++) {
+		tw = thpool_worker_map + (idx + i) % NR_THPOOL_WORKERS;
+
+		load = nr_queued_thpool_worker(tw);
+		running = running_thpool_worker(tw);
+		if (running == THPOOL_LANE_SLOW && r->lane == THPOOL_LANE_FAST)
+			load += THPOOL_SLOW_RUNNING_LOAD;
+		else if (running != THPOOL_LANE_NONE)
+			load++;
+
+		if (load < best_load) {
+			best = tw;
+			best_load = load;
+			if (!load)
+				break;
+		}
+	}
+	return best;
+}
+
+/*
+ * Select a worker thread and pass the buffer
+ * to it. The worker should do ACK and REPLY.
+ */
+static void dispatch_thpool_buffer(struct thpool_buffer *b)
+{
+	struct thpool_worker *w;
+
+	b->lane = thpool_buffer_lane(b);
+	thpool_buffer_enqueue_time(b);
+	w = select_thpool_worker(b);
+	enqueue_tail_thpool_worker(w, b);
+	nr_thpool_reqs++;
+}
+
+/*
+ * Called by worker once @b is replied. If requests are waiting
+ * in the backlog, @b is handed to the oldest one directly.
+ */
+static void free_thpool_buffer(struct thpool_buffer *b)
+{
+	struct thpool_backlog_entry *e;
+
+	__ClearThpoolBufferNoreply(b);
+
+	spin_lock(&thpool_buffer_lock);
+	if (likely(!nr_thpool_backlog())) {
+		__ClearThpoolBufferUsed(b);
+		list_add(&b->next, &thpool_buffer_free_list);
+		nr_free_thpool_buffer++;
+		spin_unlock(&thpool_buffer_lock);
+		return;
+	}
+
+	e = &thpool_backlog[thpool_backlog_tail % NR_THPOOL_BACKLOG];
+	fill_thpool_buffer(b, e->fit_ctx, e->fit_imm, e->fit_rx,
+			   e->fit_node_id, e->fit_offset);
+	WRITE_ONCE(thpool_backlog_tail, thpool_backlog_tail + 1);
+	spin_unlock(&thpool_buffer_lock);
+
+	dispatch_thpool_buffer(b);
 }
 
 static void thpool_worker_handler(struct thpool_worker *worker,
@@ -177,10 +354,26 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		inc_mm_stat(HANDLE_PCACHE_MISS);
 		handle_p2m_pcache_miss(msg, buffer);
 		break;
+	case P2M_PCACHE_MISS_BATCH:
+		inc_mm_stat(HANDLE_PCACHE_MISS_BATCH);
+		handle_p2m_pcache_miss_batch(msg, buffer);
+		break;
+	case P2M_PCACHE_MISS_EXTENT:
+		inc_mm_stat(HANDLE_PCACHE_MISS_EXTENT);
+		handle_p2m_pcache_miss_extent(msg, buffer);
+		break;
+	case P2M_PCACHE_MISS_AROUND:
+		inc_mm_stat(HANDLE_PCACHE_MISS_AROUND);
+		handle_p2m_pcache_miss_around(msg, buffer);
+		break;
 	case P2M_PCACHE_FLUSH:
 		inc_mm_stat(HANDLE_PCACHE_FLUSH);
 		handle_p2m_flush_one(msg, buffer);
 		break;
+	case P2M_PCACHE_FLUSH_BATCH:
+		inc_mm_stat(HANDLE_PCACHE_FLUSH_BATCH);
+		handle_p2m_flush_batch(msg, buffer);
+		break;
 	case P2M_PCACHE_ZEROFILL:
 		handle_p2m_zerofill(msg, buffer);
 		break;
@@ -248,6 +441,10 @@ static void thpool_worker_handler(struct thpool_worker *worker,
 		handle_p2m_msync(payload, desc, hdr, tx);
 		break;
 
+	case P2M_MADVISE:
+		handle_p2m_madvise(payload, hdr, buffer);
+		break;
+
 	case P2M_FORK:
 		handle_p2m_fork(payload, hdr, buffer);
 		break;
@@ -357,62 +554,61 @@ static int thpool_worker_func(void *_worker)
 
 	preempt_disable();
 	while (1) {
-		/* Check comments on enqueue */
-		while (!nr_queued_thpool_worker(w))
-			cpu_relax();
-
-		spin_lock(&w->lock);
-		while (!list_empty(&w->work_head)) {
-			b = __dequeue_head_thpool_worker(w);
-			spin_unlock(&w->lock);
-
-			/*
-			 * Update queuing stats
-			 *
-			 * HACK!!! The operations below except thpool_worker_handler()
-			 * are for debugging/tracing purpose. The will be compiled
-			 * away if disable CONFIG_COUNTER_THPOOL.
-			 */
-			thpool_buffer_dequeue_time(b);
-			queuing_delay = thpool_buffer_queuing_delay(b);
-			add_thpool_worker_total_queuing(w, queuing_delay);
-
-			set_in_handler_thpool_worker(w);
-			set_wip_buffer_thpool_worker(w, b);
-
-			PROFILE_START(thpool_worker_handler);
-
-			/* Invoke the real handler */
-			tb_reset_tx_size(b);
-			tb_reset_private_tx(b);
-			thpool_worker_handler(w, b);
-
-			/*
-			 * Leave this BUG_ON checking to catch
-			 * buggy handlers.
-			 */
-			BUG_ON(!b->tx_size);
-			PROFILE_LEAVE(thpool_worker_handler);
-
-			/*
-			 * Callback to FIT layer to perform the
-			 * last two steps: ACK, and REPLY.
-			 */
-			PROFILE_START(thpool_worker_fit_ack_reply);
-			fit_ack_reply_callback(b);
-			PROFILE_LEAVE(thpool_worker_fit_ack_reply);
-
-			clear_wip_buffer_thpool_worker(w);
-			clear_in_handler_thpool_worker(w);
-
-			/* Return buffer to free pool */
-			__ClearThpoolBufferNoreply(b);
-			__ClearThpoolBufferUsed(b);
-
-			inc_thpool_worker_nr_handled(w);
-			spin_lock(&w->lock);
+		b = dequeue_head_thpool_worker(w);
+		if (!b) {
+			b = steal_thpool_buffer(w);
+			if (!b) {
+				if (!anon_prefetch_run(w))
+					cpu_relax();
+				continue;
+			}
 		}
-		spin_unlock(&w->lock);
+
+		/*
+		 * Update queuing stats
+		 *
+		 * HACK!!! The operations below except thpool_worker_handler()
+		 * are for debugging/tracing purpose. The will be compiled
+		 * away if disable CONFIG_COUNTER_THPOOL.
+		 */
+		thpool_buffer_dequeue_time(b);
+		queuing_delay = thpool_buffer_queuing_delay(b);
+		add_thpool_worker_total_queuing(w, b, queuing_delay);
+
+		set_running_thpool_worker(w, b->lane);
+		set_in_handler_thpool_worker(w);
+		set_wip_buffer_thpool_worker(w, b);
+
+		PROFILE_START(thpool_worker_handler);
+
+		/* Invoke the real handler */
+		tb_reset_tx_size(b);
+		tb_reset_private_tx(b);
+		thpool_worker_handler(w, b);
+
+		/*
+		 * Leave this BUG_ON checking to catch
+		 * buggy handlers.
+		 */
+		BUG_ON(!b->tx_size);
+		PROFILE_LEAVE(thpool_worker_handler);
+
+		/*
+		 * Callback to FIT layer to perform the
+		 * last two steps: ACK, and REPLY.
+		 */
+		PROFILE_START(thpool_worker_fit_ack_reply);
+		fit_ack_reply_callback(b);
+		PROFILE_LEAVE(thpool_worker_fit_ack_reply);
+
+		clear_wip_buffer_thpool_worker(w);
+		clear_in_handler_thpool_worker(w);
+		set_running_thpool_worker(w, THPOOL_LANE_NONE);
+
+		inc_thpool_worker_nr_handled(w);
+
+		/* Return buffer to free pool, @b may be reused right away */
+		free_thpool_buffer(b);
 	}
 	preempt_enable();
 
@@ -424,35 +620,57 @@ static int thpool_worker_func(void *_worker)
 	return 0;
 }
 
-unsigned long nr_thpool_reqs;
-
+/* Called by FIT polling thread for each incoming request */
 void thpool_callback(void *fit_ctx, void *fit_imm,
 		     void *rx, int rx_size, int node_id, int fit_offset)
 {
+	struct thpool_backlog_entry *e;
 	struct thpool_buffer *b;
-	struct thpool_worker *w;
 
-	b = alloc_thpool_buffer();
-	b->fit_rx = rx;
-	b->fit_ctx = fit_ctx;
-	b->fit_imm = fit_imm;
-	b->fit_offset = fit_offset;
-	b->fit_node_id = node_id;
+	spin_lock(&thpool_buffer_lock);
+	b = __alloc_thpool_buffer();
+	if (unlikely(!b)) {
+		/*
+		 * Do not hold up the receive path for a slow handler,
+		 * park the request. Requesters are told to back off
+		 * by the credits in replies.
+		 */
+		if (likely(nr_thpool_backlog() < NR_THPOOL_BACKLOG)) {
+			e = &thpool_backlog[thpool_backlog_head % NR_THPOOL_BACKLOG];
+			e->fit_ctx = fit_ctx;
+			e->fit_imm = fit_imm;
+			e->fit_rx = rx;
+			e->fit_node_id = node_id;
+			e->fit_offset = fit_offset;
+			WRITE_ONCE(thpool_backlog_head, thpool_backlog_head + 1);
+			nr_thpool_backlogged++;
+			spin_unlock(&thpool_buffer_lock);
+			return;
+		}
 
-	/*
-	 * Select a worker thread and pass the buffer
-	 * to it. The worker should do ACK and REPLY.
-	 */
-	thpool_buffer_enqueue_time(b);
-	w = select_thpool_worker(b);
-	enqueue_tail_thpool_worker(w, b);
-	nr_thpool_reqs++;
+		/*
+		 * If the warning is triggered, it basically means:
+		 * - buffer is not big enough
+		 * - handler are too slow
+		 */
+		WARN_ON_ONCE(1);
+		do {
+			spin_unlock(&thpool_buffer_lock);
+			cpu_relax();
+			spin_lock(&thpool_buffer_lock);
+			b = __alloc_thpool_buffer();
+		} while (!b);
+	}
+	spin_unlock(&thpool_buffer_lock);
+
+	fill_thpool_buffer(b, fit_ctx, fit_imm, rx, node_id, fit_offset);
+	dispatch_thpool_buffer(b);
 }
 
 /* Create worker and polling threads */
 void __init thpool_init(void)
 {
-	int i;
+	int i, lane;
 	struct task_struct *p;
 	struct thpool_worker *worker;
 
@@ -463,11 +681,16 @@ void __init thpool_init(void)
 		worker->nr_queued = 0;
 		worker->max_nr_queued = 0;
 		worker->flags = 0;
+		worker->running = THPOOL_LANE_NONE;
 		worker->nr_handled = 0;
+		worker->nr_handled_fast = 0;
+		worker->nr_stolen = 0;
 		worker->total_queuing_delay_ns = 0;
 		worker->max_queuing_delay_ns = 0;
+		worker->max_fast_queuing_delay_ns = 0;
 		worker->min_queuing_delay_ns = ULONG_MAX;
-		INIT_LIST_HEAD(&worker->work_head);
+		for (lane = 0; lane < NR_THPOOL_LANES; lane++)
+			INIT_LIST_HEAD(&worker->work_head[lane]);
 		spin_lock_init(&worker->lock);
 		memset(worker->queuing_stats, 0, sizeof(worker->queuing_stats));
 
@@ -518,14 +741,14 @@ void __init memory_manager_early_init(void)
 	if (!thpool_buffer_map)
 		panic("Unable to allocate thpool buffer array!");
 
-	TB_HEAD = 0;
 	memset(thpool_buffer_map, 0, size);
 	for (i = 0; i < NR_THPOOL_BUFFER; i++) {
 		struct thpool_buffer *tb;
 
 		tb = thpool_buffer_map + i;
-		INIT_LIST_HEAD(&tb->next);
+		list_add_tail(&tb->next, &thpool_buffer_free_list);
 	}
+	nr_free_thpool_buffer = NR_THPOOL_BUFFER;
 
 	pr_debug("Memory: thpool_buffer [%p - %#Lx] %Lx bytes nr:%d size:%zu\n",
 		thpool_buffer_map, (unsigned long)(thpool_buffer_map) + size, size,
@@ -594,6 +817,11 @@ void print_thpool_stats(void)
 	int i;
 	struct thpool_worker *tw;
 
+	pr_info("Watchdog:\n"
+		"    thpool_buffer nr_free=%d nr_backlog=%d nr_backlogged=%lu\n",
+		READ_ONCE(nr_free_thpool_buffer), nr_thpool_backlog(),
+		nr_thpool_backlogged);
+
 	for (i = 0; i < NR_THPOOL_WORKERS; i++) {
 		int j;
 		u64 p_i, p_re;
@@ -604,12 +832,14 @@ void print_thpool_stats(void)
 		pr_info("Watchdog:\n"
 			"    worker[%d]\n"
 			"        max_nr_queued=%d current_nr_queued=%d in_handler=%s\n"
-			"        nr_handled=%lu nr_thpool_reqs=%lu\n"
-			"        total_queuing_ns: %lu avg_queuing_ns:%lu max_queuing_ns: %lu min_queuing_ns: %lu\n",
+			"        nr_handled=%lu nr_handled_fast=%lu nr_stolen=%lu nr_thpool_reqs=%lu\n"
+			"        total_queuing_ns: %lu avg_queuing_ns:%lu max_queuing_ns: %lu min_queuing_ns: %lu\n"
+			"        max_fast_queuing_ns: %lu\n",
 			i, max_queued_thpool_worker(tw), tw->nr_queued, thpool_worker_in_handler(tw) ? "YES" : "NO",
-			tw->nr_handled, nr_thpool_reqs,
+			tw->nr_handled, tw->nr_handled_fast, tw->nr_stolen, nr_thpool_reqs,
 			tw->total_queuing_delay_ns, tw->nr_handled ? (tw->total_queuing_delay_ns / tw->nr_handled) : 0,
-			tw->max_queuing_delay_ns, tw->min_queuing_delay_ns);
+			tw->max_queuing_delay_ns, tw->min_queuing_delay_ns,
+			tw->max_fast_queuing_delay_ns);
 
 		for (j = 0; j < QUEUING_STAT_ENTRIES; j++) {
 			if (!tw->queuing_stats[i])
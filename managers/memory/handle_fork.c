@@ -370,19 +370,19 @@ void handle_m2m_fork(struct m2m_fork_struct *payload,
 		return;
 	}
 
-	if (down_write_killable(&parent->mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(parent->mm)) {
 		reply->ret = -EINTR;
 		return;
 	}
 
-	down_write(&child->mm->mmap_sem);
+	lego_mmap_write_lock(child->mm);
 
 	/* task struct is prepared, start duplication */
 	reply->ret = dup_lego_mmap_local_vmatree(child->mm, parent->mm);
 	WARN_ON(reply->ret);
 
-	up_write(&child->mm->mmap_sem);
-	up_write(&parent->mm->mmap_sem);
+	lego_mmap_write_unlock(child->mm);
+	lego_mmap_write_unlock(parent->mm);
 
 	/* everything is fine, update datasize needs to be sent to homenode */
 	reply_size = sizeof(int) + sizeof(u32) +
@@ -401,10 +401,10 @@ static int dup_lego_mmap(struct lego_mm_struct *mm,
 	int ret = 0;
 	u64 mnode = 0;
 
-	if (down_write_killable(&oldmm->mmap_sem))
+	if (lego_mmap_write_lock_killable(oldmm))
 		return -EINTR;
 
-	down_write(&mm->mmap_sem);
+	lego_mmap_write_lock(mm);
 
 	mm->total_vm = oldmm->total_vm;
 	mm->data_vm = oldmm->data_vm;
@@ -451,8 +451,8 @@ static int dup_lego_mmap(struct lego_mm_struct *mm,
 	}
 
 out:
-	up_write(&mm->mmap_sem);
-	up_write(&oldmm->mmap_sem);
+	lego_mmap_write_unlock(mm);
+	lego_mmap_write_unlock(oldmm);
 
 	return ret;
 }
@@ -471,10 +471,10 @@ static int dup_lego_mmap(struct lego_mm_struct *mm,
 	struct rb_node **rb_link, *rb_parent;
 	int ret = 0;
 
-	if (down_write_killable(&oldmm->mmap_sem))
+	if (lego_mmap_write_lock_killable(oldmm))
 		return -EINTR;
 
-	down_write(&mm->mmap_sem);
+	lego_mmap_write_lock(mm);
 
 	mm->total_vm = oldmm->total_vm;
 	mm->data_vm = oldmm->data_vm;
@@ -544,8 +544,8 @@ static int dup_lego_mmap(struct lego_mm_struct *mm,
 
 	ret = 0;
 out:
-	up_write(&mm->mmap_sem);
-	up_write(&oldmm->mmap_sem);
+	lego_mmap_write_unlock(mm);
+	lego_mmap_write_unlock(oldmm);
 	return ret;
 }
 #endif /* CONFIG_DISTRIBUTED_VMA_MEMORY */
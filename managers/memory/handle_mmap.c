@@ -74,7 +74,7 @@ void handle_p2m_brk(struct p2m_brk_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		reply->ret_brk = RET_EINTR;
 		return;
 	}
@@ -114,7 +114,7 @@ set_brk:
 		lego_mm_populate(mm, oldbrk, newbrk - oldbrk);
 
 out:
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	reply->ret_brk = mm->brk;
 
@@ -173,7 +173,7 @@ void handle_p2m_mmap(struct p2m_mmap_struct *payload,
 	flags &= ~(MAP_EXECUTABLE | MAP_DENYWRITE);
 
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
-	if (down_write_killable(&tsk->mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(tsk->mm)) {
 		reply->ret = -EINTR;
 		return;
 	}
@@ -182,7 +182,7 @@ void handle_p2m_mmap(struct p2m_mmap_struct *payload,
 	ret = distvm_mmap_homenode(tsk->mm, file, addr, len, prot, flags, pgoff);
 	remove_reply_buffer(tsk->mm);
 
-	up_write(&tsk->mm->mmap_sem);
+	lego_mmap_write_unlock(tsk->mm);
 #else
 	ret = vm_mmap_pgoff(tsk, file, addr, len, prot, flags, pgoff);
 #endif
@@ -229,7 +229,7 @@ void handle_p2m_munmap(struct p2m_munmap_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		reply->ret = RET_EINTR;
 		return;
 	}
@@ -241,7 +241,7 @@ void handle_p2m_munmap(struct p2m_munmap_struct *payload,
 #else
 	reply->ret = do_munmap(mm, addr, len);
 #endif
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	replicate_vma(tsk, REPLICATE_MUNMAP, addr, len, 0, 0);
 	debug_dump_vm_all(tsk->mm, 0);
@@ -418,6 +418,129 @@ out:
 	return 0;
 }
 
+static inline bool madvise_dontneed_vma(struct vm_area_struct *vma)
+{
+	return vma_is_anonymous(vma) && !(vma->vm_flags & VM_SHARED);
+}
+
+/*
+ * Report the pieces of [@start, @end) that madvise_dontneed() will
+ * discard, processor only drops its lines there. Contiguous vmas are
+ * merged into one piece. If the interval covers unmapped ranges,
+ * reply -ENOMEM, same as msync, but still report the pieces.
+ */
+static void madvise_dontneed_query(struct lego_mm_struct *mm, unsigned long start,
+				   unsigned long end,
+				   struct p2m_madvise_reply_struct *reply)
+{
+	struct p2m_madvise_range *r = NULL;
+	struct vm_area_struct *vma;
+	unsigned long vm_start, vm_end;
+
+	reply->ret = 0;
+	reply->nr_ranges = 0;
+
+	down_read(&mm->mmap_sem);
+	for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+	     vma = vma->vm_next) {
+		if (start < vma->vm_start)
+			reply->ret = -ENOMEM;
+
+		if (madvise_dontneed_vma(vma)) {
+			vm_start = max(start, vma->vm_start);
+			vm_end = min(end, vma->vm_end);
+
+			if (r && r->end == vm_start) {
+				r->end = vm_end;
+			} else if (reply->nr_ranges < P2M_MADVISE_NR_RANGES) {
+				r = &reply->ranges[reply->nr_ranges++];
+				r->start = vm_start;
+				r->end = vm_end;
+			} else {
+				/* Out of slots, processor comes back for the rest */
+				start = vm_start;
+				goto out;
+			}
+		}
+
+		start = vma->vm_end;
+		if (start >= end)
+			break;
+	}
+
+	if (start < end)
+		reply->ret = -ENOMEM;
+	start = end;
+out:
+	up_read(&mm->mmap_sem);
+	reply->next = start;
+}
+
+/*
+ * Discard pages of private anonymous vmas within [@start, @end),
+ * the next miss gets a zeroed page. Processor has already dropped
+ * its cached lines of the pieces madvise_dontneed_query() reported,
+ * without flushing them back.
+ *
+ * File-backed and shared vmas are left as they are.
+ */
+static void madvise_dontneed(struct lego_mm_struct *mm, unsigned long start,
+			     unsigned long end)
+{
+	struct vm_area_struct *vma;
+
+	/* Misses and flushes copy pages without holding pte lock */
+	lego_mmap_write_lock(mm);
+	for (vma = find_vma(mm, start); vma && vma->vm_start < end;
+	     vma = vma->vm_next) {
+		if (madvise_dontneed_vma(vma))
+			unmap_vmas(vma, max(start, vma->vm_start),
+				   min(end, vma->vm_end));
+	}
+	lego_mmap_write_unlock(mm);
+}
+
+void handle_p2m_madvise(struct p2m_madvise_struct *payload,
+			struct common_header *hdr, struct thpool_buffer *tb)
+{
+	u32 nid = hdr->src_nid;
+	u32 pid = payload->pid;
+	unsigned long start = payload->start;
+	unsigned long len = payload->len;
+	int behavior = payload->behavior;
+	struct p2m_madvise_reply_struct *reply;
+	struct lego_task_struct *tsk;
+
+	mmap_debug("src_nid:%u,pid:%u,start:%#lx,len:%#lx,behavior:%d,query:%u",
+		   nid, pid, start, len, behavior, payload->query);
+
+	reply = thpool_buffer_tx(tb);
+	tb_set_tx_size(tb, sizeof(*reply));
+	reply->nr_ranges = 0;
+	reply->next = start + len;
+
+	tsk = find_lego_task_by_pid(nid, pid);
+	if (unlikely(!tsk)) {
+		reply->ret = -ESRCH;
+		return;
+	}
+
+	switch (behavior) {
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		if (payload->query) {
+			madvise_dontneed_query(tsk->mm, start, start + len, reply);
+			break;
+		}
+		madvise_dontneed(tsk->mm, start, start + len);
+		reply->ret = 0;
+		break;
+	default:
+		reply->ret = -EINVAL;
+		break;
+	}
+}
+
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
 void handle_p2m_mremap(struct p2m_mremap_struct *payload,
 		       struct common_header *hdr, struct thpool_buffer *tb)
@@ -447,7 +570,7 @@ void handle_p2m_mremap(struct p2m_mremap_struct *payload,
 	}
 	debug_dump_vm_all(tsk->mm, 1);
 
-	if (down_write_killable(&tsk->mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(tsk->mm)) {
 		reply->status = RET_EINTR;
 		reply->line = __LINE__;
 		return;
@@ -464,7 +587,7 @@ void handle_p2m_mremap(struct p2m_mremap_struct *payload,
 	}
 	reply->status = 0;
 
-	up_write(&tsk->mm->mmap_sem);
+	lego_mmap_write_unlock(tsk->mm);
 
 out:
 	mmap_debug("status: %s, new_addr: %#Lx, line: %u",
@@ -586,7 +709,7 @@ void handle_p2m_mremap(struct p2m_mremap_struct *payload,
 	}
 	debug_dump_vm_all(tsk->mm, 1);
 
-	if (down_write_killable(&tsk->mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(tsk->mm)) {
 		reply->status = RET_EINTR;
 		reply->line = __LINE__;
 		return;
@@ -679,7 +802,7 @@ void handle_p2m_mremap(struct p2m_mremap_struct *payload,
 	}
 
 out:
-	up_write(&tsk->mm->mmap_sem);
+	lego_mmap_write_unlock(tsk->mm);
 
 	mmap_debug("status: %s, new_addr: %#Lx, line: %u",
 		   ret_to_string(reply->status), reply->new_addr,
@@ -724,7 +847,7 @@ void handle_p2m_brk(struct p2m_brk_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		reply->ret_brk = RET_EINTR;
 		return;
 	}
@@ -767,7 +890,7 @@ set_brk:
 
 out:
 	remove_reply_buffer(mm);
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 #ifdef CONFIG_DEBUG_VMA
 	dump_reply(&reply->map);
@@ -852,7 +975,7 @@ void handle_m2m_mmap(struct m2m_mmap_struct *payload,
 		}
 	}
 
-	if (down_write_killable(&tsk->mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(tsk->mm)) {
 		reply->addr = -EINTR;
 		return;
 	}
@@ -861,7 +984,7 @@ void handle_m2m_mmap(struct m2m_mmap_struct *payload,
 	reply->addr = do_dist_mmap(tsk->mm, file, LEGO_LOCAL_NID, new_range, addr, len,
 				  prot, flags, vm_flags, pgoff, &reply->max_gap);
 
-	up_write(&tsk->mm->mmap_sem);
+	lego_mmap_write_unlock(tsk->mm);
 
 	debug_dump_vm_all(tsk->mm, 0);
 }
@@ -892,13 +1015,13 @@ void handle_m2m_munmap(struct m2m_munmap_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		reply->status = RET_EINTR;
 		return;
 	}
 
 	reply->status = distvm_munmap(mm, begin, len, &reply->max_gap);
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	mmap_debug("%s, reply status: %x, max_gap: %lx\n",
 			__func__, reply->status, reply->max_gap);
@@ -932,7 +1055,7 @@ void handle_m2m_findvma(struct m2m_findvma_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		reply->vma_exist = RET_EINTR;
 		return;
 	}
@@ -943,7 +1066,7 @@ void handle_m2m_findvma(struct m2m_findvma_struct *payload,
 	if (find_vma_intersection(mm, begin, end))
 		reply->vma_exist = 1;
 	save_vma_context(mm, root);
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	debug_dump_vm_all(tsk->mm, 0);
 }
@@ -975,7 +1098,7 @@ void handle_m2m_mremap_grow(struct m2m_mremap_grow_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		reply->status = RET_EINTR;
 		return;
 	}
@@ -983,7 +1106,7 @@ void handle_m2m_mremap_grow(struct m2m_mremap_grow_struct *payload,
 	reply->status = distvm_mremap_grow(tsk, addr, old_len, new_len);
 	reply->max_gap = mm->vmrange_map[vmr_idx(addr)]->max_gap;
 
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	debug_dump_vm_all(tsk->mm, 0);
 }
@@ -1018,7 +1141,7 @@ void handle_m2m_mremap_move(struct m2m_mremap_move_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		WARN_ON_ONCE(1);
 		reply->new_addr = -EINTR;
 		return;
@@ -1027,7 +1150,7 @@ void handle_m2m_mremap_move(struct m2m_mremap_move_struct *payload,
 	reply->new_addr = do_dist_mremap_move(mm, LEGO_LOCAL_NID, old_addr, old_len,
 					new_len, new_range, &reply->old_max_gap,
 					&reply->new_max_gap);
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	debug_dump_vm_all(tsk->mm, 0);
 }
@@ -1062,7 +1185,7 @@ void handle_m2m_mremap_move_split(struct m2m_mremap_move_split_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		WARN_ON_ONCE(1);
 		reply->new_addr = -EINTR;
 		return;
@@ -1072,7 +1195,7 @@ void handle_m2m_mremap_move_split(struct m2m_mremap_move_split_struct *payload,
 				new_addr, new_len, &reply->old_max_gap,
 				&reply->new_max_gap);
 
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	debug_dump_vm_all(tsk->mm, 0);
 }
@@ -1105,7 +1228,7 @@ void handle_m2m_validate(struct m2m_validate_struct *payload,
 	debug_dump_vm_all(tsk->mm, 1);
 
 	mm = tsk->mm;
-	if (down_write_killable(&mm->mmap_sem)) {
+	if (lego_mmap_write_lock_killable(mm)) {
 		WARN_ON_ONCE(1);
 		*reply = -EINTR;
 		return;
@@ -1114,7 +1237,7 @@ void handle_m2m_validate(struct m2m_validate_struct *payload,
 	mmap_brk_validate_local(mm, addr, len);
 	*reply = 0;
 
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 	debug_dump_vm_all(tsk->mm, 0);
 }
 #endif
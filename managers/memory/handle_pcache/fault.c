@@ -21,6 +21,7 @@
 #include <lego/comp_storage.h>
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/stat.h>
 #include <memory/thread_pool.h>
 #include <processor/pcache.h>
 
@@ -78,41 +79,48 @@ static void pcache_miss_error(u32 retval, struct lego_task_struct *p,
  */
 DEFINE_PROFILE_POINT(pcache_miss_find_vma)
 
-static int common_handle_p2m_miss(struct lego_task_struct *p,
-				  u64 vaddr, u32 flags, unsigned long *new_page)
+/*
+ * Caller must hold mmap_sem.
+ * @vmap caches the vma used by last call. Batched misses that fall
+ * into the same vma can skip find_vma().
+ */
+static int __common_handle_p2m_miss(struct lego_task_struct *p,
+				    u64 vaddr, u32 flags, unsigned long *new_page,
+				    struct vm_area_struct **vmap)
 {
-	struct vm_area_struct *vma;
-	struct lego_mm_struct *mm = p->mm;
-	int ret;
+	struct vm_area_struct *vma = *vmap;
 	PROFILE_POINT_TIME(pcache_miss_find_vma)
 
-	down_read(&mm->mmap_sem);
+	if (vma && vma->vm_start <= vaddr && vaddr < vma->vm_end)
+		goto good_area;
 
 	PROFILE_START(pcache_miss_find_vma);
-	vma = find_vma(mm, vaddr);
+	vma = find_vma(p->mm, vaddr);
 	PROFILE_LEAVE(pcache_miss_find_vma);
 
 	if (unlikely(!vma)) {
-		pr_info("fail to find vma\n");
-		ret = VM_FAULT_SIGSEGV;
-		goto unlock;
+		if (!(flags & FAULT_FLAG_SPECULATIVE))
+			pr_info("fail to find vma\n");
+		return VM_FAULT_SIGSEGV;
 	}
 
 	/* VMAs except stack */
 	if (likely(vma->vm_start <= vaddr))
 		goto good_area;
 
+	/* Speculative fills never grow the stack */
+	if (unlikely(flags & FAULT_FLAG_SPECULATIVE))
+		return VM_FAULT_SIGSEGV;
+
 	/* stack? */
 	if (unlikely(!(vma->vm_flags & VM_GROWSDOWN))) {
 		pr_info("not a stack\n");
-		ret = VM_FAULT_SIGSEGV;
-		goto unlock;
+		return VM_FAULT_SIGSEGV;
 	}
 
 	if (unlikely(expand_stack(vma, vaddr))) {
 		pr_info("fail to expand stack\n");
-		ret = VM_FAULT_SIGSEGV;
-		goto unlock;
+		return VM_FAULT_SIGSEGV;
 	}
 
 	/*
@@ -122,9 +130,100 @@ static int common_handle_p2m_miss(struct lego_task_struct *p,
 	 * own choice of mapping: pgtable, segment etc.
 	 */
 good_area:
-	ret = handle_lego_mm_fault(vma, vaddr, flags, new_page, NULL);
-unlock:
-	up_read(&mm->mmap_sem);
+	*vmap = vma;
+	return handle_lego_mm_fault(vma, vaddr, flags, new_page, NULL);
+}
+
+/*
+ * Speculative miss.
+ *
+ * Each worker remembers the last anonymous vma it faulted on, together
+ * with mm->vma_seq at that time. As long as nobody took mmap_sem for
+ * write since then, the vma is still there and still covers the same
+ * range. Misses that hit it skip mmap_sem and find_vma() altogether,
+ * so they neither bounce the rwsem cacheline nor wait behind
+ * mmap/brk/munmap of the same process.
+ *
+ * Writers bump vma_seq, then wait for any CPU whose @active_mm is
+ * theirs, see lego_mm_vma_write_begin(). The smp_mb() pairs with that.
+ * File-backed vmas are not cached, their faults may go to storage and
+ * would hold writers up for too long.
+ *
+ * Return true if the miss was handled, with the result in @ret.
+ */
+static bool spf_handle_p2m_miss(struct lego_task_struct *p,
+				u64 vaddr, u32 flags, unsigned long *new_page,
+				int *ret)
+{
+	struct lego_mm_struct *mm = p->mm;
+	struct vma_miss_cache *vc;
+
+	vc = raw_cpu_ptr(&vma_miss_cache);
+	if (vc->mm_id != mm->vma_cache_id ||
+	    vaddr < vc->start || vaddr >= vc->end)
+		return false;
+
+	WRITE_ONCE(vc->active_mm, mm);
+	smp_mb();
+
+	/* Odd or changed */
+	if (unlikely(raw_read_seqcount(&mm->vma_seq) != vc->seq)) {
+		smp_store_release(&vc->active_mm, NULL);
+		return false;
+	}
+
+	*ret = handle_lego_mm_fault(vc->vma, vaddr, flags, new_page, NULL);
+	smp_store_release(&vc->active_mm, NULL);
+
+	if (likely(!(*ret & VM_FAULT_ERROR)))
+		anon_prefetch_note_miss(p, vaddr, vc->end);
+
+	inc_mm_stat(HANDLE_PCACHE_MISS_SPECULATIVE);
+	return true;
+}
+
+/*
+ * @vma is anonymous. Caller holds mmap_sem,
+ * so vma_seq is stable and even.
+ */
+static inline void spf_cache_vma(struct lego_mm_struct *mm,
+				 struct vm_area_struct *vma)
+{
+	struct vma_miss_cache *vc;
+
+	vc = raw_cpu_ptr(&vma_miss_cache);
+	vc->seq = raw_read_seqcount(&mm->vma_seq);
+	vc->start = vma->vm_start;
+	vc->end = vma->vm_end;
+	vc->vma = vma;
+	vc->mm_id = mm->vma_cache_id;
+}
+
+static int common_handle_p2m_miss(struct lego_task_struct *p,
+				  u64 vaddr, u32 flags, unsigned long *new_page)
+{
+	struct vm_area_struct *vma = NULL;
+	int ret;
+
+	if (spf_handle_p2m_miss(p, vaddr, flags, new_page, &ret))
+		return ret;
+
+	down_read(&p->mm->mmap_sem);
+	ret = __common_handle_p2m_miss(p, vaddr, flags, new_page, &vma);
+	if (likely(vma && !(ret & VM_FAULT_ERROR)) && vma_is_anonymous(vma)) {
+		spf_cache_vma(p->mm, vma);
+		anon_prefetch_note_miss(p, vaddr, vma->vm_end);
+	}
+	up_read(&p->mm->mmap_sem);
+	return ret;
+}
+
+static inline u32 vm_fault_to_retval(int ret)
+{
+	if (ret & VM_FAULT_OOM)
+		return RET_ENOMEM;
+	else if (ret & (VM_FAULT_SIGBUS | VM_FAULT_SIGSEGV))
+		return RET_ESIGSEGV;
 	return ret;
 }
 
@@ -152,10 +251,17 @@ static void do_handle_p2m_pcache_miss(struct lego_task_struct *p,
 
 	ret = common_handle_p2m_miss(p, vaddr, flags, &new_page);
 	if (unlikely(ret & VM_FAULT_ERROR)) {
-		if (ret & VM_FAULT_OOM)
-			ret = RET_ENOMEM;
-		else if (ret & (VM_FAULT_SIGBUS | VM_FAULT_SIGSEGV))
-			ret = RET_ESIGSEGV;
+		ret = vm_fault_to_retval(ret);
+
+		/*
+		 * Processor prefetch may run past the end of a vma.
+		 * That is expected, just report back without noise.
+		 */
+		if (flags & FAULT_FLAG_SPECULATIVE) {
+			*(int *)thpool_buffer_tx(tb) = ret;
+			tb_set_tx_size(tb, sizeof(int));
+			return;
+		}
 
 		pcache_miss_error(ret, p, vaddr, tb);
 		return;
@@ -206,6 +312,67 @@ out:
 	PROFILE_LEAVE(handle_flush);
 }
 
+DEFINE_PROFILE_POINT(handle_flush_batch)
+
+/*
+ * Lines of the same process are usually sent next to each other,
+ * thus the task and its mmap_sem are kept across a run of lines.
+ */
+void handle_p2m_flush_batch(struct p2m_flush_batch_msg *msg,
+			    struct thpool_buffer *tb)
+{
+	struct p2m_flush_batch_reply *reply = thpool_buffer_tx(tb);
+	struct lego_task_struct *p = NULL;
+	unsigned int src_nid, nr, i;
+	unsigned long dst_page;
+	pid_t pid = 0;
+	int ret;
+	PROFILE_POINT_TIME(handle_flush_batch)
+
+	BUILD_BUG_ON(sizeof(*reply) > THPOOL_TX_SIZE);
+
+	src_nid = to_common_header(msg)->src_nid;
+	nr = msg->nr_lines;
+
+	if (unlikely(!nr || nr > PCACHE_FLUSH_BATCH_MAX)) {
+		*(int *)thpool_buffer_tx(tb) = -EINVAL;
+		tb_set_tx_size(tb, sizeof(int));
+		WARN_ON_ONCE(1);
+		return;
+	}
+
+	PROFILE_START(handle_flush_batch);
+	for (i = 0; i < nr; i++) {
+		if (!p || msg->lines[i].pid != pid) {
+			if (p)
+				up_read(&p->mm->mmap_sem);
+
+			pid = msg->lines[i].pid;
+			p = find_lego_task_by_pid(src_nid, pid);
+			if (unlikely(!p)) {
+				reply->retval[i] = -ESRCH;
+				continue;
+			}
+			down_read(&p->mm->mmap_sem);
+		}
+
+		ret = get_user_pages(p, msg->lines[i].user_va, 1, 0, &dst_page, NULL);
+		if (likely(ret == 1)) {
+			memcpy((void *)dst_page,
+			       msg->pcacheline + i * PCACHE_LINE_SIZE,
+			       PCACHE_LINE_SIZE);
+			reply->retval[i] = 0;
+		} else
+			reply->retval[i] = -EFAULT;
+	}
+	if (p)
+		up_read(&p->mm->mmap_sem);
+	PROFILE_LEAVE(handle_flush_batch);
+
+	reply->credits = thpool_credits();
+	tb_set_tx_size(tb, sizeof(*reply));
+}
+
 /*
  * Processor counterpart: __pcache_do_fill_page().
  * Check how we fill the information.
@@ -285,6 +452,285 @@ void handle_p2m_pcache_miss(struct p2m_pcache_miss_msg *msg,
 		src_nid, msg->pid, tgid, flags, vaddr);
 }
 
+DEFINE_PROFILE_POINT(handle_miss_batch)
+
+/*
+ * Handle a vector of misses from one process. All lines are fetched
+ * within one mmap_sem critical section, and consecutive lines of
+ * the same vma only need one find_vma(). Lines are copied into tx
+ * while mmap_sem is held, so they can not go away underneath us.
+ */
+void handle_p2m_pcache_miss_batch(struct p2m_pcache_miss_batch_msg *msg,
+				  struct thpool_buffer *tb)
+{
+	struct p2m_pcache_miss_batch_reply *reply = thpool_buffer_tx(tb);
+	struct vm_area_struct *vma = NULL;
+	struct lego_task_struct *p;
+	unsigned int src_nid, nr, i;
+	u32 tgid, flags;
+	PROFILE_POINT_TIME(handle_miss_batch)
+
+	BUILD_BUG_ON(P2M_PCACHE_MISS_BATCH_REPLY_SIZE(PCACHE_MISS_BATCH_MAX) >
+		     THPOOL_TX_SIZE);
+
+	src_nid = to_common_header(msg)->src_nid;
+	tgid  = msg->tgid;
+	flags = msg->flags;
+	nr    = msg->nr_lines;
+
+	handle_pcache_debug("I nid:%u pid:%u tgid:%u flags:%x nr:%u vaddr:%#Lx",
+		src_nid, msg->pid, tgid, flags, nr, msg->missing_vaddr[0]);
+
+	if (unlikely(!nr || nr > PCACHE_MISS_BATCH_MAX)) {
+		*(int *)thpool_buffer_tx(tb) = RET_EINVAL;
+		tb_set_tx_size(tb, sizeof(int));
+		WARN_ON_ONCE(1);
+		return;
+	}
+
+	p = find_lego_task_by_pid(src_nid, tgid);
+	if (unlikely(!p)) {
+		pr_info("%s(): src_nid: %d tgid: %d\n", __func__, src_nid, tgid);
+		pcache_miss_error(RET_ESRCH, p, msg->missing_vaddr[0], tb);
+		return;
+	}
+
+	PROFILE_START(handle_miss_batch);
+	down_read(&p->mm->mmap_sem);
+	for (i = 0; i < nr; i++) {
+		u64 vaddr = msg->missing_vaddr[i];
+		unsigned long new_page;
+		int ret;
+
+		if (unlikely(fault_in_kernel_space(vaddr))) {
+			reply->retval[i] = RET_EFAULT;
+			continue;
+		}
+
+		ret = __common_handle_p2m_miss(p, vaddr, flags, &new_page, &vma);
+		if (unlikely(ret & VM_FAULT_ERROR)) {
+			reply->retval[i] = vm_fault_to_retval(ret);
+			if (!(flags & FAULT_FLAG_SPECULATIVE))
+				pr_info("src_nid:%u,pid:%u,vaddr:%#Lx batch miss fail\n",
+					src_nid, msg->pid, vaddr);
+			continue;
+		}
+
+		memcpy(reply->data + i * PCACHE_LINE_SIZE, (void *)new_page,
+		       PCACHE_LINE_SIZE);
+		reply->retval[i] = 0;
+	}
+	up_read(&p->mm->mmap_sem);
+	PROFILE_LEAVE(handle_miss_batch);
+
+	reply->credits = thpool_credits();
+	tb_set_tx_size(tb, P2M_PCACHE_MISS_BATCH_REPLY_SIZE(nr));
+
+	handle_pcache_debug("O nid:%u pid:%u tgid:%u flags:%x nr:%u vaddr:%#Lx",
+		src_nid, msg->pid, tgid, flags, nr, msg->missing_vaddr[0]);
+}
+
+DEFINE_PROFILE_POINT(handle_miss_extent)
+
+static inline void pcache_miss_extent_reject(struct thpool_buffer *tb, int retval)
+{
+	*(int *)thpool_buffer_tx(tb) = retval;
+	tb_set_tx_size(tb, sizeof(int));
+}
+
+/*
+ * Handle a miss of a whole extent. This is a hint from processor,
+ * any extent that is not entirely within one private anonymous vma
+ * is rejected quietly, processor will then fall back to normal misses.
+ * Pages are copied into tx while mmap_sem is held.
+ */
+void handle_p2m_pcache_miss_extent(struct p2m_pcache_miss_extent_msg *msg,
+				   struct thpool_buffer *tb)
+{
+	void *data = thpool_buffer_tx(tb);
+	struct vm_area_struct *vma;
+	struct lego_task_struct *p;
+	unsigned int src_nid;
+	u64 start, vaddr;
+	u32 tgid, flags;
+	PROFILE_POINT_TIME(handle_miss_extent)
+
+	BUILD_BUG_ON(PCACHE_EXTENT_SIZE >= THPOOL_TX_SIZE);
+
+	src_nid = to_common_header(msg)->src_nid;
+	tgid  = msg->tgid;
+	flags = msg->flags;
+	start = msg->start;
+
+	handle_pcache_debug("I nid:%u pid:%u tgid:%u flags:%x start:%#Lx",
+		src_nid, msg->pid, tgid, flags, start);
+
+	if (unlikely(start & ~PCACHE_EXTENT_MASK ||
+		     fault_in_kernel_space(start + PCACHE_EXTENT_SIZE - 1))) {
+		pcache_miss_extent_reject(tb, RET_EINVAL);
+		WARN_ON_ONCE(1);
+		return;
+	}
+
+	p = find_lego_task_by_pid(src_nid, tgid);
+	if (unlikely(!p)) {
+		pr_info("%s(): src_nid: %d tgid: %d\n", __func__, src_nid, tgid);
+		pcache_miss_error(RET_ESRCH, p, start, tb);
+		return;
+	}
+
+	PROFILE_START(handle_miss_extent);
+	down_read(&p->mm->mmap_sem);
+	vma = find_vma(p->mm, start);
+	if (!vma || vma->vm_start > start ||
+	    vma->vm_end < start + PCACHE_EXTENT_SIZE ||
+	    !vma_is_anonymous(vma) || (vma->vm_flags & VM_SHARED)) {
+		up_read(&p->mm->mmap_sem);
+		pcache_miss_extent_reject(tb, RET_EINVAL);
+		goto out;
+	}
+
+	for (vaddr = start; vaddr < start + PCACHE_EXTENT_SIZE;
+	     vaddr += PCACHE_LINE_SIZE) {
+		unsigned long new_page;
+		int ret;
+
+		ret = __common_handle_p2m_miss(p, vaddr, flags, &new_page, &vma);
+		if (unlikely(ret & VM_FAULT_ERROR)) {
+			up_read(&p->mm->mmap_sem);
+			pcache_miss_extent_reject(tb, vm_fault_to_retval(ret));
+			goto out;
+		}
+
+		memcpy(data + (vaddr - start), (void *)new_page, PCACHE_LINE_SIZE);
+	}
+	up_read(&p->mm->mmap_sem);
+	tb_set_tx_size(tb, PCACHE_EXTENT_SIZE);
+
+out:
+	PROFILE_LEAVE(handle_miss_extent);
+	handle_pcache_debug("O nid:%u pid:%u tgid:%u flags:%x start:%#Lx",
+		src_nid, msg->pid, tgid, flags, start);
+}
+
+DEFINE_PROFILE_POINT(handle_miss_around)
+
+/*
+ * Only text and read-only data are worth fetching ahead on every miss.
+ * Writable data is left to the stride detector on processor side.
+ */
+static inline bool vma_allows_fault_around(struct vm_area_struct *vma)
+{
+	return (vma->vm_flags & VM_EXEC) || !(vma->vm_flags & VM_WRITE);
+}
+
+/*
+ * Handle a miss, plus the lines around it if its vma allows.
+ * The missing line is handled like a normal miss. Extra lines are
+ * speculative, the window stops growing at the first one that fails.
+ * Pages are copied into tx while mmap_sem is held.
+ */
+void handle_p2m_pcache_miss_around(struct p2m_pcache_miss_around_msg *msg,
+				   struct thpool_buffer *tb)
+{
+	struct p2m_pcache_miss_around_reply *reply = thpool_buffer_tx(tb);
+	unsigned long pages[PCACHE_FAULT_AROUND_MAX], page;
+	struct vm_area_struct *vma = NULL;
+	struct lego_task_struct *p;
+	unsigned int src_nid, nr, i;
+	u64 vaddr, start, end, lo, hi;
+	u32 tgid, flags;
+	int ret;
+	PROFILE_POINT_TIME(handle_miss_around)
+
+	BUILD_BUG_ON(P2M_PCACHE_MISS_AROUND_REPLY_SIZE(PCACHE_FAULT_AROUND_MAX) >
+		     THPOOL_TX_SIZE);
+
+	src_nid = to_common_header(msg)->src_nid;
+	tgid  = msg->tgid;
+	flags = msg->flags;
+	nr    = msg->nr_lines;
+	vaddr = msg->missing_vaddr & PCACHE_LINE_MASK;
+
+	handle_pcache_debug("I nid:%u pid:%u tgid:%u flags:%x nr:%u vaddr:%#Lx",
+		src_nid, msg->pid, tgid, flags, nr, vaddr);
+
+	if (unlikely(!nr || nr > PCACHE_FAULT_AROUND_MAX || (nr & (nr - 1)))) {
+		*(int *)thpool_buffer_tx(tb) = RET_EINVAL;
+		tb_set_tx_size(tb, sizeof(int));
+		WARN_ON_ONCE(1);
+		return;
+	}
+
+	p = find_lego_task_by_pid(src_nid, tgid);
+	if (unlikely(!p)) {
+		pr_info("%s(): src_nid: %d tgid: %d\n", __func__, src_nid, tgid);
+		pcache_miss_error(RET_ESRCH, p, vaddr, tb);
+		return;
+	}
+
+	if (unlikely(fault_in_kernel_space(vaddr))) {
+		pcache_miss_error(RET_EFAULT, p, vaddr, tb);
+		return;
+	}
+
+	PROFILE_START(handle_miss_around);
+	down_read(&p->mm->mmap_sem);
+	ret = __common_handle_p2m_miss(p, vaddr, flags, &page, &vma);
+	if (unlikely(ret & VM_FAULT_ERROR)) {
+		up_read(&p->mm->mmap_sem);
+		pcache_miss_error(vm_fault_to_retval(ret), p, vaddr, tb);
+		goto out;
+	}
+
+	reply->vm_start = vma->vm_start;
+	reply->vm_end = vma->vm_end;
+	reply->around = vma_allows_fault_around(vma);
+
+	/* pages[] is indexed from the window start */
+	start = vaddr;
+	end = vaddr + PCACHE_LINE_SIZE;
+	if (reply->around) {
+		u64 window = vaddr & ~((u64)nr * PCACHE_LINE_SIZE - 1);
+
+		start = max_t(u64, window, vma->vm_start);
+		end = min_t(u64, window + nr * PCACHE_LINE_SIZE, vma->vm_end);
+	}
+	pages[(vaddr - start) / PCACHE_LINE_SIZE] = page;
+
+	/* Forward first, code tends to run that way */
+	flags |= FAULT_FLAG_SPECULATIVE;
+	for (hi = vaddr + PCACHE_LINE_SIZE; hi < end; hi += PCACHE_LINE_SIZE) {
+		i = (hi - start) / PCACHE_LINE_SIZE;
+		ret = __common_handle_p2m_miss(p, hi, flags, &pages[i], &vma);
+		if (ret & VM_FAULT_ERROR)
+			break;
+	}
+
+	for (lo = vaddr; lo > start; lo -= PCACHE_LINE_SIZE) {
+		i = (lo - PCACHE_LINE_SIZE - start) / PCACHE_LINE_SIZE;
+		ret = __common_handle_p2m_miss(p, lo - PCACHE_LINE_SIZE, flags,
+					       &pages[i], &vma);
+		if (ret & VM_FAULT_ERROR)
+			break;
+	}
+
+	reply->start = lo;
+	reply->nr_lines = (hi - lo) / PCACHE_LINE_SIZE;
+	for (i = 0; i < reply->nr_lines; i++)
+		memcpy(reply->data + i * PCACHE_LINE_SIZE,
+		       (void *)pages[(lo - start) / PCACHE_LINE_SIZE + i],
+		       PCACHE_LINE_SIZE);
+	up_read(&p->mm->mmap_sem);
+
+	tb_set_tx_size(tb, P2M_PCACHE_MISS_AROUND_REPLY_SIZE(reply->nr_lines));
+
+out:
+	PROFILE_LEAVE(handle_miss_around);
+	handle_pcache_debug("O nid:%u pid:%u tgid:%u flags:%x nr:%u vaddr:%#Lx",
+		src_nid, msg->pid, tgid, flags, nr, vaddr);
+}
+
 void handle_p2m_zerofill(struct p2m_zerofill_msg *msg,
 			 struct thpool_buffer *tb)
 {
@@ -13,6 +13,8 @@
 #include <lego/comp_storage.h>
 #include <memory/vm.h>
 #include <memory/pid.h>
+#include <memory/stat.h>
+#include <memory/thread_pool.h>
 #include <processor/pcache.h>
 
 #ifdef CONFIG_MEM_PREFETCH
@@ -56,3 +58,169 @@ void do_mmap_prefetch(struct lego_task_struct *p, u64 vaddr,
 		      u32 flags, u32 nr_pages)
 { }
 #endif /* CONFIG_MEM_PREFETCH */
+
+#ifdef CONFIG_MEM_ANON_PREFETCH
+/*
+ * Anonymous prefetch.
+ *
+ * The first miss on an anonymous page allocates and zeroes it, and
+ * fills the page table, while the processor waits. When misses of a
+ * process walk forward through an anonymous vma, the next window of
+ * pages is queued here, and populated by a worker that has nothing
+ * else to do.
+ *
+ * Detection is per-mm, since misses of one process are spread over
+ * all workers. It is racy on purpose, a wrong guess only costs pages.
+ */
+#define ANON_PREFETCH_PAGES	CONFIG_MEM_ANON_PREFETCH_PAGES
+#define ANON_PREFETCH_WINDOW	(ANON_PREFETCH_PAGES * PAGE_SIZE)
+#define ANON_PREFETCH_STREAK	2
+#define NR_ANON_PREFETCH_WORKS	64
+
+struct anon_prefetch_work {
+	unsigned int		node;
+	pid_t			pid;
+	unsigned long		mm_id;
+	unsigned long		start;
+	unsigned long		end;
+};
+
+static struct anon_prefetch_work anon_prefetch_works[NR_ANON_PREFETCH_WORKS];
+static unsigned int anon_prefetch_head, anon_prefetch_tail;
+static DEFINE_SPINLOCK(anon_prefetch_lock);
+
+static void queue_anon_prefetch(struct lego_task_struct *p,
+				unsigned long start, unsigned long end)
+{
+	struct anon_prefetch_work *work;
+
+	spin_lock(&anon_prefetch_lock);
+	if (unlikely(anon_prefetch_head - anon_prefetch_tail >=
+		     NR_ANON_PREFETCH_WORKS)) {
+		spin_unlock(&anon_prefetch_lock);
+		inc_mm_stat(NR_ANON_PREFETCH_DROPPED);
+		return;
+	}
+
+	work = &anon_prefetch_works[anon_prefetch_head % NR_ANON_PREFETCH_WORKS];
+	work->node = p->node;
+	work->pid = p->pid;
+	work->mm_id = p->mm->vma_cache_id;
+	work->start = start;
+	work->end = end;
+	WRITE_ONCE(anon_prefetch_head, anon_prefetch_head + 1);
+	spin_unlock(&anon_prefetch_lock);
+}
+
+/*
+ * Called after a miss of @p at @address was handled,
+ * in an anonymous vma which ends at @vm_end.
+ */
+void anon_prefetch_note_miss(struct lego_task_struct *p, unsigned long address,
+			     unsigned long vm_end)
+{
+	struct lego_mm_struct *mm = p->mm;
+	unsigned long last, start, end;
+	unsigned int streak;
+
+	address &= PAGE_MASK;
+	last = READ_ONCE(mm->anon_prefetch_last);
+	WRITE_ONCE(mm->anon_prefetch_last, address);
+
+	/* Parallel workers may see a stream slightly out of order */
+	streak = READ_ONCE(mm->anon_prefetch_streak);
+	if (address > last && address - last <= 2 * PAGE_SIZE)
+		streak++;
+	else
+		streak = 0;
+	WRITE_ONCE(mm->anon_prefetch_streak, streak);
+
+	if (streak < ANON_PREFETCH_STREAK)
+		return;
+
+	/* Still more than half a window populated ahead of us */
+	end = READ_ONCE(mm->anon_prefetch_end);
+	if (end > address && end - address > ANON_PREFETCH_WINDOW / 2)
+		return;
+
+	start = max(end, address + PAGE_SIZE);
+	end = min(start + ANON_PREFETCH_WINDOW, vm_end);
+	if (start >= end)
+		return;
+
+	WRITE_ONCE(mm->anon_prefetch_end, end);
+	queue_anon_prefetch(p, start, end);
+}
+
+/*
+ * Called by idle worker @w. Populate one queued window, and stop early
+ * once @w has a real request to handle.
+ *
+ * Return true if a window was dequeued.
+ */
+bool anon_prefetch_run(struct thpool_worker *w)
+{
+	struct anon_prefetch_work work;
+	struct lego_task_struct *p;
+	struct lego_mm_struct *mm;
+	struct vm_area_struct *vma;
+	unsigned long address;
+	int ret;
+
+	if (READ_ONCE(anon_prefetch_head) == READ_ONCE(anon_prefetch_tail))
+		return false;
+
+	spin_lock(&anon_prefetch_lock);
+	if (anon_prefetch_head == anon_prefetch_tail) {
+		spin_unlock(&anon_prefetch_lock);
+		return false;
+	}
+	work = anon_prefetch_works[anon_prefetch_tail % NR_ANON_PREFETCH_WORKS];
+	anon_prefetch_tail++;
+	spin_unlock(&anon_prefetch_lock);
+
+	p = find_lego_task_by_pid(work.node, work.pid);
+	if (!p)
+		return true;
+
+	/*
+	 * Unlike handlers, we do not run on behalf of a request from @p,
+	 * an execve() of it may drop its mm anytime. Pin the mm, and skip
+	 * the window if it is not the one it was queued for.
+	 */
+	lego_task_lock(p);
+	mm = p->mm;
+	if (mm && mm->vma_cache_id == work.mm_id)
+		atomic_inc(&mm->mm_users);
+	else
+		mm = NULL;
+	lego_task_unlock(p);
+	if (!mm)
+		return true;
+
+	/* Never wait behind mmap and friends, real misses do that */
+	if (!down_read_trylock(&mm->mmap_sem))
+		goto put;
+
+	vma = find_vma(mm, work.start);
+	if (!vma || vma->vm_start > work.start || !vma_is_anonymous(vma))
+		goto unlock;
+
+	work.end = min(work.end, vma->vm_end);
+	for (address = work.start; address < work.end; address += PAGE_SIZE) {
+		if (nr_queued_thpool_worker(w))
+			break;
+
+		ret = handle_lego_mm_fault(vma, address, 0, NULL, NULL);
+		if (unlikely(ret & VM_FAULT_ERROR))
+			break;
+		inc_mm_stat(NR_ANON_PREFETCH_PAGES);
+	}
+
+unlock:
+	up_read(&mm->mmap_sem);
+put:
+	lego_mmput(mm);
+	return true;
+}
+#endif /* CONFIG_MEM_ANON_PREFETCH */
@@ -496,7 +496,7 @@ int setup_arg_pages(struct lego_task_struct *tsk, struct lego_binprm *bprm,
 	bprm->exec -= stack_shift;
 	mm->arg_start = bprm->p;
 
-	if (down_write_killable(&mm->mmap_sem))
+	if (lego_mmap_write_lock_killable(mm))
 		return -EINTR;
 
 	vm_flags = VM_STACK_FLAGS;
@@ -539,6 +539,6 @@ int setup_arg_pages(struct lego_task_struct *tsk, struct lego_binprm *bprm,
 		ret = -EFAULT;
 
 out_unlock:
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 	return ret;
 }
@@ -16,7 +16,12 @@ struct memory_manager_stat memory_manager_stats;
 static const char *const memory_manager_stat_text[] = {
 	/* Handler group */
 	"handle_pcache_miss",
+	"handle_pcache_miss_batch",
+	"handle_pcache_miss_extent",
+	"handle_pcache_miss_around",
+	"handle_pcache_miss_speculative",
 	"handle_pcache_flush",
+	"handle_pcache_flush_batch",
 	"handle_pcache_replica",
 	"handle_p2m_mmap",
 	"handle_p2m_munmap",
@@ -29,7 +34,11 @@ static const char *const memory_manager_stat_text[] = {
 	"handle_write",
 
 	/* replication */
-	"nr_batched_log_flush"
+	"nr_batched_log_flush",
+
+	/* anonymous prefetch */
+	"nr_anon_prefetch_pages",
+	"nr_anon_prefetch_dropped",
 };
 
 #ifdef CONFIG_COUNTER_MEMORY_HANDLER
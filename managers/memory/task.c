@@ -7,9 +7,12 @@
  * (at your option) any later version.
  */
 
-#include <lego/kernel.h>
+#include <lego/hash.h>
 #include <lego/slab.h>
+#include <lego/kernel.h>
 #include <lego/hashtable.h>
+#include <lego/percpu.h>
+#include <lego/seqlock.h>
 #include <lego/spinlock.h>
 #include <lego/comp_memory.h>
 
@@ -17,38 +20,184 @@
 #include <memory/pid.h>
 #include <memory/task.h>
 
-#define PID_ARRAY_HASH_BITS	10
+/*
+ * Tasks are hashed by (node, pid).
+ *
+ * Lookups are done by every handler and take no lock. Writers (fork,
+ * execve, exit) are serialized by pid_table_lock and publish links the
+ * way RCU does. Lego has no RCU grace periods, so each CPU announces
+ * its read-side sections in a per-cpu sequence, and a writer waits for
+ * the sections that might still see an unlinked task or an old table
+ * before freeing it.
+ *
+ * The table doubles once it holds more than two tasks per bucket.
+ * Readers that raced with a rehash retry, through pid_table_seq.
+ */
+#define PID_HASH_MIN_BITS	8
+#define PID_HASH_MAX_BITS	16
+
+struct pid_hash_table {
+	unsigned int		bits;
+	struct hlist_head	*buckets;
+};
+
+static struct hlist_head pid_hash_initial_buckets[1 << PID_HASH_MIN_BITS];
+static struct pid_hash_table pid_table_initial = {
+	.bits		= PID_HASH_MIN_BITS,
+	.buckets	= pid_hash_initial_buckets,
+};
+
+static struct pid_hash_table *pid_table = &pid_table_initial;
+static seqcount_t pid_table_seq = SEQCNT_ZERO(pid_table_seq);
+static DEFINE_SPINLOCK(pid_table_lock);
+static unsigned int nr_lego_tasks;
+
+/* Odd while this CPU is within a lookup */
+struct pid_hash_reader {
+	unsigned long		seq;
+} ____cacheline_aligned;
+
+static DEFINE_PER_CPU(struct pid_hash_reader, pid_hash_readers);
+
+static inline void pid_hash_read_lock(void)
+{
+	struct pid_hash_reader *r;
+
+	preempt_disable();
+	r = this_cpu_ptr(&pid_hash_readers);
+	WRITE_ONCE(r->seq, r->seq + 1);
+
+	/* Order the announcement before any load from the table */
+	smp_mb();
+}
+
+static inline void pid_hash_read_unlock(void)
+{
+	struct pid_hash_reader *r;
+
+	r = this_cpu_ptr(&pid_hash_readers);
+	smp_store_release(&r->seq, r->seq + 1);
+	preempt_enable();
+}
 
-static DEFINE_HASHTABLE(node_pid_hash, PID_ARRAY_HASH_BITS);
-static DEFINE_SPINLOCK(hashtable_lock);
+/*
+ * Wait for all lookups that started before the caller unlinked
+ * something. Those started after can not find it anymore.
+ */
+static void pid_hash_synchronize(void)
+{
+	struct pid_hash_reader *r;
+	unsigned long seq;
+	int cpu;
+
+	smp_mb();
+	for_each_online_cpu(cpu) {
+		r = per_cpu_ptr(&pid_hash_readers, cpu);
+		seq = READ_ONCE(r->seq);
+		if (!(seq & 1))
+			continue;
+		while (READ_ONCE(r->seq) == seq)
+			cpu_relax();
+	}
+}
 
-static int getKey(unsigned int node, unsigned int pid)
+static inline struct hlist_head *
+pid_hash_bucket(struct pid_hash_table *t, unsigned int node, unsigned int pid)
 {
-        return node*10000+pid*10;
+	return &t->buckets[hash_64(((u64)node << 32) | pid, t->bits)];
+}
+
+/* Same as hlist_add_head(), but @n is fully set up before it is visible */
+static inline void pid_hash_add(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	if (first)
+		first->pprev = &n->next;
+	smp_store_release(&h->first, n);
+}
+
+/* Caller holds pid_table_lock */
+static struct lego_task_struct *
+__find_lego_task(struct pid_hash_table *t, unsigned int node, unsigned int pid)
+{
+	struct lego_task_struct *tsk;
+
+	hlist_for_each_entry(tsk, pid_hash_bucket(t, node, pid), link) {
+		if (tsk->pid == pid && tsk->node == node)
+			return tsk;
+	}
+	return NULL;
+}
+
+static void pid_hash_grow(void)
+{
+	struct pid_hash_table *old, *new;
+	struct lego_task_struct *tsk;
+	struct hlist_node *tmp;
+	unsigned int bits, i;
+
+	bits = READ_ONCE(pid_table)->bits + 1;
+	new = kmalloc(sizeof(*new) + (sizeof(struct hlist_head) << bits),
+		      GFP_KERNEL);
+	if (!new)
+		return;
+	new->bits = bits;
+	new->buckets = (struct hlist_head *)(new + 1);
+	for (i = 0; i < (1U << bits); i++)
+		INIT_HLIST_HEAD(&new->buckets[i]);
+
+	spin_lock(&pid_table_lock);
+	old = pid_table;
+
+	/* Someone else did it */
+	if (old->bits + 1 != bits) {
+		spin_unlock(&pid_table_lock);
+		kfree(new);
+		return;
+	}
+
+	write_seqcount_begin(&pid_table_seq);
+	for (i = 0; i < (1U << old->bits); i++) {
+		hlist_for_each_entry_safe(tsk, tmp, &old->buckets[i], link)
+			pid_hash_add(&tsk->link,
+				     pid_hash_bucket(new, tsk->node, tsk->pid));
+	}
+	smp_store_release(&pid_table, new);
+	write_seqcount_end(&pid_table_seq);
+	spin_unlock(&pid_table_lock);
+
+	if (old != &pid_table_initial) {
+		pid_hash_synchronize();
+		kfree(old);
+	}
 }
 
 int __must_check ht_insert_lego_task(struct lego_task_struct *tsk)
 {
-	struct lego_task_struct *p;
-	unsigned int key;
 	unsigned int node, pid;
+	bool grow;
 
 	BUG_ON(!tsk || !tsk->pid);
 
 	pid = tsk->pid;
 	node = tsk->node;
-	key = getKey(node, pid);
 
-	spin_lock(&hashtable_lock);
-	hash_for_each_possible(node_pid_hash, p, link, key) {
-		if (unlikely(p->pid == pid && p->node ==node)) {
-			spin_unlock(&hashtable_lock);
-			return -EEXIST;
-		}
+	spin_lock(&pid_table_lock);
+	if (unlikely(__find_lego_task(pid_table, node, pid))) {
+		spin_unlock(&pid_table_lock);
+		return -EEXIST;
 	}
-	hash_add(node_pid_hash, &tsk->link, key);
-	spin_unlock(&hashtable_lock);
+	pid_hash_add(&tsk->link, pid_hash_bucket(pid_table, node, pid));
+	nr_lego_tasks++;
+	grow = nr_lego_tasks > (2U << pid_table->bits) &&
+	       pid_table->bits < PID_HASH_MAX_BITS;
+	spin_unlock(&pid_table_lock);
 
+	if (grow)
+		pid_hash_grow();
 	return 0;
 }
 
@@ -75,62 +224,83 @@ void free_lego_task_struct(struct lego_task_struct *tsk)
 
 void free_lego_task(struct lego_task_struct *tsk)
 {
-	unsigned int node, pid, key;
-	struct lego_task_struct *p;
+	unsigned int node, pid;
 
 	BUG_ON(!tsk);
 	BUG_ON(!hash_hashed(&tsk->link));
 
 	node = tsk->node;
 	pid = tsk->pid;
-	key = getKey(node, pid);
-
-	spin_lock(&hashtable_lock);
-	hash_for_each_possible(node_pid_hash, p, link, key) {
-		if (likely(p->node == node && p->pid == pid)) {
-			hash_del(&p->link);
-			spin_unlock(&hashtable_lock);
-			kfree(tsk);
-			return;
-		}
+
+	spin_lock(&pid_table_lock);
+	if (unlikely(__find_lego_task(pid_table, node, pid) != tsk)) {
+		spin_unlock(&pid_table_lock);
+		WARN(1, "fail to find tsk->(node:%u,pid:%u)\n", node, pid);
+		return;
 	}
-	spin_unlock(&hashtable_lock);
-	WARN(1, "fail to find tsk->(node:%u,pid:%u)\n", node, pid);
+
+	/* Keep ->next, lookups may still be standing on @tsk */
+	__hlist_del(&tsk->link);
+	tsk->link.pprev = NULL;
+	nr_lego_tasks--;
+	spin_unlock(&pid_table_lock);
+
+	pid_hash_synchronize();
+	kfree(tsk);
 }
 
+/*
+ * Lockless. Returned task is not pinned, same as before,
+ * callers rely on the processor not racing exit with its own requests.
+ */
 struct lego_task_struct *
 find_lego_task_by_pid(unsigned int node, unsigned int pid)
 {
 	struct lego_task_struct *tsk;
-	unsigned int key;
+	struct pid_hash_table *t;
+	struct hlist_node *pos;
+	unsigned int seq;
 
 	if (unlikely(!pid))
 		return NULL;
 
-	key = getKey(node, pid);
-	spin_lock(&hashtable_lock);
-	hash_for_each_possible(node_pid_hash, tsk, link, key) {
-		if (likely(tsk->pid == pid && tsk->node == node)) {
-			spin_unlock(&hashtable_lock);
-			return tsk;
+	pid_hash_read_lock();
+	do {
+		seq = read_seqcount_begin(&pid_table_seq);
+		t = lockless_dereference(pid_table);
+
+		tsk = NULL;
+		pos = lockless_dereference(pid_hash_bucket(t, node, pid)->first);
+		while (pos) {
+			struct lego_task_struct *p;
+
+			p = hlist_entry(pos, struct lego_task_struct, link);
+			if (likely(p->pid == pid && p->node == node)) {
+				tsk = p;
+				break;
+			}
+			pos = lockless_dereference(pos->next);
 		}
-        }
-        spin_unlock(&hashtable_lock);
+	} while (!tsk && read_seqcount_retry(&pid_table_seq, seq));
+	pid_hash_read_unlock();
 
-	return NULL;
+	return tsk;
 }
 
 void dump_lego_tasks(void)
 {
 	struct lego_task_struct *p;
-	int i;
+	unsigned int i;
 
-	spin_lock(&hashtable_lock);
-	pr_info("----- Start Dump Tasks\n");
-	hash_for_each(node_pid_hash, i, p, link) {
-		pr_info("  node:%u comm: %s pid: %u vnode_id: %u parent_pid:%u home_node: %u\n",
-			p->node, p->comm, p->pid, p->vnode_id, p->parent_pid, p->home_node);
+	spin_lock(&pid_table_lock);
+	pr_info("----- Start Dump Tasks (%u tasks, %u buckets)\n",
+		nr_lego_tasks, 1U << pid_table->bits);
+	for (i = 0; i < (1U << pid_table->bits); i++) {
+		hlist_for_each_entry(p, &pid_table->buckets[i], link) {
+			pr_info("  node:%u comm: %s pid: %u vnode_id: %u parent_pid:%u home_node: %u\n",
+				p->node, p->comm, p->pid, p->vnode_id, p->parent_pid, p->home_node);
+		}
 	}
 	pr_info("----- Finish Dump Tasks\n");
-	spin_unlock(&hashtable_lock);
+	spin_unlock(&pid_table_lock);
 }
@@ -18,6 +18,7 @@
 #include <lego/rbtree.h>
 #include <lego/sched.h>
 #include <lego/kernel.h>
+#include <lego/percpu.h>
 #include <lego/netmacro.h>
 #include <lego/fit_ibapi.h>
 
@@ -1235,7 +1236,7 @@ int vm_munmap(struct lego_task_struct *p, unsigned long start, size_t len)
 	int ret;
 	struct lego_mm_struct *mm = p->mm;
 
-	if (down_write_killable(&mm->mmap_sem))
+	if (lego_mmap_write_lock_killable(mm))
 		return -EINTR;
 
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
@@ -1243,7 +1244,7 @@ int vm_munmap(struct lego_task_struct *p, unsigned long start, size_t len)
 #else
 	ret = do_munmap(mm, start, len);
 #endif
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	return ret;
 }
@@ -1855,7 +1856,7 @@ unsigned long vm_mmap_pgoff(struct lego_task_struct *p, struct lego_file *file,
 {
 	unsigned long ret;
 
-	if (down_write_killable(&p->mm->mmap_sem))
+	if (lego_mmap_write_lock_killable(p->mm))
 		return -EINTR;
 
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
@@ -1864,7 +1865,7 @@ unsigned long vm_mmap_pgoff(struct lego_task_struct *p, struct lego_file *file,
 	ret = do_mmap_pgoff(p, file, addr, len, prot, flag, pgoff);
 #endif
 
-	up_write(&p->mm->mmap_sem);
+	lego_mmap_write_unlock(p->mm);
 	return ret;
 }
 
@@ -1964,7 +1965,7 @@ int vm_brk(struct lego_task_struct *tsk,
 	int ret;
 	struct lego_mm_struct *mm = tsk->mm;
 
-	if (down_write_killable(&mm->mmap_sem))
+	if (lego_mmap_write_lock_killable(mm))
 		return -EINTR;
 
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
@@ -1972,7 +1973,7 @@ int vm_brk(struct lego_task_struct *tsk,
 #else
 	ret = do_brk(tsk, start, len);
 #endif
-	up_write(&mm->mmap_sem);
+	lego_mmap_write_unlock(mm);
 
 	/* Prepopulate brk pages */
 	if (!ret)
@@ -1993,6 +1994,31 @@ static void lego_pgd_free(struct lego_mm_struct *mm)
 	free_page((unsigned long)mm->pgd);
 }
 
+DEFINE_PER_CPU(struct vma_miss_cache, vma_miss_cache);
+
+static atomic_long_t next_vma_cache_id = ATOMIC_LONG_INIT(0);
+
+/*
+ * Called with mmap_sem held for write, before the vma tree or page
+ * tables are changed. Once @mm->vma_seq is odd, no new speculative
+ * miss starts on @mm. Wait for those already running.
+ */
+void lego_mm_vma_write_begin(struct lego_mm_struct *mm)
+{
+	struct vma_miss_cache *vc;
+	int cpu;
+
+	write_seqcount_begin(&mm->vma_seq);
+
+	/* Pairs with smp_mb() in speculative miss */
+	smp_mb();
+	for_each_online_cpu(cpu) {
+		vc = per_cpu_ptr(&vma_miss_cache, cpu);
+		while (READ_ONCE(vc->active_mm) == mm)
+			cpu_relax();
+	}
+}
+
 /**
  * Setup a new lego_mm_struct
  * Especially do not forget to initialize locks, counters etc.
@@ -2008,6 +2034,8 @@ lego_mm_init(struct lego_mm_struct *mm, struct lego_task_struct *p)
 	atomic_set(&mm->mm_users, 1);
 	atomic_set(&mm->mm_count, 1);
 	init_rwsem(&mm->mmap_sem);
+	seqcount_init(&mm->vma_seq);
+	mm->vma_cache_id = atomic_long_add_return(1, &next_vma_cache_id);
 	spin_lock_init(&mm->lego_page_table_lock);
 #ifdef CONFIG_DISTRIBUTED_VMA_MEMORY
 	if (is_homenode(p))
@@ -2052,7 +2080,12 @@ void __lego_mmdrop(struct lego_mm_struct *mm)
 void __lego_mmput(struct lego_mm_struct *mm)
 {
 	BUG_ON(atomic_read(&mm->mm_users));
+
+	/* No mmap_sem here, but speculative misses must still drain */
+	lego_mm_vma_write_begin(mm);
 	exit_lego_mmap(mm);
+	lego_mm_vma_write_end(mm);
+
 	lego_mmdrop(mm);
 }
 
@@ -97,33 +97,71 @@ static inline void pcache_free_check(struct pcache_meta *pcm)
 }
 
 static inline void
-__enqueue_free_list_head(struct pcache_meta *pcm, struct pcache_set *pset)
+__enqueue_free_map(struct pcache_meta *pcm, struct pcache_set *pset)
 {
-	list_add(&pcm->free_list, &pset->free_head);
+	/* Make updates to @pcm visible before it can be allocated again */
+	smp_mb__before_atomic();
+	set_bit(pcache_meta_to_way(pcm), pset->free_map);
 }
 
+/*
+ * Find a free way within @way_mask. For a partial mask, search a snapshot
+ * of the free ways we are allowed to use. Losing the race for a way is
+ * fine, test_and_clear_bit() on the real map decides.
+ */
 static inline struct pcache_meta *
-__dequeue_free_list_head(struct pcache_set *pset)
+__dequeue_free_map(struct pcache_set *pset, unsigned long way_mask)
 {
-        struct pcache_meta *pcm;
+	DECLARE_BITMAP(avail, PCACHE_ASSOCIATIVITY);
+	unsigned long *map = pset->free_map;
+	unsigned long way;
+
+	if (pcache_way_mask_partial(way_mask)) {
+		if (!bitmap_and(avail, pset->free_map, &way_mask,
+				PCACHE_ASSOCIATIVITY))
+			return NULL;
+		map = avail;
+	}
 
-        pcm = list_first_entry(&pset->free_head, struct pcache_meta, free_list);
-        list_del(&pcm->free_list);
-        return pcm;
+	/*
+	 * Start from a per-cpu position, so that CPUs allocating
+	 * from the same set do not all race for the same way.
+	 */
+	way = smp_processor_id() % PCACHE_ASSOCIATIVITY;
+	for (;;) {
+		way = find_next_bit(map, PCACHE_ASSOCIATIVITY, way);
+		if (way >= PCACHE_ASSOCIATIVITY) {
+			way = find_first_bit(map, PCACHE_ASSOCIATIVITY);
+			if (way >= PCACHE_ASSOCIATIVITY)
+				return NULL;
+		}
+
+		/* Lost the race, look for the next one */
+		if (likely(test_and_clear_bit(way, pset->free_map)))
+			return pcache_set_way_to_pcache_meta(pset, way);
+
+		if (map == avail)
+			__clear_bit(way, avail);
+	}
 }
 
 /*
  * This is the ultimate free function.
  * At the time of calling, @pcm has been removed from LRU list.
- * Upon finish, @pcm will be enqueued into free list.
+ * Upon finish, @pcm will be marked free in its set's free map.
  */
 void __put_pcache_nolru(struct pcache_meta *pcm)
 {
 	struct pcache_set *pset;
 
 	pcache_free_check(pcm);
+	pcache_prefetch_free(pcm);
+	pcache_partition_uncharge(pcm);
 	dec_pcache_used();
 
+	pset = pcache_meta_to_pcache_set(pcm);
+	arc_free_pcache(pcm, pset);
+
 	/*
 	 * This @pcm is pushed into per-cpu cached
 	 * piggyback candidate. Skip enqueuing.
@@ -131,10 +169,7 @@ void __put_pcache_nolru(struct pcache_meta *pcm)
 	if (PcachePiggybackCached(pcm))
 		return;
 
-	pset = pcache_meta_to_pcache_set(pcm);
-	spin_lock(&pset->free_lock);
-	__enqueue_free_list_head(pcm, pset);
-	spin_unlock(&pset->free_lock);
+	__enqueue_free_map(pcm, pset);
 }
 
 /*
@@ -166,7 +201,7 @@ static inline void prep_new_pcache_meta(struct pcache_meta *pcm)
 }
 
 static inline struct pcache_meta *
-pcache_alloc_fastpath(struct pcache_set *pset)
+pcache_alloc_fastpath(struct mm_struct *mm, struct pcache_set *pset)
 {
 	struct pcache_meta *pcm;
 
@@ -178,19 +213,48 @@ pcache_alloc_fastpath(struct pcache_set *pset)
 		goto prep;
 	}
 
-	spin_lock(&pset->free_lock);
-	if (list_empty(&pset->free_head)) {
-		spin_unlock(&pset->free_lock);
+	pcm = __dequeue_free_map(pset, pcache_mm_way_mask(mm));
+	if (!pcm)
 		return NULL;
-	}
-	pcm = __dequeue_free_list_head(pset);
-	spin_unlock(&pset->free_lock);
 
 	pcache_reset_flags(pcm);
 prep:
 	prep_new_pcache_meta(pcm);
 	add_to_lru_list(pcm, pset);
+	pcache_partition_charge(pcm, mm);
+	inc_pcache_used();
+	return pcm;
+}
+
+/**
+ * pcache_alloc_noevict
+ * @mm: the mm this line is allocated for
+ * @address: user virtual address
+ *
+ * Take a free line from the set that @address belongs to, never evict.
+ * Used by speculative fills, which should not push out lines that were
+ * actually asked for. Return NULL if the set has no free line.
+ */
+struct pcache_meta *pcache_alloc_noevict(struct mm_struct *mm,
+					 unsigned long address)
+{
+	struct pcache_set *pset;
+	struct pcache_meta *pcm;
+
+	pset = user_vaddr_to_pcache_set(address);
+	pcm = __dequeue_free_map(pset, pcache_mm_way_mask(mm));
+	if (!pcm)
+		return NULL;
+
+	pcache_reset_flags(pcm);
+	prep_new_pcache_meta(pcm);
+	add_to_lru_list(pcm, pset);
+	pcache_partition_charge(pcm, mm);
 	inc_pcache_used();
+
+	inc_pset_event(pset, PSET_ALLOC);
+	arc_admit_pcache(pcm, pset, address);
+	pcache_reclaim_check(pset);
 	return pcm;
 }
 
@@ -199,11 +263,14 @@ DEFINE_PROFILE_POINT(pcache_alloc_evict)
 DEFINE_PROFILE_POINT(pcache_alloc_fastpath)
 
 /**
- * pcache_alloc
+ * __pcache_alloc
+ * @mm: the mm this line is allocated for, its partition limits the ways used
  * @address: user virtual address
  * @piggyback: if this is true, underlying pcache eviction routine will enable
  *             piggyback optimization. We only have one single caller is able
  *             to use this opt, which is pcache fault on remote.
+ * @ptl_held: caller holds a pte lock, lines pinned by lazy fork are left
+ *            to others to resolve
  *
  * This function will try to allocate a cacheline from the set that @address
  * belongs to. On success, the returned @pcm has refcount 1, and mapcount 0.
@@ -216,8 +283,9 @@ DEFINE_PROFILE_POINT(pcache_alloc_fastpath)
  *	   |- pcache_alloc_evict_do_find
  *	   |- pcache_alloc_evict_do_evict
  */
-struct pcache_meta *pcache_alloc(unsigned long address,
-				 enum piggyback_options piggyback)
+static struct pcache_meta *
+__pcache_alloc(struct mm_struct *mm, unsigned long address,
+	       enum piggyback_options piggyback, bool ptl_held)
 {
 	struct pcache_set *pset;
 	struct pcache_meta *pcm;
@@ -238,17 +306,22 @@ struct pcache_meta *pcache_alloc(unsigned long address,
 retry:
 	/* Fastpath try to allocate one directly */
 	PROFILE_START(pcache_alloc_fastpath);
-	pcm = pcache_alloc_fastpath(pset);
+	pcm = pcache_alloc_fastpath(mm, pset);
 	PROFILE_LEAVE(pcache_alloc_fastpath);
 	if (likely(pcm)) {
 		if (piggyback == DISABLE_PIGGYBACK && PcachePiggyback(pcm))
 			BUG();
+		arc_admit_pcache(pcm, pset, address);
+		pcache_reclaim_check(pset);
 		PROFILE_LEAVE(pcache_alloc);
 		return pcm;
 	}
 
+	/* Background reclaim fell behind, evict synchronously */
+	pcache_reclaim_check(pset);
+
 	PROFILE_START(pcache_alloc_evict);
-	ret = pcache_evict_line(pset, address, piggyback);
+	ret = pcache_evict_line(mm, pset, address, piggyback);
 	PROFILE_LEAVE(pcache_alloc_evict);
 	switch (ret) {
 	case PCACHE_EVICT_FAILURE_FIND:
@@ -262,6 +335,10 @@ retry:
 		BUG();
 	};
 
+	/* Dirty lines skipped because of lazy fork */
+	if (!ptl_held)
+		lazy_fork_resolve_pinned();
+
 	if (likely(time_before(jiffies, timeout)))
 		goto retry;
 
@@ -272,3 +349,15 @@ retry:
 		address, pcache_set_to_set_index(pset));
 	return NULL;
 }
+
+struct pcache_meta *pcache_alloc(struct mm_struct *mm, unsigned long address,
+				 enum piggyback_options piggyback)
+{
+	return __pcache_alloc(mm, address, piggyback, false);
+}
+
+/* Called with a pte lock held */
+struct pcache_meta *pcache_alloc_ptl(struct mm_struct *mm, unsigned long address)
+{
+	return __pcache_alloc(mm, address, DISABLE_PIGGYBACK, true);
+}
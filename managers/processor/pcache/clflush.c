@@ -32,6 +32,7 @@ static inline void clflush_debug(const char *fmt, ...) { }
 #endif
 
 static struct p2m_flush_msg *clflush_msg_array;
+static struct p2m_flush_batch_msg *clflush_batch_msg_array;
 
 DEFINE_PROFILE_POINT(pcache_flush_net)
 
@@ -43,15 +44,15 @@ DEFINE_PROFILE_POINT(pcache_flush_net)
  *
  * Replication is done the at the end, if configured.
  *
- * TODO:
- * Instead of having a per-cpu message array and doing a memcpy,
- * we should use IB sg list to send both metadate and in-place cache data out.
+ * Only the message header is built in the per-cpu message array.
+ * The cache line is sent in place by IB sg list, without memcpy.
  */
 void __clflush_one(pid_t tgid, unsigned long user_va,
 		   unsigned int m_nid, unsigned int rep_nid, void *cache_addr)
 {
 	int reply, cpu;
 	struct p2m_flush_msg *msg;
+	struct fit_sglist sglist[2];
 	PROFILE_POINT_TIME(pcache_flush_net)
 
 	/*
@@ -66,16 +67,20 @@ void __clflush_one(pid_t tgid, unsigned long user_va,
 	fill_common_header(msg, P2M_PCACHE_FLUSH);
 	msg->pid = tgid;
 	msg->user_va = user_va & PCACHE_LINE_MASK;
-	memcpy(msg->pcacheline, cache_addr, PCACHE_LINE_SIZE);
 	barrier();
 
+	sglist[0].addr = msg;
+	sglist[0].len = offsetof(struct p2m_flush_msg, pcacheline);
+	sglist[1].addr = cache_addr;
+	sglist[1].len = PCACHE_LINE_SIZE;
+
 	clflush_debug("I m_nid:%d tgid:%u user_va:%#lx cache_kva:%p",
 		m_nid, msg->pid, msg->user_va, cache_addr);
 
 	/* Network */
 	PROFILE_START(pcache_flush_net);
-	ibapi_send_reply_timeout(m_nid, msg, sizeof(*msg),
-				 &reply, sizeof(reply), false, DEF_NET_TIMEOUT);
+	ibapi_send_reply_sge_timeout(m_nid, sglist, 2,
+				     &reply, sizeof(reply), false, DEF_NET_TIMEOUT);
 	PROFILE_LEAVE(pcache_flush_net);
 	clflush_debug("O tgid:%u user_va:%#lx cache_kva:%p reply:%d %s",
 		msg->pid, msg->user_va, cache_addr, reply, perror(reply));
@@ -93,6 +98,83 @@ void __clflush_one(pid_t tgid, unsigned long user_va,
 	put_cpu();
 }
 
+DEFINE_PROFILE_POINT(pcache_flush_batch_net)
+
+/*
+ * Flush @nr_entries lines that all belong to memory node @m_nid
+ * with one P2M_PCACHE_FLUSH_BATCH request.
+ *
+ * Same as __clflush_one(), information MUST NOT be pointers,
+ * except the cache lines themselves, which are sent in place.
+ */
+void __clflush_batch(unsigned int m_nid, struct clflush_batch_entry *entries,
+		     int nr_entries)
+{
+	struct p2m_flush_batch_reply reply;
+	struct p2m_flush_batch_msg *msg;
+	struct fit_sglist sglist[PCACHE_FLUSH_BATCH_MAX + 1];
+	int i, len, cpu;
+	PROFILE_POINT_TIME(pcache_flush_batch_net)
+
+	BUILD_BUG_ON(PCACHE_FLUSH_BATCH_MAX + 1 > FIT_MAX_SGE);
+	BUG_ON(nr_entries > PCACHE_FLUSH_BATCH_MAX);
+
+	if (nr_entries <= 0)
+		return;
+
+	/* Not worth a batch header */
+	if (nr_entries == 1) {
+		__clflush_one(entries[0].tgid, entries[0].user_va,
+			      m_nid, entries[0].rep_nid, entries[0].cache_addr);
+		return;
+	}
+
+	cpu = get_cpu();
+	msg = &clflush_batch_msg_array[cpu];
+
+	fill_common_header(msg, P2M_PCACHE_FLUSH_BATCH);
+	msg->nr_lines = nr_entries;
+
+	sglist[0].addr = msg;
+	sglist[0].len = offsetof(struct p2m_flush_batch_msg, pcacheline);
+	for (i = 0; i < nr_entries; i++) {
+		msg->lines[i].pid = entries[i].tgid;
+		msg->lines[i].user_va = entries[i].user_va & PCACHE_LINE_MASK;
+
+		sglist[i + 1].addr = entries[i].cache_addr;
+		sglist[i + 1].len = PCACHE_LINE_SIZE;
+	}
+	barrier();
+
+	PROFILE_START(pcache_flush_batch_net);
+	len = ibapi_send_reply_sge_timeout(m_nid, sglist, nr_entries + 1,
+					   &reply, sizeof(reply), false,
+					   DEF_NET_TIMEOUT);
+	PROFILE_LEAVE(pcache_flush_batch_net);
+
+	/* The whole request failed */
+	if (unlikely(len != sizeof(reply))) {
+		for (i = 0; i < nr_entries; i++)
+			reply.retval[i] = len < 0 ? len : -EIO;
+	} else
+		pcache_update_memory_credits(m_nid, reply.credits);
+
+	inc_pcache_event(PCACHE_CLFLUSH_BATCH);
+	for (i = 0; i < nr_entries; i++) {
+		clflush_debug("O m_nid:%d tgid:%u user_va:%#lx cache_kva:%p reply:%d %s",
+			m_nid, entries[i].tgid, entries[i].user_va,
+			entries[i].cache_addr, reply.retval[i], perror(reply.retval[i]));
+
+		inc_pcache_event(PCACHE_CLFLUSH);
+		inc_pcache_event_cond(PCACHE_CLFLUSH_FAIL, !!reply.retval[i]);
+
+		replicate(entries[i].tgid, entries[i].user_va, m_nid,
+			  entries[i].rep_nid, entries[i].cache_addr);
+	}
+
+	put_cpu();
+}
+
 /*
  * @tsk: the task this cache line belongs to
  * @user_va: the user virtual address associated with this line
@@ -166,6 +248,10 @@ void __init init_pcache_clflush_buffer(void)
 	if (!clflush_msg_array)
 		panic("Unable to allocate clflush message array");
 
+	clflush_batch_msg_array = kmalloc(sizeof(*clflush_batch_msg_array) * nr_cpus, GFP_KERNEL);
+	if (!clflush_batch_msg_array)
+		panic("Unable to allocate clflush batch message array");
+
 	pr_info("%s(): clflush array at %p, nr_entries: %d\n",
 		__func__, clflush_msg_array, nr_cpus);
 }
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Compressed tier
+ *
+ * Evicted lines are compressed into a pool of local DRAM, a later miss
+ * finds them there and decompresses instead of going to remote memory.
+ * Only the latest copy of a line is stored, and it is always flushed or
+ * being flushed by the eviction mechanism, thus entries are clean and can
+ * be dropped at any time. Lines shared by multiple processes, and lines
+ * that do not compress to half a line are not stored.
+ *
+ * The pool is split into frames of PCACHE_LINE_SIZE. A frame is carved
+ * into equal slots of one size class, from 1/16 to 1/2 of a line. Each
+ * class has its own LRU, the oldest entry of a class gives its slot to a
+ * new one when the pool is full.
+ *
+ * Entries are invalidated when their range is unmapped, moved or dropped
+ * by madvise, and when the process exits. An invalidation also cancels
+ * all stores that are in the middle of eviction, see ctier_inval_seq.
+ */
+
+#include <lego/mm.h>
+#include <lego/lzf.h>
+#include <lego/smp.h>
+#include <lego/slab.h>
+#include <lego/hash.h>
+#include <lego/log2.h>
+#include <lego/kernel.h>
+#include <lego/bitops.h>
+#include <lego/memblock.h>
+#include <lego/spinlock.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+#define CTIER_SIZE		((unsigned long)CONFIG_PCACHE_CTIER_SIZE_MB << 20)
+#define CTIER_FRAME_SIZE	PCACHE_LINE_SIZE
+
+#define CTIER_NR_CLASSES	4
+#define CTIER_SLOT_SIZE(c)	(CTIER_FRAME_SIZE >> (CTIER_NR_CLASSES - (c)))
+#define CTIER_NR_SLOTS(c)	(1 << (CTIER_NR_CLASSES - (c)))
+#define CTIER_MAX_LEN		CTIER_SLOT_SIZE(CTIER_NR_CLASSES - 1)
+
+/* Bound the entries dropped to make room for one store */
+#define CTIER_RECLAIM_MAX	32
+
+struct ctier_frame {
+	struct list_head	next;		/* free or partial list */
+	unsigned int		class;
+	unsigned int		nr_used;
+	unsigned long		used_map;
+};
+
+struct ctier_entry {
+	struct hlist_node	hnode;
+	struct list_head	lru;
+	pid_t			tgid;
+	unsigned long		address;
+	struct ctier_frame	*frame;
+	unsigned int		slot;
+	unsigned int		len;
+};
+
+struct ctier_scratch {
+	u8			buf[CTIER_MAX_LEN];
+	u16			htab[LZF_HTAB_SIZE];
+};
+
+static void *ctier_data_map;
+static struct ctier_frame *ctier_frame_map;
+static unsigned long nr_ctier_frames;
+
+static struct hlist_head *ctier_hash;
+static unsigned int ctier_hash_bits;
+
+/* Everything below is protected by ctier_lock */
+static DEFINE_SPINLOCK(ctier_lock);
+static LIST_HEAD(ctier_free_frames);
+static struct list_head ctier_partial[CTIER_NR_CLASSES];
+static struct list_head ctier_lru[CTIER_NR_CLASSES];
+static unsigned long ctier_nr_class[CTIER_NR_CLASSES];
+
+/*
+ * Bumped by every invalidation. A store whose line was unmapped by
+ * eviction before the invalidation, and stored after it, would bring
+ * back a line that has been unmapped by user. Such stores see a
+ * different seq than the one captured before unmap, and give up.
+ */
+static unsigned long ctier_inval_seq;
+
+atomic_t ctier_nr_entries;
+
+/* Per-cpu compression buffers, used with preemption disabled */
+static struct ctier_scratch *ctier_scratch;
+
+static inline struct hlist_head *ctier_bucket(pid_t tgid, unsigned long address)
+{
+	return &ctier_hash[hash_long((address >> PCACHE_LINE_SIZE_SHIFT) + tgid,
+				     ctier_hash_bits)];
+}
+
+static inline void *ctier_entry_to_kva(struct ctier_entry *e)
+{
+	unsigned long index = e->frame - ctier_frame_map;
+
+	return ctier_data_map + index * CTIER_FRAME_SIZE +
+	       e->slot * CTIER_SLOT_SIZE(e->frame->class);
+}
+
+static inline unsigned int ctier_len_to_class(unsigned int len)
+{
+	unsigned int class = 0;
+
+	while (CTIER_SLOT_SIZE(class) < len)
+		class++;
+	return class;
+}
+
+static struct ctier_entry *__ctier_lookup(pid_t tgid, unsigned long address)
+{
+	struct ctier_entry *e;
+
+	hlist_for_each_entry(e, ctier_bucket(tgid, address), hnode) {
+		if (e->address == address && e->tgid == tgid)
+			return e;
+	}
+	return NULL;
+}
+
+static void __ctier_link(struct ctier_entry *e)
+{
+	unsigned int class = e->frame->class;
+
+	hlist_add_head(&e->hnode, ctier_bucket(e->tgid, e->address));
+	list_add_tail(&e->lru, &ctier_lru[class]);
+	ctier_nr_class[class]++;
+	atomic_inc(&ctier_nr_entries);
+}
+
+/* Remove @e from lookup, its slot is still in use */
+static void __ctier_unlink(struct ctier_entry *e)
+{
+	hlist_del(&e->hnode);
+	list_del(&e->lru);
+	ctier_nr_class[e->frame->class]--;
+	atomic_dec(&ctier_nr_entries);
+}
+
+static bool __ctier_alloc_slot(struct ctier_entry *e, unsigned int class)
+{
+	struct ctier_frame *frame;
+
+	if (list_empty(&ctier_partial[class])) {
+		if (list_empty(&ctier_free_frames))
+			return false;
+
+		frame = list_first_entry(&ctier_free_frames, struct ctier_frame, next);
+		list_move(&frame->next, &ctier_partial[class]);
+		frame->class = class;
+		frame->nr_used = 0;
+		frame->used_map = 0;
+	}
+
+	frame = list_first_entry(&ctier_partial[class], struct ctier_frame, next);
+	e->frame = frame;
+	e->slot = find_first_zero_bit(&frame->used_map, CTIER_NR_SLOTS(class));
+	__set_bit(e->slot, &frame->used_map);
+
+	if (++frame->nr_used == CTIER_NR_SLOTS(class))
+		list_del_init(&frame->next);
+	return true;
+}
+
+static void __ctier_free_slot(struct ctier_entry *e)
+{
+	struct ctier_frame *frame = e->frame;
+	unsigned int class = frame->class;
+
+	__clear_bit(e->slot, &frame->used_map);
+
+	/* A full frame is on no list */
+	if (frame->nr_used-- == CTIER_NR_SLOTS(class))
+		list_add(&frame->next, &ctier_partial[class]);
+	else if (!frame->nr_used)
+		list_move(&frame->next, &ctier_free_frames);
+}
+
+static void __ctier_drop(struct ctier_entry *e)
+{
+	__ctier_unlink(e);
+	__ctier_free_slot(e);
+	kfree(e);
+}
+
+/*
+ * Make sure there is a slot of @class. The oldest entry of the same class
+ * gives up its slot right away. If the class has no entries, the largest
+ * class is shrunk until one of its frames becomes free.
+ */
+static bool __ctier_reclaim(unsigned int class)
+{
+	struct ctier_entry *e;
+	unsigned int c, from;
+	int i;
+
+	for (i = 0; i < CTIER_RECLAIM_MAX; i++) {
+		if (!list_empty(&ctier_partial[class]) ||
+		    !list_empty(&ctier_free_frames))
+			return true;
+
+		from = class;
+		if (!ctier_nr_class[from]) {
+			for (c = 0; c < CTIER_NR_CLASSES; c++) {
+				if (ctier_nr_class[c] > ctier_nr_class[from])
+					from = c;
+			}
+			if (!ctier_nr_class[from])
+				return false;
+		}
+
+		e = list_first_entry(&ctier_lru[from], struct ctier_entry, lru);
+		__ctier_drop(e);
+		inc_pcache_event(PCACHE_CTIER_DROP);
+	}
+	return !list_empty(&ctier_partial[class]) || !list_empty(&ctier_free_frames);
+}
+
+/**
+ * pcache_ctier_evict_prepare
+ * @pcm: the line selected for eviction, locked and still mapped
+ * @key: where the owner of @pcm is saved
+ *
+ * Called by eviction before @pcm is unmapped, the rmap is gone afterwards.
+ * Shared lines are not stored, and copies that other owners may still have
+ * in the tier are dropped, because the line may have been written since.
+ */
+void pcache_ctier_evict_prepare(struct pcache_meta *pcm,
+				struct pcache_ctier_key *key)
+{
+	struct pcache_rmap *rmap;
+
+	key->tgid = 0;
+	key->seq = READ_ONCE(ctier_inval_seq);
+
+	if (likely(pcache_mapcount(pcm) == 1)) {
+		rmap = pcache_first_rmap(pcm);
+		key->tgid = rmap->owner_process->tgid;
+		key->address = rmap->address & PCACHE_LINE_MASK;
+		return;
+	}
+
+	if (!pcache_ctier_may_hit())
+		return;
+
+	spin_lock(&ctier_lock);
+	rmap = &pcm->rmap_inline;
+	if (RmapUsed(rmap)) {
+		struct ctier_entry *e;
+
+		e = __ctier_lookup(rmap->owner_process->tgid,
+				   rmap->address & PCACHE_LINE_MASK);
+		if (e)
+			__ctier_drop(e);
+	}
+	list_for_each_entry(rmap, &pcm->rmap, next) {
+		struct ctier_entry *e;
+
+		e = __ctier_lookup(rmap->owner_process->tgid,
+				   rmap->address & PCACHE_LINE_MASK);
+		if (e)
+			__ctier_drop(e);
+	}
+	spin_unlock(&ctier_lock);
+}
+
+/**
+ * pcache_ctier_store
+ * @pcm: the line being evicted, unmapped and TLB flushed
+ * @key: filled by pcache_ctier_evict_prepare()
+ *
+ * Called by eviction before the flush is finished, concurrent misses on the
+ * same line are still held back by the eviction mechanism at this point.
+ * An older copy of the same line is always dropped, even if the new one
+ * can not be stored.
+ */
+void pcache_ctier_store(struct pcache_meta *pcm, struct pcache_ctier_key *key)
+{
+	struct ctier_scratch *s;
+	struct ctier_entry *e, *old;
+	unsigned int len;
+	int cpu;
+
+	if (!key->tgid)
+		return;
+
+	e = kmalloc(sizeof(*e), GFP_KERNEL);
+
+	cpu = get_cpu();
+	s = ctier_scratch + cpu;
+	len = lzf_compress(pcache_meta_to_kva(pcm), PCACHE_LINE_SIZE,
+			   s->buf, CTIER_MAX_LEN, s->htab);
+
+	spin_lock(&ctier_lock);
+	old = __ctier_lookup(key->tgid, key->address);
+	if (old)
+		__ctier_drop(old);
+
+	if (unlikely(!e || !len || key->seq != ctier_inval_seq))
+		goto fail;
+
+	if (unlikely(!__ctier_reclaim(ctier_len_to_class(len))))
+		goto fail;
+
+	e->tgid = key->tgid;
+	e->address = key->address;
+	e->len = len;
+	__ctier_alloc_slot(e, ctier_len_to_class(len));
+	memcpy(ctier_entry_to_kva(e), s->buf, len);
+	__ctier_link(e);
+	spin_unlock(&ctier_lock);
+	put_cpu();
+
+	inc_pcache_event(PCACHE_CTIER_STORE);
+	mod_pcache_event(PCACHE_CTIER_STORE_BYTES, len);
+	return;
+
+fail:
+	spin_unlock(&ctier_lock);
+	put_cpu();
+	kfree(e);
+	inc_pcache_event(PCACHE_CTIER_STORE_FAIL);
+}
+
+/*
+ * Callback for common fill code
+ * Fill the pcache line from compressed tier
+ */
+static int __ctier_fill_pcache(unsigned long address, unsigned long flags,
+			       struct pcache_meta *pcm, void *_e)
+{
+	struct ctier_entry *e = _e;
+	unsigned int len;
+
+	len = lzf_decompress(ctier_entry_to_kva(e), e->len,
+			     pcache_meta_to_kva(pcm), PCACHE_LINE_SIZE);
+	if (WARN_ON_ONCE(len != PCACHE_LINE_SIZE))
+		return -EIO;
+
+	inc_pcache_event(PCACHE_CTIER_HIT);
+	return 0;
+}
+
+/**
+ * pcache_ctier_try_fill
+ *
+ * Look up the compressed tier for @address of current process.
+ * The entry is taken out before fill, a concurrent miss on the same line
+ * goes to memory, which has the same data.
+ *
+ * Return 0 on success, otherwise caller needs to fallback to remote memory.
+ */
+int pcache_ctier_try_fill(struct mm_struct *mm, unsigned long address,
+			  pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
+			  unsigned long flags)
+{
+	struct ctier_entry *e;
+	int ret;
+
+	spin_lock(&ctier_lock);
+	e = __ctier_lookup(current->tgid, address & PCACHE_LINE_MASK);
+	if (e)
+		__ctier_unlink(e);
+	spin_unlock(&ctier_lock);
+
+	if (!e) {
+		inc_pcache_event(PCACHE_CTIER_MISS);
+		return 1;
+	}
+
+	/*
+	 * Filling may evict, which may store into the tier again,
+	 * thus the lock is not held across.
+	 */
+	ret = common_do_fill_page(mm, address, page_table, orig_pte, pmd, flags,
+				  __ctier_fill_pcache, e, RMAP_CTIER_FILL,
+				  DISABLE_PIGGYBACK);
+
+	spin_lock(&ctier_lock);
+	__ctier_free_slot(e);
+	spin_unlock(&ctier_lock);
+	kfree(e);
+
+	return ret;
+}
+
+/**
+ * pcache_ctier_invalidate_range
+ * @tgid: the owner
+ * @start: start address
+ * @end: end address, not included
+ *
+ * Called after [@start, @end) is unmapped from pgtable. Small ranges are
+ * looked up line by line, large ones walk all entries.
+ */
+void pcache_ctier_invalidate_range(pid_t tgid, unsigned long start,
+				   unsigned long end)
+{
+	struct ctier_entry *e, *tmp;
+	unsigned long address;
+	int c, nr = 0;
+
+	start &= PCACHE_LINE_MASK;
+
+	spin_lock(&ctier_lock);
+	ctier_inval_seq++;
+
+	if (!atomic_read(&ctier_nr_entries))
+		goto out;
+
+	if ((end - start) >> PCACHE_LINE_SIZE_SHIFT > atomic_read(&ctier_nr_entries)) {
+		for (c = 0; c < CTIER_NR_CLASSES; c++) {
+			list_for_each_entry_safe(e, tmp, &ctier_lru[c], lru) {
+				if (e->tgid != tgid ||
+				    e->address < start || e->address >= end)
+					continue;
+				__ctier_drop(e);
+				nr++;
+			}
+		}
+	} else {
+		for (address = start; address < end; address += PCACHE_LINE_SIZE) {
+			e = __ctier_lookup(tgid, address);
+			if (e) {
+				__ctier_drop(e);
+				nr++;
+			}
+		}
+	}
+out:
+	spin_unlock(&ctier_lock);
+	mod_pcache_event(PCACHE_CTIER_INVALIDATE, nr);
+}
+
+/* Called when process @tgid exits, or execs */
+void pcache_ctier_invalidate_tgid(pid_t tgid)
+{
+	struct ctier_entry *e, *tmp;
+	int c, nr = 0;
+
+	spin_lock(&ctier_lock);
+	ctier_inval_seq++;
+	for (c = 0; c < CTIER_NR_CLASSES; c++) {
+		list_for_each_entry_safe(e, tmp, &ctier_lru[c], lru) {
+			if (e->tgid != tgid)
+				continue;
+			__ctier_drop(e);
+			nr++;
+		}
+	}
+	spin_unlock(&ctier_lock);
+	mod_pcache_event(PCACHE_CTIER_INVALIDATE, nr);
+}
+
+/*
+ * Allocate the pool, frame metadata and hash table.
+ * Called during early boot, use memblock.
+ */
+void __init pcache_ctier_early_init(void)
+{
+	unsigned long i, nr_buckets;
+	int c;
+
+	nr_ctier_frames = CTIER_SIZE / CTIER_FRAME_SIZE;
+
+	ctier_data_map = memblock_virt_alloc(CTIER_SIZE, PAGE_SIZE);
+	if (!ctier_data_map)
+		panic("Unable to allocate compressed tier!");
+
+	ctier_frame_map = memblock_virt_alloc(nr_ctier_frames * sizeof(struct ctier_frame),
+					      PAGE_SIZE);
+	if (!ctier_frame_map)
+		panic("Unable to allocate compressed tier frames!");
+
+	/* Assume 4 entries per frame on average */
+	nr_buckets = roundup_pow_of_two(nr_ctier_frames * 4);
+	ctier_hash_bits = ilog2(nr_buckets);
+	ctier_hash = memblock_virt_alloc(nr_buckets * sizeof(struct hlist_head),
+					 PAGE_SIZE);
+	if (!ctier_hash)
+		panic("Unable to allocate compressed tier hash!");
+
+	for (i = 0; i < nr_buckets; i++)
+		INIT_HLIST_HEAD(&ctier_hash[i]);
+
+	for (c = 0; c < CTIER_NR_CLASSES; c++) {
+		INIT_LIST_HEAD(&ctier_partial[c]);
+		INIT_LIST_HEAD(&ctier_lru[c]);
+	}
+
+	for (i = 0; i < nr_ctier_frames; i++)
+		list_add_tail(&ctier_frame_map[i].next, &ctier_free_frames);
+
+	atomic_set(&ctier_nr_entries, 0);
+}
+
+void __init pcache_ctier_post_init(void)
+{
+	ctier_scratch = kmalloc(sizeof(*ctier_scratch) * nr_cpus, GFP_KERNEL);
+	if (!ctier_scratch)
+		panic("Unable to allocate compressed tier buffers!");
+
+	pr_info("%s(): %lu frames at %p, %u hash bits\n",
+		__func__, nr_ctier_frames, ctier_data_map, ctier_hash_bits);
+}
@@ -23,7 +23,9 @@
 	{1UL << PC_reclaim,		"reclaim"	},	\
 	{1UL << PC_writeback,		"writeback"	},	\
 	{1UL << PC_piggyback,		"piggyback"	},	\
-	{1UL << PC_piggyback,		"piggybackC"	}
+	{1UL << PC_piggyback,		"piggybackC"	},	\
+	{1UL << PC_prefetched,		"prefetched"	},	\
+	{1UL << PC_frequent,		"frequent"	}
 
 const struct trace_print_flags pcacheflag_names[] = {
 	__def_pcacheflag_names,
@@ -54,6 +56,10 @@ static const char *RMAP_CALLER_NAME[] = {
 	"cow",
 	"fork",
 	"mremap_slowpath",
+	"prefetch",
+	"extent_fill",
+	"fault_around",
+	"ctier_fill",
 };
 
 /**
@@ -103,25 +109,26 @@ static DEFINE_SPINLOCK(dump_pset_lock);
 void dump_pset(struct pcache_set *pset)
 {
 	struct pcache_meta *pcm;
+	unsigned long way;
 
 	spin_lock(&dump_pset_lock);
 
 	pr_debug("pset:%p set_idx: %lu nr_lru:%d\n",
 		pset, pcache_set_to_set_index(pset),
-		IS_ENABLED(CONFIG_PCACHE_EVICT_LRU) ? atomic_read(&pset->nr_lru) : 0);
+		pset_nr_lru(pset));
 
 	pcm = this_cpu_read(piggybacker);
 	if (pcm)
 		dump_pcache_meta(pcm, "This is piggybacker");
 
-	pr_info("Free List\n");
-	spin_lock(&pset->free_lock);
-	list_for_each_entry(pcm, &pset->free_head, free_list) {
+	pr_info("Free Lines\n");
+	for_each_set_bit(way, pset->free_map, PCACHE_ASSOCIATIVITY) {
+		pcm = pcache_set_way_to_pcache_meta(pset, way);
 		dump_pcache_meta(pcm, NULL);
 		dump_pcache_rmaps(pcm);
 	}
-	spin_unlock(&pset->free_lock);
 
+#ifdef CONFIG_PCACHE_EVICT_LRU
 	pr_info("LRU List\n");
 	spin_lock(&pset->lru_lock);
 	list_for_each_entry(pcm, &pset->lru_list, lru) {
@@ -129,6 +136,7 @@ void dump_pset(struct pcache_set *pset)
 		dump_pcache_rmaps(pcm);
 	}
 	spin_unlock(&pset->lru_lock);
+#endif
 	spin_unlock(&dump_pset_lock);
 }
 
@@ -21,45 +21,71 @@
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
+#include <asm/tlbflush.h>
+
 /**
  * evict_find_line
  * @pset: the pcache set in question
+ * @way_mask: only lines in these ways can be selected
  *
  * This function will find a line to evict within a set.
  * The returned pcache line MUST be locked.
  */
 static inline struct pcache_meta *
-evict_find_line(struct pcache_set *pset)
+evict_find_line(struct pcache_set *pset, unsigned long way_mask)
 {
 #ifdef CONFIG_PCACHE_EVICT_RANDOM
-	return evict_find_line_random(pset);
+	return evict_find_line_random(pset, way_mask);
 #elif defined(CONFIG_PCACHE_EVICT_FIFO)
-	return evict_find_line_fifo(pset);
+	return evict_find_line_fifo(pset, way_mask);
 #elif defined(CONFIG_PCACHE_EVICT_LRU)
-	return evict_find_line_lru(pset);
+	return evict_find_line_lru(pset, way_mask);
+#elif defined(CONFIG_PCACHE_EVICT_CLOCK)
+	return evict_find_line_clock(pset, way_mask);
+#elif defined(CONFIG_PCACHE_EVICT_ARC)
+	return evict_find_line_arc(pset, way_mask);
 #endif
 }
 
+/*
+ * One line in the middle of eviction.
+ * The unmap half only gathers the TLB shootdown, so that multiple
+ * lines can share one IPI. The finish half runs after the flush,
+ * when no cpu can touch the line through a stale TLB entry anymore.
+ */
+struct evict_control {
+	struct pcache_meta		*pcm;
+	int				nr_mapped;
+	bool				dirty;
+	struct pcache_ctier_key		ctier;
+#ifdef CONFIG_PCACHE_EVICTION_VICTIM
+	struct pcache_victim_meta	*victim;
+#elif defined(CONFIG_PCACHE_EVICTION_PERSET_LIST)
+	int				nr_added;
+#endif
+};
+
 #ifdef CONFIG_PCACHE_EVICTION_VICTIM
 
 DEFINE_PROFILE_POINT(evict_line_victim_prepare)
 DEFINE_PROFILE_POINT(evict_line_victim_unmap)
 DEFINE_PROFILE_POINT(evict_line_victim_finish)
 
-static inline int evict_line_victim(struct pcache_set *pset,
-				    struct pcache_meta *pcm, unsigned long address)
+static inline int evict_line_victim_unmap(struct pcache_set *pset,
+					  struct evict_control *ec,
+					  unsigned long address,
+					  struct tlb_gather *tlb)
 {
 	struct pcache_victim_meta *victim;
-	bool dirty;
 	PROFILE_POINT_TIME(evict_line_victim_prepare)
 	PROFILE_POINT_TIME(evict_line_victim_unmap)
-	PROFILE_POINT_TIME(evict_line_victim_finish)
 
 	PROFILE_START(evict_line_victim_prepare);
-	victim = victim_prepare_insert(pset, pcm, address);
+	victim = victim_prepare_insert(pset, ec->pcm, address);
 	PROFILE_LEAVE(evict_line_victim_prepare);
 	if (IS_ERR(victim))
 		return PTR_ERR(victim);
+	ec->victim = victim;
 
 	/*
 	 * Make sure other cpus can see the above
@@ -67,15 +93,20 @@ static inline int evict_line_victim(struct pcache_set *pset,
 	 */
 	smp_wmb();
 	PROFILE_START(evict_line_victim_unmap);
-	dirty = pcache_try_to_unmap_check_dirty(pcm);
+	ec->dirty = pcache_try_to_unmap_check_dirty_tlb(ec->pcm, tlb);
 	PROFILE_LEAVE(evict_line_victim_unmap);
-	PCACHE_BUG_ON_PCM(pcache_mapped(pcm), pcm);
+	PCACHE_BUG_ON_PCM(pcache_mapped(ec->pcm), ec->pcm);
+
+	return 0;
+}
+
+static inline void evict_line_victim_finish(struct evict_control *ec)
+{
+	PROFILE_POINT_TIME(evict_line_victim_finish)
 
 	PROFILE_START(evict_line_victim_finish);
-	victim_finish_insert(victim, dirty);
+	victim_finish_insert(ec->victim, ec->dirty);
 	PROFILE_LEAVE(evict_line_victim_finish);
-
-	return 0;
 }
 #endif
 
@@ -96,15 +127,34 @@ evict_line_wrprotect(struct pcache_set *pset, struct pcache_meta *pcm)
 }
 #endif
 
-static inline int evict_line(struct pcache_set *pset, struct pcache_meta *pcm,
-			     unsigned long address, enum piggyback_options piggyback)
+/*
+ * Mechanism Hook, first half.
+ * Return 0 on success, and the line must be finished by evict_line_finish()
+ * after @tlb is flushed. Otherwise nothing has been done to the line.
+ */
+static inline int evict_line_unmap(struct pcache_set *pset, struct evict_control *ec,
+				   unsigned long address, struct tlb_gather *tlb)
 {
 #ifdef CONFIG_PCACHE_EVICTION_WRITE_PROTECT
-	return evict_line_wrprotect(pset, pcm);
+	/* Flush back must follow write-protect, nothing to batch */
+	return evict_line_wrprotect(pset, ec->pcm);
 #elif defined(CONFIG_PCACHE_EVICTION_PERSET_LIST)
-	return evict_line_perset_list(pset, pcm, piggyback);
+	ec->nr_added = evict_line_perset_list_unmap(pset, ec->pcm, tlb, &ec->dirty);
+	return 0;
 #elif defined(CONFIG_PCACHE_EVICTION_VICTIM)
-	return evict_line_victim(pset, pcm, address);
+	return evict_line_victim_unmap(pset, ec, address, tlb);
+#endif
+}
+
+/* Mechanism Hook, second half */
+static inline void evict_line_finish(struct pcache_set *pset, struct evict_control *ec,
+				     enum piggyback_options piggyback)
+{
+#ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
+	evict_line_perset_list_finish(pset, ec->pcm, ec->nr_added,
+				      ec->dirty, piggyback);
+#elif defined(CONFIG_PCACHE_EVICTION_VICTIM)
+	evict_line_victim_finish(ec);
 #endif
 }
 
@@ -115,89 +165,70 @@ static inline int evict_line(struct pcache_set *pset, struct pcache_meta *pcm,
 DEFINE_PROFILE_POINT(pcache_alloc_evict_do_find)
 DEFINE_PROFILE_POINT(pcache_alloc_evict_do_evict)
 
-/**
- * pcache_evict_line
- * @pset: the pcache set to find a line to evict
- * @address: the user virtual address who initalized this eviction
- *
- * 1)
- * This function will try to evict one cache line from @pset.
- * If succeed, the cache line will be flushed back to its backing memory.
- * This function can be called concurrently: the selection of cache line
- * is serialized by pset lock, the real eviction procedure can be overlapped.
- *
- * 2)
- * We clear pte and pcache in this sequence:
- * 	a) unmap pte
- * 	b) free pcache
- * This guarantees: if pgfault routines (pcache_do_wp_page) or some rmap walkers
- * use pte_to_pcache_meta() to get the corresponding pcm, and continues holding
- * the pte lock while doing something to this pcm, they are guaranteed this pcm
- * will not go away in the middle.
- *
- * Return 0 on success, otherwise on failures.
+/*
+ * Algorithm Hook.
+ * Return a locked, Reclaim pcm, or NULL with PCACHE_EVICT_* in @ret.
  */
-int pcache_evict_line(struct pcache_set *pset, unsigned long address,
-		      enum piggyback_options piggyback)
+static struct pcache_meta *evict_find(struct pcache_set *pset,
+				      unsigned long way_mask, int *ret)
 {
 	struct pcache_meta *pcm;
-	int nr_mapped;
-	int ret;
 	PROFILE_POINT_TIME(pcache_alloc_evict_do_find)
-	PROFILE_POINT_TIME(pcache_alloc_evict_do_evict)
 
 	inc_pcache_event(PCACHE_EVICTION_TRIGGERED);
 
 	/*
-	 * Algorithm Hook.
-	 *
 	 * We mark this pcache set as Evicting, so sweep thread
 	 * will try to avoid use it concurrently. Since lock is
 	 * held within evict_find_line(), it is fine to clear it.
 	 */
 	PROFILE_START(pcache_alloc_evict_do_find);
 	__SetPsetEvicting(pset);
-	pcm = evict_find_line(pset);
+	pcm = evict_find_line(pset, way_mask);
 	__ClearPsetEvicting(pset);
 	PROFILE_LEAVE(pcache_alloc_evict_do_find);
 
 	if (IS_ERR_OR_NULL(pcm)) {
 		if (likely(PTR_ERR(pcm) == -EAGAIN)) {
 			inc_pcache_event(PCACHE_EVICTION_EAGAIN_FREEABLE);
-			return PCACHE_EVICT_EAGAIN_FREEABLE;
+			*ret = PCACHE_EVICT_EAGAIN_FREEABLE;
 		} else {
 			inc_pcache_event(PCACHE_EVICTION_FAILURE_FIND);
-			return PCACHE_EVICT_FAILURE_FIND;
+			*ret = PCACHE_EVICT_FAILURE_FIND;
 		}
+		return NULL;
 	}
 
 	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
 	PCACHE_BUG_ON_PCM(!PcacheReclaim(pcm), pcm);
 
-	/* we locked, it can not be unmapped by others */
-	nr_mapped = pcache_mapcount(pcm);
-	BUG_ON(nr_mapped < 1);
+	/* Invalidate any prefetch that is on the fly in this set */
+	pcache_prefetch_evict_start(pset);
+	return pcm;
+}
 
-	PROFILE_START(pcache_alloc_evict_do_evict);
-	ret = evict_line(pset, pcm, address, piggyback);
-	PROFILE_LEAVE(pcache_alloc_evict_do_evict);
-	if (ret) {
-		/*
-		 * Revert what algorithm has done:
-		 * - Clear reclaim flag
-		 * - add it back to lru list (update counter)
-		 * - unlock
-		 * - dec ref (may lead to free)
-		 */
-		ClearPcacheReclaim(pcm);
-		add_to_lru_list(pcm, pset);
-		unlock_pcache(pcm);
-		put_pcache(pcm);
+/*
+ * Revert what algorithm has done:
+ * - Clear reclaim flag
+ * - add it back to lru list (update counter)
+ * - unlock
+ * - dec ref (may lead to free)
+ */
+static int evict_revert(struct pcache_set *pset, struct pcache_meta *pcm)
+{
+	ClearPcacheReclaim(pcm);
+	add_to_lru_list(pcm, pset);
+	unlock_pcache(pcm);
+	put_pcache(pcm);
 
-		inc_pcache_event(PCACHE_EVICTION_FAILURE_EVICT);
-		return PCACHE_EVICT_FAILURE_EVICT;
-	}
+	inc_pcache_event(PCACHE_EVICTION_FAILURE_EVICT);
+	return PCACHE_EVICT_FAILURE_EVICT;
+}
 
+/* Free the unmapped line back to @pset */
+static int evict_free(struct pcache_set *pset, struct pcache_meta *pcm,
+		      int nr_mapped)
+{
 	/*
 	 * After a successful eviction, @pcm has no rmap left
 	 * which implies PcacheValid is cleared too.
@@ -247,3 +278,117 @@ int pcache_evict_line(struct pcache_set *pset, unsigned long address,
 	inc_pcache_event(PCACHE_EVICTION_SUCCEED);
 	return PCACHE_EVICT_SUCCEED;
 }
+
+/**
+ * pcache_evict_line
+ * @mm: the mm we are evicting for, its partition limits the candidates
+ * @pset: the pcache set to find a line to evict
+ * @address: the user virtual address who initalized this eviction
+ *
+ * 1)
+ * This function will try to evict one cache line from @pset.
+ * If succeed, the cache line will be flushed back to its backing memory.
+ * This function can be called concurrently: the selection of cache line
+ * is serialized by pset lock, the real eviction procedure can be overlapped.
+ *
+ * 2)
+ * We clear pte and pcache in this sequence:
+ * 	a) unmap pte
+ * 	b) free pcache
+ * This guarantees: if pgfault routines (pcache_do_wp_page) or some rmap walkers
+ * use pte_to_pcache_meta() to get the corresponding pcm, and continues holding
+ * the pte lock while doing something to this pcm, they are guaranteed this pcm
+ * will not go away in the middle.
+ *
+ * Return 0 on success, otherwise on failures.
+ */
+int pcache_evict_line(struct mm_struct *mm, struct pcache_set *pset,
+		      unsigned long address, enum piggyback_options piggyback)
+{
+	struct evict_control ec;
+	struct tlb_gather tlb;
+	int ret;
+	PROFILE_POINT_TIME(pcache_alloc_evict_do_evict)
+
+	ec.pcm = evict_find(pset, pcache_mm_way_mask(mm), &ret);
+	if (!ec.pcm)
+		return ret;
+
+	/* we locked, it can not be unmapped by others */
+	ec.nr_mapped = pcache_mapcount(ec.pcm);
+	BUG_ON(ec.nr_mapped < 1);
+
+	/* Owner is only known before unmap */
+	pcache_ctier_evict_prepare(ec.pcm, &ec.ctier);
+
+	PROFILE_START(pcache_alloc_evict_do_evict);
+	tlb_gather_init(&tlb);
+	ret = evict_line_unmap(pset, &ec, address, &tlb);
+	tlb_gather_flush(&tlb);
+	if (!ret) {
+		/*
+		 * Nobody can write the line anymore, and misses on it
+		 * are still held back by the mechanism until finish.
+		 */
+		pcache_ctier_store(ec.pcm, &ec.ctier);
+		evict_line_finish(pset, &ec, piggyback);
+		pcache_partition_evicted(ec.pcm, mm);
+	}
+	PROFILE_LEAVE(pcache_alloc_evict_do_evict);
+	if (ret)
+		return evict_revert(pset, ec.pcm);
+
+	return evict_free(pset, ec.pcm, ec.nr_mapped);
+}
+
+/**
+ * pcache_evict_lines
+ * @pset: the pcache set to evict lines from
+ * @nr_to_evict: number of lines we want to evict
+ *
+ * Same as pcache_evict_line(), but lines are unmapped first, and their
+ * TLB entries are shot down together, before any of them is flushed back.
+ * Piggyback is not supported. Return the number of evicted lines.
+ */
+int pcache_evict_lines(struct pcache_set *pset, int nr_to_evict)
+{
+	struct evict_control ecs[PCACHE_EVICT_BATCH_MAX];
+	struct evict_control *ec;
+	struct tlb_gather tlb;
+	int i, ret, nr = 0, nr_evicted = 0;
+
+	nr_to_evict = min(nr_to_evict, PCACHE_EVICT_BATCH_MAX);
+	tlb_gather_init(&tlb);
+
+	while (nr < nr_to_evict) {
+		ec = &ecs[nr];
+		ec->pcm = evict_find(pset, PCACHE_WAYS_ALL, &ret);
+		if (!ec->pcm)
+			break;
+
+		ec->nr_mapped = pcache_mapcount(ec->pcm);
+		BUG_ON(ec->nr_mapped < 1);
+
+		pcache_ctier_evict_prepare(ec->pcm, &ec->ctier);
+		if (evict_line_unmap(pset, ec, 0, &tlb)) {
+			evict_revert(pset, ec->pcm);
+			break;
+		}
+		nr++;
+	}
+
+	if (!nr)
+		return 0;
+
+	tlb_gather_flush(&tlb);
+	inc_pcache_event(PCACHE_EVICTION_BATCH);
+
+	for (i = 0; i < nr; i++) {
+		ec = &ecs[i];
+		pcache_ctier_store(ec->pcm, &ec->ctier);
+		evict_line_finish(pset, ec, DISABLE_PIGGYBACK);
+		if (evict_free(pset, ec->pcm, ec->nr_mapped) == PCACHE_EVICT_SUCCEED)
+			nr_evicted++;
+	}
+	return nr_evicted;
+}
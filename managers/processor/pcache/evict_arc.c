@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+/*
+ * Adaptive Replacement, the CLOCK flavor of ARC (CAR).
+ *
+ * Lines of a set are in one of two segments:
+ *  - recent:   filled once, not referenced since
+ *  - frequent: referenced again after the fill, marked by PC_frequent
+ *
+ * Pgfault does not see pcache hits, so the young bit in PTEs is the only
+ * reference information. Eviction walks the ways with a per-set hand and
+ * test-and-clears young bits. A referenced recent line is promoted, a
+ * referenced frequent line is kept. The first unreferenced line of the
+ * segment we are replacing from is evicted.
+ *
+ * Each set also remembers the lines it evicted lately, the ghosts. If a
+ * miss refetches a ghost, the line goes straight into the frequent segment
+ * and the target size of the recent segment adapts: refetching a recent
+ * ghost means recent was too small, refetching a frequent ghost means
+ * frequent was too small. One-touch streams only churn the recent segment.
+ */
+
+#define ARC_NR_GHOSTS		PCACHE_ASSOCIATIVITY
+
+/*
+ * Ghost entry: line aligned address, plus the two low bits below.
+ * Addresses are not qualified by mm, a false match just costs one
+ * misplaced promotion.
+ */
+#define ARC_GHOST_VALID		(1UL << 0)
+#define ARC_GHOST_FREQUENT	(1UL << 1)
+
+static inline unsigned int arc_hand_advance(unsigned int way)
+{
+	if (++way == PCACHE_ASSOCIATIVITY)
+		way = 0;
+	return way;
+}
+
+static void arc_ghost_insert(struct pcache_set *pset, unsigned long address,
+			     bool frequent)
+{
+	unsigned long entry;
+	unsigned int idx;
+
+	entry = (address & PCACHE_LINE_MASK) | ARC_GHOST_VALID;
+	if (frequent)
+		entry |= ARC_GHOST_FREQUENT;
+
+	/* Oldest ghost is overwritten */
+	idx = atomic_inc_return(&pset->arc_ghost_head) % ARC_NR_GHOSTS;
+	WRITE_ONCE(pset->arc_ghost[idx], entry);
+}
+
+/* Find and consume the ghost of @address, return 0 if none */
+static unsigned long arc_ghost_lookup(struct pcache_set *pset,
+				      unsigned long address)
+{
+	unsigned long entry;
+	int i;
+
+	address &= PCACHE_LINE_MASK;
+	for (i = 0; i < ARC_NR_GHOSTS; i++) {
+		entry = READ_ONCE(pset->arc_ghost[i]);
+		if (!(entry & ARC_GHOST_VALID))
+			continue;
+		if ((entry & PCACHE_LINE_MASK) != address)
+			continue;
+
+		/* Lost the race, someone else consumed it */
+		if (cmpxchg(&pset->arc_ghost[i], entry, 0) == entry)
+			return entry;
+	}
+	return 0;
+}
+
+/*
+ * Called after @pcm is allocated from @pset for @address.
+ * @pcm is not visible to eviction yet.
+ */
+void arc_admit_pcache(struct pcache_meta *pcm, struct pcache_set *pset,
+		      unsigned long address)
+{
+	unsigned long ghost;
+	int target;
+
+	ghost = arc_ghost_lookup(pset, address);
+	if (likely(!ghost))
+		return;
+
+	/* Races on target only make adaption a bit less precise */
+	target = READ_ONCE(pset->arc_target);
+	if (ghost & ARC_GHOST_FREQUENT) {
+		if (target > 0)
+			WRITE_ONCE(pset->arc_target, target - 1);
+		inc_pcache_event(PCACHE_ARC_GHOST_HIT_FREQUENT);
+	} else {
+		if (target < PCACHE_ASSOCIATIVITY)
+			WRITE_ONCE(pset->arc_target, target + 1);
+		inc_pcache_event(PCACHE_ARC_GHOST_HIT_RECENT);
+	}
+
+	SetPcacheFrequent(pcm);
+	atomic_inc(&pset->arc_nr_frequent);
+}
+
+/* Replace from the recent segment if it is above its target size */
+static inline bool arc_replace_recent(int nr_recent, int nr_frequent, int target)
+{
+	if (!nr_frequent)
+		return true;
+	if (!nr_recent)
+		return false;
+	return nr_recent >= max(1, target);
+}
+
+/*
+ * The returned pcache is Locked, Reclaim, ref inc'ed 1 by us.
+ * Return ERR_PTR(-EAGAIN) if nothing can be evicted for now.
+ */
+struct pcache_meta *evict_find_line_arc(struct pcache_set *pset,
+					unsigned long way_mask)
+{
+	struct pcache_meta *pcm;
+	struct pcache_rmap *rmap;
+	unsigned int way;
+	int nr_recent, nr_frequent;
+	int nr_scan;
+	bool recent;
+
+	way = READ_ONCE(pset->arc_hand);
+	nr_frequent = atomic_read(&pset->arc_nr_frequent);
+	nr_recent = PCACHE_ASSOCIATIVITY - pset_nr_free(pset) - nr_frequent;
+	recent = arc_replace_recent(nr_recent, nr_frequent,
+				    READ_ONCE(pset->arc_target));
+
+	/*
+	 * Three rounds: promotions may switch us from recent to frequent,
+	 * whose young bits are then cleared by one more round.
+	 */
+	for (nr_scan = 0; nr_scan < 3 * PCACHE_ASSOCIATIVITY;
+	     nr_scan++, way = arc_hand_advance(way)) {
+		int pte_referenced, pte_contention;
+
+		if (!pcache_way_allowed(way_mask, way))
+			continue;
+
+		pcm = pcache_set_way_to_pcache_meta(pset, way);
+
+		/* Free, or being freed */
+		if (!get_pcache_unless_zero(pcm))
+			continue;
+
+		/*
+		 * This means pcache is within common_do_fill_page(),
+		 * before pte and rmap are both setup.
+		 * Do not race with normal pgfault code
+		 */
+		if (unlikely(!PcacheValid(pcm)))
+			goto put_pcache;
+
+		/*
+		 * Leave the other segment's young bits alone. Segment sizes
+		 * are per set, ways of a partition may all be in the other
+		 * segment, so the last round takes whatever it finds.
+		 */
+		if (!!PcacheFrequent(pcm) == recent &&
+		    (!pcache_way_mask_partial(way_mask) ||
+		     nr_scan < 2 * PCACHE_ASSOCIATIVITY))
+			goto put_pcache;
+
+		if (!trylock_pcache(pcm))
+			goto put_pcache;
+
+		if (PcacheWriteback(pcm))
+			goto unlock_pcache;
+
+		/*
+		 * 1 for original allocation
+		 * 1 for get_pcache_unless_zero above
+		 * Otherwise, it is used by others.
+		 */
+		if (unlikely(pcache_ref_count(pcm) > 2))
+			goto unlock_pcache;
+
+		/* pcache can be unmaped just before we lock it */
+		if (unlikely(!pcache_mapped(pcm)))
+			goto unlock_pcache;
+
+		pcache_referenced_trylock(pcm, &pte_referenced, &pte_contention);
+		if (pte_contention)
+			goto unlock_pcache;
+
+		if (pte_referenced) {
+			if (recent) {
+				SetPcacheFrequent(pcm);
+				atomic_inc(&pset->arc_nr_frequent);
+				nr_recent--;
+				nr_frequent++;
+				recent = arc_replace_recent(nr_recent, nr_frequent,
+						READ_ONCE(pset->arc_target));
+				inc_pcache_event(PCACHE_ARC_PROMOTE);
+			} else {
+				inc_pcache_event(PCACHE_ARC_FREQUENT_HIT);
+			}
+			goto unlock_pcache;
+		}
+
+		/*
+		 * Yeah! We have a candidate that is:
+		 * 0) Valid, mapped to user pgtable
+		 * 1) locked by us
+		 * 2) not under writeback
+		 * 3) not used by others
+		 * 4) not referenced since the hand passed by last time
+		 *
+		 * Remember it as a ghost of its segment.
+		 */
+		rmap = pcache_first_rmap(pcm);
+		arc_ghost_insert(pset, rmap->address, !recent);
+		if (recent)
+			inc_pcache_event(PCACHE_ARC_EVICT_RECENT);
+		else
+			inc_pcache_event(PCACHE_ARC_EVICT_FREQUENT);
+
+		SetPcacheReclaim(pcm);
+		WRITE_ONCE(pset->arc_hand, arc_hand_advance(way));
+		return pcm;
+
+unlock_pcache:
+		unlock_pcache(pcm);
+put_pcache:
+		/*
+		 * Someone else put_pcache() in the middle,
+		 * we are the last user and must free it.
+		 */
+		if (put_pcache_testzero(pcm)) {
+			__put_pcache(pcm);
+			WRITE_ONCE(pset->arc_hand, arc_hand_advance(way));
+			return ERR_PTR(-EAGAIN);
+		}
+	}
+
+	WRITE_ONCE(pset->arc_hand, way);
+	return ERR_PTR(-EAGAIN);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+/*
+ * CLOCK (second-chance)
+ *
+ * Ways of a set form the clock face, pset->clock_hand points to the next
+ * way to inspect. The young bit in the PTEs is the reference bit: a line
+ * whose PTEs were accessed gets them cleared and survives this round.
+ * The first unreferenced line is evicted.
+ *
+ * Nothing is maintained in the fill path, no list and no lock.
+ * Concurrent evictions within a set are serialized by trylock_pcache() on
+ * each line, the hand itself is updated racily, which is harmless.
+ */
+
+static inline unsigned int clock_hand_advance(unsigned int way)
+{
+	if (++way == PCACHE_ASSOCIATIVITY)
+		way = 0;
+	return way;
+}
+
+/*
+ * The returned pcache is Locked, Reclaim, ref inc'ed 1 by us.
+ * Return ERR_PTR(-EAGAIN) if nothing can be evicted for now.
+ */
+struct pcache_meta *evict_find_line_clock(struct pcache_set *pset,
+					  unsigned long way_mask)
+{
+	struct pcache_meta *pcm;
+	unsigned int way;
+	int nr_scan;
+
+	way = READ_ONCE(pset->clock_hand);
+
+	/*
+	 * Two full rounds: the first one may only clear young bits,
+	 * the second one finds those lines unreferenced.
+	 */
+	for (nr_scan = 0; nr_scan < 2 * PCACHE_ASSOCIATIVITY;
+	     nr_scan++, way = clock_hand_advance(way)) {
+		int pte_referenced, pte_contention;
+
+		if (!pcache_way_allowed(way_mask, way))
+			continue;
+
+		pcm = pcache_set_way_to_pcache_meta(pset, way);
+		inc_pcache_event(PCACHE_CLOCK_SCANNED);
+
+		/* Free, or being freed */
+		if (!get_pcache_unless_zero(pcm))
+			continue;
+
+		/*
+		 * This means pcache is within common_do_fill_page(),
+		 * before pte and rmap are both setup.
+		 * Do not race with normal pgfault code
+		 */
+		if (unlikely(!PcacheValid(pcm)))
+			goto put_pcache;
+
+		if (!trylock_pcache(pcm))
+			goto put_pcache;
+
+		if (PcacheWriteback(pcm))
+			goto unlock_pcache;
+
+		/*
+		 * 1 for original allocation
+		 * 1 for get_pcache_unless_zero above
+		 * Otherwise, it is used by others.
+		 */
+		if (unlikely(pcache_ref_count(pcm) > 2))
+			goto unlock_pcache;
+
+		/* pcache can be unmaped just before we lock it */
+		if (unlikely(!pcache_mapped(pcm)))
+			goto unlock_pcache;
+
+		/* Second chance: young bits are cleared by this walk */
+		pcache_referenced_trylock(pcm, &pte_referenced, &pte_contention);
+		if (pte_contention || pte_referenced) {
+			inc_pcache_event(PCACHE_CLOCK_SECOND_CHANCE);
+			goto unlock_pcache;
+		}
+
+		/*
+		 * Yeah! We have a candidate that is:
+		 * 0) Valid, mapped to user pgtable
+		 * 1) locked by us
+		 * 2) not under writeback
+		 * 3) not used by others
+		 * 4) not referenced since the hand passed by last time
+		 */
+		SetPcacheReclaim(pcm);
+		WRITE_ONCE(pset->clock_hand, clock_hand_advance(way));
+		return pcm;
+
+unlock_pcache:
+		unlock_pcache(pcm);
+put_pcache:
+		/*
+		 * Someone else put_pcache() in the middle,
+		 * we are the last user and must free it.
+		 */
+		if (put_pcache_testzero(pcm)) {
+			__put_pcache(pcm);
+			WRITE_ONCE(pset->clock_hand, clock_hand_advance(way));
+			return ERR_PTR(-EAGAIN);
+		}
+	}
+
+	WRITE_ONCE(pset->clock_hand, way);
+	return ERR_PTR(-EAGAIN);
+}
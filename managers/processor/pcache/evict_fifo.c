@@ -13,7 +13,8 @@
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
-struct pcache_meta *evict_find_line_fifo(struct pcache_set *pset)
+struct pcache_meta *evict_find_line_fifo(struct pcache_set *pset,
+					unsigned long way_mask)
 {
 	panic("pcache/eviction: FIFO not implemented!");
 	return NULL;
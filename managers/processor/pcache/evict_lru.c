@@ -78,7 +78,8 @@ static inline int lru_get_pcache(struct pcache_meta *pcm)
  * This function is similar to some part of shrink_page_list(). 
  * The returned pcache is Locked, Reclaim, ref inc'ed 1 by us.
  */
-struct pcache_meta *evict_find_line_lru(struct pcache_set *pset)
+struct pcache_meta *evict_find_line_lru(struct pcache_set *pset,
+					unsigned long way_mask)
 {
 	struct pcache_meta *pcm;
 	bool found = false;
@@ -94,6 +95,10 @@ struct pcache_meta *evict_find_line_lru(struct pcache_set *pset)
 	list_for_each_entry_reverse(pcm, &pset->lru_list, lru) {
 		PCACHE_BUG_ON_PCM(PcacheReclaim(pcm), pcm);
 
+		/* Belongs to ways of another partition */
+		if (!pcache_way_allowed(way_mask, pcache_meta_to_way(pcm)))
+			continue;
+
 		/*
 		 * Someone else freed at the same time
 		 * Counter is updated within lru_lock, but we are holding it.
@@ -320,6 +325,9 @@ void kevict_sweepd_lru(void)
 			PROFILE_LEAVE(evict_lru_sweep_set);
 			__ClearPsetSweeping(pset);
 
+			/* Out of lru_lock, unpin what lazy fork held back */
+			lazy_fork_resolve_pinned();
+
 			inc_pcache_event(PCACHE_SWEEP_NR_PSET);
 		}
 		PROFILE_LEAVE(evict_lru_sweep);
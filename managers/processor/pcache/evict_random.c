@@ -22,12 +22,16 @@
  * Don't use this.
  */
 
-struct pcache_meta *evict_find_line_random(struct pcache_set *pset)
+struct pcache_meta *evict_find_line_random(struct pcache_set *pset,
+					   unsigned long way_mask)
 {
 	struct pcache_meta *pcm;
 	int way;
 
 	pcache_for_each_way_set(pcm, pset, way) {
+		if (!pcache_way_allowed(way_mask, way))
+			continue;
+
 		/*
 		 * Still under alloc setup, or
 		 * freed by someone else before this checking
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Extent fill
+ *
+ * The first miss within a PCACHE_EXTENT_SIZE aligned extent whose pmd has
+ * never been populated fetches the whole extent with one
+ * P2M_PCACHE_MISS_EXTENT. Memory only accepts extents that are entirely
+ * within one private anonymous vma, others fall back to normal misses.
+ *
+ * This only batches the fill. Lines are still PCACHE_LINE_SIZE and mapped
+ * by ptes, there are no pmd mapped huge lines. Each line is allocated from
+ * its own set without eviction, so the lines nobody asked for yet never
+ * push out lines that were actually used. The faulting line is mapped
+ * young, the rest are mapped old and put at LRU tail like prefetched ones.
+ *
+ * Same as prefetch, pte lock is not held across network. A line is not
+ * mapped if its pte is no longer empty, it is being evicted, or any
+ * eviction started in its set while we were on network.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/bitmap.h>
+#include <lego/profile.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
+#include <processor/pcache.h>
+#include <processor/distvm.h>
+#include <processor/processor.h>
+
+/*
+ * Each in-flight extent fill holds one PCACHE_EXTENT_SIZE buffer.
+ * Faults that find all of them busy take the normal path.
+ */
+#define NR_EXTENT_FILL_BUFFERS		(4)
+
+static void *extent_fill_buffers[NR_EXTENT_FILL_BUFFERS];
+static int extent_fill_evict_seq[NR_EXTENT_FILL_BUFFERS][PCACHE_EXTENT_NR_LINES];
+static unsigned long extent_fill_busy;
+
+static int get_extent_fill_buffer(void)
+{
+	int i;
+
+	for (i = 0; i < NR_EXTENT_FILL_BUFFERS; i++) {
+		if (!test_and_set_bit(i, &extent_fill_busy))
+			return i;
+	}
+	return -1;
+}
+
+static void put_extent_fill_buffer(int i)
+{
+	smp_mb__before_atomic();
+	clear_bit(i, &extent_fill_busy);
+}
+
+DEFINE_PROFILE_POINT(pcache_extent_fill_net)
+
+/**
+ * pcache_extent_fill
+ * @mm: address space in question
+ * @address: the missing user virtual address
+ * @pmd: the pmd covering @address, its pte table has just been allocated
+ * @flags: how the page fault happens
+ *
+ * Fetch the extent @address belongs to and map as many of its lines
+ * as possible. Return 0 if the line of @address itself is mapped,
+ * otherwise the caller should handle this miss as usual.
+ */
+int pcache_extent_fill(struct mm_struct *mm, unsigned long address,
+		       pmd_t *pmd, unsigned long flags)
+{
+	struct p2m_pcache_miss_extent_msg msg;
+	DECLARE_BITMAP(skip, PCACHE_EXTENT_NR_LINES);
+	unsigned long start, addr;
+	int *evict_seq;
+	void *data;
+	int i, idx, len, ret = -EEXIST;
+	int nr_mapped = 0;
+	PROFILE_POINT_TIME(pcache_extent_fill_net)
+
+	start = address & PCACHE_EXTENT_MASK;
+	if (unlikely(start + PCACHE_EXTENT_SIZE > TASK_SIZE))
+		return -EINVAL;
+
+	idx = get_extent_fill_buffer();
+	if (idx < 0) {
+		inc_pcache_event(PCACHE_EXTENT_FILL_BUSY);
+		return -EBUSY;
+	}
+	data = extent_fill_buffers[idx];
+	evict_seq = extent_fill_evict_seq[idx];
+
+	pcache_fill_snapshot(start, PCACHE_EXTENT_NR_LINES, evict_seq, skip);
+
+	fill_common_header(&msg, P2M_PCACHE_MISS_EXTENT);
+	msg.pid = current->pid;
+	msg.tgid = current->tgid;
+	msg.flags = FAULT_FLAG_SPECULATIVE;
+	msg.start = start;
+
+	PROFILE_START(pcache_extent_fill_net);
+	len = ibapi_send_reply_timeout(get_memory_node(current, start),
+				       &msg, sizeof(msg), data, PCACHE_EXTENT_SIZE,
+				       false, DEF_NET_TIMEOUT);
+	PROFILE_LEAVE(pcache_extent_fill_net);
+
+	/* Not an anonymous extent, or network error */
+	if (unlikely(len != PCACHE_EXTENT_SIZE)) {
+		inc_pcache_event(PCACHE_EXTENT_FILL_REJECTED);
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < PCACHE_EXTENT_NR_LINES; i++) {
+		enum rmap_caller caller;
+		bool faulting;
+
+		if (test_bit(i, skip))
+			continue;
+
+		addr = start + i * PCACHE_LINE_SIZE;
+		faulting = addr == (address & PCACHE_LINE_MASK);
+		caller = faulting ? RMAP_FILL_PAGE_REMOTE : RMAP_EXTENT_FILL;
+		if (pcache_fill_install_copy(mm, pmd, addr,
+					     data + i * PCACHE_LINE_SIZE,
+					     caller, evict_seq[i], faulting))
+			continue;
+
+		nr_mapped++;
+		if (faulting)
+			ret = 0;
+	}
+
+	inc_pcache_event(PCACHE_EXTENT_FILL);
+	mod_pcache_event(PCACHE_EXTENT_FILL_LINES, nr_mapped);
+	mod_pcache_event(PCACHE_EXTENT_FILL_SKIPPED,
+			 PCACHE_EXTENT_NR_LINES - nr_mapped);
+out:
+	put_extent_fill_buffer(idx);
+	return ret;
+}
+
+void __init pcache_extent_fill_post_init(void)
+{
+	int i;
+
+	BUILD_BUG_ON(NR_EXTENT_FILL_BUFFERS > BITS_PER_LONG);
+
+	for (i = 0; i < NR_EXTENT_FILL_BUFFERS; i++) {
+		extent_fill_buffers[i] = kmalloc(PCACHE_EXTENT_SIZE, GFP_KERNEL);
+		if (!extent_fill_buffers[i])
+			panic("Fail to allocate pcache extent fill buffer!");
+	}
+}
@@ -81,7 +81,7 @@ static void print_bad_pte(struct mm_struct *mm, unsigned long addr, pte_t pte,
 static void piggyback_fallback(struct pcache_meta *pcm)
 {
 	struct pcache_set *pset;
-	struct piggyback_info *pb = &pcm->pb;
+	struct piggyback_info *pb = pcache_meta_to_piggyback(pcm);
 	void *va_cache = pcache_meta_to_kva(pcm);
 
 	__clflush_one(pb->tgid, pb->user_addr, pb->memory_nid,
@@ -114,7 +114,7 @@ int common_do_fill_page(struct mm_struct *mm, unsigned long address,
 	pte_t entry;
 	int ret;
 
-	pcm = pcache_alloc(address, piggyback);
+	pcm = pcache_alloc(mm, address, piggyback);
 	if (unlikely(!pcm))
 		return VM_FAULT_OOM;
 
@@ -207,7 +207,8 @@ __pcache_do_fill_page(unsigned long address, unsigned long flags,
 	 */
 	if (PcachePiggyback(pcm)) {
 		struct p2m_pcache_miss_flush_combine_msg *pb_msg;
-		struct piggyback_info *pb = &pcm->pb;
+		struct piggyback_info *pb = pcache_meta_to_piggyback(pcm);
+		struct fit_sglist sglist[2];
 
 		/*
 		 * Okay. Flush and miss belong to different nodes.
@@ -243,11 +244,21 @@ __pcache_do_fill_page(unsigned long address, unsigned long flags,
 		/* The piggyback flush part */
 		pb_msg->flush.pid = pb->tgid;
 		pb_msg->flush.user_va = pb->user_addr;
-		memcpy(pb_msg->flush.pcacheline, va_cache, PCACHE_LINE_SIZE);
 		smp_wmb();
 
+		/*
+		 * The dirty line is sent in place, right after the headers.
+		 * The reply lands in the same line, which is fine: memory
+		 * only replies after it received the whole message.
+		 */
+		sglist[0].addr = pb_msg;
+		sglist[0].len = offsetof(struct p2m_pcache_miss_flush_combine_msg,
+					 flush.pcacheline);
+		sglist[1].addr = va_cache;
+		sglist[1].len = PCACHE_LINE_SIZE;
+
 		PROFILE_START(__pcache_fill_remote_piggyback_net);
-		len = ibapi_send_reply_timeout(dst_nid, pb_msg, sizeof(*pb_msg),
+		len = ibapi_send_reply_sge_timeout(dst_nid, sglist, 2,
 					       va_cache, PCACHE_LINE_SIZE, false,
 					       DEF_NET_TIMEOUT);
 		PROFILE_LEAVE(__pcache_fill_remote_piggyback_net);
@@ -307,6 +318,107 @@ out:
 	return ret;
 }
 
+/*
+ * Credits last advertised by each memory node. They are only trusted
+ * for a short while, so that a node which is no longer asked for
+ * anything speculative can not stay congested forever.
+ */
+#define PCACHE_CREDITS_TTL	(msecs_to_jiffies(10))
+
+struct memory_node_credits {
+	unsigned int		credits;
+	unsigned long		updated;
+} ____cacheline_aligned;
+
+static struct memory_node_credits memory_credits[CONFIG_FIT_NR_NODES] = {
+	[0 ... CONFIG_FIT_NR_NODES - 1] = {
+		.credits = UINT_MAX,
+	},
+};
+
+void pcache_update_memory_credits(unsigned int nid, unsigned int credits)
+{
+	if (unlikely(nid >= CONFIG_FIT_NR_NODES))
+		return;
+
+	WRITE_ONCE(memory_credits[nid].credits, credits);
+	WRITE_ONCE(memory_credits[nid].updated, jiffies);
+}
+
+bool pcache_memory_node_congested(unsigned int nid)
+{
+	struct memory_node_credits *c;
+
+	if (unlikely(nid >= CONFIG_FIT_NR_NODES))
+		return false;
+
+	c = &memory_credits[nid];
+	if (READ_ONCE(c->credits) >= P2M_CREDITS_LOW)
+		return false;
+	return time_before(jiffies, READ_ONCE(c->updated) + PCACHE_CREDITS_TTL);
+}
+
+DEFINE_PROFILE_POINT(__pcache_fill_remote_batch_net)
+
+/**
+ * pcache_fill_remote_batch
+ * @b: lines to fetch, see struct pcache_miss_batch
+ * @reply_buf: at least P2M_PCACHE_MISS_BATCH_REPLY_SIZE(@b->nr) bytes
+ *
+ * Fetch multiple lines from one memory node with one round-trip.
+ * This only moves data into @b->dst, callers are responsible for
+ * allocating the pcache lines and establishing the mappings.
+ *
+ * Return 0 if the request went through, @b->retval[i] tells if the
+ * i-th line is filled. Otherwise the whole batch failed.
+ */
+int pcache_fill_remote_batch(struct pcache_miss_batch *b, void *reply_buf)
+{
+	struct p2m_pcache_miss_batch_msg msg;
+	struct p2m_pcache_miss_batch_reply *reply = reply_buf;
+	int i, len, reply_len, nr_filled = 0;
+	PROFILE_POINT_TIME(__pcache_fill_remote_batch_net)
+
+	if (WARN_ON_ONCE(b->nr <= 0 || b->nr > PCACHE_MISS_BATCH_MAX))
+		return -EINVAL;
+
+	fill_common_header(&msg, P2M_PCACHE_MISS_BATCH);
+	msg.pid = b->pid;
+	msg.tgid = b->tgid;
+	msg.flags = b->flags;
+	msg.nr_lines = b->nr;
+	for (i = 0; i < b->nr; i++)
+		msg.missing_vaddr[i] = b->address[i];
+
+	reply_len = P2M_PCACHE_MISS_BATCH_REPLY_SIZE(b->nr);
+
+	PROFILE_START(__pcache_fill_remote_batch_net);
+	len = ibapi_send_reply_timeout(b->memory_nid, &msg, sizeof(msg),
+				       reply, reply_len, false, DEF_NET_TIMEOUT);
+	PROFILE_LEAVE(__pcache_fill_remote_batch_net);
+
+	if (unlikely(len < reply_len)) {
+		/* remote reported error, or network error */
+		if (len < 0)
+			return len;
+		return -EFAULT;
+	}
+
+	pcache_update_memory_credits(b->memory_nid, reply->credits);
+	for (i = 0; i < b->nr; i++) {
+		b->retval[i] = reply->retval[i];
+		if (likely(!b->retval[i])) {
+			memcpy(b->dst[i], reply->data + i * PCACHE_LINE_SIZE,
+			       PCACHE_LINE_SIZE);
+			nr_filled++;
+		}
+	}
+
+	inc_pcache_event(PCACHE_FILL_BATCH);
+	mod_pcache_event(PCACHE_FILL_BATCH_LINES, nr_filled);
+	return 0;
+}
+
 /*
  * This function handles normal cache line misses.
  * We enter with pte unlocked, we return with pte unlocked.
@@ -315,6 +427,21 @@ static inline int
 pcache_do_fill_page(struct mm_struct *mm, unsigned long address,
 		    pte_t *page_table, pte_t orig_pte, pmd_t *pmd, unsigned long flags)
 {
+	/*
+	 * Feed the stride detector before going to network,
+	 * so that prefetch overlaps with this synchronous fill.
+	 */
+	pcache_prefetch_miss(mm, address);
+
+	/* Text and read-only data, fetch the whole window at once */
+	if (pcache_fault_around_candidate(mm, address, flags)) {
+		int ret;
+
+		ret = pcache_fault_around(mm, address, page_table, orig_pte, pmd, flags);
+		if (ret != -EBUSY)
+			return ret;
+	}
+
 	return common_do_fill_page(mm, address, page_table, orig_pte, pmd, flags,
 			__pcache_do_fill_page, NULL, RMAP_FILL_PAGE_REMOTE,
 			ENABLE_PIGGYBACK);
@@ -480,7 +607,7 @@ static int pcache_do_wp_page(struct mm_struct *mm, unsigned long address,
 		struct pcache_meta *new_pcm;
 		pte_t entry;
 
-		new_pcm = pcache_alloc(address, DISABLE_PIGGYBACK);
+		new_pcm = pcache_alloc_ptl(mm, address);
 		if (!new_pcm) {
 			ret = VM_FAULT_OOM;
 			goto unlock_all;
@@ -546,13 +673,10 @@ static int pcache_handle_pte_fault(struct mm_struct *mm, unsigned long address,
 #ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
 			/*
 			 * Check per-set's current eviction list.
-			 * Wait until cache line is fully flushed
+			 * Sleep until cache line is fully flushed
 			 * back to memory.
 			 */
-			while (pset_find_eviction(address, current)) {
-				cpu_relax();
-				inc_pcache_event(PCACHE_PSET_LIST_LOOKUP);
-			}
+			pset_wait_eviction(address, current);
 #elif defined(CONFIG_PCACHE_EVICTION_VICTIM)
 			/*
 			 * Check victim cache
@@ -562,10 +686,19 @@ static int pcache_handle_pte_fault(struct mm_struct *mm, unsigned long address,
 					return 0;
 			}
 #endif
+			/*
+			 * Check compressed tier
+			 */
+			if (pcache_ctier_may_hit()) {
+				if (!pcache_ctier_try_fill(mm, address, pte, entry, pmd, flags))
+					return 0;
+			}
+
 			/*
 			 * write-protect
 			 * per-set eviction list (flush finished)
 			 * victim cache (miss)
+			 * compressed tier (miss)
 			 *
 			 * All of them fall-back and merge into this:
 			 */
@@ -631,6 +764,7 @@ int pcache_handle_fault(struct mm_struct *mm,
 	pud_t *pud;
 	pmd_t *pmd;
 	pte_t *pte;
+	bool extent;
 
 	pgd = pgd_offset(mm, address);
 	pud = pud_alloc(mm, pgd, address);
@@ -639,6 +773,13 @@ int pcache_handle_fault(struct mm_struct *mm,
 	pmd = pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
+
+	/* Copy pending ptes, or make a write-protected pmd writable */
+	lazy_fork_handle_fault(mm, pmd, address);
+
+	/* Nothing of this extent is cached, try to fetch all of it */
+	extent = pcache_extent_fill_candidate(pmd, flags);
+
 	pte = pte_alloc(mm, pmd, address);
 	if (!pte)
 		return VM_FAULT_OOM;
@@ -646,5 +787,8 @@ int pcache_handle_fault(struct mm_struct *mm,
 	inc_pcache_event(PCACHE_FAULT);
 	inc_pcache_event_cond(PCACHE_FAULT_CODE, !!(flags & FAULT_FLAG_INSTRUCTION));
 
+	if (extent && !pcache_extent_fill(mm, address, pmd, flags))
+		return 0;
+
 	return pcache_handle_pte_fault(mm, address, pte, pmd, flags);
 }
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Fault-around
+ *
+ * A read or instruction fetch miss asks memory for the aligned window of
+ * lines around it with one P2M_PCACHE_MISS_AROUND. Memory only returns the
+ * extra lines if the vma is read-only or executable, such as text and
+ * read-only data, whose cold start is otherwise a chain of serial misses.
+ *
+ * The missing line is filled the normal way. Extra lines are allocated
+ * without eviction, mapped old and put at LRU tail, so the unused ones are
+ * the first to go. Same as prefetch, they are only mapped if the pte is
+ * still empty and no eviction started in their set while we were on network.
+ *
+ * Memory also tells us about vmas that refuse fault-around, plain reads
+ * within them take the normal path afterwards.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/bitmap.h>
+#include <lego/profile.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
+#include <processor/pcache.h>
+#include <processor/distvm.h>
+#include <processor/processor.h>
+
+#define FAULT_AROUND_NR_LINES		(1 << CONFIG_PCACHE_FAULT_AROUND_SHIFT)
+#define FAULT_AROUND_SIZE		(FAULT_AROUND_NR_LINES * PCACHE_LINE_SIZE)
+#define FAULT_AROUND_MASK		(~(FAULT_AROUND_SIZE - 1))
+
+/*
+ * Each in-flight fault-around holds one reply buffer.
+ * Faults that find all of them busy take the normal path.
+ */
+#define NR_FAULT_AROUND_BUFFERS		(8)
+
+static void *fault_around_buffers[NR_FAULT_AROUND_BUFFERS];
+static unsigned long fault_around_busy;
+
+static int get_fault_around_buffer(void)
+{
+	int i;
+
+	for (i = 0; i < NR_FAULT_AROUND_BUFFERS; i++) {
+		if (!test_and_set_bit(i, &fault_around_busy))
+			return i;
+	}
+	return -1;
+}
+
+static void put_fault_around_buffer(int i)
+{
+	smp_mb__before_atomic();
+	clear_bit(i, &fault_around_busy);
+}
+
+void pcache_fault_around_mm_init(struct mm_struct *mm)
+{
+	struct pcache_fault_around_info *info = &mm->pcache_fault_around;
+
+	memset(info->refused, 0, sizeof(info->refused));
+	spin_lock_init(&info->lock);
+	info->next_replace = 0;
+}
+
+bool pcache_fault_around_refused(struct mm_struct *mm, unsigned long address)
+{
+	struct pcache_fault_around_info *info = &mm->pcache_fault_around;
+	struct pcache_fault_around_range *r;
+	bool ret = false;
+	int i;
+
+	spin_lock(&info->lock);
+	for (i = 0; i < NR_PCACHE_FAULT_AROUND_REFUSED; i++) {
+		r = &info->refused[i];
+		if (r->start <= address && address < r->end) {
+			ret = true;
+			break;
+		}
+	}
+	spin_unlock(&info->lock);
+	return ret;
+}
+
+/*
+ * Remember [@start, @end) refused fault-around.
+ * An overlapping record is updated in place, since the vma may have
+ * grown, otherwise the oldest record is replaced.
+ */
+static void fault_around_refuse(struct mm_struct *mm, unsigned long start,
+				unsigned long end)
+{
+	struct pcache_fault_around_info *info = &mm->pcache_fault_around;
+	struct pcache_fault_around_range *r = NULL;
+	int i;
+
+	spin_lock(&info->lock);
+	for (i = 0; i < NR_PCACHE_FAULT_AROUND_REFUSED; i++) {
+		if (info->refused[i].start < end && start < info->refused[i].end) {
+			r = &info->refused[i];
+			break;
+		}
+	}
+
+	if (!r) {
+		r = &info->refused[info->next_replace];
+		info->next_replace = (info->next_replace + 1) %
+				     NR_PCACHE_FAULT_AROUND_REFUSED;
+	}
+	r->start = start;
+	r->end = end;
+	spin_unlock(&info->lock);
+}
+
+/*
+ * @window: the aligned window the missing line belongs to
+ * @evict_seq: snapshots of each line's pset eviction sequence
+ * @skip: lines that had pending eviction before going to network
+ * @filled: the missing line is filled, @reply is valid
+ */
+struct fault_around_control {
+	struct p2m_pcache_miss_around_reply	*reply;
+	unsigned long				window;
+	int					evict_seq[FAULT_AROUND_NR_LINES];
+	DECLARE_BITMAP(skip, FAULT_AROUND_NR_LINES);
+	bool					filled;
+};
+
+DEFINE_PROFILE_POINT(__pcache_fill_around_net)
+
+/*
+ * Callback for common fill code, with pte lock held.
+ * Fill the missing line from the reply, keep the rest for later.
+ */
+static int __pcache_do_fill_around(unsigned long address, unsigned long flags,
+				   struct pcache_meta *pcm, void *arg)
+{
+	struct fault_around_control *fac = arg;
+	struct p2m_pcache_miss_around_reply *reply = fac->reply;
+	struct p2m_pcache_miss_around_msg msg;
+	struct pcache_set *pset;
+	unsigned long line = address & PCACHE_LINE_MASK;
+	int len;
+	PROFILE_POINT_TIME(__pcache_fill_around_net)
+
+	pset = pcache_meta_to_pcache_set(pcm);
+	inc_pset_event(pset, PSET_FILL_MEMORY);
+	inc_pcache_event(PCACHE_FAULT_FILL_FROM_MEMORY);
+
+	fill_common_header(&msg, P2M_PCACHE_MISS_AROUND);
+	msg.pid = current->pid;
+	msg.tgid = current->tgid;
+	msg.flags = flags;
+	msg.nr_lines = FAULT_AROUND_NR_LINES;
+	msg.missing_vaddr = address;
+
+	PROFILE_START(__pcache_fill_around_net);
+	len = ibapi_send_reply_timeout(get_memory_node(current, address),
+				       &msg, sizeof(msg), reply,
+				       P2M_PCACHE_MISS_AROUND_REPLY_SIZE(FAULT_AROUND_NR_LINES),
+				       false, DEF_NET_TIMEOUT);
+	PROFILE_LEAVE(__pcache_fill_around_net);
+
+	if (unlikely(len < (int)P2M_PCACHE_MISS_AROUND_REPLY_SIZE(1))) {
+		/* remote reported error, or network error */
+		if (len < 0) {
+			WARN_ON_ONCE(1);
+			return len;
+		}
+		return -EFAULT;
+	}
+
+	if (unlikely(!reply->nr_lines || reply->nr_lines > FAULT_AROUND_NR_LINES ||
+		     len < (int)P2M_PCACHE_MISS_AROUND_REPLY_SIZE(reply->nr_lines) ||
+		     reply->start < fac->window ||
+		     reply->start > line ||
+		     reply->start + reply->nr_lines * PCACHE_LINE_SIZE <= line ||
+		     reply->start + reply->nr_lines * PCACHE_LINE_SIZE >
+				fac->window + FAULT_AROUND_SIZE)) {
+		WARN(1, "Invalid fault-around reply: %d %#Lx %u\n",
+			len, reply->start, reply->nr_lines);
+		return -EFAULT;
+	}
+
+	memcpy(pcache_meta_to_kva(pcm), reply->data + (line - reply->start),
+	       PCACHE_LINE_SIZE);
+	fac->filled = true;
+	return 0;
+}
+
+/* The missing line is mapped, now map the others */
+static void fault_around_map(struct mm_struct *mm, pmd_t *pmd,
+			     unsigned long address,
+			     struct fault_around_control *fac)
+{
+	struct p2m_pcache_miss_around_reply *reply = fac->reply;
+	unsigned long addr, line = address & PCACHE_LINE_MASK;
+	int i, idx, nr_mapped = 0;
+
+	if (!reply->around) {
+		fault_around_refuse(mm, reply->vm_start, reply->vm_end);
+		inc_pcache_event(PCACHE_FAULT_AROUND_REFUSED);
+		return;
+	}
+
+	for (i = 0; i < reply->nr_lines; i++) {
+		addr = reply->start + i * PCACHE_LINE_SIZE;
+		idx = (addr - fac->window) / PCACHE_LINE_SIZE;
+		if (addr == line || test_bit(idx, fac->skip))
+			continue;
+
+		if (!pcache_fill_install_copy(mm, pmd, addr,
+					      reply->data + i * PCACHE_LINE_SIZE,
+					      RMAP_FAULT_AROUND,
+					      fac->evict_seq[idx], false))
+			nr_mapped++;
+	}
+
+	inc_pcache_event(PCACHE_FAULT_AROUND);
+	mod_pcache_event(PCACHE_FAULT_AROUND_LINES, nr_mapped);
+	mod_pcache_event(PCACHE_FAULT_AROUND_SKIPPED,
+			 reply->nr_lines - 1 - nr_mapped);
+}
+
+/**
+ * pcache_fault_around
+ * @mm: address space in question
+ * @address: the missing user virtual address
+ * @page_table: pte of @address, which was empty
+ * @orig_pte: the empty pte we saw
+ * @pmd: the pmd covering @address
+ * @flags: how the page fault happens
+ *
+ * Handle a miss that goes to remote memory, and map the lines around it
+ * if memory returns them. Return -EBUSY if nothing was done and the caller
+ * should handle this miss as usual, otherwise same as common_do_fill_page().
+ */
+int pcache_fault_around(struct mm_struct *mm, unsigned long address,
+			pte_t *page_table, pte_t orig_pte, pmd_t *pmd,
+			unsigned long flags)
+{
+	struct fault_around_control fac;
+	int idx, ret;
+
+	idx = get_fault_around_buffer();
+	if (idx < 0) {
+		inc_pcache_event(PCACHE_FAULT_AROUND_BUSY);
+		return -EBUSY;
+	}
+	fac.reply = fault_around_buffers[idx];
+	fac.window = address & FAULT_AROUND_MASK;
+	fac.filled = false;
+
+	pcache_fill_snapshot(fac.window, FAULT_AROUND_NR_LINES,
+			     fac.evict_seq, fac.skip);
+
+	ret = common_do_fill_page(mm, address, page_table, orig_pte, pmd, flags,
+			__pcache_do_fill_around, &fac, RMAP_FILL_PAGE_REMOTE,
+			DISABLE_PIGGYBACK);
+
+	/* Someone else may have filled it, then there is no reply */
+	if (!ret && fac.filled)
+		fault_around_map(mm, pmd, address, &fac);
+
+	put_fault_around_buffer(idx);
+	return ret;
+}
+
+void __init pcache_fault_around_post_init(void)
+{
+	int i;
+
+	BUILD_BUG_ON(NR_FAULT_AROUND_BUFFERS > BITS_PER_LONG);
+	BUILD_BUG_ON(FAULT_AROUND_NR_LINES > PCACHE_FAULT_AROUND_MAX);
+
+	for (i = 0; i < NR_FAULT_AROUND_BUFFERS; i++) {
+		fault_around_buffers[i] =
+			kmalloc(P2M_PCACHE_MISS_AROUND_REPLY_SIZE(FAULT_AROUND_NR_LINES),
+				GFP_KERNEL);
+		if (!fault_around_buffers[i])
+			panic("Fail to allocate pcache fault-around buffer!");
+	}
+}
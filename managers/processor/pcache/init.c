@@ -76,7 +76,6 @@ static void __init alloc_pcache_set_map(void)
 }
 
 void __init init_pcache_clflush_buffer(void);
-void __init alloc_pcache_rmap_map(void);
 
 /*
  * Early init is called before buddy allocator initialization.
@@ -93,6 +92,7 @@ void __init pcache_early_init(void)
 	if (pcache_registered_start == 0 || pcache_registered_size == 0)
 		panic("Processor cache not registered, memmap $ needed!");
 
+	BUILD_BUG_ON_NOT_POWER_OF_2(PAGE_SIZE / PCACHE_META_SIZE);
 	nr_cachelines_per_page = PAGE_SIZE / PCACHE_META_SIZE;
 	unit_size = nr_cachelines_per_page * PCACHE_LINE_SIZE;
 	unit_size += PAGE_SIZE;
@@ -141,22 +141,18 @@ void __init pcache_early_init(void)
 
 	/* Early allocation that needs memblock */
 	alloc_pcache_set_map();
-	alloc_pcache_rmap_map();
 	alloc_pcache_perset_map();
 	victim_cache_early_init();
+	pcache_ctier_early_init();
 }
 
-static void __init init_pcache_set_free_list(void)
+static void __init init_pcache_set_free_map(void)
 {
 	struct pcache_set *pset;
-	struct pcache_meta *pcm;
-	int setidx, way;
+	int setidx;
 
-	pcache_for_each_set(pset, setidx) {
-		pcache_for_each_way_set(pcm, pset, way) {
-			list_add_tail(&pcm->free_list, &pset->free_head);
-		}
-	}
+	pcache_for_each_set(pset, setidx)
+		bitmap_fill(pset->free_map, PCACHE_ASSOCIATIVITY);
 }
 
 /* Init pcache_set array */
@@ -166,15 +162,22 @@ static void __init init_pcache_set_map(void)
 	int setidx, j;
 
 	pcache_for_each_set(pset, setidx) {
-		/* Head of free pcache line */
-		INIT_LIST_HEAD(&pset->free_head);
-		spin_lock_init(&pset->free_lock);
+		/* Free pcache lines, filled later */
+		bitmap_zero(pset->free_map, PCACHE_ASSOCIATIVITY);
 
 		/* Eviction Algorithm Specific */
 #ifdef CONFIG_PCACHE_EVICT_LRU
 		INIT_LIST_HEAD(&pset->lru_list);
 		spin_lock_init(&pset->lru_lock);
 		atomic_set(&pset->nr_lru, 0);
+#elif defined(CONFIG_PCACHE_EVICT_CLOCK)
+		pset->clock_hand = 0;
+#elif defined(CONFIG_PCACHE_EVICT_ARC)
+		pset->arc_hand = 0;
+		pset->arc_target = 0;
+		atomic_set(&pset->arc_nr_frequent, 0);
+		atomic_set(&pset->arc_ghost_head, 0);
+		memset(pset->arc_ghost, 0, sizeof(pset->arc_ghost));
 #endif
 
 		/* Eviction Mechanism Specific */
@@ -183,7 +186,18 @@ static void __init init_pcache_set_map(void)
 #elif defined(CONFIG_PCACHE_EVICTION_PERSET_LIST)
 		INIT_LIST_HEAD(&pset->eviction_list);
 		spin_lock_init(&pset->eviction_list_lock);
-		atomic_set(&pset->nr_eviction_entries, 0);
+		init_waitqueue_head(&pset->eviction_wait);
+		for (j = 0; j < PSET_EVICTION_FILTER_SIZE; j++)
+			atomic_set(&pset->eviction_filter[j], 0);
+#endif
+
+#ifdef CONFIG_PCACHE_PREFETCH
+		atomic_set(&pset->evict_seq, 0);
+#endif
+
+#ifdef CONFIG_PCACHE_RECLAIMD
+		atomic_set(&pset->reclaim_pressure, 0);
+		atomic_set(&pset->reclaim_queued, 0);
 #endif
 
 		for (j = 0; j < NR_PSET_STAT_ITEMS; j++)
@@ -199,8 +213,8 @@ static void __init init_pcache_meta_map(void)
 
 	pcache_for_each_way(pcm, nr) {
 		pcm->bits = 0;
-		INIT_LIST_HEAD(&pcm->free_list);
 		INIT_LIST_HEAD(&pcm->rmap);
+		pcm->rmap_inline.flags = 0;
 		pcache_mapcount_reset(pcm);
 		pcache_ref_count_set(pcm, 0);
 		init_pcache_lru(pcm);
@@ -241,22 +255,42 @@ void __init pcache_post_init(void)
 
 	/*
 	 * Init our most important data structures
-	 * and free all pcache lines into their set free list
+	 * and free all pcache lines into their set free map
 	 */
 	init_pcache_meta_map();
 	init_pcache_set_map();
-	init_pcache_set_free_list();
+	init_pcache_set_free_map();
 
 	init_pcache_clflush_buffer();
 
 	/* Create victim_flush thread if configured */
 	victim_cache_post_init();
 
+	/* Create prefetch thread if configured */
+	pcache_prefetch_post_init();
+
+	/* Allocate extent fill buffers if configured */
+	pcache_extent_fill_post_init();
+
+	/* Allocate fault-around buffers if configured */
+	pcache_fault_around_post_init();
+
+	/* Allocate compression buffers if configured */
+	pcache_ctier_post_init();
+
+	/* Open all ways to all partitions if configured */
+	pcache_partition_init();
+
 	/* Create sweep threads if configured */
 	ret = evict_sweep_init();
 	if (ret)
 		panic("Pcache: fail to create evict sweep threads!");
 
+	/* Create background reclaim thread if configured */
+	ret = pcache_reclaimd_init();
+	if (ret)
+		panic("Pcache: fail to create reclaim thread!");
+
 	pcache_print_info();
 }
 
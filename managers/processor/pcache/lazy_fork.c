@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Lazy fork
+ *
+ * fork() does not copy the emulated pgtable of private mappings. Instead,
+ * each populated pmd of the parent is write-protected, and the part of each
+ * VMA within it is remembered as a pending range of the child. A pending
+ * range is copied with pcache_copy_page_range(), exactly as an eager fork
+ * would have done, the first time that:
+ *  - the child faults within the pmd,
+ *  - the parent faults within the pmd (the write-protected pmd makes sure
+ *    the parent can not change the content the child is going to see),
+ *  - either side munmaps or mremaps it,
+ *  - the parent exits.
+ * A child that exits or execs just drops its pending ranges.
+ *
+ * Eviction may still unmap clean lines of a write-protected pmd, the child
+ * will fetch the same content from its own memory. Dirty ones are skipped
+ * by pcache_referenced_trylock(), they have no child rmap to flush to.
+ * Once it has unlocked its lines, the eviction resolves the pmd of one it
+ * skipped, so that a set full of them can still be evicted.
+ *
+ * The lazy forks of our children are protected by our pcache_lazy_fork.lock.
+ * A child pins our mm_struct, so it can always take the lock of its parent.
+ * The copy itself runs without the lock, with the range marked COPYING,
+ * others sleep on the parent's pcache_lazy_fork.wait until it is DONE.
+ * A lazy fork is freed once all its ranges are DONE, nobody else can be
+ * copying it at that point.
+ */
+
+#include <lego/mm.h>
+#include <lego/slab.h>
+#include <lego/sched.h>
+#include <lego/kernel.h>
+#include <lego/percpu.h>
+#include <lego/spinlock.h>
+#include <processor/pcache.h>
+#include <processor/pgtable.h>
+#include <processor/processor.h>
+
+#include <asm/tlbflush.h>
+
+void lazy_fork_mm_init(struct mm_struct *mm)
+{
+	struct pcache_lazy_fork_info *info = &mm->pcache_lazy_fork;
+
+	spin_lock_init(&info->lock);
+	init_waitqueue_head(&info->wait);
+	INIT_LIST_HEAD(&info->children);
+	info->parent = NULL;
+	info->lf = NULL;
+}
+
+void lazy_fork_mm_free(struct mm_struct *mm)
+{
+	if (mm->pcache_lazy_fork.parent)
+		mmdrop(mm->pcache_lazy_fork.parent);
+}
+
+typedef void (*lazy_fork_pmd_fn)(pmd_t *pmd, unsigned long addr,
+				 unsigned long end, void *arg);
+
+/* Call @fn for each populated pmd within [@addr, @end) */
+static void lazy_fork_walk_pmd(struct mm_struct *mm, unsigned long addr,
+			       unsigned long end, lazy_fork_pmd_fn fn, void *arg)
+{
+	unsigned long pgd_next, pud_next, next;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, addr);
+	do {
+		pgd_next = pgd_addr_end(addr, end);
+		if (pgd_none_or_clear_bad(pgd))
+			continue;
+
+		pud = pud_offset(pgd, addr);
+		do {
+			pud_next = pud_addr_end(addr, pgd_next);
+			if (pud_none_or_clear_bad(pud))
+				continue;
+
+			pmd = pmd_offset(pud, addr);
+			do {
+				next = pmd_addr_end(addr, pud_next);
+				if (pmd_none_or_clear_bad(pmd))
+					continue;
+				fn(pmd, addr, next, arg);
+			} while (pmd++, addr = next, addr != pud_next);
+		} while (pud++, addr = pud_next, addr != pgd_next);
+	} while (pgd++, addr = pgd_next, addr != end);
+}
+
+struct lazy_fork_build {
+	struct pcache_lazy_fork	*lf;
+	unsigned long		vm_flags;
+	int			max_nr_ranges;
+	unsigned long		flush_start;
+	unsigned long		flush_end;
+};
+
+static void lazy_fork_count_pmd(pmd_t *pmd, unsigned long addr,
+				unsigned long end, void *arg)
+{
+	(*(int *)arg)++;
+}
+
+static void lazy_fork_freeze_pmd(pmd_t *pmd, unsigned long addr,
+				 unsigned long end, void *arg)
+{
+	struct lazy_fork_build *b = arg;
+	struct pcache_lazy_fork *lf = b->lf;
+	struct lazy_fork_range *r;
+
+	/*
+	 * Populated by the parent after we counted. The child
+	 * will fetch it from its own memory, same as the fills
+	 * that race with an eager fork.
+	 */
+	if (unlikely(lf->nr_ranges == b->max_nr_ranges))
+		return;
+
+	clear_bit(_PAGE_BIT_RW, (unsigned long *)pmd);
+
+	r = &lf->ranges[lf->nr_ranges++];
+	r->start = addr;
+	r->end = end;
+	r->vm_flags = b->vm_flags;
+	r->state = LAZY_FORK_PENDING;
+
+	b->flush_start = min(b->flush_start, addr);
+	b->flush_end = max(b->flush_end, end);
+}
+
+static int lazy_fork_cmp_range(const void *a, const void *b)
+{
+	const struct lazy_fork_range *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+static int eager_fork_dup_pcache(struct task_struct *dst_task,
+				 struct mm_struct *dst_mm, struct mm_struct *src_mm,
+				 struct fork_vmainfo *vmas, int nr_vmas)
+{
+	int i, ret;
+
+	for (i = 0; i < nr_vmas; i++) {
+		if (vmas[i].vm_flags & VM_SHARED)
+			continue;
+		ret = pcache_copy_page_range(dst_mm, src_mm,
+					     vmas[i].vm_start, vmas[i].vm_end,
+					     vmas[i].vm_flags, dst_task);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Called by fork_dup_pcache().
+ * Shared mappings are copied right away, the others are deferred.
+ */
+int lazy_fork_dup_pcache(struct task_struct *dst_task, struct mm_struct *dst_mm,
+			 struct mm_struct *src_mm, struct fork_vmainfo *vmas,
+			 int nr_vmas)
+{
+	struct pcache_lazy_fork *lf;
+	struct lazy_fork_build b;
+	int i, ret, nr_pmds = 0;
+
+	for (i = 0; i < nr_vmas; i++) {
+		if (vmas[i].vm_flags & VM_SHARED) {
+			ret = pcache_copy_page_range(dst_mm, src_mm,
+						     vmas[i].vm_start, vmas[i].vm_end,
+						     vmas[i].vm_flags, dst_task);
+			if (ret)
+				return ret;
+			continue;
+		}
+		lazy_fork_walk_pmd(src_mm, vmas[i].vm_start, vmas[i].vm_end,
+				   lazy_fork_count_pmd, &nr_pmds);
+	}
+
+	if (!nr_pmds)
+		return 0;
+
+	lf = kmalloc(sizeof(*lf) + nr_pmds * sizeof(struct lazy_fork_range),
+		     GFP_KERNEL);
+	if (unlikely(!lf)) {
+		inc_pcache_event(PCACHE_LAZY_FORK_EAGER);
+		return eager_fork_dup_pcache(dst_task, dst_mm, src_mm,
+					     vmas, nr_vmas);
+	}
+
+	lf->parent_mm = src_mm;
+	lf->child_mm = dst_mm;
+	lf->child_task = dst_task;
+	lf->nr_ranges = 0;
+	lf->first_pending = 0;
+
+	b.lf = lf;
+	b.max_nr_ranges = nr_pmds;
+	b.flush_start = TLB_FLUSH_ALL;
+	b.flush_end = 0;
+
+	/* Against parent faults that make pmds writable again */
+	spin_lock(&src_mm->pcache_lazy_fork.lock);
+	for (i = 0; i < nr_vmas; i++) {
+		if (vmas[i].vm_flags & VM_SHARED)
+			continue;
+		b.vm_flags = vmas[i].vm_flags;
+		lazy_fork_walk_pmd(src_mm, vmas[i].vm_start, vmas[i].vm_end,
+				   lazy_fork_freeze_pmd, &b);
+	}
+
+	sort(lf->ranges, lf->nr_ranges, sizeof(struct lazy_fork_range),
+	     lazy_fork_cmp_range, NULL);
+	lf->nr_pending = lf->nr_ranges;
+
+	if (lf->nr_pending) {
+		list_add(&lf->next, &src_mm->pcache_lazy_fork.children);
+
+		/* Dropped by lazy_fork_mm_free() of the child */
+		atomic_inc(&src_mm->mm_count);
+		dst_mm->pcache_lazy_fork.parent = src_mm;
+		dst_mm->pcache_lazy_fork.lf = lf;
+	}
+	spin_unlock(&src_mm->pcache_lazy_fork.lock);
+
+	if (!lf->nr_pending) {
+		kfree(lf);
+		return 0;
+	}
+
+	/* Parent's threads must not write through stale TLB entries */
+	flush_tlb_mm_range(src_mm, b.flush_start, b.flush_end);
+
+	mod_pcache_event(PCACHE_LAZY_FORK_DEFERRED, lf->nr_ranges);
+	return 0;
+}
+
+/* Index of the first range of @lf that ends after @addr */
+static int lazy_fork_first_range(struct pcache_lazy_fork *lf,
+				 unsigned long addr)
+{
+	int lo = lf->first_pending, hi = lf->nr_ranges;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (lf->ranges[mid].end <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Called with @info->lock held, @info is the parent's.
+ * Return true if @lf is freed.
+ */
+static bool lazy_fork_range_done(struct pcache_lazy_fork_info *info,
+				 struct pcache_lazy_fork *lf,
+				 struct lazy_fork_range *r)
+{
+	r->state = LAZY_FORK_DONE;
+
+	/* Waiters queue themselves with the lock held */
+	if (waitqueue_active(&info->wait))
+		wake_up_all(&info->wait);
+
+	while (lf->first_pending < lf->nr_ranges &&
+	       lf->ranges[lf->first_pending].state == LAZY_FORK_DONE)
+		lf->first_pending++;
+
+	if (--lf->nr_pending)
+		return false;
+
+	list_del(&lf->next);
+	WRITE_ONCE(lf->child_mm->pcache_lazy_fork.lf, NULL);
+	kfree(lf);
+	return true;
+}
+
+/*
+ * Resolve pending ranges of @lf within [@start, @end).
+ * If @drop is set, ranges fully inside are dropped instead of copied.
+ *
+ * Called with @info->lock held, @info is the parent's. The lock is dropped
+ * if anything is copied or someone else is copying. Return true in that case,
+ * @lf may be gone and the caller has to look it up again.
+ */
+static bool lazy_fork_resolve_one(struct pcache_lazy_fork_info *info,
+				  struct pcache_lazy_fork *lf,
+				  unsigned long start, unsigned long end,
+				  bool drop)
+{
+	struct lazy_fork_range *r;
+	int i, ret;
+
+	for (i = lazy_fork_first_range(lf, start); i < lf->nr_ranges; i++) {
+		r = &lf->ranges[i];
+		if (r->start >= end)
+			break;
+
+		if (r->state == LAZY_FORK_DONE)
+			continue;
+
+		if (r->state == LAZY_FORK_COPYING) {
+			DEFINE_WAIT(wait);
+
+			/* Queued before unlock, the wakeup can not be missed */
+			prepare_to_wait(&info->wait, &wait, TASK_UNINTERRUPTIBLE);
+			spin_unlock(&info->lock);
+			schedule();
+			finish_wait(&info->wait, &wait);
+			spin_lock(&info->lock);
+			return true;
+		}
+
+		if (drop && r->start >= start && r->end <= end) {
+			inc_pcache_event(PCACHE_LAZY_FORK_DROPPED);
+			if (lazy_fork_range_done(info, lf, r))
+				return true;
+			continue;
+		}
+
+		r->state = LAZY_FORK_COPYING;
+		spin_unlock(&info->lock);
+
+		ret = pcache_copy_page_range(lf->child_mm, lf->parent_mm,
+					     r->start, r->end, r->vm_flags,
+					     lf->child_task);
+		WARN_ON_ONCE(ret);
+		inc_pcache_event(PCACHE_LAZY_FORK_COPIED);
+
+		spin_lock(&info->lock);
+		lazy_fork_range_done(info, lf, r);
+		return true;
+	}
+	return false;
+}
+
+/* Resolve the pending ranges from our parent, under the parent's lock */
+static void lazy_fork_resolve_own(struct mm_struct *mm, unsigned long start,
+				  unsigned long end, bool drop)
+{
+	struct pcache_lazy_fork_info *info = &mm->pcache_lazy_fork;
+	struct pcache_lazy_fork_info *parent_info;
+
+	if (!info->parent || !READ_ONCE(info->lf))
+		return;
+
+	parent_info = &info->parent->pcache_lazy_fork;
+	spin_lock(&parent_info->lock);
+	while (info->lf &&
+	       lazy_fork_resolve_one(parent_info, info->lf, start, end, drop))
+		;
+	spin_unlock(&parent_info->lock);
+}
+
+/*
+ * Resolve the pending ranges to our children.
+ * Called with our lock held. Nothing of them is pending within
+ * [@start, @end) once it returns.
+ */
+static void lazy_fork_resolve_children(struct mm_struct *mm,
+				       unsigned long start, unsigned long end)
+{
+	struct pcache_lazy_fork_info *info = &mm->pcache_lazy_fork;
+	struct pcache_lazy_fork *lf;
+
+restart:
+	list_for_each_entry(lf, &info->children, next) {
+		if (lazy_fork_resolve_one(info, lf, start, end, false))
+			goto restart;
+	}
+}
+
+/*
+ * Resolve all pending ranges within [@start, @end) that involve @mm,
+ * either as the child or as the parent.
+ * @drop only applies to the ranges of which @mm is the child.
+ */
+void __lazy_fork_resolve_range(struct mm_struct *mm, unsigned long start,
+			       unsigned long end, bool drop)
+{
+	lazy_fork_resolve_own(mm, start, end, drop);
+
+	spin_lock(&mm->pcache_lazy_fork.lock);
+	lazy_fork_resolve_children(mm, start, end);
+	spin_unlock(&mm->pcache_lazy_fork.lock);
+}
+
+void __lazy_fork_handle_fault(struct mm_struct *mm, pmd_t *pmd,
+			      unsigned long address)
+{
+	unsigned long start = address & PMD_MASK;
+	unsigned long end = start + PMD_SIZE;
+
+	lazy_fork_resolve_own(mm, start, end, false);
+
+	/*
+	 * Nothing pending on this pmd anymore, make it writable again.
+	 * A concurrent fork can only freeze it again with our lock held.
+	 */
+	spin_lock(&mm->pcache_lazy_fork.lock);
+	lazy_fork_resolve_children(mm, start, end);
+	if (!pmd_none(*pmd) && !pmd_write(*pmd))
+		set_bit(_PAGE_BIT_RW, (unsigned long *)pmd);
+	spin_unlock(&mm->pcache_lazy_fork.lock);
+}
+
+struct lazy_fork_pinned {
+	struct mm_struct	*mm;
+	unsigned long		address;
+};
+
+static DEFINE_PER_CPU(struct lazy_fork_pinned, lazy_fork_pinned);
+
+/*
+ * Called by pcache_referenced_trylock() with a dirty line of @mm at @address
+ * locked, skipped because its pmd is write-protected. Nothing can be copied
+ * with the line locked, remember it for lazy_fork_resolve_pinned().
+ */
+void lazy_fork_note_pinned(struct mm_struct *mm, unsigned long address)
+{
+	struct lazy_fork_pinned *p = this_cpu_ptr(&lazy_fork_pinned);
+
+	/* One is enough to make progress */
+	if (p->mm)
+		return;
+
+	/* Keep the pgtable, dropped by lazy_fork_resolve_pinned() */
+	atomic_inc(&mm->mm_count);
+	p->mm = mm;
+	p->address = address;
+}
+
+/* Lego never frees pgtable pages before the mm itself */
+static pmd_t *lazy_fork_find_pmd(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none_or_clear_bad(pgd))
+		return NULL;
+
+	pud = pud_offset(pgd, address);
+	if (pud_none_or_clear_bad(pud))
+		return NULL;
+
+	pmd = pmd_offset(pud, address);
+	if (pmd_none_or_clear_bad(pmd))
+		return NULL;
+	return pmd;
+}
+
+/*
+ * Called by eviction once it has no line locked.
+ * Resolve the pmd remembered by lazy_fork_note_pinned() and make it writable,
+ * so that its dirty lines can be evicted by the next try.
+ */
+void lazy_fork_resolve_pinned(void)
+{
+	struct lazy_fork_pinned *p = this_cpu_ptr(&lazy_fork_pinned);
+	struct mm_struct *mm = p->mm;
+	unsigned long address = p->address;
+	pmd_t *pmd;
+
+	if (likely(!mm))
+		return;
+	p->mm = NULL;
+
+	/* An exited mm has nothing pending, this is a nop then */
+	pmd = lazy_fork_find_pmd(mm, address);
+	if (pmd) {
+		__lazy_fork_handle_fault(mm, pmd, address);
+		inc_pcache_event(PCACHE_LAZY_FORK_UNPINNED);
+	}
+	mmdrop(mm);
+}
+
+/*
+ * Called when @mm is going away.
+ * Children get their copies, our own pending ranges are dropped.
+ */
+void lazy_fork_mm_exit(struct mm_struct *mm)
+{
+	if (lazy_fork_active(mm))
+		__lazy_fork_resolve_range(mm, 0, TASK_SIZE, true);
+}
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * madvise() hints, translated into pcache actions:
+ *
+ *  MADV_WILLNEED		queue the range to prefetch thread
+ *  MADV_SEQUENTIAL/RANDOM	tune the stride detector for the range
+ *  MADV_DONTNEED/FREE		drop lines of private anonymous mappings
+ *				without flushing them back, memory then
+ *				frees the pages
+ *  MADV_COLD/PAGEOUT		move lines to where eviction looks first
+ */
+
+#include <lego/mm.h>
+#include <lego/kernel.h>
+#include <lego/comp_common.h>
+#include <processor/pcache.h>
+#include <processor/distvm.h>
+#include <processor/pgtable.h>
+#include <processor/processor.h>
+
+/*
+ * Drop our lines of [@start, @end), dirty ones are thrown away.
+ * Only called on pieces memory confirmed to be private anonymous.
+ */
+static void madvise_drop_range(struct mm_struct *mm, unsigned long start,
+			       unsigned long end)
+{
+	struct tlb_gather tlb;
+
+	lazy_fork_resolve_range(mm, start, end, true);
+
+	tlb_gather_init(&tlb);
+	unmap_page_range(mm, start, end, &tlb);
+	tlb_gather_flush(&tlb);
+	pcache_ctier_invalidate_range(current->tgid, start, end);
+}
+
+/*
+ * Memory first tells which pieces of the range are private anonymous,
+ * lines of file-backed and shared mappings are left alone. Then we drop
+ * our lines of those pieces, before memory frees its pages. If memory
+ * freed first, an eviction in the middle could flush old data back.
+ * The range is split into pieces that belong to one memory node each.
+ */
+static long madvise_dontneed(struct mm_struct *mm, unsigned long start,
+			     unsigned long end, int behavior)
+{
+	struct p2m_madvise_struct payload;
+	struct p2m_madvise_reply_struct reply;
+	struct p2m_madvise_range *r;
+	unsigned long next, node_end;
+	long retlen, ret = 0;
+	int i, nid;
+
+	inc_pcache_event(PCACHE_MADVISE_DONTNEED);
+
+	payload.pid = current->tgid;
+	payload.behavior = behavior;
+	for (; start < end; start = node_end) {
+		nid = get_memory_node(current, start);
+		node_end = start;
+		do {
+			node_end = min(end, VMR_OFFSET(node_end) + VM_GRANULARITY);
+		} while (node_end < end && get_memory_node(current, node_end) == nid);
+
+		for (; start < node_end; start = next) {
+			payload.query = 1;
+			payload.start = start;
+			payload.len = node_end - start;
+
+			retlen = net_send_reply_timeout(nid, P2M_MADVISE,
+					&payload, sizeof(payload), &reply, sizeof(reply),
+					false, DEF_NET_TIMEOUT);
+			if (unlikely(retlen != sizeof(reply)))
+				return -EIO;
+
+			/* Report the first error, but finish the whole range */
+			if (reply.ret && !ret)
+				ret = reply.ret;
+
+			next = reply.next;
+			if (unlikely(next <= start || next > node_end))
+				return -EIO;
+			if (!reply.nr_ranges)
+				continue;
+
+			for (i = 0; i < reply.nr_ranges; i++) {
+				r = &reply.ranges[i];
+				madvise_drop_range(mm, r->start, r->end);
+			}
+
+			payload.query = 0;
+			payload.len = next - start;
+
+			retlen = net_send_reply_timeout(nid, P2M_MADVISE,
+					&payload, sizeof(payload), &reply, sizeof(reply),
+					false, DEF_NET_TIMEOUT);
+			if (unlikely(retlen != sizeof(reply)))
+				return -EIO;
+			if (reply.ret && !ret)
+				ret = reply.ret;
+		}
+	}
+	return ret;
+}
+
+static void madvise_cold_pte_range(struct mm_struct *mm, pmd_t *pmd,
+				   unsigned long addr, unsigned long end)
+{
+	struct pcache_meta *pcm;
+	spinlock_t *ptl;
+	pte_t *pte;
+	int nr = 0;
+
+	pte = pte_offset_lock(mm, pmd, addr, &ptl);
+	do {
+		if (!pte_present(*pte))
+			continue;
+
+		ptep_clear_flush_young(pte);
+
+		/*
+		 * Lock order is pcache then pte, skip contended lines.
+		 * A locked line can not be unlinked from LRU by eviction.
+		 */
+		pcm = pte_to_pcache_meta(*pte);
+		if (unlikely(!pcm) || !trylock_pcache(pcm))
+			continue;
+
+		if (PcacheValid(pcm) && !PcacheReclaim(pcm)) {
+			move_to_lru_tail(pcm);
+			arc_free_pcache(pcm, pcache_meta_to_pcache_set(pcm));
+			nr++;
+		}
+		unlock_pcache(pcm);
+	} while (pte++, addr += PAGE_SIZE, addr != end);
+	spin_unlock(ptl);
+
+	mod_pcache_event(PCACHE_MADVISE_COLD, nr);
+}
+
+static inline unsigned long
+madvise_cold_pmd_range(struct mm_struct *mm, pud_t *pud,
+		       unsigned long addr, unsigned long end)
+{
+	pmd_t *pmd;
+	unsigned long next;
+
+	pmd = pmd_offset(pud, addr);
+	do {
+		next = pmd_addr_end(addr, end);
+		if (pmd_none_or_clear_bad(pmd))
+			continue;
+		madvise_cold_pte_range(mm, pmd, addr, next);
+	} while (pmd++, addr = next, addr != end);
+
+	return addr;
+}
+
+static inline unsigned long
+madvise_cold_pud_range(struct mm_struct *mm, pgd_t *pgd,
+		       unsigned long addr, unsigned long end)
+{
+	pud_t *pud;
+	unsigned long next;
+
+	pud = pud_offset(pgd, addr);
+	do {
+		next = pud_addr_end(addr, end);
+		if (pud_none_or_clear_bad(pud))
+			continue;
+		next = madvise_cold_pmd_range(mm, pud, addr, next);
+	} while (pud++, addr = next, addr != end);
+
+	return addr;
+}
+
+/*
+ * Clear the young bits and move the lines to LRU tail, CLOCK and ARC
+ * only look at the young bits and the frequent segment. Nothing is
+ * flushed here, eviction picks these lines up once the set is full.
+ */
+static void madvise_cold(struct mm_struct *mm, unsigned long addr,
+			 unsigned long end)
+{
+	pgd_t *pgd;
+	unsigned long next;
+
+	pgd = pgd_offset(mm, addr);
+	do {
+		next = pgd_addr_end(addr, end);
+		if (pgd_none_or_clear_bad(pgd))
+			continue;
+		next = madvise_cold_pud_range(mm, pgd, addr, next);
+	} while (pgd++, addr = next, addr != end);
+}
+
+/**
+ * pcache_madvise
+ * @start: page aligned start address
+ * @end: page aligned end address, larger than @start
+ * @behavior: MADV_XXX, already validated
+ *
+ * Called by madvise(). Behaviors that are not listed above are
+ * accepted and ignored.
+ */
+long pcache_madvise(unsigned long start, unsigned long end, int behavior)
+{
+	struct mm_struct *mm = current->mm;
+
+	if (end > TASK_SIZE)
+		return -ENOMEM;
+
+	switch (behavior) {
+	case MADV_WILLNEED:
+		pcache_prefetch_range(mm, start, end);
+		break;
+	case MADV_NORMAL:
+	case MADV_SEQUENTIAL:
+	case MADV_RANDOM:
+		pcache_prefetch_advise(mm, start, end, behavior);
+		break;
+	case MADV_DONTNEED:
+	case MADV_FREE:
+		return madvise_dontneed(mm, start, end, behavior);
+	case MADV_COLD:
+	case MADV_PAGEOUT:
+		madvise_cold(mm, start, end);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Way partitioning between groups of processes.
+ *
+ * Each group owns a mask of ways. Allocation takes free lines only from
+ * ways within the mask, and eviction only selects victims from there.
+ * Thus a group can not push more lines than its ways out of any set,
+ * no matter how hard it misses. Masks may overlap, e.g. a background
+ * group gets 1/4 of the ways, while group 0 keeps all of them.
+ *
+ * The group is a property of mm, inherited across fork() and exec().
+ * Changing the mask or the group of a process does not move lines
+ * already in cache, they go away with normal eviction.
+ */
+
+#include <lego/mm.h>
+#include <lego/pid.h>
+#include <lego/sched.h>
+#include <lego/cred.h>
+#include <lego/kernel.h>
+#include <lego/uaccess.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+struct pcache_partition pcache_partitions[PCACHE_NR_PARTITIONS];
+
+void pcache_partition_mm_init(struct mm_struct *mm)
+{
+	/* Both fork() and exec() come here with the parent's mm as current */
+	if (current->mm && current->mm != mm)
+		mm->pcache_partid = current->mm->pcache_partid;
+	else
+		mm->pcache_partid = 0;
+}
+
+/* Only root may change what a group gets, or move other processes */
+static inline bool partition_capable(void)
+{
+	return current_euid() == 0;
+}
+
+static long partition_set_ways(struct pcache_partition *p, unsigned long mask)
+{
+	unsigned long all = PCACHE_WAYS_ALL >> (BITS_PER_LONG - PCACHE_ASSOCIATIVITY);
+
+	if (!partition_capable())
+		return -EPERM;
+
+	mask &= all;
+	if (!mask)
+		return -EINVAL;
+
+	/* Keep the fast path for unrestricted groups */
+	if (mask == all)
+		mask = PCACHE_WAYS_ALL;
+
+	WRITE_ONCE(p->way_mask, mask);
+	return 0;
+}
+
+static long partition_attach(int group, pid_t pid)
+{
+	struct task_struct *p;
+	long ret = 0;
+
+	if (!pid)
+		pid = current->pid;
+
+	spin_lock(&tasklist_lock);
+	p = find_task_by_pid(pid);
+	if (p)
+		get_task_struct(p);
+	spin_unlock(&tasklist_lock);
+	if (!p)
+		return -ESRCH;
+
+	if (!partition_capable() && !same_thread_group(p, current)) {
+		ret = -EPERM;
+		goto out;
+	}
+
+	task_lock(p);
+	if (!p->mm) {
+		ret = -ESRCH;
+		goto unlock;
+	}
+
+	/* Without root, a process may only give up ways, not take more */
+	if (!partition_capable() &&
+	    (READ_ONCE(pcache_partitions[group].way_mask) &
+	     ~pcache_mm_way_mask(p->mm))) {
+		ret = -EPERM;
+		goto unlock;
+	}
+
+	/* Shared by all threads, and children forked from now on */
+	WRITE_ONCE(p->mm->pcache_partid, group);
+unlock:
+	task_unlock(p);
+
+out:
+	put_task_struct(p);
+	return ret;
+}
+
+static long partition_stat(struct pcache_partition *p,
+			   struct pcache_partition_stat __user *statbuf)
+{
+	struct pcache_partition_stat kstat;
+
+	kstat.way_mask = READ_ONCE(p->way_mask);
+	kstat.nr_lines = atomic_long_read(&p->nr_lines);
+	kstat.nr_fill = atomic_long_read(&p->nr_fill);
+	kstat.nr_evicted = atomic_long_read(&p->nr_evicted);
+	kstat.nr_evicted_by_others = atomic_long_read(&p->nr_evicted_by_others);
+
+	if (copy_to_user(statbuf, &kstat, sizeof(kstat)))
+		return -EFAULT;
+	return 0;
+}
+
+long pcache_partition_ctl(int op, int group, unsigned long arg)
+{
+	struct pcache_partition *p;
+
+	if (group < 0 || group >= PCACHE_NR_PARTITIONS)
+		return -EINVAL;
+	p = pcache_partitions + group;
+
+	switch (op) {
+	case PCACHE_PARTITION_SET_WAYS:
+		return partition_set_ways(p, arg);
+	case PCACHE_PARTITION_ATTACH:
+		return partition_attach(group, (pid_t)arg);
+	case PCACHE_PARTITION_STAT:
+		return partition_stat(p, (void __user *)arg);
+	}
+	return -EINVAL;
+}
+
+void __init pcache_partition_init(void)
+{
+	int i;
+
+	/* Way masks are one long */
+	BUILD_BUG_ON(PCACHE_ASSOCIATIVITY > BITS_PER_LONG);
+
+	for (i = 0; i < PCACHE_NR_PARTITIONS; i++) {
+		pcache_partitions[i].way_mask = PCACHE_WAYS_ALL;
+		atomic_long_set(&pcache_partitions[i].nr_lines, 0);
+		atomic_long_set(&pcache_partitions[i].nr_fill, 0);
+		atomic_long_set(&pcache_partitions[i].nr_evicted, 0);
+		atomic_long_set(&pcache_partitions[i].nr_evicted_by_others, 0);
+	}
+
+	pr_info("pcache: %d way partitions, %lu ways\n",
+		PCACHE_NR_PARTITIONS, PCACHE_ASSOCIATIVITY);
+}
@@ -24,13 +24,17 @@
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
+#include <asm/tlbflush.h>
+
 #include "piggyback.h"
 
 /*
- * Same as pcache_rmap_map, we use the same trick here.
- * Check comment there.
+ * A pre-allocated array, one-to-one mapped to pcache_meta_map.
+ * Both are referenced by the same index. If one pcm needs more than
+ * one entry, the extra ones come from kmalloc.
  */
 static struct pset_eviction_entry *pset_eviction_entry_map;
+struct piggyback_info *piggyback_info_map;
 
 static inline struct pset_eviction_entry *
 index_to_pee(unsigned long index)
@@ -79,7 +83,7 @@ out:
 static inline void __pset_add_eviction_entry(struct pset_eviction_entry *new,
 					     struct pcache_set *pset)
 {
-	atomic_inc(&pset->nr_eviction_entries);
+	atomic_inc(pset_eviction_filter(pset, new->address));
 	list_add(&new->next, &pset->eviction_list);
 }
 
@@ -87,7 +91,7 @@ static inline void __pset_del_eviction_entry(struct pset_eviction_entry *p,
 					     struct pcache_set *pset)
 {
 	list_del(&p->next);
-	atomic_dec(&pset->nr_eviction_entries);
+	atomic_dec(pset_eviction_filter(pset, p->address));
 }
 
 static inline void
@@ -105,6 +109,7 @@ bool __pset_find_eviction(struct pcache_set *pset, unsigned long uvaddr,
 	bool found = false;
 
 	uvaddr &= PAGE_MASK;
+	inc_pcache_event(PCACHE_PSET_LIST_LOOKUP);
 
 	spin_lock(&pset->eviction_list_lock);
 	list_for_each_entry(pos, &pset->eviction_list, next) {
@@ -121,13 +126,25 @@ bool __pset_find_eviction(struct pcache_set *pset, unsigned long uvaddr,
 	return found;
 }
 
+/*
+ * Sleep until the eviction of @uvaddr is flushed back to memory.
+ * Woken up by pset_remove_eviction(), which also covers the entries
+ * left over for piggyback until the piggyback fill is done.
+ */
+void __pset_wait_eviction(struct pcache_set *pset, unsigned long uvaddr,
+			  struct task_struct *tsk)
+{
+	inc_pcache_event(PCACHE_PSET_LIST_WAIT);
+	wait_event(pset->eviction_wait, !pset_find_eviction(uvaddr, tsk));
+}
+
 static int pset_add_eviction_one(struct pcache_meta *pcm,
 				 struct pcache_rmap *rmap, void *arg)
 {
 	int *nr_added = arg;
 	struct pcache_set *pset = pcache_meta_to_pcache_set(pcm);
 	struct pset_eviction_entry *new;
-	struct piggyback_info *pb = &pcm->pb;
+	struct piggyback_info *pb = pcache_meta_to_piggyback(pcm);
 	struct task_struct *tsk;
 	unsigned long address;
 
@@ -202,24 +219,26 @@ void pset_remove_eviction(struct pcache_set *pset,
 	spin_unlock(&pset->eviction_list_lock);
 
 	BUG_ON(nr_added);
+
+	/* Pairs with the barrier in wait_event() */
+	if (wq_has_sleeper(&pset->eviction_wait))
+		wake_up_all(&pset->eviction_wait);
 }
 
 DEFINE_PROFILE_POINT(evict_line_perset_unmap)
 DEFINE_PROFILE_POINT(evict_line_perset_flush)
 
 /*
- * @piggyback: if caller wishes to have piggyback
- *
- * Only pcache fault on remote memory can have piggyback enabled.
- * All other callers such as COW, mremap can NOT use this.
+ * First half of eviction: publish eviction entries and unmap.
+ * TLB shootdown is gathered into @tlb, which must be flushed
+ * before evict_line_perset_list_finish() is called.
+ * Return the number of added eviction entries.
  */
-int evict_line_perset_list(struct pcache_set *pset, struct pcache_meta *pcm,
-			   enum piggyback_options piggyback)
+int evict_line_perset_list_unmap(struct pcache_set *pset, struct pcache_meta *pcm,
+				 struct tlb_gather *tlb, bool *dirty)
 {
 	int nr_added;
-	bool dirty;
 	PROFILE_POINT_TIME(evict_line_perset_unmap)
-	PROFILE_POINT_TIME(evict_line_perset_flush)
 
 	/*
 	 * Add entries to pset. This has to be performed before we do unmap,
@@ -242,16 +261,26 @@ int evict_line_perset_list(struct pcache_set *pset, struct pcache_meta *pcm,
 	}
 
 	PROFILE_START(evict_line_perset_unmap);
-	dirty = pcache_try_to_unmap_reserve_check_dirty(pcm);
+	*dirty = pcache_try_to_unmap_reserve_check_dirty_tlb(pcm, tlb);
 	PROFILE_LEAVE(evict_line_perset_unmap);
 
+	return nr_added;
+}
+
+/* Second half of eviction: flush back and drop eviction entries */
+void evict_line_perset_list_finish(struct pcache_set *pset, struct pcache_meta *pcm,
+				   int nr_added, bool dirty,
+				   enum piggyback_options piggyback)
+{
+	PROFILE_POINT_TIME(evict_line_perset_flush)
+
 	if (likely(dirty)) {
 		if (likely((nr_added == 1) && (piggyback == ENABLE_PIGGYBACK))) {
 			set_per_cpu_piggybacker(pcm);
 
 			/* We already saved into pb_info */
 			pcache_free_reserved_rmap(pcm);
-			return 0;
+			return;
 		}
 
 		PROFILE_START(evict_line_perset_flush);
@@ -268,6 +297,26 @@ int evict_line_perset_list(struct pcache_set *pset, struct pcache_meta *pcm,
 	pcache_free_reserved_rmap(pcm);
 	pset_remove_eviction(pset, pcm, nr_added);
 	inc_pcache_event_cond(PCACHE_CLFLUSH_CLEAN_SKIPPED, !dirty);
+}
+
+/*
+ * @piggyback: if caller wishes to have piggyback
+ *
+ * Only pcache fault on remote memory can have piggyback enabled.
+ * All other callers such as COW, mremap can NOT use this.
+ */
+int evict_line_perset_list(struct pcache_set *pset, struct pcache_meta *pcm,
+			   enum piggyback_options piggyback)
+{
+	struct tlb_gather tlb;
+	int nr_added;
+	bool dirty;
+
+	tlb_gather_init(&tlb);
+	nr_added = evict_line_perset_list_unmap(pset, pcm, &tlb, &dirty);
+	tlb_gather_flush(&tlb);
+
+	evict_line_perset_list_finish(pset, pcm, nr_added, dirty, piggyback);
 	return 0;
 }
 
@@ -284,4 +333,14 @@ void __init alloc_pcache_perset_map(void)
 
 	pr_info("%s(): eviction entry size: %zu B, total reserved: %zu B, at %p\n",
 		__func__, size, total, pset_eviction_entry_map);
+
+	size = sizeof(struct piggyback_info);
+	total = size * nr_cachelines;
+
+	piggyback_info_map = memblock_virt_alloc(total, PAGE_SIZE);
+	if (!piggyback_info_map)
+		panic("Unable to allocate piggyback_info_map!");
+
+	pr_info("%s(): piggyback info size: %zu B, total reserved: %zu B, at %p\n",
+		__func__, size, total, piggyback_info_map);
 }
@@ -9,17 +9,698 @@
 
 /*
  * Prefetch facilities
+ *
+ * Every pcache miss that goes to remote memory feeds a small per-mm
+ * stride detector. Once a stream is confirmed, the next few lines along
+ * the stride are queued to kpcache_prefetchd, which fills them into their
+ * psets asynchronously. Consecutive lines of the same process are fetched
+ * with one P2M_PCACHE_MISS_BATCH request. Prefetched lines are mapped with the young bit
+ * cleared and moved to the LRU tail, so a wrong guess is the first thing
+ * eviction will pick.
+ *
+ * The fill is done without holding pte lock across network. To not install
+ * stale content, we give up if the pte is no longer empty, the line is being
+ * evicted, or any eviction started in this set while we were on network.
  */
 
 #include <lego/mm.h>
 #include <lego/wait.h>
 #include <lego/slab.h>
 #include <lego/log2.h>
+#include <lego/bitmap.h>
 #include <lego/hash.h>
 #include <lego/kernel.h>
 #include <lego/pgfault.h>
 #include <lego/syscalls.h>
 #include <lego/jiffies.h>
+#include <lego/kthread.h>
+#include <lego/profile.h>
+#include <lego/fit_ibapi.h>
+#include <lego/comp_common.h>
 #include <processor/pcache.h>
+#include <processor/distvm.h>
 #include <processor/processor.h>
 
+#define NR_PREFETCH_WORK		(256)
+
+/* Largest stride that can be trained, in pcache lines */
+#define PREFETCH_MAX_STRIDE		(16)
+
+/* Number of stride hits before prefetch kicks in */
+#define PREFETCH_CONFIDENCE		(2)
+#define PREFETCH_MAX_CONFIDENCE		(8)
+
+#define PREFETCH_DEGREE			CONFIG_PCACHE_PREFETCH_DEGREE
+
+struct pcache_prefetch_work {
+	struct mm_struct	*mm;
+	struct task_struct	*owner;		/* thread group leader */
+	unsigned long		address;
+	unsigned int		pid;
+	unsigned int		tgid;
+	unsigned int		memory_nid;
+};
+
+/*
+ * A simple ring protected by one lock. Both producers (pgfault)
+ * and the consumer (prefetch thread) are short under the lock.
+ * Once the ring is full, new prefetches are dropped.
+ */
+static DEFINE_SPINLOCK(prefetch_queue_lock);
+static unsigned long prefetch_head;
+static unsigned long prefetch_tail;
+static struct pcache_prefetch_work prefetch_queue[NR_PREFETCH_WORK];
+static struct task_struct *prefetch_thread;
+
+void pcache_prefetch_mm_init(struct mm_struct *mm)
+{
+	struct pcache_prefetch_info *info = &mm->pcache_prefetch;
+
+	memset(info->streams, 0, sizeof(info->streams));
+	memset(info->advice, 0, sizeof(info->advice));
+	spin_lock_init(&info->lock);
+	info->next_replace = 0;
+	info->next_advice = 0;
+	atomic_set(&info->nr_inflight, 0);
+	info->exiting = false;
+}
+
+/*
+ * Called when the last user of @mm is gone, before pgtable is released.
+ * No one can submit new works for @mm. Wait for queued ones to finish.
+ */
+void pcache_prefetch_mm_exit(struct mm_struct *mm)
+{
+	struct pcache_prefetch_info *info = &mm->pcache_prefetch;
+	unsigned long wait_start = jiffies;
+
+	WRITE_ONCE(info->exiting, true);
+	smp_mb();
+
+	while (atomic_read(&info->nr_inflight)) {
+		cpu_relax();
+		if (unlikely(time_after(jiffies, wait_start + 30 * HZ)))
+			panic("prefetch: mm %p has %d works pending.", mm,
+				atomic_read(&info->nr_inflight));
+	}
+}
+
+static int submit_prefetch_work(struct mm_struct *mm, unsigned long address)
+{
+	struct pcache_prefetch_work *pw;
+	unsigned int memory_nid;
+
+	memory_nid = get_memory_node(current, address);
+
+	spin_lock(&prefetch_queue_lock);
+	if (unlikely(prefetch_head - prefetch_tail >= NR_PREFETCH_WORK)) {
+		spin_unlock(&prefetch_queue_lock);
+		inc_pcache_event(PCACHE_PREFETCH_QUEUE_FULL);
+		return -EBUSY;
+	}
+
+	pw = &prefetch_queue[prefetch_head % NR_PREFETCH_WORK];
+	pw->mm = mm;
+	pw->owner = current->group_leader;
+	pw->address = address;
+	pw->pid = current->pid;
+	pw->tgid = current->tgid;
+	pw->memory_nid = memory_nid;
+	atomic_inc(&mm->pcache_prefetch.nr_inflight);
+
+	smp_wmb();
+	WRITE_ONCE(prefetch_head, prefetch_head + 1);
+	spin_unlock(&prefetch_queue_lock);
+
+	inc_pcache_event(PCACHE_PREFETCH_ISSUED);
+	return 0;
+}
+
+/*
+ * Dequeue a run of works that can be sent within one batched request:
+ * they must belong to the same address space and the same memory node.
+ */
+static int dequeue_prefetch_works(struct pcache_prefetch_work *pws, int max)
+{
+	struct pcache_prefetch_work *pw;
+	int nr = 0;
+
+	spin_lock(&prefetch_queue_lock);
+	while (nr < max && prefetch_tail != prefetch_head) {
+		pw = &prefetch_queue[prefetch_tail % NR_PREFETCH_WORK];
+		if (nr && (pw->mm != pws[0].mm ||
+			   pw->memory_nid != pws[0].memory_nid))
+			break;
+
+		pws[nr++] = *pw;
+		prefetch_tail++;
+	}
+	spin_unlock(&prefetch_queue_lock);
+	return nr;
+}
+
+static inline bool has_pending_prefetch_work(void)
+{
+	return READ_ONCE(prefetch_tail) != READ_ONCE(prefetch_head);
+}
+
+/*
+ * Does @address continue the trained stream @s?
+ * A miss can land anywhere between the last miss and one stride
+ * past what has been covered, if some prefetches were dropped.
+ */
+static inline bool stream_match(struct pcache_prefetch_stream *s,
+				unsigned long address)
+{
+	long delta, covered;
+
+	if (!s->stride)
+		return false;
+
+	delta = (long)(address - s->last_miss);
+	if (delta % s->stride)
+		return false;
+
+	delta /= s->stride;
+	covered = (long)(s->last_addr - s->last_miss) / s->stride;
+	return delta >= 1 && delta <= covered + 1;
+}
+
+static inline bool stream_trainable(struct pcache_prefetch_stream *s,
+				    unsigned long address)
+{
+	long delta = (long)(address - s->last_miss);
+
+	if (!s->last_miss || !delta)
+		return false;
+	return abs(delta) <= PREFETCH_MAX_STRIDE * (long)PCACHE_LINE_SIZE;
+}
+
+/* Return the madvise behavior that covers @address, called with lock held */
+static int prefetch_advice(struct pcache_prefetch_info *info,
+			   unsigned long address)
+{
+	struct pcache_prefetch_advice *a;
+	int i;
+
+	for (i = 0; i < NR_PCACHE_PREFETCH_ADVICE; i++) {
+		a = &info->advice[i];
+		if (a->behavior && a->start <= address && address < a->end)
+			return a->behavior;
+	}
+	return MADV_NORMAL;
+}
+
+/*
+ * Feed @address into streams of @info.
+ * Return the number of lines saved into @addrs that should be prefetched.
+ *
+ * Misses within MADV_RANDOM ranges are ignored. Within MADV_SEQUENTIAL
+ * ranges, a miss that starts a new stream is trusted right away.
+ */
+static int prefetch_detect(struct pcache_prefetch_info *info,
+			   unsigned long address, unsigned long *addrs)
+{
+	struct pcache_prefetch_stream *s;
+	long covered;
+	int i, nr = 0, advice;
+
+	spin_lock(&info->lock);
+
+	advice = prefetch_advice(info, address);
+	if (advice == MADV_RANDOM)
+		goto unlock;
+
+	for (i = 0; i < NR_PCACHE_PREFETCH_STREAMS; i++) {
+		s = &info->streams[i];
+		if (stream_match(s, address))
+			goto hit;
+	}
+
+	if (advice == MADV_SEQUENTIAL) {
+		s = &info->streams[info->next_replace];
+		info->next_replace = (info->next_replace + 1) % NR_PCACHE_PREFETCH_STREAMS;
+		s->stride = PCACHE_LINE_SIZE;
+		s->confidence = PREFETCH_CONFIDENCE - 1;
+		s->last_miss = address - PCACHE_LINE_SIZE;
+		s->last_addr = address - PCACHE_LINE_SIZE;
+		goto hit;
+	}
+
+	for (i = 0; i < NR_PCACHE_PREFETCH_STREAMS; i++) {
+		s = &info->streams[i];
+		if (stream_trainable(s, address)) {
+			s->stride = (long)(address - s->last_miss);
+			s->confidence = 1;
+			s->last_miss = address;
+			s->last_addr = address;
+			goto unlock;
+		}
+	}
+
+	/* A brand new stream, replace in round-robin */
+	s = &info->streams[info->next_replace];
+	info->next_replace = (info->next_replace + 1) % NR_PCACHE_PREFETCH_STREAMS;
+	s->stride = 0;
+	s->confidence = 0;
+	s->last_miss = address;
+	s->last_addr = address;
+	goto unlock;
+
+hit:
+	if (s->confidence < PREFETCH_MAX_CONFIDENCE)
+		s->confidence++;
+
+	/* Lines ahead of @address that were already issued */
+	covered = (long)(s->last_addr - address) / s->stride;
+	if (covered < 0)
+		covered = 0;
+
+	s->last_miss = address;
+	if (s->confidence < PREFETCH_CONFIDENCE)
+		goto unlock;
+
+	for (i = covered + 1; i <= PREFETCH_DEGREE; i++) {
+		unsigned long next = address + i * s->stride;
+
+		/* Wrapped around, or not user address */
+		if (next < PAGE_SIZE || next >= TASK_SIZE)
+			break;
+		addrs[nr++] = next;
+		s->last_addr = next;
+	}
+
+unlock:
+	spin_unlock(&info->lock);
+	return nr;
+}
+
+/**
+ * pcache_prefetch_miss
+ * @mm: address space in question
+ * @address: the missing user virtual address
+ *
+ * Called by pgfault code for each miss that needs to go to remote memory.
+ * Prefetches are queued only, this does not involve network.
+ */
+void pcache_prefetch_miss(struct mm_struct *mm, unsigned long address)
+{
+	unsigned long addrs[PREFETCH_DEGREE];
+	int i, nr;
+
+	/* Lines may still be copied from our parent */
+	if (unlikely(lazy_fork_child_pending(mm)))
+		return;
+
+	nr = prefetch_detect(&mm->pcache_prefetch, address & PAGE_MASK, addrs);
+	if (!nr)
+		return;
+
+	inc_pcache_event(PCACHE_PREFETCH_TRIGGERED);
+	for (i = 0; i < nr; i++) {
+		if (submit_prefetch_work(mm, addrs[i]))
+			break;
+	}
+}
+
+/*
+ * madvise(MADV_WILLNEED) on [@start, @end).
+ * Lines are queued like normal prefetches, the ones already cached are
+ * skipped by the prefetch thread. At most half of the queue is used,
+ * the rest of the range will be missed as usual.
+ */
+void pcache_prefetch_range(struct mm_struct *mm, unsigned long start,
+			   unsigned long end)
+{
+	unsigned long address;
+	int nr = 0;
+
+	if (unlikely(lazy_fork_child_pending(mm)))
+		return;
+
+	for (address = start & PCACHE_LINE_MASK; address < end;
+	     address += PCACHE_LINE_SIZE) {
+		if (nr >= NR_PREFETCH_WORK / 2)
+			break;
+		if (submit_prefetch_work(mm, address))
+			break;
+		nr++;
+	}
+	mod_pcache_event(PCACHE_MADVISE_WILLNEED, nr);
+}
+
+/*
+ * madvise(MADV_NORMAL, MADV_SEQUENTIAL or MADV_RANDOM) on [@start, @end).
+ * Advices that overlap with the new range are forgotten entirely.
+ * If all slots are used, the oldest advice is replaced.
+ */
+void pcache_prefetch_advise(struct mm_struct *mm, unsigned long start,
+			    unsigned long end, int behavior)
+{
+	struct pcache_prefetch_info *info = &mm->pcache_prefetch;
+	struct pcache_prefetch_advice *a = NULL;
+	int i;
+
+	spin_lock(&info->lock);
+	for (i = 0; i < NR_PCACHE_PREFETCH_ADVICE; i++) {
+		struct pcache_prefetch_advice *p = &info->advice[i];
+
+		if (p->behavior && p->start < end && start < p->end)
+			p->behavior = MADV_NORMAL;
+		if (!p->behavior && !a)
+			a = p;
+	}
+
+	if (behavior != MADV_NORMAL) {
+		if (!a) {
+			a = &info->advice[info->next_advice];
+			info->next_advice = (info->next_advice + 1) %
+					    NR_PCACHE_PREFETCH_ADVICE;
+		}
+		a->start = start;
+		a->end = end;
+		a->behavior = behavior;
+	}
+	spin_unlock(&info->lock);
+}
+
+/*
+ * Speculative fill helpers
+ *
+ * Shared by prefetch, extent fill and fault-around. They all fetch lines
+ * nobody is waiting for, without holding pte lock across network.
+ */
+
+/*
+ * Is there any pending eviction of @address that has not been flushed back?
+ * If so, memory still has the old content.
+ */
+bool pcache_fill_pending_eviction(unsigned long address, struct task_struct *owner)
+{
+#ifdef CONFIG_PCACHE_EVICTION_PERSET_LIST
+	return pset_find_eviction(address, owner);
+#elif defined(CONFIG_PCACHE_EVICTION_VICTIM)
+	/* Coarse but safe: dirty lines might live in victim cache */
+	return victim_may_hit(address);
+#else
+	return false;
+#endif
+}
+
+/*
+ * Called before going to network for @nr lines starting at @start.
+ * Snapshot the eviction sequence of each line's pset, only later evictions
+ * matter. Lines whose flush is still on the way would get stale content,
+ * they are marked in @skip.
+ */
+void pcache_fill_snapshot(unsigned long start, int nr, int *evict_seq,
+			  unsigned long *skip)
+{
+	struct pcache_set *pset;
+	unsigned long addr;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		addr = start + i * PCACHE_LINE_SIZE;
+		pset = user_vaddr_to_pcache_set(addr);
+		evict_seq[i] = atomic_read(&pset->evict_seq);
+	}
+	smp_rmb();
+
+	bitmap_zero(skip, nr);
+	for (i = 0; i < nr; i++) {
+		addr = start + i * PCACHE_LINE_SIZE;
+		if (pcache_fill_pending_eviction(addr, current))
+			__set_bit(i, skip);
+	}
+}
+
+/**
+ * pcache_fill_install
+ * @mm: address space in question
+ * @pmd: the pmd covering @address
+ * @address: user virtual address
+ * @pcm: a new line that has been filled, not Valid yet
+ * @owner: thread group leader the rmap belongs to
+ * @caller: who is installing
+ * @evict_seq: snapshot of @pcm's pset eviction sequence taken before
+ *             going to network
+ * @young: map it young, for the line that was actually asked for.
+ *         Otherwise it is mapped old and put at LRU tail.
+ *
+ * Return 0 if mapped. Return -EEXIST if the pte is no longer empty or the
+ * content may be stale, -ENOMEM if rmap failed. The caller still owns the
+ * reference of @pcm on failure.
+ */
+int pcache_fill_install(struct mm_struct *mm, pmd_t *pmd, unsigned long address,
+			struct pcache_meta *pcm, struct task_struct *owner,
+			enum rmap_caller caller, int evict_seq, bool young)
+{
+	struct pcache_set *pset = pcache_meta_to_pcache_set(pcm);
+	spinlock_t *ptl;
+	pte_t *pte;
+	pte_t entry;
+
+	entry = pcache_mk_pte(pcm, PAGE_SHARED_EXEC);
+	if (!young) {
+		/*
+		 * Not Valid yet, nobody else will touch its LRU position.
+		 * Do this before taking pte lock.
+		 */
+		move_to_lru_tail(pcm);
+		entry = pte_mkold(entry);
+	}
+
+	pte = pte_offset_lock(mm, pmd, address, &ptl);
+	if (unlikely(!pte_none(*pte) ||
+		     pcache_fill_pending_eviction(address, owner) ||
+		     atomic_read(&pset->evict_seq) != evict_seq)) {
+		spin_unlock(ptl);
+		return -EEXIST;
+	}
+
+	pte_set(pte, entry);
+
+	/* which will also mark PcacheValid */
+	if (unlikely(pcache_add_rmap(pcm, pte, address, mm, owner, caller))) {
+		pte_clear(pte);
+		spin_unlock(ptl);
+		return -ENOMEM;
+	}
+	spin_unlock(ptl);
+	return 0;
+}
+
+/*
+ * Map @address to a line allocated without eviction, that has @src as its
+ * content. Used when lines come back in one buffer. Return 0 if mapped.
+ */
+int pcache_fill_install_copy(struct mm_struct *mm, pmd_t *pmd,
+			     unsigned long address, void *src,
+			     enum rmap_caller caller, int evict_seq, bool young)
+{
+	struct pcache_meta *pcm;
+	int ret;
+
+	pcm = pcache_alloc_noevict(mm, address);
+	if (!pcm)
+		return -ENOMEM;
+
+	memcpy(pcache_meta_to_kva(pcm), src, PCACHE_LINE_SIZE);
+
+	ret = pcache_fill_install(mm, pmd, address, pcm, current->group_leader,
+				  caller, evict_seq, young);
+	if (ret)
+		put_pcache(pcm);
+	return ret;
+}
+
+/*
+ * A line that has been allocated and is waiting for data.
+ * @evict_seq is a snapshot of its pset's eviction sequence.
+ */
+struct pcache_prefetch_fill {
+	struct pcache_prefetch_work	*pw;
+	struct pcache_meta		*pcm;
+	pmd_t				*pmd;
+	int				evict_seq;
+};
+
+static struct pcache_miss_batch prefetch_batch;
+static struct pcache_prefetch_fill prefetch_fills[PCACHE_MISS_BATCH_MAX];
+static void *prefetch_reply_buf;
+
+/*
+ * Allocate a pcache line for @pw.
+ * Return 0 if @pf is ready to be filled from remote.
+ */
+static int prefetch_prepare(struct pcache_prefetch_work *pw,
+			    struct pcache_prefetch_fill *pf)
+{
+	struct mm_struct *mm = pw->mm;
+	unsigned long address = pw->address;
+	struct pcache_set *pset;
+	struct pcache_meta *pcm;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	pgd = pgd_offset(mm, address);
+	pud = pud_alloc(mm, pgd, address);
+	if (!pud)
+		goto fail;
+	pmd = pmd_alloc(mm, pud, address);
+	if (!pmd)
+		goto fail;
+	pte = pte_alloc(mm, pmd, address);
+	if (!pte)
+		goto fail;
+
+	/* Quick check before allocating, recheck with pte locked later */
+	if (!pte_none(*pte)) {
+		inc_pcache_event(PCACHE_PREFETCH_SKIPPED);
+		return -EEXIST;
+	}
+
+	pcm = pcache_alloc(mm, address, DISABLE_PIGGYBACK);
+	if (unlikely(!pcm))
+		goto fail;
+
+	/*
+	 * Snapshot after allocation, which may evict
+	 * lines of its own. Only later evictions matter.
+	 */
+	pset = pcache_meta_to_pcache_set(pcm);
+	pf->evict_seq = atomic_read(&pset->evict_seq);
+	smp_rmb();
+
+	if (!pte_none(*pte) || pcache_fill_pending_eviction(address, pw->owner)) {
+		put_pcache(pcm);
+		inc_pcache_event(PCACHE_PREFETCH_SKIPPED);
+		return -EEXIST;
+	}
+
+	pf->pw = pw;
+	pf->pcm = pcm;
+	pf->pmd = pmd;
+	return 0;
+
+fail:
+	inc_pcache_event(PCACHE_PREFETCH_FAIL);
+	return -ENOMEM;
+}
+
+/*
+ * @pf has been filled with data from remote, try to map it.
+ * Consume the reference of pf->pcm either way.
+ */
+static void prefetch_install(struct pcache_prefetch_fill *pf)
+{
+	struct pcache_prefetch_work *pw = pf->pw;
+	struct pcache_meta *pcm = pf->pcm;
+	int ret;
+
+	SetPcachePrefetched(pcm);
+	ret = pcache_fill_install(pw->mm, pf->pmd, pw->address, pcm, pw->owner,
+				  RMAP_PREFETCH, pf->evict_seq, false);
+	if (likely(!ret)) {
+		inc_pcache_event(PCACHE_PREFETCH_FILLED);
+		return;
+	}
+
+	ClearPcachePrefetched(pcm);
+	put_pcache(pcm);
+	if (ret == -EEXIST)
+		inc_pcache_event(PCACHE_PREFETCH_RACE);
+	else
+		inc_pcache_event(PCACHE_PREFETCH_FAIL);
+}
+
+/*
+ * All works belong to the same mm and memory node.
+ * Lines are fetched with one P2M_PCACHE_MISS_BATCH.
+ */
+static void do_prefetch_works(struct pcache_prefetch_work *pws, int nr_works)
+{
+	struct pcache_miss_batch *b = &prefetch_batch;
+	struct pcache_prefetch_fill *pf;
+	int i, nr = 0;
+
+	for (i = 0; i < nr_works; i++) {
+		pf = &prefetch_fills[nr];
+		if (prefetch_prepare(&pws[i], pf))
+			continue;
+
+		b->address[nr] = pf->pw->address;
+		b->dst[nr] = pcache_meta_to_kva(pf->pcm);
+		nr++;
+	}
+	if (!nr)
+		return;
+
+	b->memory_nid = pws[0].memory_nid;
+	b->pid = pws[0].pid;
+	b->tgid = pws[0].tgid;
+	b->flags = FAULT_FLAG_SPECULATIVE;
+	b->nr = nr;
+
+	if (unlikely(pcache_fill_remote_batch(b, prefetch_reply_buf))) {
+		for (i = 0; i < nr; i++)
+			b->retval[i] = -EFAULT;
+	}
+
+	for (i = 0; i < nr; i++) {
+		pf = &prefetch_fills[i];
+
+		/* Remote reports error if address is not within any vma */
+		if (unlikely(b->retval[i])) {
+			put_pcache(pf->pcm);
+			inc_pcache_event(PCACHE_PREFETCH_FAIL);
+			continue;
+		}
+		prefetch_install(pf);
+	}
+}
+
+static int kpcache_prefetchd(void *unused)
+{
+	struct pcache_prefetch_work pws[PCACHE_MISS_BATCH_MAX];
+	struct pcache_prefetch_info *info;
+	int nr;
+
+	if (pin_current_thread())
+		panic("Fail to pin pcache prefetch thread");
+
+	for (;;) {
+		while (!has_pending_prefetch_work())
+			cpu_relax();
+
+		while ((nr = dequeue_prefetch_works(pws, PCACHE_MISS_BATCH_MAX))) {
+			info = &pws[0].mm->pcache_prefetch;
+
+			/* Leave the slots of a busy memory node to real misses */
+			if (unlikely(pcache_memory_node_congested(pws[0].memory_nid)))
+				mod_pcache_event(PCACHE_PREFETCH_THROTTLED, nr);
+			else if (likely(!READ_ONCE(info->exiting)))
+				do_prefetch_works(pws, nr);
+
+			smp_mb__before_atomic();
+			atomic_sub(nr, &info->nr_inflight);
+		}
+	}
+	return 0;
+}
+
+/* Has to be called after kthreadd is running */
+void __init pcache_prefetch_post_init(void)
+{
+	prefetch_reply_buf = kmalloc(P2M_PCACHE_MISS_BATCH_REPLY_SIZE(PCACHE_MISS_BATCH_MAX),
+				     GFP_KERNEL);
+	if (!prefetch_reply_buf)
+		panic("Fail to allocate pcache prefetch buffer!");
+
+	prefetch_thread = kthread_run(kpcache_prefetchd, NULL, "kpcache_prefetchd");
+	if (IS_ERR(prefetch_thread))
+		panic("Fail to create pcache prefetch thread!");
+}
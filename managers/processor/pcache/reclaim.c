@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2016-2019 Wuklab, Purdue University. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Background pcache reclaim
+ *
+ * Without this, pcache_alloc() evicts synchronously once a set has no free
+ * lines left, and the faulting thread pays for victim selection, unmap,
+ * TLB shootdown and flush. kpcache_reclaimd instead evicts ahead of time:
+ * whenever an allocation leaves a set below its low watermark, the set is
+ * queued, and the daemon evicts lines until the high watermark is reached.
+ *
+ * Each set also counts how many times it asked for reclaim since it was
+ * served last time. The daemon serves the sets with highest pressure first,
+ * so hot sets are refilled before a burst of faults drains them again.
+ */
+
+#include <lego/mm.h>
+#include <lego/smp.h>
+#include <lego/slab.h>
+#include <lego/kernel.h>
+#include <lego/jiffies.h>
+#include <lego/kthread.h>
+#include <lego/profile.h>
+#include <processor/pcache.h>
+#include <processor/processor.h>
+
+#define NR_RECLAIM_QUEUE	(1024)
+
+/* Number of queued sets sorted and served in one round */
+#define NR_RECLAIM_BATCH	(64)
+
+/* Give up a set after this many unsuccessful evictions in a row */
+#define RECLAIM_MAX_RETRY	(PCACHE_ASSOCIATIVITY)
+
+static DEFINE_SPINLOCK(reclaim_queue_lock);
+static unsigned long reclaim_head;
+static unsigned long reclaim_tail;
+static struct pcache_set *reclaim_queue[NR_RECLAIM_QUEUE];
+static struct task_struct *reclaim_thread;
+
+/*
+ * Called by pcache_alloc() when @pset is below its low watermark.
+ * A set is queued at most once. If it is already queued, we only
+ * bump its pressure, so the daemon will serve it earlier.
+ */
+void __pcache_reclaim_wakeup(struct pcache_set *pset)
+{
+	atomic_inc(&pset->reclaim_pressure);
+
+	if (atomic_read(&pset->reclaim_queued) ||
+	    atomic_xchg(&pset->reclaim_queued, 1))
+		return;
+
+	spin_lock(&reclaim_queue_lock);
+	if (unlikely(reclaim_head - reclaim_tail >= NR_RECLAIM_QUEUE)) {
+		spin_unlock(&reclaim_queue_lock);
+		atomic_set(&pset->reclaim_queued, 0);
+		inc_pcache_event(PCACHE_RECLAIM_QUEUE_FULL);
+		return;
+	}
+	reclaim_queue[reclaim_head % NR_RECLAIM_QUEUE] = pset;
+	smp_wmb();
+	WRITE_ONCE(reclaim_head, reclaim_head + 1);
+	spin_unlock(&reclaim_queue_lock);
+
+	inc_pcache_event(PCACHE_RECLAIM_QUEUED);
+}
+
+struct reclaim_candidate {
+	struct pcache_set	*pset;
+	int			pressure;
+};
+
+static int dequeue_reclaim_sets(struct reclaim_candidate *cands, int max)
+{
+	int nr = 0;
+
+	spin_lock(&reclaim_queue_lock);
+	while (nr < max && reclaim_tail != reclaim_head) {
+		cands[nr++].pset = reclaim_queue[reclaim_tail % NR_RECLAIM_QUEUE];
+		reclaim_tail++;
+	}
+	spin_unlock(&reclaim_queue_lock);
+	return nr;
+}
+
+static inline bool has_pending_reclaim(void)
+{
+	return READ_ONCE(reclaim_tail) != READ_ONCE(reclaim_head);
+}
+
+/* Sort by pressure, highest first */
+static int cmp_reclaim_candidate(const void *a, const void *b)
+{
+	const struct reclaim_candidate *ca = a, *cb = b;
+
+	return cb->pressure - ca->pressure;
+}
+
+static void reclaim_pset(struct pcache_set *pset)
+{
+	int nr_evicted, nr_retry = 0;
+
+	/*
+	 * Clear before reclaiming: allocations that happen
+	 * after we start will queue this set again.
+	 */
+	atomic_set(&pset->reclaim_pressure, 0);
+	atomic_set(&pset->reclaim_queued, 0);
+	smp_mb();
+
+	/* Lines of one round share a single TLB shootdown */
+	while (pset_nr_free(pset) < PCACHE_RECLAIM_WMARK_HIGH) {
+		nr_evicted = pcache_evict_lines(pset,
+				PCACHE_RECLAIM_WMARK_HIGH - pset_nr_free(pset));
+		/* Lines are unlocked, unpin what lazy fork held back */
+		lazy_fork_resolve_pinned();
+
+		if (likely(nr_evicted)) {
+			mod_pcache_event(PCACHE_RECLAIM_EVICTED, nr_evicted);
+			nr_retry = 0;
+			continue;
+		}
+
+		/*
+		 * Lines are in use or being filled, or the mechanism
+		 * could not make progress. Leave it to direct eviction.
+		 */
+		if (++nr_retry > RECLAIM_MAX_RETRY) {
+			inc_pcache_event(PCACHE_RECLAIM_FAIL);
+			break;
+		}
+	}
+}
+
+static int kpcache_reclaimd(void *unused)
+{
+	struct reclaim_candidate cands[NR_RECLAIM_BATCH];
+	int i, nr;
+
+	if (pin_current_thread())
+		panic("Fail to pin pcache reclaim thread");
+
+	for (;;) {
+		while (!has_pending_reclaim())
+			cpu_relax();
+
+		/*
+		 * Snapshot pressure first, it keeps changing
+		 * while allocations go on.
+		 */
+		nr = dequeue_reclaim_sets(cands, NR_RECLAIM_BATCH);
+		for (i = 0; i < nr; i++)
+			cands[i].pressure = atomic_read(&cands[i].pset->reclaim_pressure);
+		sort(cands, nr, sizeof(*cands), cmp_reclaim_candidate, NULL);
+
+		for (i = 0; i < nr; i++)
+			reclaim_pset(cands[i].pset);
+	}
+	return 0;
+}
+
+/* Has to be called after kthreadd is running */
+int __init pcache_reclaimd_init(void)
+{
+	reclaim_thread = kthread_run(kpcache_reclaimd, NULL, "kpcache_reclaimd");
+	if (IS_ERR(reclaim_thread))
+		return PTR_ERR(reclaim_thread);
+
+	pr_info("pcache: reclaimd watermark low %d high %d\n",
+		PCACHE_RECLAIM_WMARK_LOW, PCACHE_RECLAIM_WMARK_HIGH);
+	return 0;
+}
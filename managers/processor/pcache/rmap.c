@@ -44,44 +44,32 @@ static inline void rmap_debug(const char *fmt, ...) { }
  */
 
 /*
- * This is a pre-allocated pcache_rmap array.
- * It has a one-to-one mapping to pcache_meta_map.
- * Both are referenced by the same index.
+ * The first rmap of a pcm is embedded in pcache_meta itself.
+ * What if one pcm requires multiple rmaps (e.g. fork)? We use kmalloc,
+ * and link them to pcm->rmap list. Do note commonly each pcm is only
+ * mapped to one single process, so the fill path never allocates or
+ * touches any cacheline other than pcm's own.
  *
- * What if one pcm requires multiple rmaps (e.g. fork)? We use kmalloc.
- * Do note commonly each pcm is only mapped to one single process.
- * Thus this should speed things up a lot.
+ * @pcm is locked when called, which serializes the Used flag.
  */
-static struct pcache_rmap *rmap_map;
-
-static inline struct pcache_rmap *index_to_pcache_rmap(unsigned long index)
-{
-	return &rmap_map[index];
-}
-
 static struct pcache_rmap *alloc_pcache_rmap(struct pcache_meta *pcm)
 {
 	struct pcache_rmap *rmap;
-	unsigned long index;
-
-	index = __pcache_meta_index(pcm);
-	rmap = index_to_pcache_rmap(index);
 
-	/* Atomic test-and-set is a sync point */
-	if (unlikely(TestSetRmapUsed(rmap))) {
-		rmap = kzalloc(sizeof(*rmap), GFP_KERNEL);
-		if (unlikely(!rmap))
-			goto out;
-
-		SetRmapKmalloced(rmap);
-		inc_pcache_event(PCACHE_RMAP_ALLOC_KMALLOC);
+	rmap = &pcm->rmap_inline;
+	if (likely(!RmapUsed(rmap))) {
+		SetRmapUsed(rmap);
+		goto out;
 	}
 
-	/*
-	 * No need to clear other fields
-	 * because it will soon be filled
-	 */
+	rmap = kzalloc(sizeof(*rmap), GFP_KERNEL);
+	if (unlikely(!rmap))
+		return NULL;
+
+	SetRmapKmalloced(rmap);
+	SetRmapUsed(rmap);
 	INIT_LIST_HEAD(&rmap->next);
+	inc_pcache_event(PCACHE_RMAP_ALLOC_KMALLOC);
 
 out:
 	inc_pcache_event(PCACHE_RMAP_ALLOC);
@@ -93,13 +81,14 @@ static void free_pcache_rmap(struct pcache_rmap *rmap)
 	PCACHE_BUG_ON_RMAP(RmapReserved(rmap), rmap);
 
 	if (unlikely(RmapKmalloced(rmap))) {
+		list_del(&rmap->next);
 		kfree(rmap);
 		inc_pcache_event(PCACHE_RMAP_FREE_KMALLOC);
 		goto out;
 	}
 
 	/*
-	 * Otherwise it is from pr-allocated array.
+	 * Otherwise it is the one embedded in pcm.
 	 * Just clear the Used flag.
 	 */
 	if (unlikely(!TestClearRmapUsed(rmap))) {
@@ -385,6 +374,27 @@ out:
 	return ptep;
 }
 
+/*
+ * Remember that @mm has lines in the set of @address, so that exit only
+ * walks those sets. Bits are never cleared during the lifetime of @mm,
+ * a stale bit just costs one extra set scan at exit.
+ */
+static inline void pcache_mark_resident(struct mm_struct *mm,
+					unsigned long address)
+{
+	unsigned long *map = mm->pcache_resident_sets;
+	unsigned long index;
+
+	/* Allocation failed, exit falls back to pgtable walk */
+	if (unlikely(!map))
+		return;
+
+	/* Most fills hit an already marked set, avoid the locked op */
+	index = user_vaddr_to_set_index(address);
+	if (!test_bit(index, map))
+		set_bit(index, map);
+}
+
 /**
  * pcache_add_rmap
  * @pcm: pcache line in question
@@ -425,10 +435,16 @@ int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
 	BUG_ON(!thread_group_leader(owner_process));
 	rmap->owner_process = owner_process;
 
-	if (likely(list_empty(&pcm->rmap)))
+	if (likely(atomic_read(&pcm->mapcount) == 0))
 		goto add;
 
 	/* No duplication */
+	pos = &pcm->rmap_inline;
+	if (pos != rmap && RmapUsed(pos)) {
+		BUG_ON(pos->page_table == page_table);
+		BUG_ON(pos->owner_mm == owner_mm);
+		BUG_ON(pos->owner_process == owner_process);
+	}
 	list_for_each_entry(pos, &pcm->rmap, next) {
 		BUG_ON(pos->page_table == page_table);
 		BUG_ON(pos->owner_mm == owner_mm);
@@ -437,8 +453,10 @@ int pcache_add_rmap(struct pcache_meta *pcm, pte_t *page_table,
 
 add:
 	ret = 0;
-	list_add(&rmap->next, &pcm->rmap);
+	if (unlikely(RmapKmalloced(rmap)))
+		list_add(&rmap->next, &pcm->rmap);
 	atomic_inc(&pcm->mapcount);
+	pcache_mark_resident(owner_mm, address);
 
 	/*
 	 * Also informs eviction code that we could be
@@ -460,7 +478,6 @@ out:
 static inline void __pcache_remove_rmap(struct pcache_meta *pcm,
 				        struct pcache_rmap *rmap)
 {
-	list_del(&rmap->next);
 	free_pcache_rmap(rmap);
 
 	/*
@@ -744,7 +761,7 @@ static int pcache_move_pte_slowpath(struct mm_struct *mm,
 	BUG_ON(!old_pcm);
 
 	/* Alloc a line in the new set */
-	new_pcm = pcache_alloc(new_addr, DISABLE_PIGGYBACK);
+	new_pcm = pcache_alloc_ptl(mm, new_addr);
 	if (unlikely(!new_pcm)) {
 		ret = -ENOMEM;
 		goto out;
@@ -920,6 +937,9 @@ int pcache_zap_pte(struct mm_struct *mm, unsigned long address,
 	rmap_walk(pcm, &rwc);
 	unlock_pcache(pcm);
 
+	if (pte_young(ptent))
+		pcache_prefetch_referenced(pcm);
+
 	/*
 	 * Failure is not an option!
 	 * Why? You ask. Well, the above few lines of code make sure if we are
@@ -945,11 +965,135 @@ int pcache_zap_pte(struct mm_struct *mm, unsigned long address,
 	return 0;
 }
 
+struct pcache_zap_mm_control {
+	struct mm_struct *mm;
+	struct tlb_gather *tlb;
+	bool zapped;
+	bool dirty;
+};
+
+/*
+ * Called with @pcm locked.
+ * An mm maps one pcm at most once, the walk stops at the first match.
+ */
+static int __pcache_zap_mm_one(struct pcache_meta *pcm,
+			       struct pcache_rmap *rmap, void *arg)
+{
+	struct pcache_zap_mm_control *zmc = arg;
+	spinlock_t *ptl = NULL;
+	pte_t *pte;
+	pte_t pteval;
+
+	if (rmap->owner_mm != zmc->mm)
+		return PCACHE_RMAP_AGAIN;
+
+	/* PTE is cleared already, whoever reserved it frees the rmap */
+	if (unlikely(RmapReserved(rmap)))
+		return PCACHE_RMAP_SUCCEED;
+
+	pte = rmap_get_pte_locked(pcm, rmap, &ptl);
+	if (unlikely(!pte))
+		return PCACHE_RMAP_SUCCEED;
+
+	pteval = ptep_get_and_clear(0, pte);
+	if (pte_dirty(pteval))
+		zmc->dirty = true;
+	tlb_gather_page(zmc->tlb, zmc->mm, rmap->address);
+
+	__pcache_remove_rmap(pcm, rmap);
+	spin_unlock(ptl);
+
+	zmc->zapped = true;
+	return PCACHE_RMAP_SUCCEED;
+}
+
+/**
+ * pcache_zap_mm_pset
+ * @pset: a set @mm has lines in
+ * @mm: the exiting mm
+ * @nr_dirty: return the number of dirty lines dropped
+ *
+ * Zap all lines of @pset that are mapped by @mm. Nobody will ever read
+ * the content again, dirty lines are dropped without flush. Lines are
+ * released as one batch: PTEs of the whole set are cleared first, then
+ * one TLB flush, then the lines are freed.
+ *
+ * Lock ordering is pcache then pte, same as eviction. Return the number
+ * of lines zapped.
+ */
+int pcache_zap_mm_pset(struct pcache_set *pset, struct mm_struct *mm,
+		       int *nr_dirty)
+{
+	struct pcache_meta *pcm, *batch[PCACHE_ASSOCIATIVITY];
+	struct tlb_gather tlb;
+	struct pcache_zap_mm_control zmc = {
+		.mm = mm,
+		.tlb = &tlb,
+	};
+	struct rmap_walk_control rwc = {
+		.arg = &zmc,
+		.rmap_one = __pcache_zap_mm_one,
+	};
+	int way, i, nr_batch = 0;
+
+	*nr_dirty = 0;
+	tlb_gather_init(&tlb);
+
+	for (way = 0; way < PCACHE_ASSOCIATIVITY; way++) {
+		pcm = pcache_set_way_to_pcache_meta(pset, way);
+
+		/* Free, or being freed */
+		if (!get_pcache_unless_zero(pcm))
+			continue;
+
+		/*
+		 * Not mapped, or being filled by someone else:
+		 * our own fills and prefetch have finished.
+		 */
+		if (!PcacheValid(pcm))
+			goto put;
+
+		zmc.zapped = false;
+		zmc.dirty = false;
+
+		lock_pcache(pcm);
+		rmap_walk(pcm, &rwc);
+		unlock_pcache(pcm);
+
+		if (zmc.zapped) {
+			if (zmc.dirty)
+				(*nr_dirty)++;
+			batch[nr_batch++] = pcm;
+			continue;
+		}
+put:
+		put_pcache(pcm);
+	}
+
+	tlb_gather_flush(&tlb);
+
+	/* Drop the ref held by the removed rmap, and ours */
+	for (i = 0; i < nr_batch; i++) {
+		put_pcache(batch[i]);
+		put_pcache(batch[i]);
+	}
+	return nr_batch;
+}
+
+/*
+ * @dirty: set if any of the unmapped PTEs was dirty
+ * @tlb: where the TLB shootdown of unmapped PTEs is gathered
+ */
+struct pcache_unmap_control {
+	bool dirty;
+	struct tlb_gather *tlb;
+};
+
 static int pcache_try_to_unmap_one(struct pcache_meta *pcm,
 				   struct pcache_rmap *rmap, void *arg)
 {
 	int ret = PCACHE_RMAP_AGAIN;
-	bool *dirty = arg;
+	struct pcache_unmap_control *uc = arg;
 	spinlock_t *ptl = NULL;
 	pte_t *pte;
 	pte_t pteval;
@@ -968,16 +1112,17 @@ static int pcache_try_to_unmap_one(struct pcache_meta *pcm,
 		 * Otherwise it is undefined behaviour.
 		 */
 		if (pte_dirty(pteval))
-			*dirty = true;
+			uc->dirty = true;
+
+		if (pte_young(pteval))
+			pcache_prefetch_referenced(pcm);
 
 		/*
-		 * Flush any stale TLB entries.
-		 * After this, pgfault on other cores will
+		 * Stale TLB entries are shot down when the gather
+		 * is flushed. After that, pgfault on other cores will
 		 * follow immediately, if they access this page.
 		 */
-		flush_tlb_mm_range(rmap->owner_mm,
-				   rmap->address,
-				   rmap->address + PAGE_SIZE -1);
+		tlb_gather_page(uc->tlb, rmap->owner_mm, rmap->address);
 	}
 
 	__pcache_remove_rmap(pcm, rmap);
@@ -991,7 +1136,7 @@ static int pcache_try_to_unmap_reserve_one(struct pcache_meta *pcm,
 					   struct pcache_rmap *rmap, void *arg)
 {
 	int ret = PCACHE_RMAP_AGAIN;
-	bool *dirty = arg;
+	struct pcache_unmap_control *uc = arg;
 	spinlock_t *ptl = NULL;
 	pte_t *pte;
 	pte_t pteval;
@@ -1010,16 +1155,17 @@ static int pcache_try_to_unmap_reserve_one(struct pcache_meta *pcm,
 		 * Otherwise it is undefined behaviour.
 		 */
 		if (pte_dirty(pteval))
-			*dirty = true;
+			uc->dirty = true;
+
+		if (pte_young(pteval))
+			pcache_prefetch_referenced(pcm);
 
 		/*
-		 * Flush any stale TLB entries.
-		 * After this, pgfault on other cores will
+		 * Stale TLB entries are shot down when the gather
+		 * is flushed. After that, pgfault on other cores will
 		 * follow immediately, if they access this page.
 		 */
-		flush_tlb_mm_range(rmap->owner_mm,
-				   rmap->address,
-				   rmap->address + PAGE_SIZE -1);
+		tlb_gather_page(uc->tlb, rmap->owner_mm, rmap->address);
 	}
 
 	SetRmapReserved(rmap);
@@ -1033,6 +1179,26 @@ static int pcache_mapcount_is_zero(struct pcache_meta *pcm)
 	return !pcache_mapcount(pcm);
 }
 
+static bool __pcache_try_to_unmap(struct pcache_meta *pcm,
+		int (*rmap_one)(struct pcache_meta *, struct pcache_rmap *, void *),
+		struct tlb_gather *tlb)
+{
+	struct pcache_unmap_control uc = {
+		.dirty = false,
+		.tlb = tlb,
+	};
+	struct rmap_walk_control rwc = {
+		.rmap_one = rmap_one,
+		.done = pcache_mapcount_is_zero,
+		.arg = &uc,
+	};
+
+	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
+
+	rmap_walk(pcm, &rwc);
+	return uc.dirty;
+}
+
 /**
  * pcache_try_to_unmap
  * @pcm: the pcache to get unmapped
@@ -1050,20 +1216,15 @@ static int pcache_mapcount_is_zero(struct pcache_meta *pcm)
  */
 int pcache_try_to_unmap(struct pcache_meta *pcm)
 {
-	int ret;
-	bool dirty = false;
-	struct rmap_walk_control rwc = {
-		.rmap_one = pcache_try_to_unmap_one,
-		.done = pcache_mapcount_is_zero,
-		.arg = &dirty,
-	};
+	struct tlb_gather tlb;
 
-	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
+	tlb_gather_init(&tlb);
+	__pcache_try_to_unmap(pcm, pcache_try_to_unmap_one, &tlb);
+	tlb_gather_flush(&tlb);
 
-	ret = rmap_walk(pcm, &rwc);
 	if (!pcache_mapcount(pcm))
-		ret = PCACHE_RMAP_SUCCEED;
-	return ret;
+		return PCACHE_RMAP_SUCCEED;
+	return PCACHE_RMAP_AGAIN;
 }
 
 /*
@@ -1072,23 +1233,25 @@ int pcache_try_to_unmap(struct pcache_meta *pcm)
  */
 bool pcache_try_to_unmap_check_dirty(struct pcache_meta *pcm)
 {
-	bool dirty = false;
-	struct rmap_walk_control rwc = {
-		.rmap_one = pcache_try_to_unmap_one,
-		.done = pcache_mapcount_is_zero,
-		.arg = &dirty,
-	};
+	struct tlb_gather tlb;
+	bool dirty;
 
-	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
-
-	/*
-	 * No need to check return value though.
-	 * Caller cares about dirty value more..
-	 */
-	rmap_walk(pcm, &rwc);
+	tlb_gather_init(&tlb);
+	dirty = __pcache_try_to_unmap(pcm, pcache_try_to_unmap_one, &tlb);
+	tlb_gather_flush(&tlb);
 	return dirty;
 }
 
+/*
+ * Same as above, but TLB shootdown is only gathered into @tlb.
+ * Caller must flush @tlb before it reads or frees the line.
+ */
+bool pcache_try_to_unmap_check_dirty_tlb(struct pcache_meta *pcm,
+					 struct tlb_gather *tlb)
+{
+	return __pcache_try_to_unmap(pcm, pcache_try_to_unmap_one, tlb);
+}
+
 /**
  * pcache_try_to_unmap_reserve
  * @pcm: the pcache to get unmapped
@@ -1099,16 +1262,7 @@ bool pcache_try_to_unmap_check_dirty(struct pcache_meta *pcm)
  */
 int pcache_try_to_unmap_reserve(struct pcache_meta *pcm)
 {
-	bool dirty = false;
-	struct rmap_walk_control rwc = {
-		.rmap_one = pcache_try_to_unmap_reserve_one,
-		.done = pcache_mapcount_is_zero,
-		.arg = &dirty,
-	};
-
-	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
-
-	rmap_walk(pcm, &rwc);
+	pcache_try_to_unmap_reserve_check_dirty(pcm);
 	return PCACHE_RMAP_SUCCEED;
 }
 
@@ -1119,19 +1273,22 @@ int pcache_try_to_unmap_reserve(struct pcache_meta *pcm)
  */
 bool pcache_try_to_unmap_reserve_check_dirty(struct pcache_meta *pcm)
 {
-	bool dirty = false;
-	struct rmap_walk_control rwc = {
-		.rmap_one = pcache_try_to_unmap_reserve_one,
-		.done = pcache_mapcount_is_zero,
-		.arg = &dirty,
-	};
-
-	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
+	struct tlb_gather tlb;
+	bool dirty;
 
-	rmap_walk(pcm, &rwc);
+	tlb_gather_init(&tlb);
+	dirty = __pcache_try_to_unmap(pcm, pcache_try_to_unmap_reserve_one, &tlb);
+	tlb_gather_flush(&tlb);
 	return dirty;
 }
 
+/* Caller must flush @tlb before it reads or frees the line */
+bool pcache_try_to_unmap_reserve_check_dirty_tlb(struct pcache_meta *pcm,
+						 struct tlb_gather *tlb)
+{
+	return __pcache_try_to_unmap(pcm, pcache_try_to_unmap_reserve_one, tlb);
+}
+
 static int pcache_free_reserved_rmap_one(struct pcache_meta *pcm,
 					 struct pcache_rmap *rmap, void *arg)
 {
@@ -1283,9 +1440,34 @@ int pcache_referenced(struct pcache_meta *pcm)
 
 	rmap_walk(pcm, &rwc);
 
+	if (prc.referenced)
+		pcache_prefetch_referenced(pcm);
 	return prc.referenced;
 }
 
+#ifdef CONFIG_PCACHE_LAZY_FORK
+/*
+ * A dirty line mapped by a pmd write-protected by lazy fork, may still be
+ * copied to a child. The child has no rmap yet, eviction would only flush
+ * it to the parent's memory.
+ */
+static inline bool rmap_lazy_fork_pinned(struct pcache_rmap *rmap, pte_t *pte)
+{
+	pmd_t *pmd;
+
+	if (!pte_dirty(*pte))
+		return false;
+
+	pmd = rmap_get_pmd(rmap->owner_mm, rmap->address);
+	return !pmd_write(*pmd);
+}
+#else
+static inline bool rmap_lazy_fork_pinned(struct pcache_rmap *rmap, pte_t *pte)
+{
+	return false;
+}
+#endif
+
 static int pcache_referenced_trylock_one(struct pcache_meta *pcm,
 					 struct pcache_rmap *rmap, void *arg)
 {
@@ -1312,6 +1494,15 @@ static int pcache_referenced_trylock_one(struct pcache_meta *pcm,
 	if (unlikely(!pte))
 		return PCACHE_RMAP_AGAIN;
 
+	/* Pinned by lazy fork, treat it like contention */
+	if (unlikely(rmap_lazy_fork_pinned(rmap, pte))) {
+		lazy_fork_note_pinned(rmap->owner_mm, rmap->address);
+		spin_unlock(ptl);
+		inc_pcache_event(PCACHE_LAZY_FORK_PINNED);
+		prc->pte_contention = 1;
+		goto out;
+	}
+
 	if (ptep_clear_flush_young(pte))
 		prc->referenced = 1;
 	spin_unlock(ptl);
@@ -1357,6 +1548,8 @@ void pcache_referenced_trylock(struct pcache_meta *pcm,
 
 	rmap_walk(pcm, &rwc);
 
+	if (prc.referenced)
+		pcache_prefetch_referenced(pcm);
 out:
 	*pte_referenced = prc.referenced;
 	*pte_contention = prc.pte_contention;
@@ -1376,11 +1569,21 @@ int rmap_walk(struct pcache_meta *pcm, struct rmap_walk_control *rwc)
 
 	PCACHE_BUG_ON_PCM(!PcacheLocked(pcm), pcm);
 
+	rmap = &pcm->rmap_inline;
+	if (likely(RmapUsed(rmap))) {
+		ret = rwc->rmap_one(pcm, rmap, rwc->arg);
+		if (ret != PCACHE_RMAP_AGAIN)
+			return ret;
+
+		if (rwc->done && rwc->done(pcm))
+			return ret;
+	}
+
 	/*
 	 * In case someone called rmap without checking mapcount.
 	 * Otherwise we might end up looping forever below.
 	 */
-	if (unlikely(list_empty(&pcm->rmap)))
+	if (likely(list_empty(&pcm->rmap)))
 		return ret;
 
 	list_for_each_entry_safe(rmap, keeper, &pcm->rmap, next) {
@@ -1394,22 +1597,3 @@ int rmap_walk(struct pcache_meta *pcm, struct rmap_walk_control *rwc)
 
 	return ret;
 }
-
-/*
- * Called during early boot
- * where we want to use memblock to reserve large map..
- */
-void __init alloc_pcache_rmap_map(void)
-{
-	size_t size, total;
-
-	size = sizeof(struct pcache_rmap);
-	total = size * nr_cachelines;
-
-	rmap_map = memblock_virt_alloc(total, PAGE_SIZE);
-	if (!rmap_map)
-		panic("Unable to allocate rmap map!");
-
-	pr_info("%s(): rmap size: %zu B, total reserved: %zu B, at %p - %p\n",
-		__func__, size, total, rmap_map, rmap_map + total);
-}
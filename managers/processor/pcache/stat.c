@@ -21,6 +21,7 @@ static const char *const pcache_event_text[] = {
 	"nr_clflush_clean_skipped",
 	"nr_clflush_fail",
 	"nr_clflush_piggyback_fallback",
+	"nr_clflush_batch",
 
 	/* write-protection fault */
 	"nr_pgfault_wp",
@@ -33,6 +34,8 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_fill_from_memory",
 	"nr_pcache_fill_from_memory_piggyback",
 	"nr_pcache_fill_from_memory_piggyback_fallback",
+	"nr_pcache_fill_batch",
+	"nr_pcache_fill_batch_lines",
 	"nr_pcache_fill_from_victim",			/* victim cache specific */
 
 	"nr_pcache_eviction_triggered",
@@ -41,9 +44,11 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_eviction_failure_find",
 	"nr_pcache_eviction_failure_evict",
 	"nr_pcache_eviction_succeed",
+	"nr_pcache_eviction_batch",
 
 	"nr_pset_list_lookup",
 	"nr_pset_list_hit",
+	"nr_pset_list_wait",
 
         "nr_victim_lookup",
         "nr_victim_hit",
@@ -68,6 +73,18 @@ static const char *const pcache_event_text[] = {
 	"nr_sweep_nr_pset",
 	"nr_sweep_nr_moved_pcm",
 
+	/* clock */
+	"nr_clock_scanned",
+	"nr_clock_second_chance",
+
+	/* adaptive replacement */
+	"nr_arc_promote",
+	"nr_arc_frequent_hit",
+	"nr_arc_evict_recent",
+	"nr_arc_evict_frequent",
+	"nr_arc_ghost_hit_recent",
+	"nr_arc_ghost_hit_frequent",
+
 	"nr_mremap_pset_same",
 	"nr_mremap_pset_diff",
 
@@ -80,6 +97,66 @@ static const char *const pcache_event_text[] = {
 	"nr_pcache_pee_alloc_kmalloc",
 	"nr_pcache_pee_free",
 	"nr_pcache_pee_free_kmalloc",
+
+	/* prefetch */
+	"nr_pcache_prefetch_triggered",
+	"nr_pcache_prefetch_issued",
+	"nr_pcache_prefetch_queue_full",
+	"nr_pcache_prefetch_skipped",
+	"nr_pcache_prefetch_filled",
+	"nr_pcache_prefetch_race",
+	"nr_pcache_prefetch_fail",
+	"nr_pcache_prefetch_hit",
+	"nr_pcache_prefetch_unused",
+	"nr_pcache_prefetch_throttled",
+
+	/* reclaim */
+	"nr_pcache_reclaim_queued",
+	"nr_pcache_reclaim_queue_full",
+	"nr_pcache_reclaim_evicted",
+	"nr_pcache_reclaim_fail",
+
+	/* exit */
+	"nr_pcache_exit_pset_scanned",
+	"nr_pcache_exit_zapped",
+	"nr_pcache_exit_dirty_dropped",
+	"nr_pcache_exit_full_walk",
+
+	/* lazy fork */
+	"nr_pcache_lazy_fork_deferred",
+	"nr_pcache_lazy_fork_copied",
+	"nr_pcache_lazy_fork_dropped",
+	"nr_pcache_lazy_fork_eager",
+	"nr_pcache_lazy_fork_pinned",
+	"nr_pcache_lazy_fork_unpinned",
+
+	/* extent fill */
+	"nr_pcache_extent_fill",
+	"nr_pcache_extent_fill_lines",
+	"nr_pcache_extent_fill_skipped",
+	"nr_pcache_extent_fill_rejected",
+	"nr_pcache_extent_fill_busy",
+
+	/* madvise */
+	"nr_pcache_madvise_willneed",
+	"nr_pcache_madvise_dontneed",
+	"nr_pcache_madvise_cold",
+
+	/* fault-around */
+	"nr_pcache_fault_around",
+	"nr_pcache_fault_around_lines",
+	"nr_pcache_fault_around_skipped",
+	"nr_pcache_fault_around_refused",
+	"nr_pcache_fault_around_busy",
+
+	/* compressed tier */
+	"nr_pcache_ctier_store",
+	"nr_pcache_ctier_store_bytes",
+	"nr_pcache_ctier_store_fail",
+	"nr_pcache_ctier_hit",
+	"nr_pcache_ctier_miss",
+	"nr_pcache_ctier_drop",
+	"nr_pcache_ctier_invalidate",
 };
 
 void print_pcache_events(void)
@@ -92,4 +169,6 @@ void print_pcache_events(void)
 		pr_info("%s: %lu\n", pcache_event_text[i],
 			atomic_long_read(&pcache_event_stats.event[i]));
 	}
+
+	print_victim_flush_stats();
 }
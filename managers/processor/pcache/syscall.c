@@ -39,3 +39,8 @@ SYSCALL_DEFINE1(pcache_stat, struct pcache_stat __user *, statbuf)
 		return -EFAULT;
 	return 0;
 }
+
+SYSCALL_DEFINE3(pcache_partition, int, op, int, group, unsigned long, arg)
+{
+	return pcache_partition_ctl(op, group, arg);
+}
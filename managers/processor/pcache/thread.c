@@ -44,6 +44,10 @@ int fork_dup_pcache(struct task_struct *dst_task,
 	int ret, i, nr_vmas = fork_reply->vma_count;
 	unsigned long start, end, flags;
 
+	if (IS_ENABLED(CONFIG_PCACHE_LAZY_FORK))
+		return lazy_fork_dup_pcache(dst_task, dst_mm, src_mm,
+					    vmas, nr_vmas);
+
 	/*
 	 * We walk through pgtable based on vma range and flags.
 	 * We need to wrprotect most of the pte entries..
@@ -65,20 +69,74 @@ int fork_dup_pcache(struct task_struct *dst_task,
 	return 0;
 }
 
+/*
+ * One bit per pcache set, set by pcache_add_rmap() when this mm maps a
+ * line of that set. If allocation fails, exit walks the pgtable instead.
+ */
+void pcache_mm_init(struct mm_struct *mm)
+{
+	mm->pcache_resident_sets = kzalloc(BITS_TO_LONGS(nr_cachesets) *
+					   sizeof(unsigned long), GFP_KERNEL);
+	lazy_fork_mm_init(mm);
+	pcache_fault_around_mm_init(mm);
+	pcache_partition_mm_init(mm);
+}
+
+void pcache_mm_free(struct mm_struct *mm)
+{
+	kfree(mm->pcache_resident_sets);
+	mm->pcache_resident_sets = NULL;
+	lazy_fork_mm_free(mm);
+}
+
 /*
  * Called when a process exit
  * Cleanup all pcache lines
  *
+ * Only the sets this mm has mapped lines in are visited, the cost
+ * follows the resident footprint instead of the address space size.
+ * Lines are freed without flush, anonymous data of a dead process is
+ * never read again.
+ *
  * TODO:
- * Anonymous: just free
  * File-backed: flush back
  *
  * Be careful against pcache eviction
  */
 void pcache_process_exit(struct task_struct *tsk)
 {
-	/* will also free rmap */
-	release_pgtable(tsk, PAGE_SIZE, TASK_SIZE);
+	struct mm_struct *mm = tsk->mm;
+	unsigned long *map = mm->pcache_resident_sets;
+	unsigned long index;
+	int nr_zapped, nr_dirty;
+
+	/* Wait for in-flight prefetch into this mm */
+	pcache_prefetch_mm_exit(mm);
+
+	/* Children copy what they still need from us */
+	lazy_fork_mm_exit(mm);
+
+	if (unlikely(!map)) {
+		/* will also free rmap */
+		release_pgtable(tsk, PAGE_SIZE, TASK_SIZE);
+		inc_pcache_event(PCACHE_EXIT_FULL_WALK);
+		return;
+	}
+
+	for_each_set_bit(index, map, nr_cachesets) {
+		nr_zapped = pcache_zap_mm_pset(pcache_set_map + index,
+					       mm, &nr_dirty);
+
+		inc_pcache_event(PCACHE_EXIT_PSET_SCANNED);
+		mod_pcache_event(PCACHE_EXIT_ZAPPED, nr_zapped);
+		mod_pcache_event(PCACHE_EXIT_DIRTY_DROPPED, nr_dirty);
+	}
+
+	/* Nothing is present anymore, clear the rest */
+	free_pgd_range(mm, PAGE_SIZE, TASK_SIZE);
+
+	/* exec() keeps tgid, drop evicted lines of the old image too */
+	pcache_ctier_invalidate_tgid(tsk->tgid);
 }
 
 /*
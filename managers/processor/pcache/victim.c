@@ -474,7 +474,7 @@ retry:
 			jiffies_to_msecs(jiffies - alloc_start),
 			atomic_read(&nr_usable_victims),
 			pcache_set_to_set_index(pset), pcache_set_victim_nr(pset),
-			IS_ENABLED(CONFIG_PCACHE_EVICT_LRU) ? atomic_read(&pset->nr_lru) : 0,
+			pset_nr_lru(pset),
 			address);
 
 		/*
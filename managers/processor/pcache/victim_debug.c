@@ -92,7 +92,7 @@ static void __dump_pcache_victim(struct pcache_victim_meta *victim,
 	if (victim->pset) {
 		vdump("    rmap to pset_idx: %lu nr_hint_victims: %d nr_lru: %d\n",
 			pcache_set_to_set_index(victim->pset), pcache_set_victim_nr(victim->pset),
-			IS_ENABLED(CONFIG_PCACHE_EVICT_LRU) ? atomic_read(&victim->pset->nr_lru) : 0);
+			pset_nr_lru(victim->pset));
 	}
 
 	if (reason)
@@ -125,20 +125,29 @@ static void __dump_all_victim(void)
 
 static void __dump_victim_flush_queue(void)
 {
+	struct victim_flush_queue *q;
 	struct victim_flush_job *job;
 	struct pcache_victim_meta *v;
+	int nid;
 
 	vdump("  --  Start Dump Victim Flush Queue [%d]\n", nr_dumped_flush_queue);
 
-	if (list_empty(&victim_flush_queue)) {
+	if (!nr_flush_queue_jobs()) {
 		vdump("     (empty) [%d]\n", nr_dumped_flush_queue);
 		goto out;
 	}
 
-	list_for_each_entry(job, &victim_flush_queue, next) {
-		v = job->victim;
-		BUG_ON(!v);
-		__dump_pcache_victim_simple(v);
+	for (nid = 0; nid < VICTIM_NR_FLUSH_QUEUES; nid++) {
+		q = &victim_flush_queues[nid];
+		if (list_empty(&q->head))
+			continue;
+
+		vdump("     nid: %d nr_jobs: %d\n", nid, atomic_read(&q->nr_jobs));
+		list_for_each_entry(job, &q->head, next) {
+			v = job->victim;
+			BUG_ON(!v);
+			__dump_pcache_victim_simple(v);
+		}
 	}
 
 out:
@@ -28,41 +28,88 @@
 #include <processor/pcache.h>
 #include <processor/processor.h>
 
+/*
+ * Total number of queued jobs, and the per memory node queues.
+ * A job is queued by the memory node of its victim's first hit.
+ */
 atomic_t nr_flush_jobs = ATOMIC_INIT(0);
-DEFINE_SPINLOCK(victim_flush_lock);
-LIST_HEAD(victim_flush_queue);
-static struct task_struct *victim_flush_thread;
+struct victim_flush_queue victim_flush_queues[VICTIM_NR_FLUSH_QUEUES];
+
+/*
+ * Batched flush
+ *
+ * A flush thread grabs up to VICTIM_FLUSH_BATCH_JOBS jobs from one queue.
+ * Dirty lines of all of them are grouped by memory node, and each group
+ * is sent as one P2M_PCACHE_FLUSH_BATCH request. Jobs are only finished
+ * after all their lines are flushed.
+ */
+#define VICTIM_FLUSH_BATCH_JOBS		8
+#define VICTIM_FLUSH_BATCH_ENTRIES	(4 * PCACHE_FLUSH_BATCH_MAX)
+
+/*
+ * Flush thread @id is homed on queues whose nid % VICTIM_NR_FLUSHD == @id.
+ */
+struct victim_flushd {
+	int			id;
+	struct task_struct	*task;
+	struct victim_flush_job	*jobs[VICTIM_FLUSH_BATCH_JOBS];
+	struct clflush_batch_entry entries[VICTIM_FLUSH_BATCH_ENTRIES];
+};
+
+static struct victim_flushd victim_flushds[VICTIM_NR_FLUSHD];
 
-static inline void __dequeue_victim_flush_job(struct victim_flush_job *job)
+static inline struct victim_flush_queue *victim_flush_queue(unsigned int nid)
+{
+	return &victim_flush_queues[nid];
+}
+
+static inline void
+__dequeue_victim_flush_job(struct victim_flush_queue *q, struct victim_flush_job *job)
 {
 	list_del(&job->next);
+	atomic_dec(&q->nr_jobs);
 	atomic_dec(&nr_flush_jobs);
 
 	/* Sane test only if DEBUG_PCACHE is on */
 	PCACHE_BUG_ON(atomic_read(&nr_flush_jobs) < 0);
 }
 
-static inline void __enqueue_victim_flush_job(struct victim_flush_job *job)
+static inline void
+__enqueue_victim_flush_job(struct victim_flush_queue *q, struct victim_flush_job *job)
 {
-	list_add_tail(&job->next, &victim_flush_queue);
+	int nr_jobs;
+
+	list_add_tail(&job->next, &q->head);
+	nr_jobs = atomic_inc_return(&q->nr_jobs);
 	atomic_inc(&nr_flush_jobs);
 
+	/* Updated under q->lock */
+	if (nr_jobs > atomic_read(&q->max_nr_jobs))
+		atomic_set(&q->max_nr_jobs, nr_jobs);
+
 	/* Sane test only if DEBUG_PCACHE is on */
 	PCACHE_BUG_ON(atomic_read(&nr_flush_jobs) > VICTIM_NR_ENTRIES);
 }
 
-static inline void dequeue_victim_flush_job(struct victim_flush_job *job)
+static inline void enqueue_victim_flush_job(struct victim_flush_job *job)
 {
-	spin_lock(&victim_flush_lock);
-	__dequeue_victim_flush_job(job);
-	spin_unlock(&victim_flush_lock);
+	struct victim_flush_queue *q = victim_flush_queue(job->nid);
+
+	spin_lock(&q->lock);
+	__enqueue_victim_flush_job(q, job);
+	spin_unlock(&q->lock);
 }
 
-static inline void enqueue_victim_flush_job(struct victim_flush_job *job)
+/* Memory node whose queue @victim is flushed through */
+static inline unsigned int victim_flush_nid(struct pcache_victim_meta *victim)
 {
-	spin_lock(&victim_flush_lock);
-	__enqueue_victim_flush_job(job);
-	spin_unlock(&victim_flush_lock);
+	struct pcache_victim_hit_entry *hit;
+
+	hit = list_first_entry_or_null(&victim->hits,
+				       struct pcache_victim_hit_entry, next);
+	if (unlikely(!hit))
+		return 0;
+	return hit->m_nid % VICTIM_NR_FLUSH_QUEUES;
 }
 
 /*
@@ -100,6 +147,7 @@ int victim_submit_flush(struct pcache_victim_meta *victim, bool wait, bool dirty
 		return -ENOMEM;
 	job->victim = victim;
 	job->wait = wait;
+	job->nid = victim_flush_nid(victim);
 	if (unlikely(wait))
 		init_completion(&job->done);
 
@@ -134,10 +182,8 @@ static void victim_flush_one(struct pcache_victim_meta *victim)
 			      entry->m_nid, entry->rep_nid, cache_kva);
 }
 
-void __victim_flush_func(struct victim_flush_job *job)
+static inline void victim_flush_prepare(struct victim_flush_job *job)
 {
-	bool wait = job->wait;
-	struct completion *done = &job->done;
 	struct pcache_victim_meta *victim = job->victim;
 
 	PCACHE_BUG_ON_VICTIM(!VictimHasdata(victim) || !VictimAllocated(victim), victim);
@@ -145,7 +191,15 @@ void __victim_flush_func(struct victim_flush_job *job)
 	PCACHE_BUG_ON_VICTIM(!VictimWaitflush(victim), victim);
 
 	__SetVictimWriteback(victim);
-	victim_flush_one(victim);
+}
+
+/* Called after all hits of @job->victim have been flushed */
+static void victim_flush_finish(struct victim_flush_job *job)
+{
+	bool wait = job->wait;
+	struct completion *done = &job->done;
+	struct pcache_victim_meta *victim = job->victim;
+
 	inc_pcache_event(PCACHE_VICTIM_FLUSH_FINISHED_DIRTY);
 	__ClearVictimWriteback(victim);
 
@@ -168,25 +222,132 @@ void __victim_flush_func(struct victim_flush_job *job)
 	kfree(job);
 }
 
+void __victim_flush_func(struct victim_flush_job *job)
+{
+	victim_flush_prepare(job);
+	victim_flush_one(job->victim);
+	victim_flush_finish(job);
+}
+
 /*
- * Stead a victim flush job from the pending queue.
+ * Stead a victim flush job from any pending queue.
  * Return NULL if we failed.
  */
 struct victim_flush_job *__steal_victim_flush_job(void)
 {
+	struct victim_flush_queue *q;
 	struct victim_flush_job *job = NULL;
+	int nid;
+
+	for (nid = 0; nid < VICTIM_NR_FLUSH_QUEUES && !job; nid++) {
+		q = victim_flush_queue(nid);
 
-	spin_lock(&victim_flush_lock);
-	if (unlikely(!list_empty(&victim_flush_queue))) {
-		job = list_entry(victim_flush_queue.next, struct victim_flush_job, next);
-		__dequeue_victim_flush_job(job);
+		spin_lock(&q->lock);
+		if (unlikely(!list_empty(&q->head))) {
+			job = list_entry(q->head.next, struct victim_flush_job, next);
+			__dequeue_victim_flush_job(q, job);
+		}
+		spin_unlock(&q->lock);
 	}
-	spin_unlock(&victim_flush_lock);
 	return job;
 }
 
-static int victim_flush_async(void *unused)
+/* Flush all @entries, one request per memory node per PCACHE_FLUSH_BATCH_MAX */
+static void victim_flush_entries(struct clflush_batch_entry *entries, int nr)
 {
+	struct clflush_batch_entry batch[PCACHE_FLUSH_BATCH_MAX];
+	struct victim_flush_queue *q;
+	int i, nr_batch, nr_left;
+	unsigned int m_nid;
+	u64 start_ns;
+
+	while (nr > 0) {
+		m_nid = entries[0].m_nid;
+		nr_batch = nr_left = 0;
+
+		/* Pick lines of m_nid, move the rest to the front */
+		for (i = 0; i < nr; i++) {
+			if (entries[i].m_nid == m_nid && nr_batch < PCACHE_FLUSH_BATCH_MAX)
+				batch[nr_batch++] = entries[i];
+			else
+				entries[nr_left++] = entries[i];
+		}
+
+		start_ns = sched_clock();
+		__clflush_batch(m_nid, batch, nr_batch);
+
+		q = victim_flush_queue(m_nid % VICTIM_NR_FLUSH_QUEUES);
+		atomic_long_add(sched_clock() - start_ns, &q->flush_ns);
+		atomic_long_add(nr_batch, &q->nr_lines);
+		atomic_long_inc(&q->nr_requests);
+
+		nr = nr_left;
+	}
+}
+
+static void victim_flush_batch(struct victim_flushd *flushd, int nr_jobs)
+{
+	struct clflush_batch_entry *entries = flushd->entries;
+	struct victim_flush_job **jobs = flushd->jobs;
+	struct pcache_victim_hit_entry *hit;
+	struct pcache_victim_meta *victim;
+	int i, nr = 0;
+
+	for (i = 0; i < nr_jobs; i++) {
+		victim = jobs[i]->victim;
+		victim_flush_prepare(jobs[i]);
+
+		/* Same as victim_flush_one(), hits are stable here */
+		list_for_each_entry(hit, &victim->hits, next) {
+			if (nr == VICTIM_FLUSH_BATCH_ENTRIES) {
+				victim_flush_entries(entries, nr);
+				nr = 0;
+			}
+
+			entries[nr].tgid = hit->tgid;
+			entries[nr].m_nid = hit->m_nid;
+			entries[nr].rep_nid = hit->rep_nid;
+			entries[nr].user_va = hit->address;
+			entries[nr].cache_addr = pcache_victim_to_kva(victim);
+			nr++;
+		}
+	}
+	victim_flush_entries(entries, nr);
+
+	for (i = 0; i < nr_jobs; i++)
+		victim_flush_finish(jobs[i]);
+}
+
+/* Grab up to VICTIM_FLUSH_BATCH_JOBS jobs from @q */
+static int victim_flush_dequeue(struct victim_flush_queue *q,
+				struct victim_flush_job **jobs)
+{
+	struct victim_flush_job *job;
+	int nr_jobs = 0;
+
+	if (!atomic_read(&q->nr_jobs))
+		return 0;
+
+	spin_lock(&q->lock);
+	while (!list_empty(&q->head) && nr_jobs < VICTIM_FLUSH_BATCH_JOBS) {
+		job = list_entry(q->head.next, struct victim_flush_job, next);
+		__dequeue_victim_flush_job(q, job);
+		jobs[nr_jobs++] = job;
+	}
+	spin_unlock(&q->lock);
+	return nr_jobs;
+}
+
+static inline bool victim_flushd_is_home(struct victim_flushd *flushd, int nid)
+{
+	return nid % VICTIM_NR_FLUSHD == flushd->id;
+}
+
+static int victim_flush_async(void *_flushd)
+{
+	struct victim_flushd *flushd = _flushd;
+	int nid, nr_jobs;
+
 	if (pin_current_thread())
 		panic("Fail to pin victim flush");
 
@@ -194,28 +355,84 @@ static int victim_flush_async(void *unused)
 		while (!nr_flush_queue_jobs())
 			cpu_relax();
 
-		spin_lock(&victim_flush_lock);
-		while (!list_empty(&victim_flush_queue)) {
-			struct victim_flush_job *job;
-
-			job = list_entry(victim_flush_queue.next,
-					 struct victim_flush_job, next);
-			__dequeue_victim_flush_job(job);
-			spin_unlock(&victim_flush_lock);
-
-			__victim_flush_func(job);
+		/* Home queues first, so one slow node only delays its own */
+		nr_jobs = 0;
+		for (nid = flushd->id; nid < VICTIM_NR_FLUSH_QUEUES; nid += VICTIM_NR_FLUSHD) {
+			nr_jobs = victim_flush_dequeue(victim_flush_queue(nid), flushd->jobs);
+			if (nr_jobs)
+				break;
+		}
 
-			spin_lock(&victim_flush_lock);
+		/* Then help others */
+		if (!nr_jobs) {
+			for (nid = 0; nid < VICTIM_NR_FLUSH_QUEUES; nid++) {
+				if (victim_flushd_is_home(flushd, nid))
+					continue;
+
+				nr_jobs = victim_flush_dequeue(victim_flush_queue(nid),
+							       flushd->jobs);
+				if (nr_jobs) {
+					atomic_long_add(nr_jobs,
+						&victim_flush_queue(nid)->nr_stolen);
+					break;
+				}
+			}
 		}
-		spin_unlock(&victim_flush_lock);
+
+		if (nr_jobs)
+			victim_flush_batch(flushd, nr_jobs);
 	}
 	return 0;
 }
 
+void print_victim_flush_stats(void)
+{
+	struct victim_flush_queue *q;
+	long nr_requests;
+	int nid;
+
+	for (nid = 0; nid < VICTIM_NR_FLUSH_QUEUES; nid++) {
+		q = victim_flush_queue(nid);
+
+		nr_requests = atomic_long_read(&q->nr_requests);
+		if (!nr_requests && !atomic_read(&q->max_nr_jobs))
+			continue;
+
+		pr_info("victim_flush nid:%d nr_jobs:%d max_nr_jobs:%d nr_stolen:%ld "
+			"nr_requests:%ld nr_lines:%ld avg_flush_ns:%ld\n",
+			nid, atomic_read(&q->nr_jobs), atomic_read(&q->max_nr_jobs),
+			atomic_long_read(&q->nr_stolen), nr_requests,
+			atomic_long_read(&q->nr_lines),
+			nr_requests ? atomic_long_read(&q->flush_ns) / nr_requests : 0);
+	}
+}
+
 /* Has to be called after kthreadd is running */
 void __init victim_cache_post_init(void)
 {
-	victim_flush_thread = kthread_run(victim_flush_async, NULL, "kvictim_flushd");
-	if (IS_ERR(victim_flush_thread))
-		panic("Fail to create victim flush thread!");
+	struct victim_flush_queue *q;
+	struct victim_flushd *flushd;
+	int i;
+
+	for (i = 0; i < VICTIM_NR_FLUSH_QUEUES; i++) {
+		q = victim_flush_queue(i);
+
+		spin_lock_init(&q->lock);
+		INIT_LIST_HEAD(&q->head);
+		atomic_set(&q->nr_jobs, 0);
+		atomic_set(&q->max_nr_jobs, 0);
+		atomic_long_set(&q->nr_stolen, 0);
+		atomic_long_set(&q->nr_requests, 0);
+		atomic_long_set(&q->nr_lines, 0);
+		atomic_long_set(&q->flush_ns, 0);
+	}
+
+	for (i = 0; i < VICTIM_NR_FLUSHD; i++) {
+		flushd = &victim_flushds[i];
+		flushd->id = i;
+		flushd->task = kthread_run(victim_flush_async, flushd,
+					   "kvictim_flushd/%d", i);
+		if (IS_ERR(flushd->task))
+			panic("Fail to create victim flush thread!");
+	}
 }
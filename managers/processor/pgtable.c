@@ -92,12 +92,15 @@ static inline void free_pud_range(struct mm_struct *mm, pgd_t *pgd,
  * it never free any pgtable pages, it will only clear the PTE entries.
  * This won't violate logic things, it will only waste some pages.
  * Come back and fix this after deadline!
+ *
+ * Present PTEs are zapped by unmap_page_range() before, which also
+ * gathers the TLB flush. Nothing left here is present, no flush needed.
  */
 void free_pgd_range(struct mm_struct *mm,
 		    unsigned long __user addr, unsigned long __user end)
 {
 	pgd_t *pgd;
-	unsigned long next, original_addr = addr;
+	unsigned long next;
 
 	pgtable_debug("[%#lx - %#lx]", addr, end);
 
@@ -111,8 +114,6 @@ void free_pgd_range(struct mm_struct *mm,
 			continue;
 		free_pud_range(mm, pgd, addr, next);
 	} while (pgd++, addr = next, addr != end);
-
-	flush_tlb_mm_range(mm, original_addr, end);
 }
 
 /*
@@ -121,7 +122,8 @@ void free_pgd_range(struct mm_struct *mm,
  */
 static unsigned long
 zap_pte_range(struct mm_struct *mm, pmd_t *pmd,
-	      unsigned long addr, unsigned long end)
+	      unsigned long addr, unsigned long end,
+	      struct tlb_gather *tlb)
 {
 	spinlock_t *ptl;
 	pte_t *start_pte;
@@ -158,8 +160,10 @@ retry:
 			 * pcache_try_to_unmap(), it will fail to remove the rmap.
 			 */
 			ret = pcache_zap_pte(mm, addr, ptent, pte, ptl);
-			if (likely(!ret))
+			if (likely(!ret)) {
+				tlb_gather_page(tlb, mm, addr);
 				continue;
+			}
 			else if (ret == -EAGAIN) {
 				goto retry;
 			} else
@@ -176,7 +180,8 @@ retry:
 
 static inline unsigned long
 zap_pmd_range(struct mm_struct *mm, pud_t *pud,
-	      unsigned long addr, unsigned long end)
+	      unsigned long addr, unsigned long end,
+	      struct tlb_gather *tlb)
 {
 	pmd_t *pmd;
 	unsigned long next;
@@ -186,7 +191,7 @@ zap_pmd_range(struct mm_struct *mm, pud_t *pud,
 		next = pmd_addr_end(addr, end);
 		if (pmd_none_or_clear_bad(pmd))
 			continue;
-		next = zap_pte_range(mm, pmd, addr, next);
+		next = zap_pte_range(mm, pmd, addr, next, tlb);
 	} while (pmd++, addr = next, addr != end);
 
 	return addr;
@@ -194,7 +199,8 @@ zap_pmd_range(struct mm_struct *mm, pud_t *pud,
 
 static inline unsigned long
 zap_pud_range(struct mm_struct *mm, pgd_t *pgd,
-	      unsigned long addr, unsigned long end)
+	      unsigned long addr, unsigned long end,
+	      struct tlb_gather *tlb)
 {
 	pud_t *pud;
 	unsigned long next;
@@ -204,7 +210,7 @@ zap_pud_range(struct mm_struct *mm, pgd_t *pgd,
 		next = pud_addr_end(addr, end);
 		if (pud_none_or_clear_bad(pud))
 			continue;
-		next = zap_pmd_range(mm, pud, addr, next);
+		next = zap_pmd_range(mm, pud, addr, next, tlb);
 	} while (pud++, addr = next, addr != end);
 
 	return addr;
@@ -218,9 +224,11 @@ zap_pud_range(struct mm_struct *mm, pgd_t *pgd,
  * is handled by free_pgd_range().
  *
  * PTEs are cleared, but not PGD, PUD, and PMD.
+ * Zapped present PTEs are gathered into @tlb, caller flushes it.
  */
 void unmap_page_range(struct mm_struct *mm,
-		      unsigned long __user addr, unsigned long __user end)
+		      unsigned long __user addr, unsigned long __user end,
+		      struct tlb_gather *tlb)
 {
 	pgd_t *pgd;
 	unsigned long next;
@@ -233,7 +241,7 @@ void unmap_page_range(struct mm_struct *mm,
 		next = pgd_addr_end(addr, end);
 		if (pgd_none_or_clear_bad(pgd))
 			continue;
-		next = zap_pud_range(mm, pgd, addr, next);
+		next = zap_pud_range(mm, pgd, addr, next, tlb);
 	} while (pgd++, addr = next, addr != end);
 }
 
@@ -250,12 +258,20 @@ void release_pgtable(struct task_struct *tsk,
 		     unsigned long __user start, unsigned long __user end)
 {
 	struct mm_struct *mm = tsk->mm;
+	struct tlb_gather tlb;
 
 	pgtable_debug("%s[%d] [%#lx - %#lx]",
 		tsk->comm, tsk->tgid, start, end);
 
-	/* Free actual pages */
-	unmap_page_range(mm, start, end);
+	lazy_fork_resolve_range(mm, start, end, true);
+
+	/* Free actual pages, one shootdown for all of them */
+	tlb_gather_init(&tlb);
+	unmap_page_range(mm, start, end, &tlb);
+	tlb_gather_flush(&tlb);
+
+	/* Evicted lines of this range are gone too */
+	pcache_ctier_invalidate_range(tsk->tgid, start, end);
 
 	/* Free pgtable pages */
 	free_pgd_range(mm, start, end);
@@ -268,7 +284,8 @@ void release_pgtable(struct task_struct *tsk,
 static inline int
 pcache_copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		pte_t *dst_pte, pte_t *src_pte, unsigned long addr,
-		unsigned long vm_flags, struct task_struct *dst_task)
+		unsigned long vm_flags, struct task_struct *dst_task,
+		struct tlb_gather *tlb)
 {
 	pte_t pte = *src_pte;
 	struct pcache_meta *pcm;
@@ -279,12 +296,8 @@ pcache_copy_one_pte(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	 */
 	if (is_cow_mapping(vm_flags)) {
 		ptep_set_wrprotect(src_pte);
-		/*
-		 * TODO:
-		 * Should be batched
-		 * Doing this one by one make fork() very slow.
-		 */
-		flush_tlb_mm_range(src_mm, addr, addr + PAGE_SIZE);
+		/* Shot down once by pcache_copy_page_range() */
+		tlb_gather_page(tlb, src_mm, addr);
 		pte = pte_wrprotect(pte);
 	}
 
@@ -321,7 +334,8 @@ static inline int
 pcache_copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		      pmd_t *dst_pmd, pmd_t *src_pmd,
 		      unsigned long addr, unsigned long end,
-		      unsigned long vm_flags, struct task_struct *dst_task)
+		      unsigned long vm_flags, struct task_struct *dst_task,
+		      struct tlb_gather *tlb)
 {
 	pte_t *orig_src_pte, *orig_dst_pte;
 	pte_t *src_pte, *dst_pte;
@@ -379,7 +393,8 @@ pcache_copy_pte_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 #endif
 		}
 
-		if (pcache_copy_one_pte(dst_mm, src_mm, dst_pte, src_pte, addr, vm_flags, dst_task)) {
+		if (pcache_copy_one_pte(dst_mm, src_mm, dst_pte, src_pte, addr,
+					vm_flags, dst_task, tlb)) {
 			ret = -ENOMEM;
 			break;
 		}
@@ -396,7 +411,8 @@ static inline int
 pcache_copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		      pud_t *dst_pud, pud_t *src_pud,
 		      unsigned long addr, unsigned long end,
-		      unsigned long vm_flags, struct task_struct *dst_task)
+		      unsigned long vm_flags, struct task_struct *dst_task,
+		      struct tlb_gather *tlb)
 {
 	pmd_t *src_pmd, *dst_pmd;
 	unsigned long next;
@@ -410,7 +426,7 @@ pcache_copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		if (pmd_none_or_clear_bad(src_pmd))
 			continue;
 		if (pcache_copy_pte_range(dst_mm, src_mm, dst_pmd, src_pmd,
-						addr, next, vm_flags, dst_task))
+						addr, next, vm_flags, dst_task, tlb))
 			return -ENOMEM;
 	} while (dst_pmd++, src_pmd++, addr = next, addr != end);
 	return 0;
@@ -420,7 +436,8 @@ static inline int
 pcache_copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		      pgd_t *dst_pgd, pgd_t *src_pgd,
 		      unsigned long addr, unsigned long end,
-		      unsigned long vm_flags, struct task_struct *dst_task)
+		      unsigned long vm_flags, struct task_struct *dst_task,
+		      struct tlb_gather *tlb)
 {
 	pud_t *src_pud, *dst_pud;
 	unsigned long next;
@@ -434,7 +451,7 @@ pcache_copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		if (pud_none_or_clear_bad(src_pud))
 			continue;
 		if (pcache_copy_pmd_range(dst_mm, src_mm, dst_pud, src_pud,
-						addr, next, vm_flags, dst_task))
+						addr, next, vm_flags, dst_task, tlb))
 			return -ENOMEM;
 	} while (dst_pud++, src_pud++, addr = next, addr != end);
 	return 0;
@@ -443,6 +460,7 @@ pcache_copy_pud_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 /*
  * Duplicate the pgtable used to emulate pcache.
  * Write-protect both ends if it is COW mapping.
+ * TLB entries of @src are shot down once, after the whole range is copied.
  */
 int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 			   unsigned long addr, unsigned long end,
@@ -450,9 +468,11 @@ int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 {
 	pgd_t *src_pgd, *dst_pgd;
 	unsigned long next;
+	struct tlb_gather tlb;
 	int ret;
 
 	ret = 0;
+	tlb_gather_init(&tlb);
 	dst_pgd = pgd_offset(dst, addr);
 	src_pgd = pgd_offset(src, addr);
 	do {
@@ -460,12 +480,13 @@ int pcache_copy_page_range(struct mm_struct *dst, struct mm_struct *src,
 		if (pgd_none_or_clear_bad(src_pgd))
 			continue;
 		if (unlikely(pcache_copy_pud_range(dst, src, dst_pgd, src_pgd,
-					    addr, next, vm_flags, dst_task))) {
+					    addr, next, vm_flags, dst_task, &tlb))) {
 			ret = -ENOMEM;
 			break;
 		}
 	} while (dst_pgd++, src_pgd++, addr = next, addr != end);
 
+	tlb_gather_flush(&tlb);
 	return ret;
 }
 
@@ -610,6 +631,16 @@ unsigned long move_page_tables(struct task_struct *tsk,
 
 	old_end = old_addr + len;
 
+	lazy_fork_resolve_range(mm, old_addr, old_end, false);
+	lazy_fork_resolve_range(mm, new_addr, new_addr + len, false);
+
+	/*
+	 * Only present lines move, evicted ones are refetched from memory
+	 * at their new address. Drop whatever is left at either end.
+	 */
+	pcache_ctier_invalidate_range(tsk->tgid, old_addr, old_end);
+	pcache_ctier_invalidate_range(tsk->tgid, new_addr, new_addr + len);
+
 	for (; old_addr < old_end; old_addr += extent, new_addr += extent) {
 		next = (old_addr + PMD_SIZE) & PMD_MASK;
 
@@ -94,12 +94,15 @@ void dump_ib_stats(void)
 DEFINE_PROFILE_POINT(ibapi_send_reply)
 
 static inline int
-__ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr,
-			   int max_ret_size, int if_use_ret_phys_addr,
+__ibapi_send_reply_timeout(int target_node, struct fit_sglist *sglist, int nr_sge,
+			   void *ret_addr, int max_ret_size, int if_use_ret_phys_addr,
 			   unsigned long timeout_sec, void *caller)
 {
 	ppc *ctx = FIT_ctx;
 	int ret;
+#ifdef CONFIG_COUNTER_FIT_IB
+	int i, size;
+#endif
         PROFILE_POINT_TIME(ibapi_send_reply)
 
         PROFILE_START(ibapi_send_reply);
@@ -110,8 +113,8 @@ __ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr
 	}
 
 	lock_ib();
-	ret = fit_send_reply_with_rdma_write_with_imm(ctx, target_node, addr,
-			size, ret_addr, max_ret_size, 0, if_use_ret_phys_addr,
+	ret = fit_send_reply_with_rdma_write_with_imm_sge(ctx, target_node, sglist,
+			nr_sge, ret_addr, max_ret_size, 0, if_use_ret_phys_addr,
 			timeout_sec, caller);
 
 	if (unlikely(ret > max_ret_size)) {
@@ -121,6 +124,8 @@ __ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr
 	unlock_ib();
 
 #ifdef CONFIG_COUNTER_FIT_IB
+	for (i = 0, size = 0; i < nr_sge; i++)
+		size += sglist[i].len;
 	atomic_long_inc(&nr_ib_send_reply);
 	atomic_long_add(size, &nr_bytes_tx);
 	atomic_long_add(ret, &nr_bytes_rx);
@@ -134,7 +139,12 @@ __ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_addr
 int ibapi_send_reply_imm(int target_node, void *addr, int size, void *ret_addr,
 			 int max_ret_size, int if_use_ret_phys_addr)
 {
-	return __ibapi_send_reply_timeout(target_node, addr, size, ret_addr,
+	struct fit_sglist sglist = {
+		.addr = addr,
+		.len = size,
+	};
+
+	return __ibapi_send_reply_timeout(target_node, &sglist, 1, ret_addr,
 			max_ret_size, if_use_ret_phys_addr, FIT_MAX_TIMEOUT_SEC,
 			__builtin_return_address(0));
 }
@@ -157,7 +167,38 @@ int ibapi_send_reply_timeout(int target_node, void *addr, int size, void *ret_ad
 			     int max_ret_size, int if_use_ret_phys_addr,
 			     unsigned long timeout_sec)
 {
-	return __ibapi_send_reply_timeout(target_node, addr, size, ret_addr,
+	struct fit_sglist sglist = {
+		.addr = addr,
+		.len = size,
+	};
+
+	return __ibapi_send_reply_timeout(target_node, &sglist, 1, ret_addr,
+			max_ret_size, if_use_ret_phys_addr, timeout_sec,
+			__builtin_return_address(0));
+}
+
+/**
+ * ibapi_send_reply_sge_timeout
+ * @target_node: target node id
+ * @sglist: buffers to send, gathered into one message by the HCA
+ * @nr_sge: number of buffers in @sglist, at most FIT_MAX_SGE
+ * @ret_addr
+ * @max_ret_size
+ * @if_use_ret_phys_addr:
+ * @timeout_sec:
+ *
+ * Same as ibapi_send_reply_timeout(), but the message does not have to be
+ * contiguous in memory. The remote side sees one contiguous message.
+ *
+ * Return:
+ * Negative values on failure (-ETIMEDOUT for timeout)
+ * Positive values indicate the reply message length
+ */
+int ibapi_send_reply_sge_timeout(int target_node, struct fit_sglist *sglist,
+				 int nr_sge, void *ret_addr, int max_ret_size,
+				 int if_use_ret_phys_addr, unsigned long timeout_sec)
+{
+	return __ibapi_send_reply_timeout(target_node, sglist, nr_sge, ret_addr,
 			max_ret_size, if_use_ret_phys_addr, timeout_sec,
 			__builtin_return_address(0));
 }
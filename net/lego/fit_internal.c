@@ -1205,6 +1205,59 @@ int fit_send_message_with_rdma_write_with_imm_request(ppc *ctx, int connection_i
 	return 0;
 }
 
+/*
+ * Same as the FIT_SEND_MESSAGE_HEADER_AND_IMM mode above, except the
+ * message is gathered from @nr_sge buffers by the HCA. The remote side
+ * sees one contiguous message, so callers can send in-place data without
+ * copying it into a message buffer first.
+ */
+static int fit_send_message_sge_with_rdma_write_with_imm_request(ppc *ctx,
+		int connection_id, uint32_t input_mr_rkey, uintptr_t input_mr_addr,
+		struct fit_sglist *sglist, int nr_sge, int offset, uint32_t imm,
+		struct imm_message_metadata *header)
+{
+	struct ib_send_wr wr, *bad_wr = NULL;
+	struct ib_sge sge[FIT_MAX_SGE + 1];
+	int poll_status = SEND_REPLY_WAIT;
+	int ret, i;
+
+	memset(&wr, 0, sizeof(wr));
+	memset(&sge, 0, sizeof(sge));
+
+	wr.sg_list = sge;
+	wr.wr.rdma.remote_addr = (uintptr_t)(input_mr_addr + offset);
+	wr.wr.rdma.rkey = input_mr_rkey;
+
+	wr.wr_id = (u64)get_reply_ready_ptr(ctx, header->reply_indicator_index);
+	wr.opcode = IB_WR_RDMA_WRITE_WITH_IMM;
+	wr.ex.imm_data = imm;
+	wr.send_flags = IB_SEND_SIGNALED;
+	wr.num_sge = nr_sge + 1;
+
+	sge[0].addr = fit_ib_reg_mr_addr(ctx, header, sizeof(*header));
+	sge[0].length = sizeof(struct imm_message_metadata);
+	sge[0].lkey = ctx->proc->lkey;
+
+	for (i = 0; i < nr_sge; i++) {
+		sge[i + 1].addr = fit_ib_reg_mr_addr(ctx, sglist[i].addr, sglist[i].len);
+		sge[i + 1].length = sglist[i].len;
+		sge[i + 1].lkey = ctx->proc->lkey;
+	}
+
+	ret = ib_post_send(ctx->qp[connection_id], &wr, &bad_wr);
+	if (unlikely(ret)) {
+		pr_info_once("Fail to post send to con:%d ret:%d\n",
+			connection_id, ret);
+		WARN_ON_ONCE(1);
+		return ret;
+	}
+
+	/* Reply is on the way, no need to poll send now */
+	fit_internal_poll_sendcq(ctx, ctx->send_cq[connection_id],
+				 connection_id, &poll_status, 0);
+	return 0;
+}
+
 inline int fit_get_connection_by_atomic_number(ppc *ctx, int target_node, int priority)
 {
 #ifdef CONFIG_SOCKET_O_IB
@@ -2383,15 +2436,18 @@ int fit_send_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 /*
  * This is one major function, it is used by ibapi_send_reply().
  * This function is blocking, it uses busy polling to get reply.
+ * The message is gathered from @nr_sge buffers of @sglist.
  *
  * Return:
  * Negative values on failues
  * Positive values indicate the reply message length
  */
-int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
-					       int size, void *ret_addr, int max_ret_size,
-					       int userspace_flag, int if_use_ret_phys_addr,
-					       unsigned long timeout_sec, void *caller)
+static int
+__fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node,
+					  struct fit_sglist *sglist, int nr_sge,
+					  void *ret_addr, int max_ret_size,
+					  int userspace_flag, int if_use_ret_phys_addr,
+					  unsigned long timeout_sec, void *caller)
 {
 	int tar_offset_start;
 	int connection_id;
@@ -2407,12 +2463,21 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 	int reply_length;
 
 	int local_reply_ready_checker = SEND_REPLY_WAIT;
+	int size, i;
 
-	if (unlikely(!addr)) {
-		fit_err("BUG: NULL addr. Caller: %pS", caller);
+	if (unlikely(nr_sge < 1 || nr_sge > FIT_MAX_SGE)) {
+		fit_err("BUG: nr_sge %d. Caller: %pS", nr_sge, caller);
 		return -EINVAL;
 	}
 
+	for (i = 0, size = 0; i < nr_sge; i++) {
+		if (unlikely(!sglist[i].addr)) {
+			fit_err("BUG: NULL addr. Caller: %pS", caller);
+			return -EINVAL;
+		}
+		size += sglist[i].len;
+	}
+
 	real_size = size + sizeof(struct imm_message_metadata);
 	if (unlikely(real_size > IMM_MAX_SIZE)) {
 		fit_err("Size %d + header > %d", size, IMM_MAX_SIZE);
@@ -2464,9 +2529,14 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 		imm_data, remote_addr, remote_rkey, msg_header.reply_addr, msg_header.reply_rkey);
 
 	/* for send reply, no need to poll the send now, since we have reply already */
-	fit_send_message_with_rdma_write_with_imm_request(ctx, connection_id, remote_rkey,
-			(uintptr_t)remote_addr, addr, size, tar_offset_start, imm_data,
-			FIT_SEND_MESSAGE_HEADER_AND_IMM, &msg_header, 0);
+	if (nr_sge == 1)
+		fit_send_message_with_rdma_write_with_imm_request(ctx, connection_id, remote_rkey,
+				(uintptr_t)remote_addr, sglist[0].addr, size, tar_offset_start, imm_data,
+				FIT_SEND_MESSAGE_HEADER_AND_IMM, &msg_header, 0);
+	else
+		fit_send_message_sge_with_rdma_write_with_imm_request(ctx, connection_id,
+				remote_rkey, (uintptr_t)remote_addr, sglist, nr_sge,
+				tar_offset_start, imm_data, &msg_header);
 
 	/*
 	 * Default model
@@ -2513,6 +2583,32 @@ int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *add
 	return reply_length;
 }
 
+int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
+					       int size, void *ret_addr, int max_ret_size,
+					       int userspace_flag, int if_use_ret_phys_addr,
+					       unsigned long timeout_sec, void *caller)
+{
+	struct fit_sglist sglist = {
+		.addr = addr,
+		.len = size,
+	};
+
+	return __fit_send_reply_with_rdma_write_with_imm(ctx, target_node, &sglist, 1,
+			ret_addr, max_ret_size, userspace_flag, if_use_ret_phys_addr,
+			timeout_sec, caller);
+}
+
+int fit_send_reply_with_rdma_write_with_imm_sge(ppc *ctx, int target_node,
+					       struct fit_sglist *sglist, int nr_sge,
+					       void *ret_addr, int max_ret_size,
+					       int userspace_flag, int if_use_ret_phys_addr,
+					       unsigned long timeout_sec, void *caller)
+{
+	return __fit_send_reply_with_rdma_write_with_imm(ctx, target_node, sglist, nr_sge,
+			ret_addr, max_ret_size, userspace_flag, if_use_ret_phys_addr,
+			timeout_sec, caller);
+}
+
 /*
  * send data and reply with extra bits
  * Return:
@@ -54,6 +54,10 @@ struct fit_sglist;
 int fit_send_reply_with_rdma_write_with_imm(ppc *ctx, int target_node, void *addr,
 				int size, void *ret_addr, int max_ret_size, int userspace_flag,
 				int if_use_ret_phys_addr, unsigned long timeout_sec, void *caller);
+int fit_send_reply_with_rdma_write_with_imm_sge(ppc *ctx, int target_node,
+				struct fit_sglist *sglist, int nr_sge, void *ret_addr,
+				int max_ret_size, int userspace_flag, int if_use_ret_phys_addr,
+				unsigned long timeout_sec, void *caller);
 int fit_send_reply_with_rdma_write_with_imm_reply_extra_bits(ppc *ctx, int target_node, void *addr,
 					       int size, void *ret_addr, int max_ret_size, int *ret_private_bits,
 					       int userspace_flag, int if_use_ret_phys_addr,
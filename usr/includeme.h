@@ -118,6 +118,11 @@ static inline int pcache_stat(struct pcache_stat *buf)
 	return ret;
 }
 
+static inline long pcache_partition(int op, int group, unsigned long arg)
+{
+	return syscall(__NR_pcache_partition, op, group, arg);
+}
+
 static inline unsigned short from32to16(unsigned a) 
 {
 	unsigned short b = a >> 16; 